@@ -0,0 +1,54 @@
+/**
+ * @headerfile airframe.h
+ *
+ * @brief      Optional compile-time airframe selection.
+ *
+ *             By default the rotor layout and thrust map are read from the
+ *             settings file at runtime. Building with
+ *             make AIRFRAME=LAYOUT_6X THRUST_MAP=RX2206_4S
+ *             defines AIRFRAME_LAYOUT_6X and AIRFRAME_MAP_RX2206_4S, which
+ *             this header turns into constants. mix.c and thrust_map.c then
+ *             only compile in the selected matrix and curve, the rotor count
+ *             becomes a constant so the mixer and ESC loops unroll, and a
+ *             settings file that asks for a different airframe is rejected.
+ *             Either option can be given on its own.
+ */
+
+#ifndef AIRFRAME_H
+#define AIRFRAME_H
+
+#if defined(AIRFRAME_LAYOUT_4X)
+#define AIRFRAME_LAYOUT		LAYOUT_4X
+#define AIRFRAME_ROTORS		4
+#define AIRFRAME_DOF		4
+#elif defined(AIRFRAME_LAYOUT_4PLUS)
+#define AIRFRAME_LAYOUT		LAYOUT_4PLUS
+#define AIRFRAME_ROTORS		4
+#define AIRFRAME_DOF		4
+#elif defined(AIRFRAME_LAYOUT_6X)
+#define AIRFRAME_LAYOUT		LAYOUT_6X
+#define AIRFRAME_ROTORS		6
+#define AIRFRAME_DOF		4
+#elif defined(AIRFRAME_LAYOUT_8X)
+#define AIRFRAME_LAYOUT		LAYOUT_8X
+#define AIRFRAME_ROTORS		8
+#define AIRFRAME_DOF		4
+#elif defined(AIRFRAME_LAYOUT_6DOF_ROTORBITS)
+#define AIRFRAME_LAYOUT		LAYOUT_6DOF_ROTORBITS
+#define AIRFRAME_ROTORS		6
+#define AIRFRAME_DOF		6
+#elif defined(AIRFRAME_LAYOUT_6DOF_5INCH_MONOCOQUE)
+#define AIRFRAME_LAYOUT		LAYOUT_6DOF_5INCH_MONOCOQUE
+#define AIRFRAME_ROTORS		6
+#define AIRFRAME_DOF		6
+#endif
+
+#if defined(AIRFRAME_MAP_MN1806_1400KV_4S)
+#define AIRFRAME_THRUST_MAP	MN1806_1400KV_4S
+#elif defined(AIRFRAME_MAP_F20_2300KV_2S)
+#define AIRFRAME_THRUST_MAP	F20_2300KV_2S
+#elif defined(AIRFRAME_MAP_RX2206_4S)
+#define AIRFRAME_THRUST_MAP	RX2206_4S
+#endif
+
+#endif // AIRFRAME_H
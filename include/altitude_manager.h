@@ -0,0 +1,61 @@
+/**
+ * <altitude_manager.h>
+ *
+ * @brief      Barometer altitude estimator running off the feedback ISR.
+ *
+ *             The BMP280 is read over I2C which takes far too long to do in
+ *             the ISR. Instead the ISR hands the vertical acceleration from
+ *             the IMU to altitude_manager_march() every loop. Every few loops
+ *             it wakes the altitude thread right after the IMU read, so the
+ *             barometer read doesn't collide with the next IMU transfer on the
+ *             shared bus. The thread fuses the mean acceleration and the
+ *             barometer in a Kalman filter with altitude, vertical velocity
+ *             and accelerometer bias as the states. The estimate is published
+ *             through a seqlock for the ISR to pick up.
+ *
+ *             Altitude is positive up and relative to the barometer reading
+ *             at startup.
+ */
+
+#ifndef ALTITUDE_MANAGER_H
+#define ALTITUDE_MANAGER_H
+
+#include <stdint.h>
+
+/**
+ * @brief      Starts the barometer, averages its reading as the zero altitude
+ *             and starts the estimator thread. Call before feedback_init().
+ *
+ * @return     0 on success, -1 on failure
+ */
+int altitude_manager_init();
+
+/**
+ * @brief      Called by the feedback ISR every loop with the IMU's vertical
+ *             acceleration. Never blocks.
+ *
+ * @param[in]  a_up  acceleration in the world frame, positive up, gravity
+ *                   removed (m/s^2)
+ */
+void altitude_manager_march(double a_up);
+
+/**
+ * @brief      Latest estimate extrapolated to now_ns. Never blocks, reuses the
+ *             previous estimate if the thread is publishing.
+ *
+ * @param[in]  now_ns    current time since boot
+ * @param[out] altitude  altitude (m), positive up
+ * @param[out] velocity  vertical velocity (m/s), positive up
+ *
+ * @return     0 on success, -1 if there is no recent estimate
+ */
+int altitude_manager_get(uint64_t now_ns, double* altitude, double* velocity);
+
+/**
+ * @brief      Stops the estimator thread and powers off the barometer.
+ *
+ * @return     0 on clean exit, -1 on exit time out/force close
+ */
+int altitude_manager_cleanup();
+
+#endif // ALTITUDE_MANAGER_H
@@ -0,0 +1,73 @@
+/**
+ * <battery_manager.h>
+ *
+ * @brief      Battery voltage monitor running off the feedback ISR.
+ *
+ *             Reading the ADC is one of the slowest calls the control loop
+ *             used to make and the pack voltage changes far slower than the
+ *             loop runs. A low priority thread samples the ADC at
+ *             settings.battery_hz, filters the reading and publishes the
+ *             filtered voltage together with the v_nominal/v_batt factor the
+ *             controller gains are scaled by. Both are packed into one atomic
+ *             word so the ISR gets a matching pair with a single load.
+ */
+
+#ifndef BATTERY_MANAGER_H
+#define BATTERY_MANAGER_H
+
+/**
+ * Latest published battery state
+ */
+typedef struct battery_state_t{
+	float v_batt;	///< filtered main battery pack voltage (v)
+	float gain;	///< settings.v_nominal/v_batt, scales the controller gains
+} battery_state_t;
+
+/**
+ * @brief      Sets up the filter and publishes a first reading so the state is
+ *             valid before the feedback ISR starts. Call after settings are
+ *             loaded and the adc is initialized.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int battery_manager_init();
+
+/**
+ * @brief      Starts the sampling thread.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int battery_manager_start();
+
+/**
+ * @brief      Takes one ADC sample, marches the filter and publishes the
+ *             result. Called by the thread at settings.battery_hz, offline
+ *             tools call it directly instead of starting the thread.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int battery_manager_update();
+
+/**
+ * @brief      Lock-free read of the latest filtered voltage and gain factor,
+ *             safe to call from the feedback ISR.
+ *
+ * @return     the latest battery state
+ */
+battery_state_t battery_manager_get();
+
+/**
+ * @brief      Latest unfiltered ADC reading, kept for the log.
+ *
+ * @return     voltage (v)
+ */
+double battery_manager_raw();
+
+/**
+ * @brief      Waits for the sampling thread to exit.
+ *
+ * @return     0 on clean exit, -1 on exit time out/force close
+ */
+int battery_manager_cleanup();
+
+#endif // BATTERY_MANAGER_H
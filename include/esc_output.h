@@ -0,0 +1,57 @@
+/**
+ * <esc_output.h>
+ *
+ * @brief      Output stage sending the motor signals to the ESCs.
+ *
+ *             All channels are handed over in one call. Every pulse is
+ *             computed and range checked before the first channel is
+ *             touched, then the channels are written back to back so the
+ *             PRU starts the pulses as close together as it can. The ESC
+ *             protocol is selected with esc_protocol in the settings file.
+ */
+
+#ifndef ESC_OUTPUT_H
+#define ESC_OUTPUT_H
+
+#include <scalar.h>
+
+/**
+ * ESC protocols the output stage can drive.
+ */
+typedef enum esc_protocol_t{
+	ESC_PWM,	///< standard 1000-2000us pulses
+	ESC_ONESHOT125	///< 125-250us pulses, 8x shorter than PWM
+} esc_protocol_t;
+
+/**
+ * @brief      Selects the protocol used by the following calls. Call after
+ *             rc_servo_init().
+ *
+ * @param[in]  protocol  The protocol
+ *
+ * @return     0 on success, -1 on failure
+ */
+int esc_output_init(esc_protocol_t protocol);
+
+/**
+ * @brief      Sends one pulse to each of the first n channels.
+ *
+ * @param[in]  m     normalized motor signals from 0 to 1, m[0] goes to
+ *                   channel 1
+ * @param[in]  n     number of channels, at most 8
+ *
+ * @return     0 on success, -1 on failure
+ */
+int esc_output_send(const scalar_t* m, int n);
+
+/**
+ * @brief      Sends the idle pulse that keeps armed ESCs awake without
+ *             spinning the motors to the first n channels.
+ *
+ * @param[in]  n     number of channels, at most 8
+ *
+ * @return     0 on success, -1 on failure
+ */
+int esc_output_idle(int n);
+
+#endif // ESC_OUTPUT_H
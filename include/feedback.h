@@ -20,7 +20,16 @@
 #define FEEDBACK_H
 
 #include <stdint.h> // for uint64_t
+#include <rc/math/filter.h>
+#include <rc/mpu.h>
 #include <rc_pilot_defs.h>
+#include <loop_timing.h>
+#include <loop_sched.h>
+#include <filter_bank.h>
+#include <setpoint_manager.h>
+#include <mix.h>
+#include <thrust_map.h>
+#include <scalar.h>
 
 /**
  * This is the state of the feedback loop. contains most recent values
@@ -34,18 +43,95 @@ typedef struct feedback_state_t{
 	uint64_t loop_index;	///< increases every time feedback loop runs
 	uint64_t last_step_ns;	///< last time controller has finished a step
 
-	double altitude;	///< altitude estimate from sea level (m)
-	double roll;		///< current roll angle (rad)
-	double pitch;		///< current pitch angle (rad)
-	double yaw;		///< current yaw angle (rad)
-	double v_batt;		///< main battery pack voltage (v)
-
-	double u[6];		///< siso controller outputs
-	double m[8];		///< signals sent to motors after mapping
+	scalar_t altitude;	///< altitude estimate (m), positive up from the mocap origin or the barometer at startup
+	scalar_t roll;		///< current roll angle (rad)
+	scalar_t pitch;		///< current pitch angle (rad)
+	scalar_t yaw;		///< current yaw angle (rad)
+	scalar_t roll_rate;	///< body rate about the roll axis from the gyro (rad/s)
+	scalar_t pitch_rate;	///< body rate about the pitch axis from the gyro (rad/s)
+	scalar_t yaw_rate;	///< body rate about the yaw axis from the gyro (rad/s)
+	scalar_t v_batt;		///< main battery pack voltage (v)
+	int mocap_valid;	///< 1 if altitude came from a fresh mocap sample this loop
+	int altitude_valid;	///< 1 if altitude is fresh from mocap or the barometer
+
+	scalar_t u[6];		///< siso controller outputs
+	scalar_t m[8];		///< signals sent to motors after mapping
+
+	loop_timing_t timing;	///< per-stage timestamps and loop timing stats
 } feedback_state_t;
 
 extern feedback_state_t fstate;
 
+struct settings_t;
+
+/**
+ * outer loops of a controller_t, the attitude loop itself runs on every tick
+ */
+typedef enum controller_task_t{
+	CONTROLLER_TASK_SETPOINT,
+	CONTROLLER_TASK_ATTITUDE,
+	CONTROLLER_TASK_ALTITUDE,
+	CONTROLLER_NUM_TASKS
+} controller_task_t;
+
+/**
+ * @brief      One instance of the flight controller.
+ *
+ *             Holds everything the control loop keeps from one loop to the
+ *             next in a single cache line aligned block, the counters and
+ *             pointers the loop reads first in the first lines and the filter
+ *             banks after them. Any number can run side by side in one
+ *             process. feedback_init() sets up the one that flies the
+ *             vehicle, with hardware set, and the feedback_* functions are
+ *             wrappers around it.
+ *
+ *             Without hardware an instance only reads the imu, setpoint and
+ *             batt_gain it was given and the altitude fields of its state,
+ *             and leaves the motor signals in state->m. It never touches the
+ *             ESCs, LEDs, log or any of the manager threads. With input set
+ *             it computes its own setpoint from that frame on every setpoint
+ *             tick and arms or disarms on its requested_arm_mode, like the
+ *             setpoint manager does for the vehicle but without smoothing
+ *             between frames. With input NULL the caller updates the
+ *             setpoint and arms it with controller_arm().
+ */
+typedef struct controller_t{
+	// touched on every loop
+	feedback_state_t* state;	///< where the estimate and outputs go
+	setpoint_t* setpoint;		///< setpoint to follow
+	const struct user_input_t* input; ///< frame the setpoint comes from without hardware, or NULL
+	const rc_mpu_data_t* imu;	///< IMU data for the state estimate
+	const mixer_t* mixer;
+	const thrust_curve_t* thrust;
+	double batt_gain;		///< v_nominal/v_batt, the battery manager's with hardware
+	double last_yaw;
+	int num_yaw_spins;
+	int last_en_alt_ctrl;
+	int alt_periods;		///< altitude periods since the loop last ran
+	int hardware;			///< 1 for the instance flying the vehicle
+	int pru_esc;			///< 1 if the output stage runs on the PRU, see pru_esc.h
+	int hold_output;		///< 1 to skip the ESC update, for all but the newest sample of a FIFO read
+	int enable_rate_loop;
+	mix_allocation_t mix_allocation;
+	int enable_logging;
+	int enable_mocap;
+	int enable_baro;
+	scalar_t rate_sp[3];		///< roll, pitch, yaw setpoints for the rate loop
+	scalar_t alt_z_cmd;		///< Z throttle from the altitude loop, held between runs
+	loop_task_t tasks[CONTROLLER_NUM_TASKS];
+	filter_bank_t angle;		///< roll, pitch, yaw angle controllers
+	filter_bank_t rate;		///< roll, pitch, yaw rate controllers, only with the rate loop
+	// only on altitude loop ticks
+	rc_filter_t alt;		///< altitude controller
+	double alt_gain_orig;		///< gain of alt before battery scaling
+	double alt_hover_thr;		///< Z throttle when altitude hold engaged
+	double alt_last;		///< altitude the loop last ran on, for a change of source
+	int alt_mocap;			///< 1 if alt_last came from mocap, 0 from the barometer
+	double dt;			///< controller timestep
+	double alt_dt;			///< altitude loop timestep
+	int own_alt;			///< 1 if alt was handed over by the caller
+} __attribute__((aligned(64))) controller_t;
+
 /**
  * @brief      Initial setup of all feedback controllers. Should only be called
  *             once on program start.
@@ -77,8 +163,80 @@ int feedback_disarm();
  */
 int feedback_arm();
 
+/**
+ * @brief      Rereads the controllers from the settings file and swaps them in
+ *             without disarming.
+ *
+ *             Parsing and discretization happen in the calling thread, the
+ *             feedback ISR only swaps the new filters in at the start of its
+ *             next loop with bumpless transfer. Waits up to a second for the
+ *             swap. On a parse error the current controllers stay in place.
+ *             Not thread safe, call from one thread only.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int feedback_reload_controllers();
+
 int feedback_cleanup();
 
+/**
+ * @brief      Sets up a controller instance, disarmed.
+ *
+ *             Reads the loop rates and options from set, the rotor count
+ *             comes from the mixer. Builds the controllers from loaded, or
+ *             from the last settings load if loaded is NULL. Otherwise the
+ *             instance takes over loaded[CTRL_ALTITUDE] and frees it in
+ *             controller_free(), the caller frees the others as soon as this
+ *             returns. The pointers must stay valid for as long as the
+ *             instance is used.
+ *
+ * @param[out] c         The controller
+ * @param[in]  set       settings to run with
+ * @param      loaded    controllers from settings_load_controllers(), or NULL
+ * @param[in]  mx        mixer for the rotor layout
+ * @param[in]  map       thrust curve of the motors
+ * @param[in]  imu       IMU data the state estimate reads
+ * @param[out] state     state the controller writes
+ * @param      sp        setpoint to follow
+ * @param[in]  hardware  1 for the instance flying the vehicle, see controller_t
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_init(controller_t* c, const struct settings_t* set, rc_filter_t* loaded,
+			const mixer_t* mx, const thrust_curve_t* map,
+			const rc_mpu_data_t* imu, feedback_state_t* state,
+			setpoint_t* sp, int hardware);
+
+/**
+ * @brief      Resets the filters and state estimate and arms the instance.
+ *             The log and LEDs are left to feedback_arm().
+ *
+ * @return     0 on success, -1 if already armed
+ */
+int controller_arm(controller_t* c);
+
+/**
+ * @brief      disarms the instance, the motors idle from the next
+ *             controller_march(). The log and LEDs are left to
+ *             feedback_disarm().
+ */
+void controller_disarm(controller_t* c);
+
+/**
+ * @brief      Runs one loop of the controller: outer loops that are due, state
+ *             estimate, and the inner loop and mixer when armed.
+ *
+ * @return     1 if state->m holds new motor signals, 0 if the motors should
+ *             idle
+ */
+int controller_march(controller_t* c);
+
+/**
+ * @brief      frees the altitude controller if the instance owns it, the banks
+ *             hold no memory of their own
+ */
+void controller_free(controller_t* c);
+
 
 
 
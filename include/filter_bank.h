@@ -0,0 +1,175 @@
+/**
+ * @file filter_bank.h
+ *
+ * @brief      Several discrete controllers marched together.
+ *
+ *             A filter bank holds up to FILTER_BANK_LANES rc_filter_t
+ *             controllers that run at the same rate, one per lane, in
+ *             structure-of-arrays form: coefficient k and history sample k of
+ *             every lane sit next to each other. One march evaluates the
+ *             difference equation of all lanes in the same loop, which the
+ *             compiler unrolls and vectorizes since the lane count is a
+ *             constant. Lanes of lower order are padded with zero
+ *             coefficients up to the highest order in the bank and unused
+ *             lanes are left as zero filters, neither changes the result.
+ *
+ *             Each lane keeps the behaviour of rc_filter_march(): gain,
+ *             saturation, soft start and the order of the floating point
+ *             operations are the same, so a lane gives bit for bit the same
+ *             output as the rc_filter_t it was built from. In a float build,
+ *             see scalar.h, coefficients and history are rounded to float.
+ *
+ *             When the saturation limits of one lane depend on the outputs of
+ *             the lanes before it, as with the greedy mixer, the march is
+ *             split in three:
+ *             filter_bank_march_begin(&fb, in);
+ *             for each lane:
+ *                 filter_bank_enable_saturation(&fb, lane, min, max);
+ *                 out = filter_bank_finish_lane(&fb, lane);
+ *             filter_bank_march_end(&fb);
+ *
+ *             Everything is stored in the struct, nothing is allocated.
+ */
+
+#ifndef FILTER_BANK_H
+#define FILTER_BANK_H
+
+#include <stdint.h>
+#include <rc/math/filter.h>
+#include <scalar.h>
+
+#define FILTER_BANK_LANES	4	///< controllers per bank
+#define FILTER_BANK_MAX_ORDER	15	///< same as the settings cache holds
+
+typedef struct filter_bank_t{
+	int lanes;		///< lanes in use, from filter_bank_alloc()
+	int order;		///< highest order of the lanes
+	double dt;		///< timestep shared by all lanes
+	uint64_t step;		///< marches since the last reset
+	// coefficient or sample k of lane l is at [k][l]
+	scalar_t num[FILTER_BANK_MAX_ORDER+1][FILTER_BANK_LANES] __attribute__((aligned(32)));
+	scalar_t den[FILTER_BANK_MAX_ORDER+1][FILTER_BANK_LANES] __attribute__((aligned(32)));
+	scalar_t in[FILTER_BANK_MAX_ORDER+1][FILTER_BANK_LANES] __attribute__((aligned(32)));
+	scalar_t out[FILTER_BANK_MAX_ORDER+1][FILTER_BANK_LANES] __attribute__((aligned(32)));
+	scalar_t gain[FILTER_BANK_LANES];		///< gain used by the next march
+	scalar_t gain_nominal[FILTER_BANK_LANES];	///< gain of the source filter
+	scalar_t sat_min[FILTER_BANK_LANES];
+	scalar_t sat_max[FILTER_BANK_LANES];
+	int sat_en[FILTER_BANK_LANES];
+	int sat_flag[FILTER_BANK_LANES];
+	int ss_en[FILTER_BANK_LANES];
+	scalar_t ss_steps[FILTER_BANK_LANES];
+	scalar_t pending[FILTER_BANK_LANES];	///< outputs of the march in progress
+	int initialized;
+} filter_bank_t;
+
+/**
+ * @brief      Returns a bank with no lanes, not initialized.
+ */
+filter_bank_t filter_bank_empty(void);
+
+/**
+ * @brief      Builds a bank from n controllers, typically straight from the
+ *             settings file.
+ *
+ *             Coefficients and gain are copied, the filters themselves are not
+ *             referenced afterwards and can be freed. Filter i becomes lane i.
+ *             History, saturation and soft start start out cleared and
+ *             disabled.
+ *
+ * @param      fb       The bank
+ * @param      filters  n initialized filters with the same dt
+ * @param[in]  n        number of filters, 1 to FILTER_BANK_LANES
+ *
+ * @return     0 on success, -1 on failure
+ */
+int filter_bank_alloc(filter_bank_t* fb, rc_filter_t* const* filters, int n);
+
+/**
+ * @brief      Zeros the input and output history of every lane and the step
+ *             count for soft start, like rc_filter_reset().
+ */
+void filter_bank_reset(filter_bank_t* fb);
+
+/**
+ * @brief      Fills the input history of one lane with a value, like
+ *             rc_filter_prefill_inputs().
+ */
+void filter_bank_prefill_inputs(filter_bank_t* fb, int lane, scalar_t in);
+
+/**
+ * @brief      Sets the saturation limits of one lane, like
+ *             rc_filter_enable_saturation().
+ */
+static inline void filter_bank_enable_saturation(filter_bank_t* fb, int lane, scalar_t min, scalar_t max)
+{
+	fb->sat_en[lane] = 1;
+	fb->sat_min[lane] = min;
+	fb->sat_max[lane] = max;
+}
+
+/**
+ * @brief      Enables soft start on every lane, like
+ *             rc_filter_enable_soft_start().
+ *
+ * @param      fb       The bank
+ * @param[in]  seconds  The ramp time
+ *
+ * @return     0 on success, -1 on failure
+ */
+int filter_bank_enable_soft_start(filter_bank_t* fb, double seconds);
+
+/**
+ * @brief      Sets the gain of every lane to the gain of its source filter
+ *             times scale, for battery compensation.
+ */
+static inline void filter_bank_scale_gains(filter_bank_t* fb, scalar_t scale)
+{
+	int l;
+	for(l=0;l<FILTER_BANK_LANES;l++) fb->gain[l] = fb->gain_nominal[l]*scale;
+}
+
+/**
+ * @brief      Marches all lanes forward one step with their current
+ *             saturation limits.
+ *
+ * @param      fb    The bank
+ * @param[in]  in    one new input per lane in use
+ * @param[out] out   one output per lane in use
+ */
+void filter_bank_march(filter_bank_t* fb, const scalar_t* in, scalar_t* out);
+
+/**
+ * @brief      First half of a split march, takes the new inputs and evaluates
+ *             the difference equation of every lane without limits.
+ *
+ * @param      fb    The bank
+ * @param[in]  in    one new input per lane in use
+ */
+void filter_bank_march_begin(filter_bank_t* fb, const scalar_t* in);
+
+/**
+ * @brief      Applies soft start and the current saturation limits to one lane
+ *             of a split march.
+ *
+ * @return     the output of the lane
+ */
+scalar_t filter_bank_finish_lane(filter_bank_t* fb, int lane);
+
+/**
+ * @brief      Ends a split march once every lane in use is finished, records
+ *             the outputs in the history.
+ */
+void filter_bank_march_end(filter_bank_t* fb);
+
+/**
+ * @brief      Copies the input and output history and the step count of one
+ *             bank into another for a bumpless controller swap.
+ *
+ *             Lanes are matched by index. If the new bank has a higher order
+ *             the oldest samples the old one has are repeated. Nothing is done
+ *             if either bank isn't initialized.
+ */
+void filter_bank_transfer_history(filter_bank_t* to, const filter_bank_t* from);
+
+#endif // FILTER_BANK_H
@@ -45,7 +45,13 @@ typedef enum flight_mode_t{
 	 * hold altitude setpoint which is them moved up and down steadily based
 	 * on user input.
 	 */
-	ALT_HOLD_6DOF
+	ALT_HOLD_6DOF,
+	/**
+	 * sticks command roll, pitch and yaw rates directly to the gyro rate
+	 * loop, no angle feedback. Direct throttle. Needs enable_rate_loop, runs
+	 * at feedback_hz, up to 1kHz with IMU_SOURCE_FIFO.
+	 */
+	ACRO_4DOF
 
 } flight_mode_t;
 
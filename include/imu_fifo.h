@@ -0,0 +1,93 @@
+/**
+ * <imu_fifo.h>
+ *
+ * @brief      Raw gyro and accel from the MPU FIFO at up to 1kHz, the IMU
+ *             source for a rate loop faster than the DMP allows. Enabled with
+ *             imu_source IMU_SOURCE_FIFO in the settings file.
+ *
+ *             The DMP needs the MPU's sample rate at 200Hz, so as long as it
+ *             runs no register or FIFO read gets past that. This runs the MPU
+ *             in plain mode instead, at feedback_hz, with every accel and
+ *             gyro sample pushed into the FIFO. A thread at the priority of
+ *             the DMP interrupt thread it replaces wakes every batch samples,
+ *             reads everything the FIFO holds in one burst and for each
+ *             sample updates the rc_mpu_data_t it was given the way the DMP
+ *             would, then calls the callback. That way the feedback ISR runs
+ *             once per raw sample and the rate loop sees every one of them.
+ *
+ *             The attitude comes from a complementary filter over the same
+ *             samples, the gyro integrated into a quaternion and pulled
+ *             towards the accelerometer's gravity vector with a time constant
+ *             of IMU_FIFO_TILT_TC. There is no magnetometer in this mode so
+ *             yaw is the integrated gyro and drifts slowly, which heading
+ *             hold doesn't mind but a compass heading would.
+ *
+ *             Gyro offsets from rc_calibrate_gyro are loaded into the MPU by
+ *             rc_mpu_initialize() so the FIFO samples have them applied, the
+ *             accelerometer calibration is not.
+ */
+
+#ifndef IMU_FIFO_H
+#define IMU_FIFO_H
+
+#include <stdint.h>
+#include <rc/mpu.h>
+
+#define IMU_FIFO_MAX_HZ		1000	///< internal sample rate with the DLPF on
+#define IMU_FIFO_MAX_BATCH	8	///< samples per read, the FIFO holds 42
+#define IMU_FIFO_TILT_TC	0.5	///< time constant of the accel correction (s)
+
+/**
+ * Where the feedback ISR gets its IMU data from.
+ */
+typedef enum imu_source_t{
+	IMU_SOURCE_DMP,		///< DMP fused attitude at feedback_hz, 200Hz at most
+	IMU_SOURCE_FIFO		///< raw samples from the FIFO at feedback_hz, see imu_fifo.h
+} imu_source_t;
+
+/**
+ * @brief      Starts the MPU without the DMP and pushes accel and gyro into
+ *             its FIFO at sample_hz. Nothing is read until
+ *             imu_fifo_set_callback().
+ *
+ *             conf is used as for rc_mpu_initialize(), the thread reading the
+ *             FIFO runs with conf.dmp_interrupt_sched_policy and
+ *             conf.dmp_interrupt_priority like the DMP interrupt thread.
+ *
+ * @param      data       filled in for every sample, like the DMP does
+ * @param[in]  conf       MPU configuration, gyro_dlpf must not be off
+ * @param[in]  sample_hz  sample rate, must divide IMU_FIFO_MAX_HZ
+ * @param[in]  batch      samples per FIFO read, 1 to IMU_FIFO_MAX_BATCH
+ *
+ * @return     0 on success, -1 on failure
+ */
+int imu_fifo_init(rc_mpu_data_t* data, rc_mpu_config_t conf, int sample_hz, int batch);
+
+/**
+ * @brief      Starts the thread reading the FIFO, func is called once per
+ *             sample after data was updated.
+ *
+ *             remaining is the number of samples still to come from the same
+ *             read, so 0 marks the newest sample. Only then does the output
+ *             need to go to the motors, the earlier ones are already late.
+ *
+ * @param[in]  func  callback, runs on the FIFO thread
+ *
+ * @return     0 on success, -1 on failure
+ */
+int imu_fifo_set_callback(void (*func)(int remaining));
+
+/**
+ * @brief      number of times the FIFO overflowed and was reset, the samples
+ *             in it are lost.
+ */
+uint64_t imu_fifo_overflows();
+
+/**
+ * @brief      Stops the thread, call before rc_mpu_power_off().
+ *
+ * @return     0 on success, -1 on failure or exit timeout
+ */
+int imu_fifo_cleanup();
+
+#endif // IMU_FIFO_H
@@ -35,7 +35,9 @@ typedef enum dsm_kill_mode_t{
 /**
  * Represents current command by the user. This is populated by the
  * input_manager thread which decides to read from mavlink or DSM depending on
- * what it is receiving.
+ * what it is receiving. Only the DSM callbacks touch it directly, each frame
+ * they finish goes to the feedback ISR through setpoint_manager_input() and
+ * to the other threads in the state snapshot.
  */
 typedef struct user_input_t{
 	int initialized;		///< set to 1 after input_manager_init()
@@ -0,0 +1,172 @@
+/**
+ * @file log_codec.h
+ *
+ * @brief      Block format for compact binary logs and a reader for both log
+ *             formats.
+ *
+ *             A compact log starts with the same log_file_header_t and
+ *             log_field_t table as a plain one, with LOG_FILE_MAGIC_BLOCKS as
+ *             the magic and header_size rounded up to LOG_BLOCK_ALIGN. Records
+ *             follow in blocks of at most LOG_BLOCK_SIZE bytes, each starting
+ *             on a multiple of LOG_BLOCK_ALIGN with a log_block_header_t and
+ *             padded with zeros to the next one. A zero magic where the next
+ *             block would start ends the log, so a preallocated file that was
+ *             never truncated still reads back.
+ *
+ *             Within a block every field is stored relative to the same field
+ *             of the previous record, the first record of a block relative to
+ *             all zeros, so every block decodes on its own:
+ *
+ *             - integers as the difference, zigzag and varint encoded. The loop
+ *               index and timestamps take one to three bytes.
+ *             - floating point as the xor of the bit patterns, varint encoded.
+ *               Unchanged values such as unused motors take one byte, values
+ *               that do change save the bytes of sign and exponent they share.
+ *
+ *             The encoding is lossless, a decoded record is bit for bit the
+ *             log_entry_t that was logged, so tools/replay gives the same
+ *             result on either format.
+ *
+ *             The codec only works from the field table, never from
+ *             log_entry_t, so a reader built from a different version of
+ *             LOG_TABLE still decodes every field.
+ */
+
+#ifndef LOG_CODEC_H
+#define LOG_CODEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <log_manager.h>
+
+#define LOG_FILE_MAGIC_BLOCKS	"RCPILOZ"	///< first 8 bytes of a compact log file
+#define LOG_BLOCK_MAGIC		0x4b4c4252	///< "RBLK" in little endian
+#define LOG_BLOCK_ALIGN		4096	///< file offset and size of blocks are multiples of this
+#define LOG_BLOCK_SIZE		65536	///< largest block including its header
+
+/**
+ * Starts every block of a compact log.
+ */
+typedef struct log_block_header_t{
+	uint32_t magic;		///< LOG_BLOCK_MAGIC
+	uint32_t num_records;	///< records in the block
+	uint32_t payload_size;	///< encoded bytes following this header, without padding
+	uint32_t reserved;	///< 0
+} log_block_header_t;
+
+/**
+ * how one field is encoded, chosen from its type and size
+ */
+typedef enum log_codec_kind_t{
+	LOG_CODEC_DELTA64,	///< 8 byte integer
+	LOG_CODEC_DELTA32,	///< 4 byte integer
+	LOG_CODEC_XOR64,	///< double
+	LOG_CODEC_XOR32,	///< float
+	LOG_CODEC_RAW		///< anything else, copied as is
+} log_codec_kind_t;
+
+/**
+ * Encoder or decoder state for one stream of records.
+ */
+typedef struct log_codec_t{
+	uint32_t num_fields;
+	uint32_t record_size;
+	uint32_t max_encoded;	///< worst case encoded size of one record
+	log_codec_kind_t* kind;	///< per field
+	uint32_t* offset;	///< per field
+	uint32_t* size;		///< per field
+	unsigned char* prev;	///< previous record, all zeros at the start of a block
+} log_codec_t;
+
+/**
+ * @brief      Sets up a codec for records described by a field table.
+ *
+ * @param      c            The codec
+ * @param[in]  fields       The field table from the log header
+ * @param[in]  num_fields   The number of fields
+ * @param[in]  record_size  The size of a decoded record
+ *
+ * @return     0 on success, -1 on failure
+ */
+int log_codec_init(log_codec_t* c, const log_field_t* fields, uint32_t num_fields, uint32_t record_size);
+
+/**
+ * @brief      starts a new block, the next record is coded against zeros
+ */
+void log_codec_reset(log_codec_t* c);
+
+/**
+ * @brief      Encodes one record.
+ *
+ * @param      c     The codec
+ * @param[in]  rec   The record, record_size bytes
+ * @param[out] out   where to write, must have room for max_encoded bytes
+ *
+ * @return     number of bytes written
+ */
+size_t log_codec_encode(log_codec_t* c, const void* rec, unsigned char* out);
+
+/**
+ * @brief      Decodes one record.
+ *
+ * @param      c     The codec
+ * @param[in]  in    encoded bytes
+ * @param[in]  len   number of encoded bytes available
+ * @param[out] rec   where to write the record, record_size bytes
+ *
+ * @return     number of bytes consumed, -1 if the data is truncated or corrupt
+ */
+int log_codec_decode(log_codec_t* c, const unsigned char* in, size_t len, void* rec);
+
+/**
+ * @brief      frees the memory of a codec set up with log_codec_init()
+ */
+void log_codec_free(log_codec_t* c);
+
+/**
+ * Sequential reader for plain and compact log files.
+ */
+typedef struct log_reader_t{
+	FILE* f;
+	log_file_header_t header;
+	log_field_t* fields;	///< header.num_fields entries
+	int blocks;		///< 1 for a compact log
+	log_codec_t codec;
+	unsigned char* block;	///< payload of the current block
+	uint32_t block_len;	///< payload bytes in the current block
+	uint32_t block_pos;	///< payload bytes decoded so far
+	uint32_t block_left;	///< records left in the current block
+	uint64_t block_start;	///< file offset of the current block
+} log_reader_t;
+
+/**
+ * @brief      Reads and checks the header and field table of a log, plain or
+ *             compact, and positions the reader at the first record.
+ *
+ * @param      r     The reader
+ * @param      f     log file opened for reading in binary mode, stays owned
+ *                   by the caller
+ *
+ * @return     0 on success, -1 on failure
+ */
+int log_reader_open(log_reader_t* r, FILE* f);
+
+/**
+ * @brief      Reads the next record.
+ *
+ * @param      r     The reader
+ * @param[out] rec   where to write the record, header.record_size bytes
+ *
+ * @return     1 if a record was read, 0 at the end of the log, -1 on a
+ *             corrupt log
+ */
+int log_reader_next(log_reader_t* r, void* rec);
+
+/**
+ * @brief      frees the memory of a reader, doesn't close the file
+ */
+void log_reader_close(log_reader_t* r);
+
+#endif // LOG_CODEC_H
@@ -0,0 +1,186 @@
+/**
+ * @file log_manager.h
+ *
+ * @brief      Functions to start, stop, and interact with the log manager
+ *             thread.
+ *
+ *             The feedback controller pushes one log_entry_t per loop into a
+ *             single-producer/single-consumer lock-free ring buffer. A
+ *             background writer thread drains the ring and streams the entries
+ *             to disk as fixed-size binary records. Each log file starts with
+ *             a header describing the LOG_TABLE layout so readers don't need
+ *             to be compiled against the same version of this file.
+ *
+ *             With log_compact in the settings file, the default, the writer
+ *             delta encodes the records into aligned blocks instead, see
+ *             log_codec.h, optionally written with O_DIRECT. Either way the
+ *             file is preallocated log_prealloc_mb at a time and truncated to
+ *             what was written when it is closed. tools/log_decode turns both
+ *             formats into CSV.
+ */
+
+#ifndef LOG_MANAGER_H
+#define LOG_MANAGER_H
+
+#include <stdint.h>
+#include <inttypes.h> // for PRIu64
+
+/**
+ * table of values to go into each log entry. It is structured this way so that
+ * it can be transformed into a struct, binary file header, or fprintf
+ * statement with macros. The second half holds the raw inputs the feedback
+ * ISR consumed that loop so tools/replay can drive the controller offline.
+ */
+#define LOG_TABLE \
+	X(uint64_t,	"%" PRIu64,	loop_index	) \
+	X(uint64_t,	"%" PRIu64,	last_step_ns	) \
+						  \
+	X(double,	"%f",	altitude	) \
+	X(double,	"%f",	roll		) \
+	X(double,	"%f",	pitch		) \
+	X(double,	"%f",	yaw		) \
+						  \
+	X(double,	"%f",	u_X		) \
+	X(double,	"%f",	u_Y		) \
+	X(double,	"%f",	u_Z		) \
+	X(double,	"%f",	u_roll		) \
+	X(double,	"%f",	u_pitch		) \
+	X(double,	"%f",	u_yaw		) \
+						  \
+	X(double,	"%f",	mot_1		) \
+	X(double,	"%f",	mot_2		) \
+	X(double,	"%f",	mot_3		) \
+	X(double,	"%f",	mot_4		) \
+	X(double,	"%f",	mot_5		) \
+	X(double,	"%f",	mot_6		) \
+	X(double,	"%f",	mot_7		) \
+	X(double,	"%f",	mot_8		) \
+	X(double,	"%f",	v_batt		) \
+						  \
+	X(double,	"%f",	imu_roll	) \
+	X(double,	"%f",	imu_pitch	) \
+	X(double,	"%f",	imu_yaw		) \
+	X(double,	"%f",	gyro_x		) \
+	X(double,	"%f",	gyro_y		) \
+	X(double,	"%f",	gyro_z		) \
+	X(double,	"%f",	v_batt_raw	) \
+	X(double,	"%f",	thr_stick	) \
+	X(double,	"%f",	roll_stick	) \
+	X(double,	"%f",	pitch_stick	) \
+	X(double,	"%f",	yaw_stick	) \
+	X(int,		"%d",	flight_mode	)
+
+
+#define X(type, fmt, name) type name ;
+/**
+ * Struct definition to contain a single line of the log. For each log entry you
+ * wish to create. Fill in an instance of this and pass to add_log_entry()
+ */
+typedef struct log_entry_t { LOG_TABLE } log_entry_t;
+#undef X
+
+#define LOG_FILE_MAGIC		"RCPILOG"	///< first 8 bytes of every log file
+#define LOG_FILE_VERSION	2	///< 2 added the raw controller inputs
+#define LOG_FIELD_NAME_LEN	32
+#define LOG_FIELD_TYPE_LEN	16
+
+/**
+ * Fixed-size header at the start of every binary log file. It is immediately
+ * followed by num_fields log_field_t descriptors, then by back-to-back
+ * records of record_size bytes each. All values are in the native byte order
+ * of the machine that wrote the log.
+ */
+typedef struct log_file_header_t{
+	char magic[8];		///< LOG_FILE_MAGIC, null terminated
+	uint32_t version;	///< LOG_FILE_VERSION
+	uint32_t header_size;	///< bytes from start of file to first record
+	uint32_t record_size;	///< sizeof(log_entry_t) of the writer
+	uint32_t num_fields;	///< number of log_field_t descriptors that follow
+} log_file_header_t;
+
+/**
+ * Describes one LOG_TABLE column within a binary record.
+ */
+typedef struct log_field_t{
+	char name[LOG_FIELD_NAME_LEN];	///< column name from LOG_TABLE
+	char type[LOG_FIELD_TYPE_LEN];	///< C type from LOG_TABLE, e.g. "double"
+	uint32_t offset;		///< byte offset within the record
+	uint32_t size;			///< size of the field in bytes
+} log_field_t;
+
+/**
+ * @brief      starts the background writer thread which opens the next binary
+ *             log file in the series and keeps it waiting for an arm.
+ *
+ *             Call once at startup, never from the feedback ISR. After every
+ *             stop_log_manager() the writer closes the file and opens the next
+ *             one on its own.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int log_manager_init();
+
+/**
+ * @brief      starts logging into the file the writer thread has open.
+ *
+ *             Only flips an atomic flag so it is safe to call from the
+ *             feedback ISR on arm. Used in log_manager.c
+ *
+ * @return     0 on success, -1 if no log file is ready yet
+ */
+int start_log_manager();
+
+/**
+ * @brief      Write the contents of one entry to the console.
+ *
+ *             Used in log_manager.c
+ *
+ * @param[in]  entry  The log_entry_t holding the LOG_TABLE to be printed.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int print_entry(log_entry_t entry);
+
+/**
+ * @brief      quickly add new data to the lock-free ring buffer
+ *
+ *             Never blocks. This must only ever be called from one thread, the
+ *             feedback controller. If the writer thread has fallen so far
+ *             behind that the ring is full the entry is dropped and counted.
+ *             Used in log_manager.c
+ *
+ * @param[in]  new_entry  the log_entry_t to be copied into the ring
+ *
+ * @return     0 on success, -1 if the entry was dropped
+ */
+int add_log_entry(const log_entry_t* new_entry);
+
+/**
+ * @brief      Tells the writer thread to flush what is left in the ring and
+ *             close the current log file, it then opens the next one.
+ *
+ *             Does not block so it is safe to call from the feedback ISR.
+ *
+ * @return     0 on success, -1 if the log manager wasn't logging
+ */
+int stop_log_manager();
+
+/**
+ * @brief      Finish writing remaining data to log and close thread.
+ *
+ *             A log file that was opened but never armed is removed. Used in
+ *             log_manager.c
+ *
+ * @return     0 on sucess and clean exit, -1 on exit timeout/force close.
+ */
+int join_log_manager_thread();
+
+/**
+ * @brief      number of entries dropped because the ring was full since the
+ *             current log file was started.
+ *
+ * @return     number of dropped entries
+ */
+uint64_t log_manager_dropped_entries();
+
+#endif // LOG_MANAGER_H
@@ -0,0 +1,72 @@
+/**
+ * @file loop_sched.h
+ *
+ * @brief      Multi-rate scheduling for the feedback ISR.
+ *
+ *             The inner attitude loop runs on every DMP interrupt. Outer loops
+ *             such as the setpoint update and altitude control are tasks that
+ *             run every divisor-th tick instead. loop_sched_init() gives each
+ *             task a phase so tasks with the same or related divisors land on
+ *             different ticks where possible, which keeps the worst case tick
+ *             close to the inner loop alone. The ISR calls loop_sched_tick()
+ *             once per loop and then loop_sched_due() at the point each task
+ *             would run, so the order within a tick stays fixed. Everything
+ *             after init is a countdown per task, no division in the ISR.
+ */
+
+#ifndef LOOP_SCHED_H
+#define LOOP_SCHED_H
+
+/**
+ * One task run at a fraction of the feedback rate.
+ */
+typedef struct loop_task_t{
+	const char* name;
+	int divisor;	///< runs every divisor ticks, 1 for every tick
+	int phase;	///< tick within the period it runs on, set by loop_sched_init()
+	int countdown;	///< ticks until it is due again
+	int due;	///< 1 if it runs on the current tick
+} loop_task_t;
+
+/**
+ * @brief      Assigns phases to spread the tasks over the ticks and resets
+ *             their countdowns so each first runs on its phase.
+ *
+ *             Two tasks share ticks whenever their phases are equal modulo
+ *             the gcd of their divisors. Tasks are placed in the order given,
+ *             each on the phase shared with the fewest tasks placed before it.
+ *
+ * @param      tasks  The tasks, divisor must be set and at least 1
+ * @param[in]  n      number of tasks
+ *
+ * @return     0 on success, -1 on failure
+ */
+int loop_sched_init(loop_task_t* tasks, int n);
+
+/**
+ * @brief      advances all tasks by one tick, call once at the top of the ISR
+ */
+static inline void loop_sched_tick(loop_task_t* tasks, int n)
+{
+	int i;
+	for(i=0;i<n;i++){
+		if(tasks[i].countdown==0){
+			tasks[i].due = 1;
+			tasks[i].countdown = tasks[i].divisor-1;
+		}
+		else{
+			tasks[i].due = 0;
+			tasks[i].countdown--;
+		}
+	}
+}
+
+/**
+ * @brief      whether a task runs on the current tick
+ */
+static inline int loop_sched_due(const loop_task_t* task)
+{
+	return task->due;
+}
+
+#endif // LOOP_SCHED_H
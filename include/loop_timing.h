@@ -0,0 +1,100 @@
+/**
+ * @file loop_timing.h
+ *
+ * @brief      Timing instrumentation for the feedback ISR.
+ *
+ *             The ISR stamps the time at entry and after each of its stages.
+ *             loop_timing_update() is then called once per loop to fold those
+ *             stamps into min/mean/max/p99 statistics for each stage and a
+ *             histogram of the interval between DMP callbacks. Loops that
+ *             apply a new DSM frame also add the time from its arrival to
+ *             their ESC writes, the stick to motor latency. Statistics are
+ *             gathered over a window of one second worth of loops and then
+ *             published all at once so readers always see a complete window.
+ *             Everything here is constant time and allocation free.
+ */
+
+#ifndef LOOP_TIMING_H
+#define LOOP_TIMING_H
+
+#include <stdint.h>
+
+#define LOOP_TIMING_HIST_BINS	64	///< bins per histogram, last bins catch outliers
+#define LOOP_TIMING_STAGE_BIN_US 10.0	///< histogram resolution for stage durations
+#define LOOP_TIMING_JITTER_BIN_US 20.0	///< histogram resolution for callback interval
+#define LOOP_TIMING_INPUT_BIN_US 500.0	///< histogram resolution for stick to motor latency
+
+/**
+ * Quantities tracked by the loop timing statistics.
+ */
+typedef enum loop_stat_t{
+	LOOP_STAT_SETPOINT,	///< ISR entry to setpoint_manager_update() done
+	LOOP_STAT_ESTIMATE,	///< setpoint done to state estimate done
+	LOOP_STAT_CONTROL,	///< state estimate done to ESC writes done
+	LOOP_STAT_TOTAL,	///< ISR entry to ESC writes done
+	LOOP_STAT_INTERVAL,	///< time between consecutive DMP callbacks
+	LOOP_STAT_INPUT,	///< DSM frame arrival to ESC writes of the first loop using it
+	LOOP_NUM_STATS
+} loop_stat_t;
+
+/**
+ * Summary of one tracked quantity over the last completed window. All zero
+ * for LOOP_STAT_INPUT when no DSM frame was used in the window.
+ */
+typedef struct loop_stat_summary_t{
+	double min_us;
+	double mean_us;
+	double max_us;
+	double p99_us;		///< resolved to the histogram bin width
+} loop_stat_summary_t;
+
+/**
+ * Fixed-bin histogram. Bin i covers origin_us + i*bin_us up to the next bin,
+ * values outside the range are counted in the first or last bin.
+ */
+typedef struct loop_hist_t{
+	double origin_us;
+	double bin_us;
+	uint32_t bins[LOOP_TIMING_HIST_BINS];
+} loop_hist_t;
+
+/**
+ * Per-loop timestamps plus the statistics published at the end of each window.
+ */
+typedef struct loop_timing_t{
+	// timestamps of the most recent loop, written by the ISR
+	uint64_t isr_entry_ns;		///< time the DMP callback started
+	uint64_t setpoint_done_ns;	///< time setpoint_manager_update() returned
+	uint64_t estimate_done_ns;	///< time state estimate returned
+	uint64_t esc_done_ns;		///< time the last ESC pulse was sent
+	uint64_t input_ns;		///< arrival of the DSM frame this loop applied, 0 if none
+
+	// published once per window
+	uint64_t windows;		///< number of completed windows
+	uint64_t overruns;		///< total loops that took longer than the period
+	uint64_t late_callbacks;	///< total callbacks arriving >1.5 periods apart
+	double period_us;		///< nominal period, 1/feedback_hz
+	loop_stat_summary_t stats[LOOP_NUM_STATS];
+	loop_hist_t jitter;		///< histogram of the callback interval
+} loop_timing_t;
+
+/**
+ * @brief      Resets timing statistics and sets up the histograms for the
+ *             given loop rate. Call before the ISR starts.
+ *
+ * @param      t            pointer to the timing struct to initialize
+ * @param[in]  feedback_hz  nominal rate of the feedback loop
+ *
+ * @return     0 on success, -1 on failure
+ */
+int loop_timing_init(loop_timing_t* t, int feedback_hz);
+
+/**
+ * @brief      Folds the timestamps of the loop that just finished into the
+ *             running statistics. Call once at the end of every ISR.
+ *
+ * @param      t     pointer to the timing struct with fresh timestamps
+ */
+void loop_timing_update(loop_timing_t* t);
+
+#endif // LOOP_TIMING_H
@@ -0,0 +1,32 @@
+/**
+ * <mavlink_manager.h>
+ *
+ * @brief      Functions to start and stop the mavlink manager
+ *
+ *             The mavlink manager streams attitude, motor outputs, battery and
+ *             arm state to a ground station at telemetry_ip:telemetry_port
+ *             over UDP. Each message has its own rate in the settings file,
+ *             a rate of 0 turns that message off. With enable_mocap it also
+ *             receives ATT_POS_MOCAP messages on mocap_port and publishes them
+ *             to the mocap mailbox for the feedback controller.
+ */
+
+#ifndef MAVLINK_MANAGER_H
+#define MAVLINK_MANAGER_H
+
+/**
+ * @brief      Starts the telemetry sender if enable_telemetry is set and the
+ *             mocap receiver if enable_mocap is set
+ *
+ * @return     0 on success, -1 on failure
+ */
+int start_mavlink_manager();
+
+/**
+ * @brief      stops the mavlink manager
+ *
+ * @return     0 if thread exited cleanly, -1 if exit timed out.
+ */
+int cleanup_mavlink_manager();
+
+#endif // MAVLINK_MANAGER_H
@@ -14,6 +14,8 @@
 #ifndef MIXING_MATRIX_H
 #define MIXING_MATRIX_H
 
+#include <scalar.h>
+
 #define MAX_INPUTS 6	///< up to 6 control inputs (roll,pitch,yaw,z,x,y)
 #define MAX_ROTORS 8	///< up to 8 rotors
 
@@ -31,6 +33,68 @@ typedef enum rotor_layout_t{
 	LAYOUT_6DOF_5INCH_MONOCOQUE
 } rotor_layout_t;
 
+/**
+ * @brief      how __feedback_control() distributes the control inputs over
+ *             the motors
+ *
+ *             MIX_ALLOC_GREEDY adds one channel at a time, each clipped to the
+ *             room the channels before it left. MIX_ALLOC_PRIORITY marches
+ *             every controller first and hands all inputs to mix_allocate().
+ *
+ *             Greedy is the default. On LAYOUT_6X and LAYOUT_8X priority
+ *             misses the requested inputs by 10-20% less, but its null space
+ *             search costs about 10-20x the greedy mix per loop. LAYOUT_4X,
+ *             LAYOUT_4PLUS and the 6DOF layouts have no null space, so
+ *             there priority only scales roll and pitch together instead of
+ *             clipping them. That keeps their direction but misses slightly
+ *             more than greedy on 4PLUS and the 6DOF layouts, for about twice
+ *             the cost. See tools/mix_bench.c.
+ */
+typedef enum mix_allocation_t{
+	MIX_ALLOC_GREEDY,
+	MIX_ALLOC_PRIORITY
+} mix_allocation_t;
+
+typedef struct mixer_t mixer_t;
+
+/**
+ * @brief      One mixer and the tables built from its layout by mixer_init().
+ *
+ *             Any number can exist side by side, mix_init() and the mix_*
+ *             functions use one of their own. The kernel pointers and
+ *             counts share the first cache line, the tables each start on a
+ *             cache line of their own in the order the loop reads them.
+ *
+ *             col is a column-major copy of the mixing matrix: row ch holds
+ *             the coefficient of input ch for every motor so one channel is
+ *             a contiguous run. pinv holds 1/coef where coef>0 and ninv holds
+ *             1/coef where coef<0. pad is SCALAR_MAX for motors a channel
+ *             can't saturate so they drop out of the min/max search without
+ *             a branch. eff is the pseudo-inverse of the mixing matrix, the
+ *             inputs produced by a set of motors, and null an orthonormal
+ *             basis of its null space, one motor pattern per row. With as
+ *             many rotors as inputs there is none.
+ */
+struct mixer_t{
+	// kernels specialised for the rotor count, unused with a fixed airframe
+	void (*bounds)(const mixer_t* mx, int ch, const scalar_t* mot, scalar_t* min, scalar_t* max);
+	void (*add)(const mixer_t* mx, scalar_t u, int ch, scalar_t* mot);
+	scalar_t (*sat_add)(const mixer_t* mx, scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot);
+	int rotors;		///< number of motors
+	int dof;		///< 4 or 6 degrees of freedom
+	int null_dim;		///< rows of null in use
+	int levels;		///< priority levels mixer_allocate() goes through
+	scalar_t col[MAX_INPUTS][MAX_ROTORS] __attribute__((aligned(64)));
+	scalar_t pinv[MAX_INPUTS][MAX_ROTORS] __attribute__((aligned(64)));
+	scalar_t ninv[MAX_INPUTS][MAX_ROTORS] __attribute__((aligned(64)));
+	scalar_t pad[MAX_INPUTS][MAX_ROTORS] __attribute__((aligned(64)));
+	scalar_t eff[MAX_INPUTS][MAX_ROTORS] __attribute__((aligned(64)));
+	scalar_t null[MAX_ROTORS][MAX_ROTORS] __attribute__((aligned(64)));
+	scalar_t (*matrix)[6];	///< the layout's mixing matrix, one row per motor
+	rotor_layout_t layout;
+	int initialized;	///< 1 once mixer_init() succeeded
+} __attribute__((aligned(64)));
+
 /**
  * @brief      Initiallizes the mixing matrix for a given input layout.
  *
@@ -48,6 +112,21 @@ typedef enum rotor_layout_t{
  */
 int mix_init(rotor_layout_t layout);
 
+/**
+ * @brief      Same as mix_init() for a mixer of the caller's own.
+ *
+ * @param[out] mx      The mixer to set up
+ * @param[in]  layout  The layout enum
+ *
+ * @return     0 on success, -1 on failure
+ */
+int mixer_init(mixer_t* mx, rotor_layout_t layout);
+
+/**
+ * @brief      the mixer set up by mix_init(), which the mix_* functions use
+ */
+const mixer_t* mix_default_mixer();
+
 /**
  * @brief      Fills the vector mot with the linear combination of XYZ, roll
  *             pitch yaw. Not actually used, only for testing.
@@ -65,7 +144,12 @@ int mix_init(rotor_layout_t layout);
  *
  * @return     0 on success, -1 on failure
  */
-int mix_all_controls(double u[6], double* mot);
+int mix_all_controls(scalar_t u[6], scalar_t* mot);
+
+/**
+ * @brief      mix_all_controls() on a given mixer
+ */
+int mixer_all_controls(const mixer_t* mx, scalar_t u[6], scalar_t* mot);
 
 /**
  * @brief      Finds the min and max inputs u that can be applied to a current
@@ -85,7 +169,12 @@ int mix_all_controls(double u[6], double* mot);
  *
  * @return     0 on success, -1 on failure
  */
-int mix_check_saturation(int ch, double* mot, double* min, double* max);
+int mix_check_saturation(int ch, scalar_t* mot, scalar_t* min, scalar_t* max);
+
+/**
+ * @brief      mix_check_saturation() on a given mixer
+ */
+int mixer_check_saturation(const mixer_t* mx, int ch, scalar_t* mot, scalar_t* min, scalar_t* max);
 
 /**
  * @brief      Mixes the control input u for a single channel ch to the existing
@@ -103,7 +192,123 @@ int mix_check_saturation(int ch, double* mot, double* min, double* max);
  *
  * @return     0 on success, -1 on failure
  */
-int mix_add_input(double u, int ch, double* mot);
+int mix_add_input(scalar_t u, int ch, scalar_t* mot);
+
+/**
+ * @brief      mix_add_input() on a given mixer
+ */
+int mixer_add_input(const mixer_t* mx, scalar_t u, int ch, scalar_t* mot);
+
+/**
+ * @brief      Fast path equivalent of mix_check_saturation().
+ *
+ *             Uses the column-major table and reciprocals precomputed by
+ *             mix_init() and the kernel specialised for the layout's rotor
+ *             count. Nothing is validated here, mix_init() must have succeeded
+ *             and ch must be a channel used by the layout. Motors are assumed
+ *             to already be within 0 to 1, which is guaranteed when they were
+ *             only ever modified by the mix_* functions.
+ *
+ * @param[in]  ch    channel
+ * @param[in]  mot   The array of motor signals to be added onto
+ * @param[out] min   The minimum possible input without saturation
+ * @param[out] max   The maximum possible input without saturation
+ */
+void mix_check_saturation_fast(int ch, const scalar_t* mot, scalar_t* min, scalar_t* max);
+
+/**
+ * @brief      mix_check_saturation_fast() on a given mixer
+ */
+void mixer_check_saturation_fast(const mixer_t* mx, int ch, const scalar_t* mot, scalar_t* min, scalar_t* max);
+
+/**
+ * @brief      Fast path equivalent of mix_add_input().
+ *
+ *             Same preconditions as mix_check_saturation_fast(). Motors are
+ *             still clamped to 0 to 1 afterwards for safety.
+ *
+ * @param[in]  u     control input
+ * @param[in]  ch    channel
+ * @param      mot   array of motor channels
+ */
+void mix_add_input_fast(scalar_t u, int ch, scalar_t* mot);
+
+/**
+ * @brief      mix_add_input_fast() on a given mixer
+ */
+void mixer_add_input_fast(const mixer_t* mx, scalar_t u, int ch, scalar_t* mot);
+
+/**
+ * @brief      Fused saturate-and-add for inputs that are known before
+ *             saturation is checked, such as direct throttle passthrough.
+ *
+ *             Finds the range of input on channel ch that the motors can
+ *             absorb, clamps u to that range and to the caller's absolute
+ *             limits, then mixes the result into mot, all in one call. Same
+ *             preconditions as mix_check_saturation_fast().
+ *
+ * @param[in]  u        desired control input
+ * @param[in]  ch       channel
+ * @param[in]  lim_min  absolute lower limit for this channel
+ * @param[in]  lim_max  absolute upper limit for this channel
+ * @param      mot      array of motor channels
+ *
+ * @return     the input actually applied after saturation
+ */
+scalar_t mix_add_input_saturated(scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot);
+
+/**
+ * @brief      mix_add_input_saturated() on a given mixer
+ */
+scalar_t mixer_add_input_saturated(const mixer_t* mx, scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot);
+
+/**
+ * @brief      Prioritised allocation of all control inputs in one pass.
+ *
+ *             Inputs are grouped in priority levels: Z, then roll and pitch
+ *             together, then yaw, then Y and X together on 6DOF layouts. Each
+ *             level is mixed with the layout matrix on top of the levels
+ *             before it. If that saturates a motor, the null space of the
+ *             layout, motor patterns with no net force or torque, is searched
+ *             first for a combination that brings the motors back in range.
+ *             Whatever still doesn't fit is removed by scaling the whole
+ *             level down, which keeps the direction of roll and pitch
+ *             together instead of clipping each one on its own. Higher levels
+ *             are never given up for lower ones.
+ *
+ *             The tables are built by mix_init() and the number of steps is
+ *             fixed by the layout, no iteration depends on the inputs.
+ *             Nothing is allocated and nothing is validated, mix_init() must
+ *             have succeeded. Channels a 4DOF layout doesn't use are ignored
+ *             and come back as 0.
+ *
+ * @param      u     in: 6 desired control inputs, out: inputs actually
+ *                   applied
+ * @param[out] mot   motor outputs, overwritten, always within 0 to 1
+ */
+void mix_allocate(scalar_t* u, scalar_t* mot);
+
+/**
+ * @brief      mix_allocate() on a given mixer
+ */
+void mixer_allocate(const mixer_t* mx, scalar_t* u, scalar_t* mot);
+
+/**
+ * @brief      Computes the control inputs a set of motor outputs produces.
+ *
+ *             Uses the pseudo-inverse of the mixing matrix built by
+ *             mix_init(), so for motors that didn't saturate this recovers
+ *             the inputs that were mixed.
+ *
+ * @param[in]  mot   motor outputs
+ * @param[out] u     6 control inputs, 0 for channels the layout doesn't use
+ */
+void mix_motor_effect(const scalar_t* mot, scalar_t* u);
+
+/**
+ * @brief      mix_motor_effect() on a given mixer
+ */
+void mixer_motor_effect(const mixer_t* mx, const scalar_t* mot, scalar_t* u);
 
 
 #endif // MIXING_MATRIX_H
\ No newline at end of file
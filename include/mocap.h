@@ -0,0 +1,63 @@
+/**
+ * @headerfile mocap.h
+ *
+ * @brief      Mailbox handing external position and attitude estimates, such
+ *             as ATT_POS_MOCAP messages from a motion capture system, to the
+ *             feedback ISR.
+ *
+ *             The receiving thread publishes each sample through a seqlock
+ *             with the time it was captured on our clock, estimated as the
+ *             receive time minus settings.mocap_latency_ms. It also tracks a
+ *             velocity estimate from consecutive samples. The ISR never
+ *             blocks on the writer. When it reads, the sample is extrapolated
+ *             forward by its age so the controller sees where the vehicle is
+ *             now, not where it was when the cameras saw it.
+ */
+
+#ifndef MOCAP_H
+#define MOCAP_H
+
+#include <stdint.h>
+
+#define MOCAP_TIMEOUT_NS	250000000ULL	///< samples older than this are stale
+
+/**
+ * One external estimate in the NED frame of the motion capture system
+ */
+typedef struct mocap_sample_t{
+	uint64_t time_ns;	///< time since boot the sample was captured
+	uint64_t age_ns;	///< time between capture and the read, set by mocap_get()
+	double pos[3];		///< position x,y,z (m), z points down
+	double vel[3];		///< velocity estimated from consecutive samples (m/s)
+	double q[4];		///< attitude quaternion w,x,y,z
+} mocap_sample_t;
+
+/**
+ * @brief      Empties the mailbox. Call before the writer and reader start.
+ */
+void mocap_init();
+
+/**
+ * @brief      Publishes a new sample. Only one thread may publish.
+ *
+ * @param[in]  capture_ns  time since boot the sample was captured
+ * @param[in]  pos         position x,y,z (m)
+ * @param[in]  q           attitude quaternion w,x,y,z
+ */
+void mocap_publish(uint64_t capture_ns, const double pos[3], const double q[4]);
+
+/**
+ * @brief      Reads the latest sample, extrapolated to now_ns with the
+ *             velocity estimate. Never blocks, safe from the feedback ISR.
+ *
+ *             If the writer is busy the previous sample is used again.
+ *
+ * @param[in]  now_ns  current time since boot
+ * @param[out] out     the compensated sample
+ *
+ * @return     0 on success, -1 if there is no sample younger than
+ *             MOCAP_TIMEOUT_NS
+ */
+int mocap_get(uint64_t now_ns, mocap_sample_t* out);
+
+#endif // MOCAP_H
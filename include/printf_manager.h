@@ -12,6 +12,8 @@
 /**
  * @brief      Start the printf_manager thread which should be the only thing
  *             printing to the screen besides error messages from other threads.
+ *             Frames are written to the terminal without blocking and dropped
+ *             when it can't keep up.
  *
  * @return     0 on success, -1 on failure
  */
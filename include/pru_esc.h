@@ -0,0 +1,94 @@
+/**
+ * <pru_esc.h>
+ *
+ * @brief      Optional output stage running on PRU0, enabled with
+ *             enable_pru_esc in the settings file.
+ *
+ *             The feedback loop still runs the greedy mixer to find the
+ *             saturation limits of every controller, then hands the six
+ *             inputs it actually applied to the PRU instead of mapping and
+ *             sending the motor signals itself. The firmware in
+ *             pru/esc_stage.c mixes them again with the layout's matrix,
+ *             saturates, maps through the thrust curve and writes all pulse
+ *             widths to the servo firmware on PRU1 back to back. If no command
+ *             arrives for watchdog_stall_ms it drops to idle pulses on its own,
+ *             without waiting for the ARM side watchdog.
+ *
+ *             The PRU computes in Q16 fixed point, so the signals differ from
+ *             the ARM path by less than one count of the servo slot. The
+ *             priority allocator moves the motors through the null space of
+ *             the layout, which the inputs alone can't reproduce, so this
+ *             needs mix_allocation MIX_ALLOC_GREEDY.
+ *
+ *             The firmware has to be built with make pru_fw and installed to
+ *             /lib/firmware, see the Makefile.
+ */
+
+#ifndef PRU_ESC_H
+#define PRU_ESC_H
+
+#include <scalar.h>
+#include <mix.h>
+#include <thrust_map.h>
+#include <esc_output.h>
+
+#define PRU_ESC_FW_NAME		"am335x-pru0-rc-pilot-esc-fw"	///< firmware in /lib/firmware
+#define PRU_ESC_CH		0				///< PRU running the stage
+
+/**
+ * @brief      Starts the firmware on PRU0 and hands it the tables of a mixer
+ *             and a thrust curve. Call after rc_servo_init() since the pulses
+ *             go out through the servo firmware on PRU1.
+ *
+ * @param[in]  mx           initialized mixer
+ * @param[in]  map          initialized thrust curve
+ * @param[in]  protocol     ESC protocol, as for esc_output_init()
+ * @param[in]  feedback_hz  rate of the feedback loop, sets the idle period
+ * @param[in]  stall_ms     time without a command before the PRU idles
+ *
+ * @return     0 on success, -1 on failure
+ */
+int pru_esc_init(const mixer_t* mx, const thrust_curve_t* map,
+			esc_protocol_t protocol, int feedback_hz, int stall_ms);
+
+/**
+ * @brief      whether pru_esc_init() succeeded and the stage is in use
+ */
+int pru_esc_running();
+
+/**
+ * @brief      Hands one set of inputs to the PRU, which mixes and sends them.
+ *             Never blocks.
+ *
+ * @param[in]  u     6 control inputs as applied by the greedy mixer
+ *
+ * @return     0 on success, -1 if the stage isn't running
+ */
+int pru_esc_send(const scalar_t* u);
+
+/**
+ * @brief      Tells the PRU to send idle pulses until the next pru_esc_send().
+ *
+ * @return     0 on success, -1 if the stage isn't running
+ */
+int pru_esc_idle();
+
+/**
+ * @brief      Reads back the motor signals the PRU sent last. Called right
+ *             after pru_esc_send() this is normally the previous loop's.
+ *
+ * @param[out] m     motor signals from 0 to 1, left as they are on failure
+ * @param[in]  n     number of motors, at most 8
+ *
+ * @return     0 on success, -1 if no coherent copy could be read
+ */
+int pru_esc_signals(scalar_t* m, int n);
+
+/**
+ * @brief      Sends the idle command and stops PRU0.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int pru_esc_cleanup();
+
+#endif // PRU_ESC_H
@@ -0,0 +1,77 @@
+/**
+ * @headerfile pru_esc_shared.h
+ *
+ * @brief      Layout of the PRU shared RAM block used by the offloaded output
+ *             stage, included by both src/pru_esc.c and the PRU firmware in
+ *             pru/esc_stage.c so it only depends on stdint.h.
+ *
+ *             All values are Q16 fixed point integers, the PRU has no
+ *             floating point. The block sits PRU_ESC_SHARED_OFFSET bytes into
+ *             the 12k shared RAM, clear of the servo pulse slots and the
+ *             encoder counter librobotcontrol keeps at the start of it.
+ *
+ *             The ARM fills in the configuration and writes magic last. The
+ *             command is written like a seqlock, cmd_seq is odd while u is
+ *             being changed and the PRU only takes a command whose cmd_seq is
+ *             even and the same before and after copying it. The PRU writes
+ *             the status the same way with status_seq. Bump PRU_ESC_VERSION
+ *             whenever the layout changes so old firmware refuses to run.
+ */
+
+#ifndef PRU_ESC_SHARED_H
+#define PRU_ESC_SHARED_H
+
+#include <stdint.h>
+
+#define PRU_ESC_MAGIC		0x43534550	///< "PESC", written last by the ARM
+#define PRU_ESC_VERSION		1
+#define PRU_ESC_SHARED_OFFSET	0x100		///< byte offset of the block in shared RAM
+#define PRU_SERVO_SLOTS_OFFSET	0x000		///< byte offset of the servo firmware's pulse slots
+
+#define PRU_ESC_MAX_ROTORS	8
+#define PRU_ESC_INPUTS		6
+#define PRU_ESC_LUT_BITS	8
+#define PRU_ESC_LUT_LEN		(1<<PRU_ESC_LUT_BITS)
+#define PRU_ESC_Q		16
+#define PRU_ESC_ONE		(1<<PRU_ESC_Q)	///< 1.0 in Q16
+
+#define PRU_CLOCK_HZ		200000000	///< both PRUs run at 200MHz
+#define PRU_SERVO_LOOP_CYCLES	48		///< PRU cycles per count of a servo pulse slot
+
+// cmd_mode
+#define PRU_ESC_CMD_IDLE	0		///< idle pulses, motors stopped
+#define PRU_ESC_CMD_RUN		1		///< mix and send u
+
+// fw_state
+#define PRU_ESC_FW_WAITING	1		///< booted, waiting for magic
+#define PRU_ESC_FW_RUNNING	2		///< configuration accepted
+#define PRU_ESC_FW_BAD_CONFIG	3		///< configuration rejected, firmware halted
+
+typedef struct pru_esc_shared_t{
+	// configuration, written by the ARM before magic
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rotors;
+	uint32_t period_cycles;		///< idle pulse period when no commands come in
+	uint32_t stall_cycles;		///< time without a command before falling back to idle
+	uint32_t loops_min_q16;		///< servo slot count for signal 0
+	uint32_t loops_span_q16;	///< servo slot count from signal 0 to 1
+	uint32_t loops_idle;		///< servo slot count of the idle pulse
+	int32_t mix[PRU_ESC_MAX_ROTORS][PRU_ESC_INPUTS];	///< mixing matrix
+	int32_t lut[PRU_ESC_LUT_LEN+2];	///< thrust curve table, see thrust_curve_t
+
+	// command, written by the ARM every loop
+	uint32_t cmd_seq;
+	uint32_t cmd_mode;
+	int32_t u[PRU_ESC_INPUTS];	///< roll, pitch, yaw, z, x, y as mixed
+
+	// status, written by the PRU
+	uint32_t fw_state;
+	uint32_t pulses;		///< pulse sets handed to the servo firmware
+	uint32_t stalls;		///< times the ARM went quiet while running
+	uint32_t status_seq;
+	uint32_t out_seq;		///< cmd_seq the signals were computed from
+	int32_t m[PRU_ESC_MAX_ROTORS];	///< motor signals last sent, 0 while idle
+} pru_esc_shared_t;
+
+#endif // PRU_ESC_SHARED_H
@@ -31,12 +31,18 @@ typedef enum arm_state_t{
 
 // user control parameters
 #define MAX_YAW_RATE		2.5	// rad/s
+#define MAX_ROLL_RATE		6.0	// rad/s, acro stick and angle loop output limit
+#define MAX_PITCH_RATE		6.0	// rad/s, acro stick and angle loop output limit
 #define MAX_ROLL_SETPOINT	0.4	// rad
 #define MAX_PITCH_SETPOINT	0.4	// rad
 #define MAX_CLIMB_RATE		1.0	// m/s
 #define YAW_DEADZONE		0.02
 #define THROTTLE_DEADZONE	0.02
 #define SOFT_START_SECONDS	1.0	// controller soft start seconds
+#define ALT_BOUND_D		1.0	// m the altitude setpoint may lead below the vehicle
+#define ALT_BOUND_U		1.0	// m the altitude setpoint may lead above the vehicle
+
+#define GRAVITY_MS2		9.80665	// m/s^2
 
 // controller absolute limits
 #define MAX_ROLL_COMPONENT	0.8
@@ -0,0 +1,96 @@
+/**
+ * <rt_setup.h>
+ *
+ * @brief      Real-time setup of the process and its threads.
+ *
+ *             rt_setup_process() runs once at startup. It locks all current
+ *             and future memory, stops malloc from handing memory back to the
+ *             kernel and prefaults a block of heap, so the flight threads
+ *             don't take page faults later. Each thread is created with the
+ *             policy and priority from rt_thread_policy() and
+ *             rt_thread_priority(), then calls rt_setup_thread() first thing
+ *             to prefault its stack and pin itself to its CPUs. Everything is
+ *             configured by the optional realtime object in the settings file.
+ *             rt_setup_report() prints what was actually obtained, since each
+ *             step can fail without root.
+ */
+
+#ifndef RT_SETUP_H
+#define RT_SETUP_H
+
+/**
+ * threads that go through the real-time setup
+ */
+typedef enum rt_thread_t{
+	RT_THREAD_FEEDBACK,	///< IMU interrupt thread running the feedback ISR
+	RT_THREAD_INPUT,
+	RT_THREAD_PRINTF,
+	RT_THREAD_LOG,
+	RT_THREAD_TELEMETRY,
+	RT_THREAD_MOCAP,
+	RT_THREAD_BATTERY,
+	RT_THREAD_ALTITUDE,
+	RT_THREAD_WATCHDOG,	///< ISR heartbeat check, see watchdog.h
+	RT_NUM_THREADS
+} rt_thread_t;
+
+/**
+ * scheduling for one thread as configured in the settings file
+ */
+typedef struct rt_thread_config_t{
+	int policy;	///< SCHED_FIFO, SCHED_RR or SCHED_OTHER
+	int priority;	///< 1-99 for SCHED_FIFO and SCHED_RR, 0 for SCHED_OTHER
+	int cpu;	///< cpu to pin the thread to, -1 to leave it unpinned
+} rt_thread_config_t;
+
+/**
+ * @brief      name of a thread as used in the settings file
+ *
+ * @return     the name, NULL if thread isn't valid
+ */
+const char* rt_thread_name(rt_thread_t thread);
+
+/**
+ * @brief      fills in the built in defaults from thread_defs.h
+ *
+ * @param[out] cfg   array of RT_NUM_THREADS configs
+ */
+void rt_setup_default_config(rt_thread_config_t* cfg);
+
+/**
+ * @brief      scheduling policy to create a thread with
+ */
+int rt_thread_policy(rt_thread_t thread);
+
+/**
+ * @brief      scheduling priority to create a thread with
+ */
+int rt_thread_priority(rt_thread_t thread);
+
+/**
+ * @brief      Locks memory and prefaults the heap according to the settings.
+ *             Call once after the settings are loaded and before any thread
+ *             starts.
+ *
+ * @return     0 if everything requested was obtained, -1 otherwise; the
+ *             program can still run without it
+ */
+int rt_setup_process();
+
+/**
+ * @brief      Prefaults the calling thread's stack and pins it to its
+ *             configured CPU. Each thread calls this once when it starts.
+ *
+ * @param[in]  thread  which thread is calling
+ *
+ * @return     0 on success, -1 if pinning failed
+ */
+int rt_setup_thread(rt_thread_t thread);
+
+/**
+ * @brief      prints which real-time guarantees were obtained for the process
+ *             and each thread that has called rt_setup_thread()
+ */
+void rt_setup_report();
+
+#endif // RT_SETUP_H
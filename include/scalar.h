@@ -0,0 +1,44 @@
+/**
+ * @headerfile scalar.h
+ *
+ * @brief      Floating point type of the control path.
+ *
+ *             The mixer tables, thrust lookup table, controller banks and the
+ *             feedback and setpoint state are all scalar_t. It is double by
+ *             default. Building with make FLOAT=1 defines CONTROL_FLOAT and
+ *             makes it float, which halves the size of the tables and lets
+ *             the Cortex-A8 run the bank and mixer loops on its NEON unit,
+ *             which has no double precision. Settings, the battery and
+ *             altitude filters and the logs stay double either way.
+ *
+ *             The replay harness compares the two builds on a flight log,
+ *             see replay -F.
+ */
+
+#ifndef SCALAR_H
+#define SCALAR_H
+
+#include <math.h>
+#include <float.h>
+
+#ifdef CONTROL_FLOAT
+typedef float scalar_t;
+#define SCALAR_NAME	"float"
+#define SCALAR_MAX	FLT_MAX
+#define scalar_fabs	fabsf
+#define scalar_cos	cosf
+#else
+typedef double scalar_t;
+#define SCALAR_NAME	"double"
+#define SCALAR_MAX	DBL_MAX
+#define scalar_fabs	fabs
+#define scalar_cos	cos
+#endif
+
+/**
+ * constant of the control path type so the float build doesn't promote the
+ * arithmetic around it to double
+ */
+#define SCALAR_C(x)	((scalar_t)(x))
+
+#endif // SCALAR_H
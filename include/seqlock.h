@@ -0,0 +1,92 @@
+/**
+ * @headerfile seqlock.h
+ *
+ * @brief      Minimal single-writer sequence lock.
+ *
+ *             The writer never blocks or waits on readers, which makes it safe
+ *             to publish from the feedback ISR. The sequence counter is odd
+ *             while a write is in progress. Readers copy the protected data
+ *             and retry if the sequence was odd or changed in the meantime, so
+ *             they always come away with a copy from a single write.
+ *
+ *             Writer:
+ *             seqlock_write_begin(&lock);
+ *             ... update the data ...
+ *             seqlock_write_end(&lock);
+ *
+ *             Reader:
+ *             do{
+ *                 seq = seqlock_read_begin(&lock);
+ *                 ... copy the data ...
+ *             }while(seqlock_read_retry(&lock, seq));
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef struct seqlock_t{
+	atomic_uint_fast32_t seq;	///< odd while a write is in progress
+} seqlock_t;
+
+#define SEQLOCK_INITIALIZER {0}
+
+/**
+ * @brief      marks the start of a write, only one writer may exist at a time
+ */
+static inline void seqlock_write_begin(seqlock_t* l)
+{
+	uint_fast32_t s = atomic_load_explicit(&l->seq, memory_order_relaxed);
+	atomic_store_explicit(&l->seq, s+1, memory_order_relaxed);
+	// the odd count must be visible before any of the data changes
+	atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * @brief      marks the end of a write and publishes the new data
+ */
+static inline void seqlock_write_end(seqlock_t* l)
+{
+	uint_fast32_t s = atomic_load_explicit(&l->seq, memory_order_relaxed);
+	atomic_store_explicit(&l->seq, s+1, memory_order_release);
+}
+
+/**
+ * @brief      starts a read
+ *
+ *             Doesn't wait for a write in progress to finish. On the single
+ *             core BeagleBone a reader with a higher priority than the writer
+ *             would spin forever, so that case is left to
+ *             seqlock_read_retry() and the caller decides how often to retry.
+ *
+ * @return     sequence number to pass to seqlock_read_retry()
+ */
+static inline uint_fast32_t seqlock_read_begin(seqlock_t* l)
+{
+	return atomic_load_explicit(&l->seq, memory_order_acquire);
+}
+
+/**
+ * @brief      checks if the data read since seqlock_read_begin() is coherent
+ *
+ * @return     nonzero if a write was in progress or happened during the read
+ *             and it must be repeated, 0 if the copy is good
+ */
+static inline int seqlock_read_retry(seqlock_t* l, uint_fast32_t start)
+{
+	// the data reads must complete before the sequence is checked again
+	atomic_thread_fence(memory_order_acquire);
+	return (start & 1) || atomic_load_explicit(&l->seq, memory_order_relaxed)!=start;
+}
+
+/**
+ * @brief      number of completed writes so far
+ */
+static inline uint_fast32_t seqlock_writes(seqlock_t* l)
+{
+	return atomic_load_explicit(&l->seq, memory_order_acquire)/2;
+}
+
+#endif // SEQLOCK_H
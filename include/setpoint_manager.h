@@ -18,7 +18,32 @@
 #ifndef SETPOINT_MANAGER_H
 #define SETPOINT_MANAGER_H
 
+#include <stdint.h>
 #include <rc_pilot_defs.h>
+#include <scalar.h>
+
+struct user_input_t;
+struct feedback_state_t;
+
+/**
+ * @brief      what setpoint_manager_update() does between DSM frames
+ *
+ *             SETPOINT_INTERP_HOLD only computes the setpoint when a new frame
+ *             arrives and holds it until the next one, the yaw setpoint then
+ *             moves by the yaw rate over the measured time between frames.
+ *             SETPOINT_INTERP_SMOOTH ramps the sticks from the previous frame
+ *             to the newest one over one frame period, which removes the steps
+ *             at the cost of one frame of delay. SETPOINT_INTERP_PREDICT
+ *             extrapolates the sticks along the last two frames for up to one
+ *             frame period. Both recompute the setpoint, yaw included, on
+ *             every setpoint tick and fall back to holding across a mode
+ *             change, arming or a lost link.
+ */
+typedef enum setpoint_interp_t{
+	SETPOINT_INTERP_HOLD,
+	SETPOINT_INTERP_SMOOTH,
+	SETPOINT_INTERP_PREDICT
+} setpoint_interp_t;
 
 /**
  * Setpoint for the feedback controllers. This is written by setpoint_manager
@@ -30,22 +55,29 @@ typedef struct setpoint_t{
 	int en_alt_ctrl;	///< enable altitude feedback.
 	int en_rpy_ctrl;	///< enable the roll pitch yaw controllers
 	int en_6dof;		///< enable direct XY control via 6DOF model
+	int en_rate_ctrl;	///< sticks command body rates to the rate loop (acro)
 
 	// direct passthrough user inputs to mixing matrix
-	double Z_throttle;	///< used only when altitude controller disabled
-	double X_throttle;	///< only used when 6dof is enabled, positive forward
-	double Y_throttle;	///< only used when 6dof is enabled, positive right
-	double roll_throttle;	///< only used when roll_pitch_yaw controllers are disbaled
-	double pitch_throttle;	///< only used when roll_pitch_yaw controllers are disbaled
-	double yaw_throttle;	///< only used when roll_pitch_yaw controllers are disbaled
+	scalar_t Z_throttle;	///< used only when altitude controller disabled
+	scalar_t X_throttle;	///< only used when 6dof is enabled, positive forward
+	scalar_t Y_throttle;	///< only used when 6dof is enabled, positive right
+	scalar_t roll_throttle;	///< only used when roll_pitch_yaw controllers are disbaled
+	scalar_t pitch_throttle;	///< only used when roll_pitch_yaw controllers are disbaled
+	scalar_t yaw_throttle;	///< only used when roll_pitch_yaw controllers are disbaled
 
 	// attitude setpoint
-	double altitude;	///< altitude from sea level, positive up (m)
-	double altitude_rate;	///< desired rate of change in altitude (m/s)
-	double roll;		///< roll angle (positive tip right) (rad)
-	double pitch;		///< pitch angle (positive tip back) (rad)
-	double yaw;		///< glabal yaw angle, positive left
-	double yaw_rate;	///< desired rate of change in yaw rad/s
+	scalar_t altitude;	///< altitude from sea level, positive up (m)
+	scalar_t altitude_rate;	///< desired rate of change in altitude (m/s)
+	scalar_t roll;		///< roll angle (positive tip right) (rad)
+	scalar_t pitch;		///< pitch angle (positive tip back) (rad)
+	scalar_t yaw;		///< glabal yaw angle, positive left
+	scalar_t yaw_rate;	///< desired rate of change in yaw rad/s
+	scalar_t roll_rate;	///< roll rate in acro mode (rad/s)
+	scalar_t pitch_rate;	///< pitch rate in acro mode (rad/s)
+
+	// user input the setpoint was computed from
+	uint64_t input_time_ns;	///< arrival of that DSM frame, time since boot
+	uint64_t input_seq;	///< frames published before it
 } setpoint_t;
 
 extern setpoint_t setpoint;
@@ -57,13 +89,70 @@ extern setpoint_t setpoint;
  */
 int setpoint_manager_init();
 
+/**
+ * @brief      Hands a new frame of user input to the setpoint manager.
+ *
+ *             Called by the DSM callbacks once per frame, and by the offline
+ *             tools for every record. The frame is copied under a seqlock so
+ *             setpoint_manager_update() always sees a complete frame together
+ *             with its timestamp. Never blocks, and only one thread may
+ *             publish.
+ *
+ * @param[in]  in       the new input
+ * @param[in]  time_ns  time since boot the frame arrived
+ */
+void setpoint_manager_input(const struct user_input_t* in, uint64_t time_ns);
+
+/**
+ * @brief      the frame the current setpoint was computed from, only for the
+ *             feedback ISR
+ */
+const struct user_input_t* setpoint_manager_last_input();
+
+/**
+ * @brief      Stops setpoint_manager_update() from arming until a frame with
+ *             requested_arm_mode DISARMED has come through.
+ *
+ *             For disarms forced by something other than the pilot, like the
+ *             watchdog on an IMU stall. Without it the next loop would see
+ *             the pilot's old arm request and arm straight onto the current
+ *             throttle stick. The DSM callback drops its request when it sees
+ *             the lock, so the pilot has to go through the arming sequence
+ *             again. Safe to call from any thread.
+ */
+void setpoint_manager_lock_arming();
+
+/**
+ * @brief      whether setpoint_manager_lock_arming() is still in effect
+ */
+int setpoint_manager_arming_locked();
+
 /**
  * @brief      updates the setpoint manager, call this before feedback loop
  *
- * @return     0 on success, -1 on failure
+ *             Does the mode logic only when a new frame arrived since the last
+ *             call unless settings.setpoint_interp asks for smoothing or
+ *             prediction in between. The setpoints that follow the vehicle's
+ *             attitude are updated on every call.
+ *
+ * @return     1 if a new frame was applied, 0 if not, -1 on failure
  */
 int setpoint_manager_update();
 
+/**
+ * @brief      Computes a setpoint from one frame the way
+ *             setpoint_manager_update() does, for a controller instance
+ *             without hardware. Doesn't touch the global setpoint, the
+ *             published frames or the arming.
+ *
+ * @param      sp    setpoint to update
+ * @param[in]  fs    state of the instance, for the setpoints that follow it
+ * @param[in]  in    the frame, applied as it is
+ * @param[in]  dt    time since the last call, the yaw rate is integrated over it (s)
+ */
+void setpoint_manager_apply(setpoint_t* sp, const struct feedback_state_t* fs,
+				const struct user_input_t* in, double dt);
+
 /**
  * @brief      cleans up the setpoint manager, not really necessary but here for
  *             completeness
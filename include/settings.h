@@ -13,8 +13,14 @@
 #include <flight_mode.h>
 #include <thrust_map.h>
 #include <mix.h>
+#include <esc_output.h>
 #include <input_manager.h>
+#include <setpoint_manager.h>
+#include <imu_fifo.h>
 #include <rc_pilot_defs.h>
+#include <airframe.h>
+#include <rt_setup.h>
+#include <filter_bank.h>
 
 /**
  * The user may elect to power the BBB off the 3-pin JST balance plug or the DC
@@ -25,6 +31,26 @@ typedef enum battery_connection_t{
 	DC_BARREL_JACK
 } battery_connection_t;
 
+/**
+ * Controllers in the settings file. The rate controllers are only read when
+ * enable_rate_loop is set and are empty filters otherwise.
+ *
+ * The rate controllers run at feedback_hz on every gyro sample. With the DMP
+ * that is one sample per packet and 200Hz at most, with imu_source
+ * IMU_SOURCE_FIFO it is every raw sample up to 1kHz and the angle loop
+ * cascaded on top runs every attitude_divisor samples.
+ */
+typedef enum settings_controller_t{
+	CTRL_ROLL,
+	CTRL_PITCH,
+	CTRL_YAW,
+	CTRL_ALTITUDE,
+	CTRL_ROLL_RATE,
+	CTRL_PITCH_RATE,
+	CTRL_YAW_RATE,
+	SETTINGS_NUM_CONTROLLERS
+} settings_controller_t;
+
 /**
  * Configuration settings read from the json settings file and passed to most
  * threads as they initialize.
@@ -37,11 +63,24 @@ typedef struct settings_t{
 	thrust_map_t thrust_map;
 	float v_nominal;
 	battery_connection_t battery_connection;
+	esc_protocol_t esc_protocol;	///< optional, defaults to ESC_PWM
 	int feedback_hz;
+	int battery_hz;		///< battery voltage sample rate, default 50
+	int setpoint_divisor;	///< setpoint update every n feedback loops, default 1
+	int altitude_divisor;	///< altitude control every n feedback loops, default 1
+	int attitude_divisor;	///< angle loop every n feedback loops, needs the rate loop
+	int enable_rate_loop;	///< gyro rate stage under the angle controllers, at feedback_hz
+	imu_source_t imu_source; ///< optional, defaults to IMU_SOURCE_DMP
+	int imu_fifo_batch;	///< FIFO samples per read and per ESC update, 1 with the DMP
+	mix_allocation_t mix_allocation; ///< optional, defaults to MIX_ALLOC_GREEDY
+	setpoint_interp_t setpoint_interp; ///< sticks between DSM frames, defaults to SETPOINT_INTERP_HOLD
 
 	// features
 	int enable_freefall_detect;
 	int enable_logging;
+	int log_compact;		///< delta encoded blocks, see log_codec.h, default on
+	int log_prealloc_mb;		///< preallocate log files in steps of this, 0 to skip
+	int log_direct_io;		///< write compact logs with O_DIRECT, default off
 
 	// flight modes
 	flight_mode_t flight_mode_1;
@@ -73,21 +112,157 @@ typedef struct settings_t{
 	int printf_u;
 	int printf_motors;
 	int printf_mode;
+	int printf_timing;
+
+	// mavlink telemetry, all optional
+	int enable_telemetry;
+	char telemetry_ip[16];		///< ground station address, default 127.0.0.1
+	int telemetry_port;		///< default 14551
+	int telemetry_sys_id;		///< mavlink system id of this vehicle
+	int telemetry_heartbeat_hz;	///< message rates, 0 disables the message
+	int telemetry_attitude_hz;
+	int telemetry_motors_hz;
+	int telemetry_battery_hz;
+
+	// barometer altitude estimate, optional
+	int enable_baro;		///< fall back to the barometer for altitude hold
+
+	// motion capture input over mavlink, all optional
+	int enable_mocap;		///< use ATT_POS_MOCAP for altitude hold
+	int mocap_port;			///< udp port to listen on, default 14552
+	int mocap_latency_ms;		///< capture to receive delay of the mocap system
+
+	// shared memory state export, optional, see shm_export.h
+	int enable_shm_export;		///< publish the state to SHM_EXPORT_NAME every loop
+
+	// output stage on the PRU, optional, see pru_esc.h
+	int enable_pru_esc;		///< mix, map and send on PRU0, needs MIX_ALLOC_GREEDY
+
+	// loop deadline and IMU stall monitor, optional, see watchdog.h
+	int enable_watchdog;		///< default on
+	int watchdog_stall_ms;		///< time without a feedback loop that counts as an IMU stall
+
+	// real-time setup from the optional realtime object, see rt_setup.h
+	int rt_lock_memory;		///< mlockall at startup, default on
+	int rt_prefault_heap_kb;	///< heap to prefault at startup, 0 to skip
+	rt_thread_config_t rt_threads[RT_NUM_THREADS];
 
 }settings_t;
 
 extern settings_t settings;
 
+/**
+ * Rotor count for loops in the control path. With a fixed airframe build this
+ * is a compile-time constant, see airframe.h.
+ */
+#ifdef AIRFRAME_ROTORS
+#define SETTINGS_NUM_ROTORS	AIRFRAME_ROTORS
+#else
+#define SETTINGS_NUM_ROTORS	settings.num_rotors
+#endif
+
 /**
  * @brief      Populates the setting sand controller structs with the json file.
  *
  *             If no settings file exits, it makes a new one filled
  *             with defaults. Used in json_settings.c
  *
+ *             After a successful parse the validated settings are written to
+ *             a binary cache next to the json file (SETTINGS_FILE.cache).
+ *             Later loads read that in a single read() and skip json-c
+ *             entirely until the json file's modification time or size
+ *             changes. A cache that fails its version, size or crc32 check is
+ *             ignored and the json is parsed again.
+ *
  * @return     0 on success, -1 on failure
  */
 int settings_load_from_file();
 
+/**
+ * @brief      Same as settings_load_from_file() but reads the json file at the
+ *             given path instead of SETTINGS_FILE.
+ *
+ *             Lets offline tools such as tools/replay load the settings a log
+ *             was recorded with. If the file doesn't exist a default one is
+ *             written there.
+ *
+ * @param[in]  path  path to the json settings file
+ *
+ * @return     0 on success, -1 on failure
+ */
+int settings_load_from_path(const char* path);
+
+
+/**
+ * @brief      Parses the controllers again from the json file the settings
+ *             were last loaded from, for changing gains in flight.
+ *
+ *             The rest of the settings and the controllers returned by
+ *             settings_get_*_controller() are left alone. Only the
+ *             controllers are reread since things like feedback_hz can't
+ *             change while running, each is discretized at the rate it was
+ *             loaded for. Reads and allocates, so never call this from the
+ *             feedback ISR.
+ *
+ * @param[out] ctl   SETTINGS_NUM_CONTROLLERS filters in settings_controller_t
+ *                   order
+ *
+ * @return     0 on success, -1 on failure in which case nothing is allocated
+ */
+int settings_load_controllers(rc_filter_t* ctl);
+
+struct json_object;
+
+/**
+ * @brief      Same as settings_load_controllers() but parses a settings json
+ *             object already in memory, e.g. one with a few gains changed.
+ *             Only the controllers are read from it, discretized for the rates
+ *             of the last settings load. Doesn't change any settings so
+ *             several threads can call it at once, each with its own object.
+ *
+ * @param[in]  obj   whole settings file
+ * @param[out] ctl   SETTINGS_NUM_CONTROLLERS filters in settings_controller_t
+ *                   order
+ *
+ * @return     0 on success, -1 on failure in which case nothing is allocated
+ */
+int settings_parse_controllers(struct json_object* obj, rc_filter_t* ctl);
+
+/**
+ * @brief      key of a controller in the settings file, e.g. roll_controller
+ *
+ * @return     the name, or NULL for an invalid id
+ */
+const char* settings_controller_name(settings_controller_t id);
+
+/**
+ * @brief      gets a controller read from the last json read
+ *
+ * @param[in]  id    which controller
+ * @param      ctrl  pointer to the controller to retrieve
+ *
+ * @return     0 on success, -1 on failure
+ */
+int settings_get_controller(settings_controller_t id, rc_filter_t* ctrl);
+
+/**
+ * @brief      builds a filter bank from controllers parsed from the json
+ *             file, one lane per controller
+ *
+ *             The controllers must run at the same rate, e.g. the three angle
+ *             or the three rate controllers.
+ *
+ * @param[in]  ids   which controllers, in lane order
+ * @param[in]  n     number of controllers
+ * @param      ctl   SETTINGS_NUM_CONTROLLERS filters from
+ *                   settings_load_controllers(), or NULL for the controllers
+ *                   from the last settings load
+ * @param[out] fb    the bank
+ *
+ * @return     0 on success, -1 on failure
+ */
+int settings_get_controller_bank(const settings_controller_t* ids, int n,
+					rc_filter_t* ctl, filter_bank_t* fb);
 
 /**
  * @brief      populates the caller's settings struct
@@ -135,6 +310,9 @@ int settings_get_yaw_controller(rc_filter_t* ctrl);
 /**
  * @brief      gets the altitude controllers read from the last json read.
  *
+ *             Discretized at feedback_hz/altitude_divisor since it runs as an
+ *             outer loop.
+ *
  * @param      ctrl  pointer to the altitude controllers to retrieve
  *
  * @return     0 on success, -1 on failure
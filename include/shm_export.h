@@ -0,0 +1,185 @@
+/**
+ * @headerfile shm_export.h
+ *
+ * @brief      Controller state exported to other processes through POSIX
+ *             shared memory.
+ *
+ *             With enable_shm_export in the settings file, rc_pilot creates
+ *             the segment SHM_EXPORT_NAME at startup and the feedback ISR
+ *             copies fstate, setpoint and the last DSM frame the setpoint
+ *             manager took into it at the end of every loop, the same data
+ *             as a state_snapshot_t including the loop timing stats in
+ *             fstate.timing. The copy is guarded by a
+ *             seqlock living in the segment, so a reader in another process
+ *             maps the segment once and then gets a coherent copy at loop
+ *             rate with plain memory reads, no syscalls and no extra thread
+ *             in rc_pilot.
+ *
+ *             The structs are copied as they are, so readers must be built
+ *             from the same headers. shm_export_open() checks the layout
+ *             version, the size of the segment and the scalar type before
+ *             handing it out. Bump SHM_EXPORT_VERSION whenever a field of the
+ *             exported structs changes meaning without changing their size.
+ *
+ *             Reader:
+ *             const shm_export_t* shm = shm_export_open();
+ *             state_snapshot_t snap;
+ *             while(...){
+ *                 if(shm_export_read(shm, &snap)==0) ... use snap ...
+ *             }
+ *             shm_export_close(shm);
+ */
+
+#ifndef SHM_EXPORT_H
+#define SHM_EXPORT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>	// for O_* constants
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <seqlock.h>
+#include <scalar.h>
+#include <state_snapshot.h>
+
+#define SHM_EXPORT_NAME		"/rc_pilot_state"	///< under /dev/shm
+#define SHM_EXPORT_MAGIC	"RCPSTATE"
+#define SHM_EXPORT_VERSION	1
+
+/**
+ * Layout of the shared memory segment.
+ */
+typedef struct shm_export_t{
+	char magic[8];		///< SHM_EXPORT_MAGIC without the terminator
+	uint32_t version;	///< SHM_EXPORT_VERSION of the writer
+	uint32_t size;		///< sizeof(shm_export_t) of the writer
+	uint32_t scalar_size;	///< sizeof(scalar_t) of the writer
+	int32_t writer_pid;	///< process id of rc_pilot
+	seqlock_t lock;		///< guards state
+	state_snapshot_t state;	///< latest loop, time_ns is 0 until the first
+} shm_export_t;
+
+/**
+ * @brief      Creates and maps the segment. Call once at startup before the
+ *             feedback ISR starts.
+ *
+ *             The whole segment is written once here so it is faulted in and,
+ *             with memory locked by rt_setup, never faults in the ISR.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int shm_export_init();
+
+/**
+ * @brief      Copies fstate, setpoint and user_input into the segment.
+ *
+ *             Only the feedback ISR may call this, once at the end of every
+ *             loop. Never blocks and does nothing if shm_export_init() hasn't
+ *             succeeded.
+ */
+void shm_export_publish();
+
+/**
+ * @brief      Unmaps and removes the segment. Readers that still have it
+ *             mapped keep the last state.
+ */
+void shm_export_cleanup();
+
+/*
+ * Reader side, inline so other processes don't link against the controller or
+ * librobotcontrol. They still need the headers this one includes, the
+ * librobotcontrol ones among them since the exported structs hold its types.
+ */
+
+#define SHM_EXPORT_READ_TRIES	8	///< same as state_snapshot_get()
+
+/**
+ * @brief      Maps the segment of a running rc_pilot read-only, for use by
+ *             other processes.
+ *
+ * @return     the segment on success, NULL if it doesn't exist or was
+ *             written by a build with a different layout
+ */
+static inline const shm_export_t* shm_export_open()
+{
+	int fd;
+	struct stat st;
+	shm_export_t* p;
+
+	fd = shm_open(SHM_EXPORT_NAME, O_RDONLY, 0);
+	if(fd<0){
+		perror("ERROR in shm_export_open, is rc_pilot running with enable_shm_export?");
+		return NULL;
+	}
+	if(fstat(fd, &st) || st.st_size<(off_t)sizeof(shm_export_t)){
+		fprintf(stderr,"ERROR in shm_export_open, segment is smaller than this build expects\n");
+		close(fd);
+		return NULL;
+	}
+	p = (shm_export_t*)mmap(NULL, sizeof(shm_export_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p==MAP_FAILED){
+		perror("ERROR in shm_export_open, mmap");
+		return NULL;
+	}
+	if(memcmp(p->magic, SHM_EXPORT_MAGIC, sizeof(p->magic))){
+		fprintf(stderr,"ERROR in shm_export_open, segment not initialized\n");
+		munmap(p, sizeof(shm_export_t));
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	if(p->version!=SHM_EXPORT_VERSION || p->size!=sizeof(shm_export_t) ||
+					p->scalar_size!=sizeof(scalar_t)){
+		fprintf(stderr,"ERROR in shm_export_open, segment has version %u size %u scalar size %u, expected %u %zu %zu\n",
+				p->version, p->size, p->scalar_size,
+				SHM_EXPORT_VERSION, sizeof(shm_export_t), sizeof(scalar_t));
+		munmap(p, sizeof(shm_export_t));
+		return NULL;
+	}
+	return p;
+}
+
+/**
+ * @brief      Fetches a coherent copy of the latest state from a segment
+ *             opened with shm_export_open().
+ *
+ *             Retries a few times if the ISR publishes during the copy.
+ *
+ * @param[in]  shm   The segment
+ * @param[out] snap  where to write the state
+ *
+ * @return     0 on success, -1 if nothing has been published yet or no
+ *             coherent copy could be made, snap is left untouched then
+ */
+static inline int shm_export_read(const shm_export_t* shm, state_snapshot_t* snap)
+{
+	int i;
+	uint_fast32_t seq;
+	state_snapshot_t tmp;
+	// the seqlock is only read, the mapping is read-only
+	seqlock_t* lock = (seqlock_t*)&shm->lock;
+
+	for(i=0;i<SHM_EXPORT_READ_TRIES;i++){
+		seq = seqlock_read_begin(lock);
+		if(seq==0) return -1; // nothing published yet
+		tmp = shm->state;
+		if(!seqlock_read_retry(lock, seq)){
+			*snap = tmp;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief      Unmaps a segment opened with shm_export_open().
+ */
+static inline void shm_export_close(const shm_export_t* shm)
+{
+	if(shm!=NULL) munmap((void*)shm, sizeof(shm_export_t));
+}
+
+#endif // SHM_EXPORT_H
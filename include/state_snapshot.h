@@ -0,0 +1,57 @@
+/**
+ * @headerfile state_snapshot.h
+ *
+ * @brief      Coherent copies of the controller state for non real-time
+ *             threads.
+ *
+ *             fstate, setpoint and user_input are written by the feedback
+ *             ISR and the DSM callback while other threads run, so reading
+ *             several of their fields directly can mix values from different
+ *             loops. At the end of every loop the ISR publishes a snapshot of
+ *             all three through a seqlock, user_input as the last DSM frame
+ *             the setpoint manager fetched. Publishing never blocks the ISR,
+ *             and readers always get every field from the same loop.
+ */
+
+#ifndef STATE_SNAPSHOT_H
+#define STATE_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include <feedback.h>
+#include <setpoint_manager.h>
+#include <input_manager.h>
+
+/**
+ * Everything the ISR knew at the end of one loop.
+ */
+typedef struct state_snapshot_t{
+	uint64_t time_ns;	///< time since boot the snapshot was published
+	uint64_t seq;		///< number of snapshots published before this one
+	feedback_state_t fstate;
+	setpoint_t setpoint;
+	user_input_t user_input;	///< frame of inputs as seen by this loop
+} state_snapshot_t;
+
+/**
+ * @brief      Copies fstate, setpoint and user_input into the shared snapshot.
+ *
+ *             Only the feedback ISR may call this, once at the end of every
+ *             loop. Never blocks.
+ */
+void state_snapshot_publish();
+
+/**
+ * @brief      Fetches a copy of the latest snapshot.
+ *
+ *             Retries a few times if the ISR publishes during the copy. Safe
+ *             from any thread except the ISR itself.
+ *
+ * @param[out] snap  where to write the snapshot
+ *
+ * @return     0 on success, -1 if nothing has been published yet or no
+ *             coherent copy could be made, snap is left untouched then
+ */
+int state_snapshot_get(state_snapshot_t* snap);
+
+#endif // STATE_SNAPSHOT_H
@@ -4,7 +4,13 @@
 #define THREAD_DEFS_H
 
 // thread speeds, prioritites, and close timeouts
-#define INPUT_MANAGER_HZ	5
+// the priorities are defaults, the realtime object in the settings file can
+// override them per thread, see rt_setup.h
+#define FEEDBACK_PRI		90	// IMU interrupt thread, above everything else
+#define IMU_FIFO_TOUT		0.5	// FIFO thread of IMU_SOURCE_FIFO, runs at FEEDBACK_PRI
+#define WATCHDOG_HZ		100	// checks the ISR heartbeat
+#define WATCHDOG_PRI		85	// above the input manager, runs while the ISR is stalled
+#define WATCHDOG_TOUT		0.5
 #define INPUT_MANAGER_PRI	80
 #define INPUT_MANAGER_TOUT	0.5
 #define LOG_MANAGER_HZ		20
@@ -13,6 +19,15 @@
 #define PRINTF_MANAGER_HZ	20
 #define PRINTF_MANAGER_PRI	60
 #define PRINTF_MANAGER_TOUT	0.3
+#define BATTERY_MANAGER_PRI	0	// SCHED_OTHER
+#define BATTERY_MANAGER_TOUT	0.5
+#define MAVLINK_MANAGER_HZ	50	// scheduling tick, each message has its own rate
+#define MAVLINK_MANAGER_PRI	0	// SCHED_OTHER
+#define MAVLINK_MANAGER_TOUT	0.5
+#define MAVLINK_RX_PRI		70	// mocap input, below the input manager
+#define ALTITUDE_MANAGER_HZ	25	// BMP280 at 16x oversampling
+#define ALTITUDE_MANAGER_PRI	50
+#define ALTITUDE_MANAGER_TOUT	0.5
 #define BUTTON_EXIT_CHECK_HZ	10
 #define BUTTON_EXIT_TIME_S	2
 
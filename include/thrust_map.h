@@ -9,6 +9,8 @@
 #ifndef THRUST_MAP_H
 #define THRUST_MAP_H
 
+#include <scalar.h>
+
 /**
  * enum thrust_map_t
  *
@@ -21,12 +23,58 @@ typedef enum thrust_map_t{
 } thrust_map_t;
 
 
+#define THRUST_LUT_BITS	8			///< log2 of lookup table intervals
+#define THRUST_LUT_LEN	(1<<THRUST_LUT_BITS)	///< lookup table intervals
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define THRUST_MAP_NEON
+#endif
+
+/**
+ * A thrust curve resampled into a lookup table by thrust_curve_init(). Any
+ * number of them can exist side by side, one per simulated vehicle or per
+ * motor type. The table is all that mapping a motor signal reads, so it
+ * starts the struct on a cache line of its own.
+ */
+typedef struct thrust_curve_t{
+	scalar_t lut[THRUST_LUT_LEN+2] __attribute__((aligned(64)));	///< motor signal at uniform thrust steps, the last entry repeated
+	#if defined(THRUST_MAP_NEON) && !defined(CONTROL_FLOAT)
+	float lut_f[THRUST_LUT_LEN+2] __attribute__((aligned(64)));	///< single precision copy for the NEON path
+	#endif
+	thrust_map_t map;	///< curve the table was built from
+	int initialized;	///< 1 once thrust_curve_init() succeeded
+} thrust_curve_t;
+
 /**
  * @brief      Check the thrust map for validity and populate data arrays.
  *
+ *             The thrust curve is also resampled into a lookup table of
+ *             THRUST_LUT_LEN uniform intervals in thrust so mapping a motor
+ *             signal is a single index and linear interpolation instead of a
+ *             scan through the curve. The resampling error is far below the
+ *             resolution of the ESC pulse.
+ *
+ * @param[in]  map   The thrust map to use
+ *
  * @return     0 on success, -1 on failure
  */
-int thrust_map_init();
+int thrust_map_init(thrust_map_t map);
+
+/**
+ * @brief      Same as thrust_map_init() for a curve of the caller's own.
+ *
+ * @param[out] c     The curve to build
+ * @param[in]  map   The thrust map to use
+ *
+ * @return     0 on success, -1 on failure
+ */
+int thrust_curve_init(thrust_curve_t* c, thrust_map_t map);
+
+/**
+ * @brief      the curve built by thrust_map_init(), which map_motor_signal()
+ *             and map_motor_signals() use
+ */
+const thrust_curve_t* thrust_map_default_curve();
 
 
 /**
@@ -35,8 +83,35 @@ int thrust_map_init();
  *
  * @param[in]  m     thrust input, must be between 0 and 1 inclusive
  *
- * @return     motor signal value on success, -1 on error
+ * @return     motor signal value on success, -1 on error or NaN input
+ */
+scalar_t map_motor_signal(scalar_t m);
+
+/**
+ * @brief      map_motor_signal() through a given curve
+ */
+scalar_t thrust_curve_signal(const thrust_curve_t* c, scalar_t m);
+
+/**
+ * @brief      Maps n motor signals at once through the lookup table.
+ *
+ *             Inputs are clamped to 0-1 rather than rejected, NaN is mapped
+ *             like 0. Uses NEON when
+ *             built for an ARM target with NEON enabled, otherwise a plain
+ *             loop the compiler is free to vectorize. in and out may be the
+ *             same array.
+ *
+ * @param[in]  in    desired normalized thrust for each motor
+ * @param[out] out   motor signals
+ * @param[in]  n     number of motors
+ *
+ * @return     0 on success, -1 on error
+ */
+int map_motor_signals(const scalar_t* in, scalar_t* out, int n);
+
+/**
+ * @brief      map_motor_signals() through a given curve
  */
-double map_motor_signal(double m);
+int thrust_curve_signals(const thrust_curve_t* c, const scalar_t* in, scalar_t* out, int n);
 
 #endif // THRUST_MAP_H
@@ -0,0 +1,120 @@
+/**
+ * <watchdog.h>
+ *
+ * @brief      Deadline monitor for the feedback ISR and heartbeat check of
+ *             the DMP interrupt.
+ *
+ *             At the end of every loop the ISR hands its entry time to
+ *             watchdog_loop_done(). A loop that took longer than the period
+ *             adds WATCHDOG_OVERRUN_WEIGHT to a debt each loop on time pays
+ *             one back, so occasional overruns are absorbed and only a
+ *             sustained overload raises the shed level. Each level stops some
+ *             optional work on top of the ones below, see watchdog_level_t.
+ *             Once the debt has stayed clear for WATCHDOG_RECOVER_S the level
+ *             steps back down one at a time.
+ *
+ *             If the DMP interrupt stops the ISR doesn't run at all, so a
+ *             separate high priority thread compares the time the ISR last
+ *             finished against watchdog_stall_ms from the settings file. On a
+ *             stall it disarms through feedback_disarm() and keeps sending
+ *             the idle pulse itself until the ISR is back, so the ESCs never
+ *             sit on the last motor command. Arming stays locked until the
+ *             pilot repeats the arming sequence.
+ *
+ *             Every event is counted, see watchdog_get_stats().
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+
+#define WATCHDOG_OVERRUN_WEIGHT	8	///< debt of one overrun, a loop on time pays back 1
+#define WATCHDOG_SHED_DEBT	64	///< debt at which the next level is shed
+#define WATCHDOG_RECOVER_S	2.0	///< time without debt before a level is restored
+
+/**
+ * Optional work shed under sustained overruns, each level includes the ones
+ * below it.
+ */
+typedef enum watchdog_level_t{
+	WATCHDOG_NOMINAL,		///< everything runs
+	WATCHDOG_SHED_LOGGING,		///< no new log entries
+	WATCHDOG_SHED_TELEMETRY,	///< no telemetry other than the heartbeat, no console updates
+	WATCHDOG_SHED_OUTER,		///< altitude loop runs at half its rate
+	WATCHDOG_NUM_LEVELS
+} watchdog_level_t;
+
+/**
+ * Event counters since watchdog_init().
+ */
+typedef struct watchdog_stats_t{
+	watchdog_level_t level;		///< current shed level
+	uint64_t overruns;		///< loops that took longer than the period
+	uint64_t escalations;		///< times the level went up
+	uint64_t recoveries;		///< times the level went down
+	uint64_t loops_at_level[WATCHDOG_NUM_LEVELS];	///< loops run at each level
+	uint64_t imu_stalls;		///< times the ISR stopped for watchdog_stall_ms
+	uint64_t stall_disarms;		///< times a stall disarmed the controller
+	uint64_t longest_stall_ns;	///< longest gap between two loops seen by the thread
+} watchdog_stats_t;
+
+/**
+ * @brief      Resets the counters and sets the deadline from feedback_hz.
+ *             Call before the feedback ISR starts.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int watchdog_init();
+
+/**
+ * @brief      Starts the heartbeat thread. Call after feedback_init().
+ *
+ * @return     0 on success, -1 on failure
+ */
+int watchdog_start();
+
+/**
+ * @brief      Checks the deadline of the loop that just finished and updates
+ *             the shed level and the heartbeat.
+ *
+ *             Only the feedback ISR may call this, once at the end of every
+ *             loop. Does nothing until watchdog_init() has been called.
+ *
+ * @param[in]  isr_entry_ns  time the loop started
+ */
+void watchdog_loop_done(uint64_t isr_entry_ns);
+
+/**
+ * @brief      whether work at a shed level is currently skipped, safe to
+ *             call from any thread
+ *
+ * @param[in]  level  The level the work belongs to
+ *
+ * @return     1 if the work should be skipped, 0 otherwise
+ */
+int watchdog_shed(watchdog_level_t level);
+
+/**
+ * @brief      What the heartbeat thread does about a stall, on every check
+ *             until the ISR is back: disarms if armed and locks arming with
+ *             setpoint_manager_lock_arming(), so the controller only arms
+ *             again after the pilot repeats the arming sequence. Public so
+ *             replay -W can check that.
+ */
+void watchdog_stall_disarm();
+
+/**
+ * @brief      copies the event counters, safe to call from any thread
+ */
+void watchdog_get_stats(watchdog_stats_t* stats);
+
+/**
+ * @brief      Waits for the heartbeat thread to exit and prints a summary if
+ *             anything happened. Call after the state is set to EXITING.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int watchdog_cleanup();
+
+#endif // WATCHDOG_H
@@ -0,0 +1,221 @@
+/**
+ * @file esc_stage.c
+ *
+ * PRU0 firmware for the offloaded output stage, see include/pru_esc.h.
+ *
+ * Waits for src/pru_esc.c to hand over the configuration, then for every new
+ * command mixes the six inputs with the layout's matrix, clamps the motors to
+ * 0 to 1, maps them through the thrust curve table and writes the pulse
+ * widths of all motors to the servo firmware on PRU1 back to back. Without a
+ * new command for stall_cycles it falls back to idle pulses by itself and
+ * keeps sending them every period_cycles until the ARM is back.
+ *
+ * The PRU has no floating point so everything is Q16 fixed point, see
+ * include/pru_esc_shared.h. Build with make pru_fw, needs the GNU PRU
+ * toolchain (pru-gcc).
+ */
+
+#include <stdint.h>
+
+#include <pru_esc_shared.h>
+
+#define SHARED_RAM	0x00010000	// PRU shared RAM in the PRU's own address map
+#define CTRL_BASE	0x00022000	// PRU0 control registers
+#define CTRL_CONTROL	(*(volatile uint32_t*)(CTRL_BASE+0x00))
+#define CTRL_CYCLE	(*(volatile uint32_t*)(CTRL_BASE+0x0C))
+#define CTRL_COUNTER_EN	(1<<3)
+#define CYCLE_FOLD	0x40000000	// the cycle counter stops at its maximum, fold it well before
+
+/**
+ * remoteproc refuses firmware without a resource table, this one lists no
+ * resources
+ */
+struct resource_table{
+	uint32_t ver;
+	uint32_t num;
+	uint32_t reserved[2];
+	uint32_t offset[1];
+};
+const struct resource_table resource_table __attribute__((section(".resource_table"), used)) = {
+	1, 0, {0, 0}, {0}
+};
+
+static volatile pru_esc_shared_t* const sh = (volatile pru_esc_shared_t*)(SHARED_RAM + PRU_ESC_SHARED_OFFSET);
+static volatile uint32_t* const servo = (volatile uint32_t*)(SHARED_RAM + PRU_SERVO_SLOTS_OFFSET);
+
+// local copy of the configuration, PRU local RAM is faster than shared RAM
+static int rotors;
+static int32_t mix[PRU_ESC_MAX_ROTORS][PRU_ESC_INPUTS];
+static int32_t lut[PRU_ESC_LUT_LEN+2];
+static uint32_t loops_min_q16, loops_span_q16, loops_idle;
+static uint64_t period, stall;
+static uint64_t clock_base;
+
+
+/**
+ * @brief      cycles since boot, the 32 bit cycle counter is folded into a
+ *             64 bit count before it can saturate
+ */
+static uint64_t __now()
+{
+	uint32_t c = CTRL_CYCLE;
+
+	if(c>=CYCLE_FOLD){
+		CTRL_CONTROL &= ~CTRL_COUNTER_EN;
+		c = CTRL_CYCLE;
+		CTRL_CYCLE = 0;
+		CTRL_CONTROL |= CTRL_COUNTER_EN;
+		clock_base += c;
+		c = 0;
+	}
+	return clock_base + c;
+}
+
+
+/**
+ * @return     0 on success, -1 if the configuration can't be used
+ */
+static int __load_config()
+{
+	int i, j;
+
+	if(sh->version!=PRU_ESC_VERSION) return -1;
+	if(sh->rotors<1 || sh->rotors>PRU_ESC_MAX_ROTORS) return -1;
+	if(sh->period_cycles==0 || sh->stall_cycles==0) return -1;
+	rotors = sh->rotors;
+	period = sh->period_cycles;
+	stall = sh->stall_cycles;
+	loops_min_q16 = sh->loops_min_q16;
+	loops_span_q16 = sh->loops_span_q16;
+	loops_idle = sh->loops_idle;
+	for(i=0;i<PRU_ESC_MAX_ROTORS;i++){
+		for(j=0;j<PRU_ESC_INPUTS;j++) mix[i][j] = sh->mix[i][j];
+	}
+	for(i=0;i<PRU_ESC_LUT_LEN+2;i++) lut[i] = sh->lut[i];
+	return 0;
+}
+
+
+/**
+ * @brief      copies a new command if there is a complete one
+ *
+ * @return     1 if mode and u were updated, 0 otherwise
+ */
+static int __read_command(uint32_t* last_seq, uint32_t* mode, int32_t* u)
+{
+	int i;
+	uint32_t seq = sh->cmd_seq;
+
+	if((seq&1) || seq==*last_seq) return 0;
+	*mode = sh->cmd_mode;
+	for(i=0;i<PRU_ESC_INPUTS;i++) u[i] = sh->u[i];
+	// the ARM started the next one while we copied, take that on the next poll
+	if(sh->cmd_seq!=seq) return 0;
+	*last_seq = seq;
+	return 1;
+}
+
+
+/**
+ * @brief      hands one pulse per motor to the servo firmware and reports
+ *             the signals
+ */
+static void __output(const uint32_t* loops, const int32_t* m, uint32_t seq)
+{
+	int i;
+
+	for(i=0;i<rotors;i++) servo[i] = loops[i];
+	sh->status_seq++;
+	for(i=0;i<rotors;i++) sh->m[i] = m[i];
+	sh->out_seq = seq;
+	sh->pulses++;
+	sh->status_seq++;
+}
+
+
+static void __idle(uint32_t seq)
+{
+	int i;
+	uint32_t loops[PRU_ESC_MAX_ROTORS];
+	int32_t m[PRU_ESC_MAX_ROTORS];
+
+	for(i=0;i<rotors;i++){
+		loops[i] = loops_idle;
+		m[i] = 0;
+	}
+	__output(loops, m, seq);
+}
+
+
+/**
+ * @brief      mix, saturate, map through the thrust curve and send, the same
+ *             steps as the ARM path in __feedback_control()
+ */
+static void __run(const int32_t* u, uint32_t seq)
+{
+	int i, j, idx;
+	int64_t acc;
+	int32_t mot, frac, sig;
+	uint32_t loops[PRU_ESC_MAX_ROTORS];
+	int32_t m[PRU_ESC_MAX_ROTORS];
+
+	for(i=0;i<rotors;i++){
+		acc = 0;
+		for(j=0;j<PRU_ESC_INPUTS;j++) acc += (int64_t)mix[i][j]*u[j];
+		acc >>= PRU_ESC_Q;
+		if(acc<0) acc = 0;
+		else if(acc>PRU_ESC_ONE) acc = PRU_ESC_ONE;
+		mot = (int32_t)acc;
+
+		// table index and fraction of the interval in Q16
+		idx = mot >> (PRU_ESC_Q-PRU_ESC_LUT_BITS);
+		frac = (mot & ((1<<(PRU_ESC_Q-PRU_ESC_LUT_BITS))-1)) << PRU_ESC_LUT_BITS;
+		sig = lut[idx] + (int32_t)(((int64_t)frac*(lut[idx+1]-lut[idx])) >> PRU_ESC_Q);
+		if(sig<0) sig = 0;
+		else if(sig>PRU_ESC_ONE) sig = PRU_ESC_ONE;
+
+		m[i] = sig;
+		loops[i] = (uint32_t)((loops_min_q16 + (((uint64_t)sig*loops_span_q16) >> PRU_ESC_Q)) >> PRU_ESC_Q);
+	}
+	__output(loops, m, seq);
+}
+
+
+int main(void)
+{
+	uint32_t last_seq = 0;
+	uint32_t mode = PRU_ESC_CMD_IDLE;
+	int32_t u[PRU_ESC_INPUTS];
+	uint64_t now, last_cmd, last_pulse;
+
+	CTRL_CYCLE = 0;
+	CTRL_CONTROL |= CTRL_COUNTER_EN;
+	sh->fw_state = PRU_ESC_FW_WAITING;
+	while(sh->magic!=PRU_ESC_MAGIC);
+	if(__load_config()){
+		sh->fw_state = PRU_ESC_FW_BAD_CONFIG;
+		for(;;);
+	}
+	sh->fw_state = PRU_ESC_FW_RUNNING;
+
+	__idle(last_seq);
+	last_cmd = last_pulse = __now();
+	for(;;){
+		now = __now();
+		if(__read_command(&last_seq, &mode, u)){
+			if(mode==PRU_ESC_CMD_RUN) __run(u, last_seq);
+			else __idle(last_seq);
+			last_cmd = last_pulse = now;
+			continue;
+		}
+		if(mode==PRU_ESC_CMD_RUN && now-last_cmd>=stall){
+			mode = PRU_ESC_CMD_IDLE;
+			sh->stalls++;
+		}
+		if(mode!=PRU_ESC_CMD_RUN && now-last_pulse>=period){
+			__idle(last_seq);
+			last_pulse = now;
+		}
+	}
+	return 0;
+}
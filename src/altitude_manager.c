@@ -0,0 +1,284 @@
+/**
+ * @file altitude_manager.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <semaphore.h>
+
+#include <rc/bmp.h>
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+
+#include <altitude_manager.h>
+#include <seqlock.h>
+#include <settings.h>
+#include <thread_defs.h>
+
+#define BMP_CALIBRATION_SAMPLES	25
+#define ALT_TIMEOUT_NS		500000000ULL	// estimates older than this are stale
+#define ALT_MAX_READ_TRIES	4
+
+// Kalman filter noise parameters
+#define ACCEL_NOISE	0.5	// m/s^2, includes vibration
+#define BIAS_NOISE	0.02	// m/s^2 per sqrt(s) accelerometer bias random walk
+#define BARO_NOISE	0.3	// m
+
+/**
+ * what the ISR hands the thread on each trigger
+ */
+typedef struct alt_input_t{
+	double a_up;		///< mean vertical acceleration since the last trigger
+	double dt;		///< time covered by the mean (s)
+} alt_input_t;
+
+/**
+ * what the thread hands back to the ISR
+ */
+typedef struct alt_estimate_t{
+	uint64_t time_ns;	///< time the estimate is valid for, 0 if none yet
+	double altitude;
+	double velocity;
+} alt_estimate_t;
+
+static pthread_t pthread;
+static int initialized = 0;
+static sem_t trigger;
+static double ground_alt;
+
+// ISR side accumulator, only touched by the ISR
+static double accel_sum;
+static int accel_count;
+static int loops_per_read;
+
+static seqlock_t input_lock = SEQLOCK_INITIALIZER;
+static alt_input_t input;
+static seqlock_t estimate_lock = SEQLOCK_INITIALIZER;
+static alt_estimate_t estimate;
+
+// ISR side copy of the last coherent estimate
+static alt_estimate_t last_estimate;
+
+// filter state [altitude, velocity, accel bias] and covariance, thread only
+static double x[3];
+static double P[3][3];
+
+
+/**
+ * @brief      propagates the state by dt with acceleration a
+ */
+static void __kalman_predict(double a, double dt)
+{
+	double F[3][3] = {{1.0, dt, -0.5*dt*dt},
+			  {0.0, 1.0, -dt},
+			  {0.0, 0.0, 1.0}};
+	double G[3] = {0.5*dt*dt, dt, 0.0};
+	double FP[3][3];
+	int i, j, k;
+
+	x[0] += x[1]*dt + 0.5*(a-x[2])*dt*dt;
+	x[1] += (a-x[2])*dt;
+
+	// P = F*P*F' + Q
+	for(i=0;i<3;i++){
+		for(j=0;j<3;j++){
+			FP[i][j] = 0.0;
+			for(k=0;k<3;k++) FP[i][j] += F[i][k]*P[k][j];
+		}
+	}
+	for(i=0;i<3;i++){
+		for(j=0;j<3;j++){
+			P[i][j] = 0.0;
+			for(k=0;k<3;k++) P[i][j] += FP[i][k]*F[j][k];
+			P[i][j] += ACCEL_NOISE*ACCEL_NOISE*G[i]*G[j];
+		}
+	}
+	P[2][2] += BIAS_NOISE*BIAS_NOISE*dt;
+}
+
+
+/**
+ * @brief      corrects the state with a barometer altitude measurement
+ */
+static void __kalman_update(double z)
+{
+	double K[3], P0[3], S, y;
+	int i, j;
+
+	y = z - x[0];
+	S = P[0][0] + BARO_NOISE*BARO_NOISE;
+	for(i=0;i<3;i++){
+		K[i] = P[i][0]/S;
+		P0[i] = P[0][i];
+	}
+	for(i=0;i<3;i++){
+		x[i] += K[i]*y;
+		for(j=0;j<3;j++) P[i][j] -= K[i]*P0[j];
+	}
+}
+
+
+static void __publish(uint64_t time_ns)
+{
+	seqlock_write_begin(&estimate_lock);
+	estimate.time_ns = time_ns;
+	estimate.altitude = x[0];
+	estimate.velocity = x[1];
+	seqlock_write_end(&estimate_lock);
+}
+
+
+static void* __altitude_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	struct timespec ts;
+	uint_fast32_t seq;
+	alt_input_t in = {0.0, 0.0};
+	rc_bmp_data_t bmp_data;
+	uint64_t read_ns;
+	int i, ok;
+
+	rt_setup_thread(RT_THREAD_ALTITUDE);
+	while(rc_get_state()!=EXITING){
+		// wait for the ISR, time out now and then to check for exit
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if(ts.tv_nsec>=1000000000){
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if(sem_timedwait(&trigger, &ts)) continue;
+
+		// the ISR leaves the input alone for several loops after posting
+		ok = 0;
+		for(i=0;i<ALT_MAX_READ_TRIES && !ok;i++){
+			seq = seqlock_read_begin(&input_lock);
+			in = input;
+			ok = !seqlock_read_retry(&input_lock, seq);
+		}
+		if(!ok) continue;
+
+		__kalman_predict(in.a_up, in.dt);
+		if(rc_bmp_read(&bmp_data)) continue;
+		read_ns = rc_nanos_since_boot();
+		__kalman_update(bmp_data.alt_m - ground_alt);
+		__publish(read_ns);
+	}
+	return NULL;
+}
+
+
+int altitude_manager_init()
+{
+	rc_bmp_data_t bmp_data;
+	double sum = 0.0;
+	int i;
+
+	if(rc_bmp_init(BMP_OVERSAMPLE_16, BMP_FILTER_OFF)){
+		fprintf(stderr,"ERROR in altitude_manager_init, failed to initialize barometer\n");
+		return -1;
+	}
+	// the estimator runs relative to where we started
+	for(i=0;i<BMP_CALIBRATION_SAMPLES;i++){
+		if(rc_bmp_read(&bmp_data)){
+			fprintf(stderr,"ERROR in altitude_manager_init, failed to read barometer\n");
+			rc_bmp_power_off();
+			return -1;
+		}
+		sum += bmp_data.alt_m;
+		rc_usleep(1000000/ALTITUDE_MANAGER_HZ);
+	}
+	ground_alt = sum/BMP_CALIBRATION_SAMPLES;
+
+	x[0] = x[1] = x[2] = 0.0;
+	for(i=0;i<9;i++) P[i/3][i%3] = 0.0;
+	P[0][0] = BARO_NOISE*BARO_NOISE;
+	P[1][1] = 0.1;
+	P[2][2] = 0.1;
+
+	loops_per_read = settings.feedback_hz/ALTITUDE_MANAGER_HZ;
+	if(loops_per_read<1) loops_per_read = 1;
+	accel_sum = 0.0;
+	accel_count = 0;
+	last_estimate.time_ns = 0;
+
+	if(sem_init(&trigger, 0, 0)){
+		perror("ERROR in altitude_manager_init, failed to make semaphore");
+		rc_bmp_power_off();
+		return -1;
+	}
+	__publish(rc_nanos_since_boot());
+	if(rc_pthread_create(&pthread, __altitude_manager_func, NULL, rt_thread_policy(RT_THREAD_ALTITUDE), rt_thread_priority(RT_THREAD_ALTITUDE))<0){
+		fprintf(stderr,"ERROR in altitude_manager_init, failed to start thread\n");
+		sem_destroy(&trigger);
+		rc_bmp_power_off();
+		return -1;
+	}
+	initialized = 1;
+	return 0;
+}
+
+
+void altitude_manager_march(double a_up)
+{
+	int val;
+
+	if(!initialized) return;
+	accel_sum += a_up;
+	accel_count++;
+	if(accel_count<loops_per_read) return;
+
+	seqlock_write_begin(&input_lock);
+	input.a_up = accel_sum/accel_count;
+	input.dt = (double)accel_count/settings.feedback_hz;
+	seqlock_write_end(&input_lock);
+	accel_sum = 0.0;
+	accel_count = 0;
+	// one pending read is enough if the thread fell behind
+	if(sem_getvalue(&trigger, &val)==0 && val==0) sem_post(&trigger);
+}
+
+
+int altitude_manager_get(uint64_t now_ns, double* altitude, double* velocity)
+{
+	uint_fast32_t seq;
+	alt_estimate_t tmp;
+	double age;
+	int i;
+
+	if(!initialized) return -1;
+	for(i=0;i<ALT_MAX_READ_TRIES;i++){
+		seq = seqlock_read_begin(&estimate_lock);
+		tmp = estimate;
+		if(!seqlock_read_retry(&estimate_lock, seq)){
+			last_estimate = tmp;
+			break;
+		}
+	}
+	if(last_estimate.time_ns==0) return -1;
+	if(now_ns<last_estimate.time_ns) age = 0.0;
+	else if(now_ns-last_estimate.time_ns>ALT_TIMEOUT_NS) return -1;
+	else age = (now_ns-last_estimate.time_ns)/1e9;
+	*altitude = last_estimate.altitude + last_estimate.velocity*age;
+	*velocity = last_estimate.velocity;
+	return 0;
+}
+
+
+int altitude_manager_cleanup()
+{
+	int ret = 0;
+	if(initialized){
+		// the thread exits on its own once the state is EXITING
+		ret = rc_pthread_timed_join(pthread,NULL,ALTITUDE_MANAGER_TOUT);
+		if(ret==1) fprintf(stderr,"WARNING: altitude_manager_thread exit timeout\n");
+		else if(ret==-1) fprintf(stderr,"ERROR: failed to join altitude_manager thread\n");
+		if(ret==0){
+			sem_destroy(&trigger);
+			rc_bmp_power_off();
+		}
+	}
+	initialized = 0;
+	return ret;
+}
@@ -0,0 +1,169 @@
+/**
+ * @file battery_manager.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h> // for lround
+
+#include <rc/adc.h>
+#include <rc/math/filter.h>
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+
+#include <battery_manager.h>
+#include <settings.h>
+#include <thread_defs.h>
+
+// the moving average spans the same time regardless of the sample rate
+#define BATTERY_FILTER_SECONDS	0.2
+
+/**
+ * battery_state_t as it is stored in the atomic word
+ */
+typedef union battery_word_t{
+	battery_state_t state;
+	uint64_t word;
+} battery_word_t;
+
+static pthread_t pthread;
+static int initialized = 0;
+static int thread_running = 0;
+static rc_filter_t D_batt = RC_FILTER_INITIALIZER;
+static _Atomic uint64_t published;
+static _Atomic float v_raw;
+
+
+/**
+ * @brief      reads the pack voltage from whichever input it is wired to
+ *
+ * @return     voltage (v), v_nominal if the reading isn't plausible
+ */
+static float __read_adc()
+{
+	float v;
+
+	if(settings.battery_connection==DC_BARREL_JACK){
+		v = rc_adc_dc_jack();
+	}
+	else if(settings.battery_connection==BALANCE_PLUG){
+		v = rc_adc_batt();
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid battery_connection_t\n");
+		return settings.v_nominal;
+	}
+
+	if(v<3.0f) v = settings.v_nominal;
+	return v;
+}
+
+
+static void __publish(float v_batt)
+{
+	battery_word_t w = {.word = 0};
+
+	w.state.v_batt = v_batt;
+	w.state.gain = settings.v_nominal/v_batt;
+	atomic_store_explicit(&published, w.word, memory_order_release);
+}
+
+
+static void* __battery_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	rt_setup_thread(RT_THREAD_BATTERY);
+
+	while(rc_get_state()!=EXITING){
+		battery_manager_update();
+		rc_usleep(1000000/settings.battery_hz);
+	}
+	return NULL;
+}
+
+
+int battery_manager_init()
+{
+	float v;
+	int taps;
+
+	taps = lround(BATTERY_FILTER_SECONDS*settings.battery_hz);
+	if(taps<2) taps = 2;
+	rc_filter_free(&D_batt);
+	if(rc_filter_moving_average(&D_batt, taps, 1.0/settings.battery_hz)){
+		fprintf(stderr,"ERROR in battery_manager_init, failed to make filter\n");
+		return -1;
+	}
+	v = __read_adc();
+	rc_filter_prefill_inputs(&D_batt, v);
+	rc_filter_prefill_outputs(&D_batt, v);
+	atomic_store(&v_raw, v);
+	__publish(v);
+	initialized = 1;
+	return 0;
+}
+
+
+int battery_manager_start()
+{
+	if(!initialized){
+		fprintf(stderr,"ERROR in battery_manager_start, call battery_manager_init first\n");
+		return -1;
+	}
+	if(rc_pthread_create(&pthread, __battery_manager_func, NULL, rt_thread_policy(RT_THREAD_BATTERY), rt_thread_priority(RT_THREAD_BATTERY))<0){
+		fprintf(stderr,"ERROR in battery_manager_start, failed to start thread\n");
+		return -1;
+	}
+	thread_running = 1;
+	return 0;
+}
+
+
+int battery_manager_update()
+{
+	float v;
+
+	if(!initialized){
+		fprintf(stderr,"ERROR in battery_manager_update, not initialized\n");
+		return -1;
+	}
+	v = __read_adc();
+	atomic_store(&v_raw, v);
+	__publish(rc_filter_march(&D_batt, v));
+	return 0;
+}
+
+
+battery_state_t battery_manager_get()
+{
+	battery_word_t w;
+
+	w.word = atomic_load_explicit(&published, memory_order_acquire);
+	return w.state;
+}
+
+
+double battery_manager_raw()
+{
+	return atomic_load(&v_raw);
+}
+
+
+int battery_manager_cleanup()
+{
+	int ret = 0;
+	if(thread_running){
+		// wait for the thread to exit
+		ret = rc_pthread_timed_join(pthread,NULL,BATTERY_MANAGER_TOUT);
+		if(ret==1) fprintf(stderr,"WARNING: battery_manager_thread exit timeout\n");
+		else if(ret==-1) fprintf(stderr,"ERROR: failed to join battery_manager thread\n");
+	}
+	thread_running = 0;
+	// a thread that didn't exit may still be marching the filter
+	if(ret==0){
+		initialized = 0;
+		rc_filter_free(&D_batt);
+	}
+	return ret;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file esc_output.c
+ */
+
+#include <stdio.h>
+
+#include <rc/servo.h>
+
+#include <esc_output.h>
+
+#define ESC_MAX_CHANNELS	8
+#define ESC_IDLE		-0.1	// below the arming threshold of the ESCs
+
+static int (*send_func)(int ch, double input) = rc_servo_send_esc_pulse_normalized;
+
+
+int esc_output_init(esc_protocol_t protocol)
+{
+	switch(protocol){
+	case ESC_PWM:
+		send_func = rc_servo_send_esc_pulse_normalized;
+		return 0;
+	case ESC_ONESHOT125:
+		send_func = rc_servo_send_oneshot_pulse_normalized;
+		return 0;
+	default:
+		fprintf(stderr,"ERROR in esc_output_init, unknown protocol\n");
+		return -1;
+	}
+}
+
+
+int esc_output_send(const scalar_t* m, int n)
+{
+	int i, ret = 0;
+	double out[ESC_MAX_CHANNELS];
+
+	if(n<1 || n>ESC_MAX_CHANNELS){
+		fprintf(stderr,"ERROR in esc_output_send, invalid number of channels\n");
+		return -1;
+	}
+	// finish all the math first so nothing sits between the channel writes
+	for(i=0;i<n;i++){
+		out[i] = m[i];
+		if(out[i]<0.0) out[i] = 0.0;
+		else if(out[i]>1.0) out[i] = 1.0;
+	}
+	for(i=0;i<n;i++){
+		if(send_func(i+1, out[i])) ret = -1;
+	}
+	return ret;
+}
+
+
+int esc_output_idle(int n)
+{
+	int i, ret = 0;
+
+	if(n<1 || n>ESC_MAX_CHANNELS){
+		fprintf(stderr,"ERROR in esc_output_idle, invalid number of channels\n");
+		return -1;
+	}
+	for(i=1;i<=n;i++){
+		if(send_func(i, ESC_IDLE)) ret = -1;
+	}
+	return ret;
+}
@@ -6,13 +6,13 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <rc/math/filter.h>
+#include <rc/math/ring_buffer.h>
 #include <rc/math/other.h>
 #include <rc/start_stop.h>
 #include <rc/led.h>
 #include <rc/mpu.h>
-#include <rc/servo.h>
-#include <rc/adc.h>
 #include <rc/time.h>
 #include <rc/mpu.h>
 
@@ -22,70 +22,298 @@
 #include <settings.h>
 #include <mix.h>
 #include <thrust_map.h>
+#include <log_manager.h>
+#include <input_manager.h>
+#include <state_snapshot.h>
+#include <shm_export.h>
+#include <battery_manager.h>
+#include <esc_output.h>
+#include <pru_esc.h>
+#include <mocap.h>
+#include <altitude_manager.h>
+#include <loop_sched.h>
+#include <filter_bank.h>
+#include <watchdog.h>
+#include <imu_fifo.h>
 
 #define TWO_PI (M_PI*2.0)
+#define GYRO_DEG_TO_RAD		(M_PI/180.0)
+#define RELOAD_TIMEOUT_US	1000000
+
+// hand off of reloaded controllers between feedback_reload_controllers()
+// and the ISR
+#define RELOAD_IDLE	0	// nothing pending
+#define RELOAD_READY	1	// new controllers waiting in the pending copies
+#define RELOAD_DONE	2	// ISR swapped them in, the pending copies hold the old ones
+
+// lanes of the angle and rate controller banks
+#define LANE_ROLL	0
+#define LANE_PITCH	1
+#define LANE_YAW	2
+#define NUM_LANES	3
+
+// with a fixed airframe the rotor count is a constant so the motor loops
+// unroll, otherwise it comes from the instance's mixer
+#ifdef AIRFRAME_ROTORS
+#define NUM_ROTORS(c)	AIRFRAME_ROTORS
+#else
+#define NUM_ROTORS(c)	((c)->mixer->rotors)
+#endif
 
 feedback_state_t fstate; // extern variable in feedback.h
 
-// keep original controller gains for scaling later
-static double D_roll_gain_orig, D_pitch_gain_orig, D_yaw_gain_orig;
-static double dt; // controller timestep
-static int num_yaw_spins;
-static double last_yaw;
-static double tmp;
-static rc_filter_t D_roll, D_pitch, D_yaw, D_batt;
+// the instance flying the vehicle and the IMU data the DMP or the FIFO
+// writes for it
+static controller_t ctl;
 static rc_mpu_data_t mpu_data;
 
+// controllers in each bank, in lane order
+static const settings_controller_t angle_ids[NUM_LANES] = {CTRL_ROLL, CTRL_PITCH, CTRL_YAW};
+static const settings_controller_t rate_ids[NUM_LANES] = {CTRL_ROLL_RATE, CTRL_PITCH_RATE, CTRL_YAW_RATE};
+static const char* const task_names[CONTROLLER_NUM_TASKS] = {
+	[CONTROLLER_TASK_SETPOINT] = "setpoint",
+	[CONTROLLER_TASK_ATTITUDE] = "attitude",
+	[CONTROLLER_TASK_ALTITUDE] = "altitude"
+};
+// replacements from feedback_reload_controllers() for the ISR to swap in
+static filter_bank_t D_angle_pending, D_rate_pending;
+static rc_filter_t D_alt_pending;
+static atomic_int reload_state = RELOAD_IDLE;
+// the first controllers share memory with the copies kept by settings.c
+static int own_controllers = 0;
+
 // local functions
 static void __feedback_isr(void);
+static void __feedback_fifo_isr(int remaining);
 static int __set_motors_to_idle();
-static double __batt_voltage();
-static int __feedback_control();
-static int __feedback_state_estimate();
+static int __feedback_control(controller_t* c);
+static int __feedback_state_estimate(controller_t* c);
+static double __vertical_accel(const rc_mpu_data_t* imu);
+static int __altitude_due(controller_t* c);
+static void __feedback_altitude(controller_t* c);
+static void __feedback_attitude(controller_t* c);
+static void __swap_controllers();
 
 
 
+/**
+ * @brief      start of one loop of the IMU interrupt thread
+ */
+static void __isr_begin(void)
+{
+	static int rt_setup_done = 0;
+
+	if(!rt_setup_done){
+		rt_setup_thread(RT_THREAD_FEEDBACK);
+		rt_setup_done = 1;
+	}
+	fstate.timing.isr_entry_ns = rc_nanos_since_boot();
+}
+
+
+/**
+ * @brief      one controller step on the latest IMU sample
+ */
+static void __isr_march(void)
+{
+	// loop boundary, the only place the controllers may change
+	if(atomic_load_explicit(&reload_state, memory_order_acquire)==RELOAD_READY){
+		__swap_controllers();
+	}
+	controller_march(&ctl);
+}
+
+
+/**
+ * @brief      end of one loop of the IMU interrupt thread, publishes the state
+ */
+static void __isr_end(void)
+{
+	loop_timing_update(&fstate.timing);
+	state_snapshot_publish();
+	shm_export_publish();
+	watchdog_loop_done(fstate.timing.isr_entry_ns);
+}
+
+
 static void __feedback_isr(void)
 {
-	setpoint_manager_update();
-	__feedback_state_estimate();
-	__feedback_control();
+	__isr_begin();
+	__isr_march();
+	__isr_end();
 }
 
 
-static int __set_motors_to_idle()
+/**
+ * @brief      FIFO callback, the controller steps on every raw sample but
+ *             only the newest one of a read goes out to the motors. The loop
+ *             timing and the watchdog count one read as one loop.
+ */
+static void __feedback_fifo_isr(int remaining)
 {
-	int i;
-	if(settings.num_rotors>8){
-		printf("ERROR: set_motors_to_idle: too many rotors\n");
-		return -1;
+	static int in_read = 0;
+
+	if(!in_read){
+		__isr_begin();
+		in_read = 1;
 	}
-	for(i=1;i<=settings.num_rotors;i++) rc_servo_send_esc_pulse_normalized(i,-0.1);
-	return 0;
+	ctl.hold_output = remaining>0;
+	__isr_march();
+	if(remaining) return;
+	in_read = 0;
+	__isr_end();
 }
 
-static double __batt_voltage()
+
+/**
+ * @brief      setpoint and arming from the frame in c->input, what
+ *             setpoint_manager_update() does for the instance with hardware
+ */
+static void __follow_input(controller_t* c)
 {
-	float tmp;
+	if(c->input->requested_arm_mode==DISARMED){
+		controller_disarm(c);
+		return;
+	}
+	setpoint_manager_apply(c->setpoint, c->state, c->input,
+			c->dt*c->tasks[CONTROLLER_TASK_SETPOINT].divisor);
+	if(c->state->arm_state==DISARMED) controller_arm(c);
+}
 
-	if(settings.battery_connection==DC_BARREL_JACK){
-		tmp = rc_adc_dc_jack();
+
+int controller_march(controller_t* c)
+{
+	loop_sched_tick(c->tasks, CONTROLLER_NUM_TASKS);
+	if(loop_sched_due(&c->tasks[CONTROLLER_TASK_SETPOINT])){
+		// a new DSM frame starts the stick to motor latency measurement
+		if(c->hardware){
+			if(setpoint_manager_update()==1){
+				c->state->timing.input_ns = c->setpoint->input_time_ns;
+			}
+		}
+		else if(c->input!=NULL) __follow_input(c);
 	}
-	else if(settings.battery_connection==BALANCE_PLUG){
-		tmp = rc_adc_batt();
+	c->state->timing.setpoint_done_ns = rc_nanos_since_boot();
+	__feedback_state_estimate(c);
+	c->state->timing.estimate_done_ns = rc_nanos_since_boot();
+	if(loop_sched_due(&c->tasks[CONTROLLER_TASK_ATTITUDE])) __feedback_attitude(c);
+	if(__altitude_due(c)) __feedback_altitude(c);
+	return __feedback_control(c);
+}
+
+
+/**
+ * @brief      Copies the input and output history of the filter being replaced
+ *             into its replacement, oldest first. If the new filter has a
+ *             higher order the oldest samples the old one has are repeated.
+ */
+static void __transfer_history(rc_filter_t* to, rc_filter_t* from)
+{
+	int k, j;
+
+	// rate controllers stay empty without the rate loop
+	if(!to->initialized || !from->initialized) return;
+	for(k=to->order;k>=0;k--){
+		j = k<from->order ? k : from->order;
+		rc_ringbuf_insert(&to->in_buf, rc_filter_previous_input(from, j));
+		rc_ringbuf_insert(&to->out_buf, rc_filter_previous_output(from, j));
 	}
-	else{
-		fprintf(stderr,"ERROR: invalid battery_connection_t\n");
-		return settings.v_nominal;
+	to->step = from->step;
+}
+
+
+/**
+ * @brief      Swaps the controllers waiting in the pending copies in for the
+ *             live ones.
+ *
+ *             Bumpless transfer: the new filters take over the error and
+ *             output history of the filters they replace, so the first output
+ *             after the swap only differs by the change in coefficients, and
+ *             any integrator carries on from where the old one was. The soft
+ *             start position carries over too so a swap in flight doesn't
+ *             restart the ramp.
+ */
+static void __swap_controllers()
+{
+	static filter_bank_t old_bank;	// too big for the ISR stack
+	rc_filter_t old;
+
+	filter_bank_transfer_history(&D_angle_pending, &ctl.angle);
+	old_bank = ctl.angle;
+	ctl.angle = D_angle_pending;
+	D_angle_pending = old_bank;
+
+	filter_bank_transfer_history(&D_rate_pending, &ctl.rate);
+	old_bank = ctl.rate;
+	ctl.rate = D_rate_pending;
+	D_rate_pending = old_bank;
+
+	__transfer_history(&D_alt_pending, &ctl.alt);
+	ctl.alt_gain_orig = D_alt_pending.gain;
+	old = ctl.alt;
+	ctl.alt = D_alt_pending;
+	D_alt_pending = old;
+
+	atomic_store_explicit(&reload_state, RELOAD_DONE, memory_order_release);
+}
+
+
+static int __set_motors_to_idle()
+{
+	if(ctl.pru_esc){
+		pru_esc_idle();
+	}
+	else if(esc_output_idle(SETTINGS_NUM_ROTORS)){
+		printf("ERROR: set_motors_to_idle: failed to send idle pulses\n");
+		return -1;
 	}
+	fstate.timing.esc_done_ns = rc_nanos_since_boot();
+	return 0;
+}
+
 
-	if(tmp<3.0f) tmp = settings.v_nominal;
-	return tmp;
+void controller_disarm(controller_t* c)
+{
+	c->state->arm_state = DISARMED;
 }
 
+
+int controller_arm(controller_t* c)
+{
+	feedback_state_t* fs = c->state;
+
+	if(fs->arm_state==ARMED) return -1;
+	// get the current time
+	fs->arm_time_ns = rc_nanos_since_boot();
+	// reset the index
+	fs->loop_index = 0;
+	// when swapping from direct throttle to altitude control, the altitude
+	// controller needs to know the last throttle input for smooth transition
+	c->last_en_alt_ctrl = 0;
+	// yaw estimator can be zero'd too
+	c->num_yaw_spins = 0;
+	c->last_yaw = -c->imu->fused_TaitBryan[TB_YAW_Z]; // minus because NED coordinates
+	// zero out all filters
+	filter_bank_reset(&c->angle);
+	rc_filter_reset(&c->alt);
+	// prefill filters with current error
+	filter_bank_prefill_inputs(&c->angle, LANE_ROLL, -fs->roll);
+	filter_bank_prefill_inputs(&c->angle, LANE_PITCH, -fs->pitch);
+	if(c->enable_rate_loop){
+		filter_bank_reset(&c->rate);
+		c->rate_sp[0] = c->rate_sp[1] = c->rate_sp[2] = 0.0;
+	}
+	// last thing is to flag as armed
+	fs->arm_state = ARMED;
+	return 0;
+}
+
+
 int feedback_disarm()
 {
-	fstate.arm_state = DISARMED;
+	controller_disarm(&ctl);
+	// close the current log file, the writer thread flushes in the background
+	if(settings.enable_logging) stop_log_manager();
 	// set LEDs
 	rc_led_set(RC_LED_RED,1);
 	rc_led_set(RC_LED_GREEN,0);
@@ -99,144 +327,527 @@ int feedback_arm()
 		printf("WARNING: trying to arm when controller is already armed\n");
 		return -1;
 	}
-	// start a new log file every time controller is armed, this may take some
-	// time so do it before touching anything else
-	//if(settings.enable_logging) start_log_manager();
-	// get the current time
-	fstate.arm_time_ns = rc_nanos_since_boot();
-	// reset the index
-	fstate.loop_index = 0;
-	// when swapping from direct throttle to altitude control, the altitude
-	// controller needs to know the last throttle input for smooth transition
-	//last_en_alt_ctrl = 0;
-	//last_usr_thr = MIN_Z_COMPONENT;
-	// yaw estimator can be zero'd too
-	num_yaw_spins = 0;
-	last_yaw = -mpu_data.fused_TaitBryan[TB_YAW_Z]; // minus because NED coordinates
-	// zero out all filters
-	rc_filter_reset(&D_roll);
-	rc_filter_reset(&D_pitch);
-	rc_filter_reset(&D_yaw);
-	// prefill filters with current error
-	rc_filter_prefill_inputs(&D_roll, -fstate.roll);
-	rc_filter_prefill_inputs(&D_pitch, -fstate.pitch);
+	// log into the file the writer thread has waiting, a new one every time
+	// the controller is armed
+	if(settings.enable_logging) start_log_manager();
 	// set LEDs
 	rc_led_set(RC_LED_RED,0);
 	rc_led_set(RC_LED_GREEN,1);
-	// last thing is to flag as armed
-	fstate.arm_state = ARMED;
-	return 0;
+	// resets everything and flags as armed last
+	return controller_arm(&ctl);
 }
 
 
 
 
-int feedback_init()
+/**
+ * @brief      builds the angle and rate controller banks with soft start, the
+ *             rate bank stays empty without the rate loop
+ *
+ * @param      loaded     controllers from settings_load_controllers(), or NULL
+ *                        for the ones from the last settings load
+ * @param[in]  rate_loop  whether to build the rate bank
+ * @param[out] angle      The angle bank
+ * @param[out] rate       The rate bank
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __build_banks(rc_filter_t* loaded, int rate_loop, filter_bank_t* angle, filter_bank_t* rate)
 {
-	double tmp;
+	if(settings_get_controller_bank(angle_ids, NUM_LANES, loaded, angle)) return -1;
+	if(filter_bank_enable_soft_start(angle, SOFT_START_SECONDS)) return -1;
+	*rate = filter_bank_empty();
+	if(rate_loop){
+		if(settings_get_controller_bank(rate_ids, NUM_LANES, loaded, rate)) return -1;
+		if(filter_bank_enable_soft_start(rate, SOFT_START_SECONDS)) return -1;
+	}
+	return 0;
+}
 
-	// get controllers from settings
-	if(settings_get_roll_controller(&D_roll)) return -1;
-	if(settings_get_pitch_controller(&D_pitch)) return -1;
-	if(settings_get_yaw_controller(&D_yaw)) return -1;
-	dt = 1.0/settings.feedback_hz;
 
+int controller_init(controller_t* c, const struct settings_t* set, rc_filter_t* loaded,
+			const mixer_t* mx, const thrust_curve_t* map,
+			const rc_mpu_data_t* imu, feedback_state_t* state,
+			setpoint_t* sp, int hardware)
+{
+	int i;
+
+	if(mx==NULL || !mx->initialized || map==NULL || !map->initialized){
+		fprintf(stderr,"ERROR in controller_init, mixer and thrust curve must be initialized\n");
+		return -1;
+	}
+	if(imu==NULL || state==NULL || sp==NULL){
+		fprintf(stderr,"ERROR in controller_init, received NULL pointer\n");
+		return -1;
+	}
+	c->state	= state;
+	c->setpoint	= sp;
+	c->input	= NULL;
+	c->imu		= imu;
+	c->mixer	= mx;
+	c->thrust	= map;
+	c->hardware	= hardware;
+	c->pru_esc	= hardware && pru_esc_running();
+	c->hold_output	= 0;
+	c->enable_rate_loop	= set->enable_rate_loop;
+	c->mix_allocation	= set->mix_allocation;
+	c->enable_logging	= set->enable_logging;
+	c->enable_mocap		= set->enable_mocap;
+	c->enable_baro		= set->enable_baro;
+
+	// get controllers from settings
+	if(__build_banks(loaded, c->enable_rate_loop, &c->angle, &c->rate)) return -1;
+	if(loaded==NULL){
+		if(settings_get_altitude_controller(&c->alt)) return -1;
+		c->own_alt = 0;
+	}
+	else{
+		c->alt = loaded[CTRL_ALTITUDE];
+		c->own_alt = 1;
+	}
+	c->dt = 1.0/set->feedback_hz;
+	c->alt_dt = c->dt*set->altitude_divisor;
 	// save original gains as we will scale these by battery voltage later
-	D_roll_gain_orig = D_roll.gain;
-	D_pitch_gain_orig = D_pitch.gain;
-	D_yaw_gain_orig = D_yaw.gain;
+	c->alt_gain_orig = c->alt.gain;
+	c->alt_hover_thr = 0.0;
+	c->alt_last = 0.0;
+	c->alt_mocap = 0;
+	c->alt_z_cmd = 0.0;
+	c->alt_periods = 0;
+	c->last_en_alt_ctrl = 0;
+	c->num_yaw_spins = 0;
+	c->last_yaw = 0.0;
+	c->rate_sp[0] = c->rate_sp[1] = c->rate_sp[2] = 0.0;
+	// nominal until the first estimate, the caller keeps it without hardware
+	c->batt_gain = 1.0;
+
+	// spread the outer loops over the ticks
+	for(i=0;i<CONTROLLER_NUM_TASKS;i++) c->tasks[i].name = task_names[i];
+	c->tasks[CONTROLLER_TASK_SETPOINT].divisor = set->setpoint_divisor;
+	c->tasks[CONTROLLER_TASK_ATTITUDE].divisor = set->attitude_divisor;
+	c->tasks[CONTROLLER_TASK_ALTITUDE].divisor = set->altitude_divisor;
+	if(loop_sched_init(c->tasks, CONTROLLER_NUM_TASKS)) return -1;
+
+	controller_disarm(c);
+	return 0;
+}
+
+
+void controller_free(controller_t* c)
+{
+	if(c->own_alt) rc_filter_free(&c->alt);
+	c->own_alt = 0;
+}
 
-	// enable soft start
-	rc_filter_enable_soft_start(&D_roll, SOFT_START_SECONDS);
-	rc_filter_enable_soft_start(&D_pitch, SOFT_START_SECONDS);
-	rc_filter_enable_soft_start(&D_yaw, SOFT_START_SECONDS);
 
-	// make battery filter
-	rc_filter_moving_average(&D_batt, 20, dt);
-	tmp = __batt_voltage();
-	rc_filter_prefill_inputs(&D_batt, tmp);
-	rc_filter_prefill_outputs(&D_batt, tmp);
+int feedback_init()
+{
+	if(controller_init(&ctl, &settings, NULL, mix_default_mixer(),
+			thrust_map_default_curve(), &mpu_data, &fstate,
+			&setpoint, 1)) return -1;
 
 	// start the IMU
 	rc_mpu_config_t conf = rc_mpu_default_config();
-	conf.dmp_sample_rate = settings.feedback_hz;
-	conf.enable_magnetometer = 1;
-	conf.orient = ORIENTATION_Z_UP;
-
-	// now set up the imu for dmp interrupt operation
+	conf.dmp_interrupt_sched_policy = rt_thread_policy(RT_THREAD_FEEDBACK);
+	conf.dmp_interrupt_priority = rt_thread_priority(RT_THREAD_FEEDBACK);
 	printf("initializing MPU\n");
-	if(rc_mpu_initialize_dmp(&mpu_data, conf)){
-		fprintf(stderr,"ERROR: in feedback_init, failed to start MPU DMP\n");
-		return -1;
+	if(settings.imu_source==IMU_SOURCE_FIFO){
+		// raw samples at feedback_hz, the DLPF at about half of that
+		if(settings.feedback_hz>=500) conf.gyro_dlpf = GYRO_DLPF_184;
+		else if(settings.feedback_hz>=200) conf.gyro_dlpf = GYRO_DLPF_92;
+		else conf.gyro_dlpf = GYRO_DLPF_41;
+		conf.accel_dlpf = (rc_mpu_accel_dlpf_t)conf.gyro_dlpf;
+		if(imu_fifo_init(&mpu_data, conf, settings.feedback_hz, settings.imu_fifo_batch)){
+			fprintf(stderr,"ERROR: in feedback_init, failed to start MPU FIFO\n");
+			return -1;
+		}
+	}
+	else{
+		conf.dmp_sample_rate = settings.feedback_hz;
+		conf.enable_magnetometer = 1;
+		conf.orient = ORIENTATION_Z_UP;
+		// accel for the altitude estimator, gyro for the log
+		conf.dmp_fetch_accel_gyro = 1;
+
+		// now set up the imu for dmp interrupt operation
+		if(rc_mpu_initialize_dmp(&mpu_data, conf)){
+			fprintf(stderr,"ERROR: in feedback_init, failed to start MPU DMP\n");
+			return -1;
+		}
 	}
 
+	// reset loop timing statistics for the configured rate, one FIFO read
+	// counts as one loop
+	if(loop_timing_init(&fstate.timing, settings.feedback_hz/settings.imu_fifo_batch)) return -1;
+
 	// make sure everything is disarmed them start the ISR
 	feedback_disarm();
-	rc_mpu_set_dmp_callback(__feedback_isr);
+	fstate.initialized = 1;
+	if(settings.imu_source==IMU_SOURCE_FIFO){
+		if(imu_fifo_set_callback(__feedback_fifo_isr)) return -1;
+	}
+	else rc_mpu_set_dmp_callback(__feedback_isr);
 
 	return 0;
 }
 
 
+/**
+ * @brief      frees the controllers the ISR swapped out and readies the next
+ *             reload, only once the state is RELOAD_DONE
+ */
+static void __free_replaced_controllers()
+{
+	// the banks hold copies, only the altitude filter has memory of its own
+	if(own_controllers) rc_filter_free(&D_alt_pending);
+	own_controllers = 1;
+	atomic_store(&reload_state, RELOAD_IDLE);
+}
+
+
+int feedback_reload_controllers()
+{
+	rc_filter_t loaded[SETTINGS_NUM_CONTROLLERS];
+	int i, ret;
+
+	if(fstate.initialized==0){
+		fprintf(stderr,"ERROR in feedback_reload_controllers, feedback not initialized\n");
+		return -1;
+	}
+	// finish up a reload that timed out but got swapped in since
+	if(atomic_load_explicit(&reload_state, memory_order_acquire)==RELOAD_DONE){
+		__free_replaced_controllers();
+	}
+	if(atomic_load(&reload_state)!=RELOAD_IDLE){
+		fprintf(stderr,"ERROR in feedback_reload_controllers, previous reload still pending\n");
+		return -1;
+	}
+	if(settings_load_controllers(loaded)){
+		fprintf(stderr,"ERROR in feedback_reload_controllers, keeping current controllers\n");
+		return -1;
+	}
+	ret = __build_banks(loaded, ctl.enable_rate_loop, &D_angle_pending, &D_rate_pending);
+	// the banks copied what they need
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		if(i!=CTRL_ALTITUDE || ret) rc_filter_free(&loaded[i]);
+	}
+	if(ret){
+		fprintf(stderr,"ERROR in feedback_reload_controllers, keeping current controllers\n");
+		return -1;
+	}
+	D_alt_pending = loaded[CTRL_ALTITUDE];
+
+	// hand over to the ISR and wait for it to swap at the next loop
+	atomic_store_explicit(&reload_state, RELOAD_READY, memory_order_release);
+	for(i=0;i<RELOAD_TIMEOUT_US/1000;i++){
+		if(atomic_load_explicit(&reload_state, memory_order_acquire)==RELOAD_DONE) break;
+		rc_usleep(1000);
+	}
+	if(i==RELOAD_TIMEOUT_US/1000){
+		// can't take them back without racing the ISR, it swaps them in
+		// whenever it runs again
+		fprintf(stderr,"WARNING: feedback ISR not running, controllers swap on its next loop\n");
+		return -1;
+	}
+
+	__free_replaced_controllers();
+	printf("reloaded controllers from settings file\n");
+	return 0;
+}
+
+
 int feedback_cleanup()
 {
 	__set_motors_to_idle();
+	if(settings.imu_source==IMU_SOURCE_FIFO) imu_fifo_cleanup();
 	rc_mpu_power_off();
 	return 0;
 }
 
 
-static int __feedback_state_estimate()
+/**
+ * @brief      rotates the accelerometer reading into the world frame with the
+ *             DMP quaternion (w,x,y,z)
+ *
+ * @return     vertical acceleration, positive up, gravity removed (m/s^2)
+ */
+static double __vertical_accel(const rc_mpu_data_t* imu)
 {
-	double tmp;
+	const double* q = imu->dmp_quat;
+	const double* a = imu->accel;
 
-	if(fstate.initialized==0){
-		fprintf(stderr, "ERROR in feedback_state_estimate, feedback controller not initialized\n");
-		return -1;
-	}
+	return 2.0*(q[1]*q[3] - q[0]*q[2])*a[0]
+		+ 2.0*(q[2]*q[3] + q[0]*q[1])*a[1]
+		+ (1.0 - 2.0*(q[1]*q[1] + q[2]*q[2]))*a[2]
+		- GRAVITY_MS2;
+}
+
+
+static int __feedback_state_estimate(controller_t* c)
+{
+	double tmp;
+	battery_state_t batt;
+	feedback_state_t* fs = c->state;
+	const rc_mpu_data_t* imu = c->imu;
 
 	// collect new IMU roll/pitch data
-	fstate.roll   = mpu_data.fused_TaitBryan[TB_ROLL_Y];
-	fstate.pitch  = mpu_data.fused_TaitBryan[TB_PITCH_X];
+	fs->roll   = imu->fused_TaitBryan[TB_ROLL_Y];
+	fs->pitch  = imu->fused_TaitBryan[TB_PITCH_X];
 
 	// yaw is more annoying since we have to detect spins
 	// also make sign negative since NED coordinates has Z point down
-	tmp = -mpu_data.fused_TaitBryan[TB_YAW_Z] + (num_yaw_spins * TWO_PI);
+	tmp = -imu->fused_TaitBryan[TB_YAW_Z] + (c->num_yaw_spins * TWO_PI);
 	// detect the crossover point at +-PI and write new value to core state
-	if(tmp-last_yaw < -M_PI) num_yaw_spins++;
-	else if (tmp-last_yaw > M_PI) num_yaw_spins--;
+	if(tmp-c->last_yaw < -M_PI) c->num_yaw_spins++;
+	else if (tmp-c->last_yaw > M_PI) c->num_yaw_spins--;
 	// finally num_yaw_spins is updated and the new value can be written
-	fstate.yaw = mpu_data.fused_TaitBryan[TB_YAW_Z] + (num_yaw_spins * TWO_PI);
-	last_yaw = fstate.yaw;
+	fs->yaw = imu->fused_TaitBryan[TB_YAW_Z] + (c->num_yaw_spins * TWO_PI);
+	c->last_yaw = fs->yaw;
+
+	// body rates for the rate loop, same axes as the Tait-Bryan angles above.
+	// One DMP packet or FIFO sample, one gyro sample, so the rate loop runs
+	// at feedback_hz
+	fs->roll_rate  = imu->gyro[TB_ROLL_Y] * GYRO_DEG_TO_RAD;
+	fs->pitch_rate = imu->gyro[TB_PITCH_X] * GYRO_DEG_TO_RAD;
+	fs->yaw_rate   = imu->gyro[TB_YAW_Z] * GYRO_DEG_TO_RAD;
+
+	if(!c->hardware) return 0;
 
-	// filter battery voltage.
-	fstate.v_batt = rc_filter_march(&D_batt,__batt_voltage());
+	// filtered battery voltage, sampled by the battery manager thread
+	batt = battery_manager_get();
+	fs->v_batt = batt.v_batt;
+	c->batt_gain = batt.gain;
+
+	// hand the vertical acceleration to the barometer estimator, it does the
+	// slow I2C read and the filtering on its own thread
+	if(c->enable_baro) altitude_manager_march(__vertical_accel(imu));
 
-	// TODO: altitude estimate
 	return 0;
 }
 
-static int __feedback_control()
+
+/**
+ * @brief      whether the loops should run, the hardware instance also stops
+ *             when the program leaves the RUNNING state
+ */
+static inline int __running(const controller_t* c)
+{
+	if(c->hardware && rc_get_state()!=RUNNING) return 0;
+	return c->state->arm_state==ARMED;
+}
+
+
+/**
+ * @brief      Angle loop cascaded on the rate loop, run every attitude_divisor
+ *             ticks. Turns the angle errors into rate setpoints held in
+ *             rate_sp for the rate loop in __feedback_control(). The output is
+ *             a body rate, not a motor command, so no battery compensation.
+ *             Without enable_rate_loop the angle loop is the inner loop and
+ *             runs in __feedback_control() instead.
+ */
+static void __feedback_attitude(controller_t* c)
+{
+	scalar_t err[NUM_LANES];
+	const feedback_state_t* fs = c->state;
+	const setpoint_t* sp = c->setpoint;
+
+	if(!c->enable_rate_loop || !sp->en_rpy_ctrl) return;
+	if(!__running(c)) return;
+
+	filter_bank_enable_saturation(&c->angle, LANE_ROLL, -MAX_ROLL_RATE, MAX_ROLL_RATE);
+	filter_bank_enable_saturation(&c->angle, LANE_PITCH, -MAX_PITCH_RATE, MAX_PITCH_RATE);
+	filter_bank_enable_saturation(&c->angle, LANE_YAW, -MAX_YAW_RATE, MAX_YAW_RATE);
+	err[LANE_ROLL]	= sp->roll - fs->roll;
+	err[LANE_PITCH]	= sp->pitch - fs->pitch;
+	err[LANE_YAW]	= sp->yaw - fs->yaw;
+	filter_bank_march(&c->angle, err, c->rate_sp);
+}
+
+
+/**
+ * @brief      whether the altitude loop runs on this tick. Under
+ *             WATCHDOG_SHED_OUTER only every other due tick runs it,
+ *             alt_periods counts the periods the next run has to cover.
+ */
+static int __altitude_due(controller_t* c)
+{
+	if(!loop_sched_due(&c->tasks[CONTROLLER_TASK_ALTITUDE])) return 0;
+	c->alt_periods++;
+	if(c->hardware && c->alt_periods<2 && watchdog_shed(WATCHDOG_SHED_OUTER)) return 0;
+	return 1;
+}
+
+
+/**
+ * @brief      Altitude estimate and controller, run as an outer loop every
+ *             altitude_divisor ticks. The Z throttle it computes is held in
+ *             alt_z_cmd for __feedback_control() to mix in on every tick.
+ *             Without hardware the altitude fields of the state are used as
+ *             the caller left them.
+ */
+static void __feedback_altitude(controller_t* c)
+{
+	mocap_sample_t mocap;
+	double alt, alt_rate;
+	uint64_t now;
+	int periods = c->alt_periods;
+	feedback_state_t* fs = c->state;
+	setpoint_t* sp = c->setpoint;
+
+	c->alt_periods = 0;
+
+	// altitude from motion capture when available, compensated for the age
+	// of the sample. z points down in the mocap frame. Otherwise use the
+	// barometer estimate.
+	if(c->hardware){
+		now = rc_nanos_since_boot();
+		fs->mocap_valid = 0;
+		fs->altitude_valid = 0;
+		if(c->enable_mocap && mocap_get(now, &mocap)==0){
+			fs->altitude = -mocap.pos[2];
+			fs->mocap_valid = 1;
+			fs->altitude_valid = 1;
+		}
+		else if(c->enable_baro && altitude_manager_get(now, &alt, &alt_rate)==0){
+			fs->altitude = alt;
+			fs->altitude_valid = 1;
+		}
+	}
+
+	if(!__running(c)) return;
+
+	/***************************************************************************
+	* Throttle/Altitude Controller
+	*
+	* If transitioning from direct throttle to altitude control, start from the
+	* current altitude and use the current throttle as the hover feedforward
+	* for a smooth transition. This is also true if taking off for the first
+	* time in altitude mode as controller_arm() resets last_en_alt_ctrl every
+	* time the controller arms. Without a fresh altitude estimate fall back to
+	* direct throttle.
+	*
+	* Mocap and the barometer have different origins. When the estimate
+	* switches between them while engaged, move the setpoint by the step
+	* between the two so the controller sees the same error as before.
+	***************************************************************************/
+	if(sp->en_alt_ctrl && fs->altitude_valid){
+		if(c->last_en_alt_ctrl == 0){
+			sp->altitude = fs->altitude; // set altitude setpoint to current altitude
+			rc_filter_reset(&c->alt);
+			c->alt_hover_thr = sp->Z_throttle;
+			c->last_en_alt_ctrl = 1;
+		}
+		else if(fs->mocap_valid!=c->alt_mocap){
+			sp->altitude += fs->altitude - c->alt_last;
+		}
+		c->alt_last = fs->altitude;
+		c->alt_mocap = fs->mocap_valid;
+		sp->altitude += sp->altitude_rate*c->alt_dt*periods;
+		if(sp->altitude>fs->altitude+ALT_BOUND_U){
+			sp->altitude = fs->altitude+ALT_BOUND_U;
+		}
+		else if(sp->altitude<fs->altitude-ALT_BOUND_D){
+			sp->altitude = fs->altitude-ALT_BOUND_D;
+		}
+		c->alt.gain = c->alt_gain_orig * c->batt_gain;
+		// Z points down so climbing needs more negative thrust
+		c->alt_z_cmd = c->alt_hover_thr - rc_filter_march(&c->alt, sp->altitude-fs->altitude);
+	}
+	else c->last_en_alt_ctrl = 0;
+}
+
+/**
+ * @brief      finishes one lane of a bank march begun with
+ *             filter_bank_march_begin() and mixes its output
+ *
+ *             With the greedy allocator the lane is saturated at the room the
+ *             channels mixed before it left and its output is mixed right
+ *             away. With the priority allocator it is only held to its
+ *             absolute limit, mixer_allocate() fits all channels afterwards.
+ *
+ * @param      c     controller instance
+ * @param      D     controller bank
+ * @param[in]  lane  lane of the controller in the bank
+ * @param[in]  ch    mixing channel
+ * @param[in]  lim   absolute limit of the channel
+ * @param      mot   motors for the greedy allocator to mix into
+ *
+ * @return     controller output
+ */
+static scalar_t __finish_channel(const controller_t* c, filter_bank_t* D, int lane, int ch, scalar_t lim, scalar_t* mot)
+{
+	scalar_t min, max, u;
+
+	if(c->mix_allocation==MIX_ALLOC_PRIORITY){
+		min = -lim;
+		max = lim;
+	}
+	else{
+		mixer_check_saturation_fast(c->mixer, ch, mot, &min, &max);
+		if(max>lim)  max =  lim;
+		if(min<-lim) min = -lim;
+	}
+	filter_bank_enable_saturation(D, lane, min, max);
+	u = filter_bank_finish_lane(D, lane);
+	if(c->mix_allocation!=MIX_ALLOC_PRIORITY) mixer_add_input_fast(c->mixer, u, ch, mot);
+	return u;
+}
+
+
+/**
+ * @brief      mixes a channel that isn't under feedback control
+ *
+ * @return     the input applied, or just limited for the priority allocator
+ */
+static scalar_t __mix_direct(const controller_t* c, scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot)
+{
+	if(c->mix_allocation!=MIX_ALLOC_PRIORITY){
+		return mixer_add_input_saturated(c->mixer, u, ch, lim_min, lim_max, mot);
+	}
+	if(u>lim_max) u = lim_max;
+	else if(u<lim_min) u = lim_min;
+	return u;
+}
+
+
+/**
+ * @brief      disarms the instance, through feedback_disarm() for the one
+ *             flying the vehicle so the log and LEDs follow
+ */
+static void __disarm(controller_t* c)
+{
+	if(c->hardware) feedback_disarm();
+	else controller_disarm(c);
+}
+
+
+static int __feedback_control(controller_t* c)
 {
 	int i;
-	double tmp, min, max;
-	double u[6], mot[8];
+	scalar_t tmp;
+	scalar_t u[6], mot[8];
+	scalar_t v[6];	// everything mixer_allocate() is asked for
+	scalar_t err[NUM_LANES];
+	log_entry_t new_log;
+	const user_input_t* in;
+	feedback_state_t* fs = c->state;
+	const setpoint_t* sp = c->setpoint;
 
 	// Disarm if rc_state is somehow paused without disarming the controller.
 	// This shouldn't happen if other threads are working properly.
-	if(rc_get_state()!=RUNNING && fstate.arm_state==ARMED){
+	if(c->hardware && rc_get_state()!=RUNNING && fs->arm_state==ARMED){
 		feedback_disarm();
 	}
 
 	// check for a tipover
-	if(fabs(fstate.roll)>TIP_ANGLE || fabs(fstate.pitch)>TIP_ANGLE){
-		feedback_disarm();
+	if(scalar_fabs(fs->roll)>SCALAR_C(TIP_ANGLE) || scalar_fabs(fs->pitch)>SCALAR_C(TIP_ANGLE)){
+		__disarm(c);
 		printf("\n TIPOVER DETECTED \n");
 	}
 
 	// if not running or not armed, keep the motors in an idle state
-	if(rc_get_state()!=RUNNING || fstate.arm_state==DISARMED){
-		__set_motors_to_idle();
+	if(!__running(c)){
+		if(c->hardware && !c->hold_output) __set_motors_to_idle();
 		return 0;
 	}
 
@@ -247,98 +858,70 @@ static int __feedback_control()
 
 
 	/***************************************************************************
-	* Throttle/Altitude Controller
-	*
-	* If transitioning from direct throttle to altitude control, prefill the
-	* filter with current throttle input to make smooth transition. This is also
-	* true if taking off for the first time in altitude mode as arm_controller
-	* sets up last_en_alt_ctrl and last_usr_thr every time controller arms
+	* Throttle, from the altitude loop while it is engaged and has run since.
+	* Until then, or without a fresh altitude estimate, use direct throttle.
 	***************************************************************************/
-	// // run altitude controller if enabled
-	// if(setpoint.en_alt_ctrl){
-	// 	if(last_en_alt_ctrl == 0){
-	// 		setpoint.altitude = fstate.alt; // set altitude setpoint to current altitude
-	// 		rc_reset_filter(&D0);
-	// 		prefill_filter_outputs(&D0,last_usr_thr);
-	// 		last_en_alt_ctrl = 1;
-	// 	}
-	// 	setpoint.altitude += setpoint.altitude_rate*DT;
-	// 	saturate_float(&setpoint.altitude, fstate.alt-ALT_BOUND_D, fstate.alt+ALT_BOUND_U);
-	// 	D0.gain = D0_GAIN * V_NOMINAL/fstate.vbatt;
-	// 	tmp = march_filter(&D0, setpoint.altitude-fstate.alt);
-	// 	u[VEC_Z] = tmp / cos(fstate.roll)*cos(fstate.pitch);
-	// 	saturate_float(&u[VEC_Z], MIN_THRUST_COMPONENT, MAX_THRUST_COMPONENT);
-	// 	mix_add_input(u[VEC_Z], VEC_Z, mot);
-	// 	last_en_alt_ctrl = 1;
-	// }
-	// // else use direct throttle
-	// else{
-
-		// compensate for tilt
-		tmp = setpoint.Z_throttle / (cos(fstate.roll)*cos(fstate.pitch));
-		rc_saturate_double(&tmp, -MIN_Z_COMPONENT, -MAX_Z_COMPONENT);
-		u[VEC_Z] = tmp;
-		mix_add_input(u[VEC_Z], VEC_Z, mot);
-	//}
+	if(sp->en_alt_ctrl && fs->altitude_valid && c->last_en_alt_ctrl){
+		tmp = c->alt_z_cmd;
+	}
+	else{
+		c->last_en_alt_ctrl = 0;
+		tmp = sp->Z_throttle;
+	}
+	// compensate for tilt
+	tmp = tmp / (scalar_cos(fs->roll)*scalar_cos(fs->pitch));
+	u[VEC_Z] = __mix_direct(c, tmp, VEC_Z, -MAX_Z_COMPONENT, -MIN_Z_COMPONENT, mot);
 
+	/***************************************************************************
+	* Roll Pitch Yaw rate loop, under the angle loop or straight from the
+	* sticks in acro mode
+	***************************************************************************/
+	if(c->enable_rate_loop && (sp->en_rpy_ctrl || sp->en_rate_ctrl)){
+		if(sp->en_rate_ctrl){
+			c->rate_sp[LANE_ROLL]  = sp->roll_rate;
+			c->rate_sp[LANE_PITCH] = sp->pitch_rate;
+			c->rate_sp[LANE_YAW]   = sp->yaw_rate;
+		}
+		err[LANE_ROLL]	= c->rate_sp[LANE_ROLL] - fs->roll_rate;
+		err[LANE_PITCH]	= c->rate_sp[LANE_PITCH] - fs->pitch_rate;
+		err[LANE_YAW]	= c->rate_sp[LANE_YAW] - fs->yaw_rate;
+		filter_bank_scale_gains(&c->rate, c->batt_gain);
+		filter_bank_march_begin(&c->rate, err);
+		u[VEC_ROLL]  = __finish_channel(c, &c->rate, LANE_ROLL, VEC_ROLL, MAX_ROLL_COMPONENT, mot);
+		u[VEC_PITCH] = __finish_channel(c, &c->rate, LANE_PITCH, VEC_PITCH, MAX_PITCH_COMPONENT, mot);
+		u[VEC_YAW]   = __finish_channel(c, &c->rate, LANE_YAW, VEC_YAW, MAX_YAW_COMPONENT, mot);
+		filter_bank_march_end(&c->rate);
+		v[VEC_ROLL]	= u[VEC_ROLL];
+		v[VEC_PITCH]	= u[VEC_PITCH];
+		v[VEC_YAW]	= u[VEC_YAW];
+	}
 	/***************************************************************************
 	* Roll Pitch Yaw controllers, only run if enabled
 	***************************************************************************/
-	if(setpoint.en_rpy_ctrl){
-		// Roll
-		mix_check_saturation(VEC_ROLL, mot, &min, &max);
-		if(max>MAX_ROLL_COMPONENT)  max =  MAX_ROLL_COMPONENT;
-		if(min<-MAX_ROLL_COMPONENT) min = -MAX_ROLL_COMPONENT;
-		rc_filter_enable_saturation(&D_roll, min, max);
-		D_roll.gain = D_roll_gain_orig * settings.v_nominal/fstate.v_batt;
-		u[VEC_ROLL] = rc_filter_march(&D_roll, setpoint.roll - fstate.roll);
-		mix_add_input(u[VEC_ROLL], VEC_ROLL, mot);
-
-		// pitch
-		mix_check_saturation(VEC_PITCH, mot, &min, &max);
-		if(max>MAX_PITCH_COMPONENT)  max =  MAX_PITCH_COMPONENT;
-		if(min<-MAX_PITCH_COMPONENT) min = -MAX_PITCH_COMPONENT;
-		rc_filter_enable_saturation(&D_pitch, min, max);
-		D_pitch.gain = D_pitch_gain_orig * settings.v_nominal/fstate.v_batt;
-		u[VEC_PITCH] = rc_filter_march(&D_pitch, setpoint.pitch - fstate.pitch);
-		mix_add_input(u[VEC_PITCH], VEC_PITCH, mot);
-
-		// Yaw
+	else if(sp->en_rpy_ctrl){
+		err[LANE_ROLL]	= sp->roll - fs->roll;
+		err[LANE_PITCH]	= sp->pitch - fs->pitch;
+		err[LANE_YAW]	= sp->yaw - fs->yaw;
+		filter_bank_scale_gains(&c->angle, c->batt_gain);
+		filter_bank_march_begin(&c->angle, err);
+		u[VEC_ROLL]  = __finish_channel(c, &c->angle, LANE_ROLL, VEC_ROLL, MAX_ROLL_COMPONENT, mot);
+		u[VEC_PITCH] = __finish_channel(c, &c->angle, LANE_PITCH, VEC_PITCH, MAX_PITCH_COMPONENT, mot);
 		// if throttle stick is down (waiting to take off) keep yaw setpoint at
 		// current heading, otherwide update by yaw rate
-		mix_check_saturation(VEC_YAW, mot, &min, &max);
-		if(max>MAX_YAW_COMPONENT)  max =  MAX_YAW_COMPONENT;
-		if(min<-MAX_YAW_COMPONENT) min = -MAX_YAW_COMPONENT;
-		rc_filter_enable_saturation(&D_yaw, min, max);
-		D_yaw.gain = D_yaw_gain_orig * settings.v_nominal/fstate.v_batt;
-		u[VEC_YAW] = rc_filter_march(&D_yaw, setpoint.yaw - fstate.yaw);
-		mix_add_input(u[VEC_YAW], VEC_YAW, mot);
+		u[VEC_YAW]   = __finish_channel(c, &c->angle, LANE_YAW, VEC_YAW, MAX_YAW_COMPONENT, mot);
+		filter_bank_march_end(&c->angle);
+		v[VEC_ROLL]	= u[VEC_ROLL];
+		v[VEC_PITCH]	= u[VEC_PITCH];
+		v[VEC_YAW]	= u[VEC_YAW];
 	}
 	// otherwise direct throttle
 	else{
-		// roll
-		mix_check_saturation(VEC_ROLL, mot, &min, &max);
-		if(max>MAX_ROLL_COMPONENT)  max =  MAX_ROLL_COMPONENT;
-		if(min<-MAX_ROLL_COMPONENT) min = -MAX_ROLL_COMPONENT;
-		u[VEC_ROLL] = setpoint.roll_throttle;
-		rc_saturate_double(&u[VEC_ROLL], min, max);
-		mix_add_input(u[VEC_ROLL], VEC_ROLL, mot);
-
-		// pitch
-		mix_check_saturation(VEC_PITCH, mot, &min, &max);
-		if(max>MAX_PITCH_COMPONENT)  max =  MAX_PITCH_COMPONENT;
-		if(min<-MAX_PITCH_COMPONENT) min = -MAX_PITCH_COMPONENT;
-		u[VEC_PITCH] = setpoint.roll_throttle;
-		rc_saturate_double(&u[VEC_PITCH], min, max);
-		mix_add_input(u[VEC_PITCH], VEC_PITCH, mot);
-
-		// YAW
-		mix_check_saturation(VEC_ROLL, mot, &min, &max);
-		if(max>MAX_YAW_COMPONENT)  max =  MAX_YAW_COMPONENT;
-		if(min<-MAX_YAW_COMPONENT) min = -MAX_YAW_COMPONENT;
-		u[VEC_YAW] = setpoint.yaw_throttle;
-		rc_saturate_double(&u[VEC_YAW], min, max);
-		mix_add_input(u[VEC_YAW], VEC_YAW, mot);
+		v[VEC_ROLL] = __mix_direct(c, sp->roll_throttle, VEC_ROLL,
+				-MAX_ROLL_COMPONENT, MAX_ROLL_COMPONENT, mot);
+		v[VEC_PITCH] = __mix_direct(c, sp->pitch_throttle, VEC_PITCH,
+				-MAX_PITCH_COMPONENT, MAX_PITCH_COMPONENT, mot);
+		v[VEC_YAW] = __mix_direct(c, sp->yaw_throttle, VEC_YAW,
+				-MAX_YAW_COMPONENT, MAX_YAW_COMPONENT, mot);
 
 		u[VEC_ROLL]	= 0.0;
 		u[VEC_PITCH]	= 0.0;
@@ -348,75 +931,115 @@ static int __feedback_control()
 	/***********************************************************************
 	* X (Side) and Y (Forward) inputs, only when 6dof is enabled
 	***********************************************************************/
-	if(setpoint.en_6dof){
+	if(sp->en_6dof){
 		// Y (sideways, positive right)
-		mix_check_saturation(VEC_Y, mot, &min, &max);
-		if(max>MAX_Y_COMPONENT)  max =  MAX_X_COMPONENT;
-		if(min<-MAX_Y_COMPONENT) min = -MAX_X_COMPONENT;
-		u[VEC_Y] = setpoint.Y_throttle;
-		rc_saturate_double(&u[VEC_Y], min, max);
-		mix_add_input(u[VEC_Y], VEC_Y, mot);
-
+		u[VEC_Y] = __mix_direct(c, sp->Y_throttle, VEC_Y,
+				-MAX_Y_COMPONENT, MAX_Y_COMPONENT, mot);
 		// X (forward)
-		mix_check_saturation(VEC_X, mot, &min, &max);
-		if(max>MAX_X_COMPONENT)  max =  MAX_Y_COMPONENT;
-		if(min<-MAX_X_COMPONENT) min = -MAX_Y_COMPONENT;
-		u[VEC_X] = setpoint.X_throttle;
-		rc_saturate_double(&u[VEC_X], min, max);
-		mix_add_input(u[VEC_X], VEC_Y, mot);
+		u[VEC_X] = __mix_direct(c, sp->X_throttle, VEC_X,
+				-MAX_X_COMPONENT, MAX_X_COMPONENT, mot);
 	}
 	else{
 		u[VEC_Y] = 0.0;
 		u[VEC_X] = 0.0;
 	}
 
+	/***************************************************************************
+	* Priority allocation of everything at once. Controllers only see their
+	* absolute limits, so u reports what the motors could actually deliver.
+	***************************************************************************/
+	if(c->mix_allocation==MIX_ALLOC_PRIORITY){
+		v[VEC_Z] = u[VEC_Z];
+		v[VEC_X] = u[VEC_X];
+		v[VEC_Y] = u[VEC_Y];
+		mixer_allocate(c->mixer, v, mot);
+		u[VEC_Z] = v[VEC_Z];
+		u[VEC_X] = v[VEC_X];
+		u[VEC_Y] = v[VEC_Y];
+		if(sp->en_rpy_ctrl || (c->enable_rate_loop && sp->en_rate_ctrl)){
+			u[VEC_ROLL]	= v[VEC_ROLL];
+			u[VEC_PITCH]	= v[VEC_PITCH];
+			u[VEC_YAW]	= v[VEC_YAW];
+		}
+	}
+
 	/***************************************************************************
 	* Send ESC motor signals immediately at the end of the control loop
 	***************************************************************************/
-	for(i=0;i<settings.num_rotors;i++){
-		rc_saturate_double(&mot[i], 0.0, 1.0);
-		fstate.m[i] = map_motor_signal(mot[i]);
-		rc_servo_send_esc_pulse_normalized(i+1,fstate.m[i]);
+	// the PRU mixes what the greedy allocator applied again, then maps and
+	// sends it. What it sent is read back one loop late for the log. Older
+	// samples of a FIFO read don't go out, the newest one follows right away.
+	if(c->pru_esc){
+		if(!c->hold_output){
+			v[VEC_Z] = u[VEC_Z];
+			v[VEC_X] = u[VEC_X];
+			v[VEC_Y] = u[VEC_Y];
+			pru_esc_send(v);
+			fs->timing.esc_done_ns = rc_nanos_since_boot();
+			pru_esc_signals(fs->m, NUM_ROTORS(c));
+		}
+	}
+	// thrust_curve_signals clamps to [0,1] itself and maps all rotors in one
+	// go, then all channels go out to the ESCs in one call
+	else{
+		thrust_curve_signals(c->thrust, mot, fs->m, NUM_ROTORS(c));
+		if(c->hardware && !c->hold_output){
+			esc_output_send(fs->m, NUM_ROTORS(c));
+			fs->timing.esc_done_ns = rc_nanos_since_boot();
+		}
 	}
 
 	/***************************************************************************
 	* Final cleanup, timing, and indexing
 	***************************************************************************/
 	// Load control inputs into cstate for viewing by outside threads
-	for(i=0;i<6;i++) fstate.u[i]=u[i];
+	for(i=0;i<6;i++) fs->u[i]=u[i];
 	// keep track of loops since arming
-	fstate.loop_index++;
+	fs->loop_index++;
 	// log us since arming, mostly for the log
-	fstate.last_step_ns = rc_nanos_since_boot();
+	fs->last_step_ns = rc_nanos_since_boot();
 
 
 	/***************************************************************************
-	* Add new log entry
+	* Add new log entry, the first work the watchdog sheds
 	***************************************************************************/
-	// if(settings.enable_logging){
-	// 	new_log.loop_index	= fstate.loop_index;
-	// 	new_log.last_step_us	= fstate.last_step_us;
-	// 	new_log.altitude	= fstate.altitude;
-	// 	new_log.roll		= fstate.roll;
-	// 	new_log.pitch		= fstate.pitch;
-	// 	new_log.yaw		= fstate.yaw;
-	// 	new_log.v_batt		= fstate.v_batt;
-	// 	new_log.u_X		= u[VEC_Y];
-	// 	new_log.u_Y		= u[VEC_X];
-	// 	new_log.u_Z		= u[VEC_Z];
-	// 	new_log.u_roll		= u[VEC_ROLL];
-	// 	new_log.u_pitch		= u[VEC_PITCH];
-	// 	new_log.u_yaw		= u[VEC_YAW];
-	// 	new_log.mot_1		= fstate.m[0];
-	// 	new_log.mot_2		= fstate.m[1];
-	// 	new_log.mot_3		= fstate.m[2];
-	// 	new_log.mot_4		= fstate.m[3];
-	// 	new_log.mot_5		= fstate.m[4];
-	// 	new_log.mot_6		= fstate.m[5];
-	// 	add_log_entry(new_log);
-	// }
+	if(c->hardware && c->enable_logging && !watchdog_shed(WATCHDOG_SHED_LOGGING)){
+		in = setpoint_manager_last_input();
+		new_log.loop_index	= fs->loop_index;
+		new_log.last_step_ns	= fs->last_step_ns;
+		new_log.altitude	= fs->altitude;
+		new_log.roll		= fs->roll;
+		new_log.pitch		= fs->pitch;
+		new_log.yaw		= fs->yaw;
+		new_log.v_batt		= fs->v_batt;
+		new_log.u_X		= u[VEC_X];
+		new_log.u_Y		= u[VEC_Y];
+		new_log.u_Z		= u[VEC_Z];
+		new_log.u_roll		= u[VEC_ROLL];
+		new_log.u_pitch		= u[VEC_PITCH];
+		new_log.u_yaw		= u[VEC_YAW];
+		new_log.mot_1		= fs->m[0];
+		new_log.mot_2		= fs->m[1];
+		new_log.mot_3		= fs->m[2];
+		new_log.mot_4		= fs->m[3];
+		new_log.mot_5		= fs->m[4];
+		new_log.mot_6		= fs->m[5];
+		new_log.mot_7		= fs->m[6];
+		new_log.mot_8		= fs->m[7];
+		new_log.imu_roll	= c->imu->fused_TaitBryan[TB_ROLL_Y];
+		new_log.imu_pitch	= c->imu->fused_TaitBryan[TB_PITCH_X];
+		new_log.imu_yaw		= c->imu->fused_TaitBryan[TB_YAW_Z];
+		new_log.gyro_x		= c->imu->gyro[0];
+		new_log.gyro_y		= c->imu->gyro[1];
+		new_log.gyro_z		= c->imu->gyro[2];
+		new_log.v_batt_raw	= battery_manager_raw();
+		new_log.thr_stick	= in->thr_stick;
+		new_log.roll_stick	= in->roll_stick;
+		new_log.pitch_stick	= in->pitch_stick;
+		new_log.yaw_stick	= in->yaw_stick;
+		new_log.flight_mode	= in->flight_mode;
+		add_log_entry(&new_log);
+	}
 
-	return 0;
+	return 1;
 }
-
-
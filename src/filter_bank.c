@@ -0,0 +1,192 @@
+/**
+ * @file filter_bank.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <filter_bank.h>
+
+
+filter_bank_t filter_bank_empty(void)
+{
+	filter_bank_t fb;
+	memset(&fb, 0, sizeof(fb));
+	return fb;
+}
+
+
+int filter_bank_alloc(filter_bank_t* fb, rc_filter_t* const* filters, int n)
+{
+	int i, k, off;
+	rc_filter_t* f;
+
+	if(n<1 || n>FILTER_BANK_LANES){
+		fprintf(stderr,"ERROR in filter_bank_alloc, %d filters, bank holds 1 to %d\n",
+							n, FILTER_BANK_LANES);
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		f = filters[i];
+		if(!f->initialized){
+			fprintf(stderr,"ERROR in filter_bank_alloc, filter %d not initialized\n", i);
+			return -1;
+		}
+		if(f->order>FILTER_BANK_MAX_ORDER || f->num.len>f->den.len){
+			fprintf(stderr,"ERROR in filter_bank_alloc, filter %d has order %d, max is %d\n",
+							i, f->order, FILTER_BANK_MAX_ORDER);
+			return -1;
+		}
+		if(f->den.d[0]==0.0){
+			fprintf(stderr,"ERROR in filter_bank_alloc, filter %d has a zero leading denominator\n", i);
+			return -1;
+		}
+		if(fabs(f->dt-filters[0]->dt)>1e-9*filters[0]->dt){
+			fprintf(stderr,"ERROR in filter_bank_alloc, filters in a bank must share one dt\n");
+			return -1;
+		}
+	}
+
+	*fb = filter_bank_empty();
+	fb->lanes = n;
+	fb->dt = filters[0]->dt;
+	// unused lanes are a zero filter, leading 1 so they stay finite
+	for(i=0;i<FILTER_BANK_LANES;i++) fb->den[0][i] = 1.0;
+	for(i=0;i<n;i++){
+		f = filters[i];
+		if(f->order>fb->order) fb->order = f->order;
+		// a shorter numerator is a delay, line it up with the denominator
+		off = f->den.len-f->num.len;
+		for(k=0;k<f->num.len;k++) fb->num[k+off][i] = f->num.d[k];
+		for(k=0;k<f->den.len;k++) fb->den[k][i] = f->den.d[k];
+		fb->gain[i] = f->gain;
+		fb->gain_nominal[i] = f->gain;
+	}
+	fb->initialized = 1;
+	return 0;
+}
+
+
+void filter_bank_reset(filter_bank_t* fb)
+{
+	memset(fb->in, 0, sizeof(fb->in));
+	memset(fb->out, 0, sizeof(fb->out));
+	fb->step = 0;
+}
+
+
+void filter_bank_prefill_inputs(filter_bank_t* fb, int lane, scalar_t in)
+{
+	int k;
+	for(k=0;k<=fb->order;k++) fb->in[k][lane] = in;
+}
+
+
+int filter_bank_enable_soft_start(filter_bank_t* fb, double seconds)
+{
+	int l;
+	if(seconds<0.0){
+		fprintf(stderr,"ERROR in filter_bank_enable_soft_start, seconds must be >= 0\n");
+		return -1;
+	}
+	for(l=0;l<fb->lanes;l++){
+		fb->ss_en[l] = 1;
+		fb->ss_steps[l] = seconds/fb->dt;
+	}
+	return 0;
+}
+
+
+void filter_bank_march_begin(filter_bank_t* fb, const scalar_t* in)
+{
+	int k, l;
+	scalar_t acc[FILTER_BANK_LANES];
+
+	for(k=fb->order;k>0;k--){
+		for(l=0;l<FILTER_BANK_LANES;l++) fb->in[k][l] = fb->in[k-1][l];
+	}
+	for(l=0;l<fb->lanes;l++) fb->in[0][l] = in[l];
+
+	// same terms in the same order as rc_filter_march(), the zero padding
+	// adds exact zeros
+	for(l=0;l<FILTER_BANK_LANES;l++) acc[l] = SCALAR_C(0.0);
+	for(k=0;k<=fb->order;k++){
+		for(l=0;l<FILTER_BANK_LANES;l++){
+			acc[l] += fb->gain[l] * fb->num[k][l] * fb->in[k][l];
+		}
+	}
+	for(k=1;k<=fb->order;k++){
+		for(l=0;l<FILTER_BANK_LANES;l++){
+			acc[l] -= fb->den[k][l] * fb->out[k-1][l];
+		}
+	}
+	for(l=0;l<FILTER_BANK_LANES;l++) fb->pending[l] = acc[l]/fb->den[0][l];
+}
+
+
+scalar_t filter_bank_finish_lane(filter_bank_t* fb, int lane)
+{
+	scalar_t y = fb->pending[lane];
+	scalar_t a, b;
+
+	// soft start limits, saturation overrides this
+	if(fb->ss_en[lane] && fb->step<fb->ss_steps[lane]){
+		a = fb->sat_max[lane]*(fb->step/fb->ss_steps[lane]);
+		b = fb->sat_min[lane]*(fb->step/fb->ss_steps[lane]);
+		if(y>a) y = a;
+		if(y<b) y = b;
+	}
+	if(fb->sat_en[lane]){
+		if(y>fb->sat_max[lane]){
+			y = fb->sat_max[lane];
+			fb->sat_flag[lane] = 1;
+		}
+		else if(y<fb->sat_min[lane]){
+			y = fb->sat_min[lane];
+			fb->sat_flag[lane] = 1;
+		}
+		else fb->sat_flag[lane] = 0;
+	}
+	fb->pending[lane] = y;
+	return y;
+}
+
+
+void filter_bank_march_end(filter_bank_t* fb)
+{
+	int k, l;
+
+	for(k=fb->order;k>0;k--){
+		for(l=0;l<FILTER_BANK_LANES;l++) fb->out[k][l] = fb->out[k-1][l];
+	}
+	for(l=0;l<FILTER_BANK_LANES;l++) fb->out[0][l] = fb->pending[l];
+	fb->step++;
+}
+
+
+void filter_bank_march(filter_bank_t* fb, const scalar_t* in, scalar_t* out)
+{
+	int l;
+
+	filter_bank_march_begin(fb, in);
+	for(l=0;l<fb->lanes;l++) out[l] = filter_bank_finish_lane(fb, l);
+	filter_bank_march_end(fb);
+}
+
+
+void filter_bank_transfer_history(filter_bank_t* to, const filter_bank_t* from)
+{
+	int k, j, l, lanes;
+
+	if(!to->initialized || !from->initialized) return;
+	lanes = to->lanes<from->lanes ? to->lanes : from->lanes;
+	for(k=0;k<=to->order;k++){
+		j = k<from->order ? k : from->order;
+		for(l=0;l<lanes;l++){
+			to->in[k][l] = from->in[j][l];
+			to->out[k][l] = from->out[j][l];
+		}
+	}
+	to->step = from->step;
+}
@@ -0,0 +1,295 @@
+/**
+ * @file imu_fifo.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+
+#include <rc/mpu.h>
+#include <rc/i2c.h>
+#include <rc/math/quaternion.h>
+#include <rc/start_stop.h>
+#include <rc/pthread.h>
+
+#include <imu_fifo.h>
+#include <rc_pilot_defs.h>
+#include <thread_defs.h>
+
+// MPU9250 registers, the rest of the setup is left to rc_mpu_initialize()
+#define MPU_SMPLRT_DIV		0x19
+#define MPU_FIFO_EN		0x23
+#define MPU_USER_CTRL		0x6A
+#define MPU_FIFO_COUNTH		0x72
+#define MPU_FIFO_R_W		0x74
+
+#define FIFO_EN_ACCEL_GYRO	0x78	// ACCEL, GYRO_XOUT, GYRO_YOUT, GYRO_ZOUT
+#define USER_CTRL_FIFO_EN	0x40
+#define USER_CTRL_FIFO_RST	0x04
+
+#define FIFO_SIZE		512
+#define SAMPLE_BYTES		12	// accel xyz then gyro xyz, big endian int16
+#define MAX_SAMPLES		(FIFO_SIZE/SAMPLE_BYTES)
+
+#define DEG_TO_RAD		(M_PI/180.0)
+
+static rc_mpu_data_t* data;
+static int bus;
+static uint8_t addr;
+static int policy, priority;
+static uint64_t wake_ns;	// batch sample periods
+static double dt;		// one sample period
+static void (*callback)(int remaining) = NULL;
+static pthread_t pthread;
+static int thread_running = 0;
+static atomic_int running;
+static _Atomic uint64_t overflows;
+
+// complementary filter state, body to world
+static double q[4];
+static int q_initialized;
+
+
+static int __write_reg(uint8_t reg, uint8_t val)
+{
+	if(rc_i2c_set_device_address(bus, addr)) return -1;
+	return rc_i2c_write_byte(bus, reg, val);
+}
+
+
+/**
+ * @brief      resets the FIFO and starts pushing accel and gyro into it
+ */
+static int __reset_fifo()
+{
+	uint8_t ctrl;
+
+	if(rc_i2c_set_device_address(bus, addr)) return -1;
+	if(rc_i2c_read_byte(bus, MPU_USER_CTRL, &ctrl)<0) return -1;
+	if(__write_reg(MPU_FIFO_EN, FIFO_EN_ACCEL_GYRO)) return -1;
+	return __write_reg(MPU_USER_CTRL, ctrl|USER_CTRL_FIFO_EN|USER_CTRL_FIFO_RST);
+}
+
+
+/**
+ * @brief      reads all whole samples in the FIFO in one burst
+ *
+ * @return     number of samples read into buf, -1 on a bus error
+ */
+static int __read_fifo(uint8_t* buf)
+{
+	uint8_t c[2];
+	int count, n = 0;
+
+	rc_i2c_lock_bus(bus);
+	if(rc_i2c_set_device_address(bus, addr)) n = -1;
+	else if(rc_i2c_read_bytes(bus, MPU_FIFO_COUNTH, 2, c)<0) n = -1;
+	else{
+		count = ((c[0]&0x1F)<<8) | c[1];
+		// once full the MPU overwrites the oldest bytes and the samples no
+		// longer line up, start over
+		if(count > FIFO_SIZE-SAMPLE_BYTES){
+			atomic_fetch_add(&overflows, 1);
+			__reset_fifo();
+		}
+		else if(count >= SAMPLE_BYTES){
+			n = count/SAMPLE_BYTES;
+			if(rc_i2c_read_bytes(bus, MPU_FIFO_R_W, n*SAMPLE_BYTES, buf)<0) n = -1;
+		}
+	}
+	rc_i2c_unlock_bus(bus);
+	return n;
+}
+
+
+/**
+ * @brief      one complementary filter step, the gyro integrated into q and
+ *             corrected towards the measured gravity direction like a
+ *             Mahony filter without the integral term
+ */
+static void __attitude_update(const double* a, const double* g)
+{
+	double an[3], v[3], w[3], qd[4], norm;
+	int i;
+
+	norm = sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+	// first sample, start level with the accelerometer, yaw at 0
+	if(!q_initialized){
+		if(norm<0.5*GRAVITY_MS2) return;
+		for(i=0;i<3;i++) an[i] = a[i]/norm;
+		// rotation taking the measured gravity to world z
+		q[QUAT_W] = 1.0 + an[2];
+		q[QUAT_X] = an[1];
+		q[QUAT_Y] = -an[0];
+		q[QUAT_Z] = 0.0;
+		if(q[QUAT_W]<1e-6){
+			q[QUAT_W] = 0.0;
+			q[QUAT_X] = 1.0;
+		}
+		q_initialized = 1;
+	}
+	else{
+		for(i=0;i<3;i++) w[i] = g[i]*DEG_TO_RAD;
+		// only trust the accelerometer as a gravity reference near 1g
+		if(norm>0.5*GRAVITY_MS2 && norm<1.5*GRAVITY_MS2){
+			for(i=0;i<3;i++) an[i] = a[i]/norm;
+			// world z in the body frame
+			v[0] = 2.0*(q[QUAT_X]*q[QUAT_Z] - q[QUAT_W]*q[QUAT_Y]);
+			v[1] = 2.0*(q[QUAT_Y]*q[QUAT_Z] + q[QUAT_W]*q[QUAT_X]);
+			v[2] = q[QUAT_W]*q[QUAT_W] - q[QUAT_X]*q[QUAT_X]
+				- q[QUAT_Y]*q[QUAT_Y] + q[QUAT_Z]*q[QUAT_Z];
+			w[0] += (an[1]*v[2] - an[2]*v[1])/IMU_FIFO_TILT_TC;
+			w[1] += (an[2]*v[0] - an[0]*v[2])/IMU_FIFO_TILT_TC;
+			w[2] += (an[0]*v[1] - an[1]*v[0])/IMU_FIFO_TILT_TC;
+		}
+		// q += q*(0,w)*dt/2
+		qd[QUAT_W] = -q[QUAT_X]*w[0] - q[QUAT_Y]*w[1] - q[QUAT_Z]*w[2];
+		qd[QUAT_X] =  q[QUAT_W]*w[0] + q[QUAT_Y]*w[2] - q[QUAT_Z]*w[1];
+		qd[QUAT_Y] =  q[QUAT_W]*w[1] - q[QUAT_X]*w[2] + q[QUAT_Z]*w[0];
+		qd[QUAT_Z] =  q[QUAT_W]*w[2] + q[QUAT_X]*w[1] - q[QUAT_Y]*w[0];
+		for(i=0;i<4;i++) q[i] += 0.5*dt*qd[i];
+	}
+	norm = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+	for(i=0;i<4;i++) q[i] /= norm;
+}
+
+
+/**
+ * @brief      fills data from one FIFO sample the way the DMP would
+ */
+static void __update_data(const uint8_t* s)
+{
+	int i;
+
+	for(i=0;i<3;i++){
+		data->raw_accel[i] = (int16_t)(s[2*i]<<8 | s[2*i+1]);
+		data->raw_gyro[i] = (int16_t)(s[6+2*i]<<8 | s[6+2*i+1]);
+		data->accel[i] = data->raw_accel[i]*data->accel_to_ms2;
+		data->gyro[i] = data->raw_gyro[i]*data->gyro_to_degs;
+	}
+	__attitude_update(data->accel, data->gyro);
+	for(i=0;i<4;i++){
+		data->dmp_quat[i] = q[i];
+		data->fused_quat[i] = q[i];
+	}
+	rc_quaternion_to_tb_array(data->fused_quat, data->fused_TaitBryan);
+	for(i=0;i<3;i++) data->dmp_TaitBryan[i] = data->fused_TaitBryan[i];
+}
+
+
+static void* __imu_fifo_func(__attribute__ ((unused)) void* ptr)
+{
+	uint8_t buf[MAX_SAMPLES*SAMPLE_BYTES];
+	struct timespec next;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(rc_get_state()!=EXITING && atomic_load(&running)){
+		// wake on an absolute schedule so the batches don't drift
+		next.tv_nsec += wake_ns;
+		while(next.tv_nsec>=1000000000){
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		// a late wakeup finds more than a batch, every sample still goes
+		// through the callback so the controllers see an even sample rate
+		n = __read_fifo(buf);
+		for(i=0;i<n;i++){
+			__update_data(&buf[i*SAMPLE_BYTES]);
+			callback(n-1-i);
+		}
+	}
+	return NULL;
+}
+
+
+int imu_fifo_init(rc_mpu_data_t* d, rc_mpu_config_t conf, int sample_hz, int batch)
+{
+	if(sample_hz<1 || sample_hz>IMU_FIFO_MAX_HZ || IMU_FIFO_MAX_HZ%sample_hz){
+		fprintf(stderr,"ERROR in imu_fifo_init, sample_hz must divide %d\n", IMU_FIFO_MAX_HZ);
+		return -1;
+	}
+	if(batch<1 || batch>IMU_FIFO_MAX_BATCH){
+		fprintf(stderr,"ERROR in imu_fifo_init, batch must be between 1 and %d\n", IMU_FIFO_MAX_BATCH);
+		return -1;
+	}
+	// the 1kHz internal sample rate needs the DLPF, without it the MPU
+	// samples at 8kHz and the divider doesn't apply
+	if(conf.gyro_dlpf==GYRO_DLPF_OFF){
+		fprintf(stderr,"ERROR in imu_fifo_init, gyro_dlpf must be on\n");
+		return -1;
+	}
+	if(rc_mpu_initialize(d, conf)){
+		fprintf(stderr,"ERROR in imu_fifo_init, failed to start MPU\n");
+		return -1;
+	}
+	data = d;
+	bus = conf.i2c_bus;
+	addr = conf.i2c_addr;
+	policy = conf.dmp_interrupt_sched_policy;
+	priority = conf.dmp_interrupt_priority;
+	wake_ns = (uint64_t)batch*1000000000ULL/sample_hz;
+	dt = 1.0/sample_hz;
+	q_initialized = 0;
+	atomic_store(&overflows, 0);
+	if(__write_reg(MPU_SMPLRT_DIV, IMU_FIFO_MAX_HZ/sample_hz-1)){
+		fprintf(stderr,"ERROR in imu_fifo_init, failed to set sample rate\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+int imu_fifo_set_callback(void (*func)(int remaining))
+{
+	if(data==NULL){
+		fprintf(stderr,"ERROR in imu_fifo_set_callback, call imu_fifo_init first\n");
+		return -1;
+	}
+	if(thread_running){
+		fprintf(stderr,"ERROR in imu_fifo_set_callback, already running\n");
+		return -1;
+	}
+	callback = func;
+	rc_i2c_lock_bus(bus);
+	if(__reset_fifo()){
+		rc_i2c_unlock_bus(bus);
+		fprintf(stderr,"ERROR in imu_fifo_set_callback, failed to enable FIFO\n");
+		return -1;
+	}
+	rc_i2c_unlock_bus(bus);
+	atomic_store(&running, 1);
+	if(rc_pthread_create(&pthread, __imu_fifo_func, NULL, policy, priority)<0){
+		fprintf(stderr,"ERROR in imu_fifo_set_callback, failed to start thread\n");
+		atomic_store(&running, 0);
+		return -1;
+	}
+	thread_running = 1;
+	return 0;
+}
+
+
+uint64_t imu_fifo_overflows()
+{
+	return atomic_load(&overflows);
+}
+
+
+int imu_fifo_cleanup()
+{
+	int ret = 0;
+
+	if(!thread_running) return 0;
+	atomic_store(&running, 0);
+	ret = rc_pthread_timed_join(pthread, NULL, IMU_FIFO_TOUT);
+	if(ret==1) fprintf(stderr,"WARNING: imu_fifo thread exit timeout\n");
+	else if(ret==-1) fprintf(stderr,"ERROR: failed to join imu_fifo thread\n");
+	thread_running = 0;
+	// stop filling the FIFO, rc_mpu_power_off() does the rest
+	if(ret==0) __write_reg(MPU_FIFO_EN, 0);
+	return ret;
+}
@@ -17,14 +17,36 @@
 #include <settings.h>
 #include <rc_pilot_defs.h>
 #include <thread_defs.h>
+#include <state_snapshot.h>
+#include <setpoint_manager.h>
 #include <rc_pilot_defs.h>
 
 user_input_t user_input; // extern variable in input_manager.h
 
 static pthread_t input_manager_thread;
-static int initialized_flag = 0;
 static arm_state_t kill_switch = DISARMED; // raw kill switch on the radio
 
+/**
+ * steps of the arming sequence, advanced in new_dsm_data_callback()
+ */
+typedef enum arm_seq_t{
+	ARM_SEQ_WAIT_LEVEL,	///< waiting for kill switch ARMED and level frame
+	ARM_SEQ_WAIT_THR_UP,	///< waiting for full throttle
+	ARM_SEQ_WAIT_THR_DOWN	///< waiting for zero throttle
+} arm_seq_t;
+static arm_seq_t arm_seq = ARM_SEQ_WAIT_LEVEL;
+
+// events from the DSM callbacks to the input_manager thread
+#define EVENT_CONNECTED	(1<<0)
+#define EVENT_LOST	(1<<1)
+#define EVENT_ARMED	(1<<2)
+#define EVENT_KILLED	(1<<3)
+#define EVENT_EXIT	(1<<4)
+#define EVENT_LOCKED	(1<<5)
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static int events;
+
 /**
 * float apply_deadzone(float in, float zone)
 *
@@ -41,55 +63,67 @@ static double __deadzone(double in, double zone)
 }
 
 /**
- * @brief      blocking function that returns after arming sequence is complete
+ * @brief      advances the arming sequence by one DSM frame
  *
- * @return     0 if successful or already armed, -1 if exiting or problem
+ *             Called from new_dsm_data_callback() so the sequence reacts to the
+ *             sticks as soon as each frame arrives instead of being polled.
+ *             The pilot has to level the frame, flip the kill switch to ARMED
+ *             then move the throttle all the way up and back down. Dropping
+ *             the kill switch at any point starts the sequence over.
+ *
+ * @param[in]  thr   new throttle stick position
+ *
+ * @return     1 if the sequence just completed, 0 otherwise
  */
-static int __wait_for_arming_sequence()
+static int __step_arming_sequence(double thr)
 {
-	// already armed, just return. Should never do this in normal operation though
-	if(user_input.requested_arm_mode == ARMED) return 0;
-
-ARM_SEQUENCE_START:
-	// wait for feedback controller to have started
-	while(fstate.initialized==0){
-		rc_usleep(100000);
-		if(rc_get_state()==EXITING) return 0;
-	}
-	// wait for level
-	while(fabs(fstate.roll)>ARM_TIP_THRESHOLD||fabs(fstate.pitch)>ARM_TIP_THRESHOLD){
-		rc_usleep(100000);
-		if(rc_get_state()==EXITING) return 0;
-	}
-	// wait for kill switch to be switched to ARMED
-	while(kill_switch==DISARMED){
-		rc_usleep(100000);
-		if(rc_get_state()==EXITING) return 0;
-	}
-	// wait for throttle up
-	while(rc_dsm_ch_normalized(settings.dsm_thr_ch)*settings.dsm_thr_pol < 0.9){
-		rc_usleep(100000);
-		if(rc_get_state()==EXITING) return 0;
-		if(kill_switch==DISARMED) goto ARM_SEQUENCE_START;
-	}
-	// wait for throttle down
-	while(rc_dsm_ch_normalized(settings.dsm_thr_ch)*settings.dsm_thr_pol > -0.9){
-		rc_usleep(100000);
-		if(rc_get_state()==EXITING) return 0;
-		if(kill_switch==DISARMED) goto ARM_SEQUENCE_START;
+	state_snapshot_t snap;
+	int level;
+
+	if(kill_switch==DISARMED){
+		arm_seq = ARM_SEQ_WAIT_LEVEL;
+		return 0;
 	}
+	// feedback controller must have started and be publishing state
+	level = state_snapshot_get(&snap)==0 &&
+		fabs(snap.fstate.roll)<=ARM_TIP_THRESHOLD &&
+		fabs(snap.fstate.pitch)<=ARM_TIP_THRESHOLD;
 
-	// final check of kill switch and level before arming
-	if(kill_switch==DISARMED) goto ARM_SEQUENCE_START;
-	if(fabs(fstate.roll)>ARM_TIP_THRESHOLD||fabs(fstate.pitch)>ARM_TIP_THRESHOLD){
-		goto ARM_SEQUENCE_START;
+	switch(arm_seq){
+	case ARM_SEQ_WAIT_LEVEL:
+		if(level) arm_seq = ARM_SEQ_WAIT_THR_UP;
+		return 0;
+	case ARM_SEQ_WAIT_THR_UP:
+		if(thr>=0.9) arm_seq = ARM_SEQ_WAIT_THR_DOWN;
+		return 0;
+	case ARM_SEQ_WAIT_THR_DOWN:
+		if(thr>-0.9) return 0;
+		// final check of level before arming
+		arm_seq = ARM_SEQ_WAIT_LEVEL;
+		return level;
+	default:
+		arm_seq = ARM_SEQ_WAIT_LEVEL;
+		return 0;
 	}
-	return 0;
+}
+
+
+/**
+ * @brief      hands events to the input_manager thread and wakes it up
+ */
+static void __post_event(int event)
+{
+	pthread_mutex_lock(&event_mutex);
+	events |= event;
+	pthread_cond_signal(&event_cond);
+	pthread_mutex_unlock(&event_mutex);
 }
 
 void new_dsm_data_callback()
 {
 	double new_thr, new_roll, new_pitch, new_yaw, new_mode, new_kill;
+	// arrival of the frame, for the stick to motor latency
+	uint64_t frame_ns = rc_nanos_since_boot();
 
 	// Read normalized (+-1) inputs from RC radio stick and multiply by
 	// polarity setting so positive stick means positive setpoint
@@ -146,6 +180,26 @@ void new_dsm_data_callback()
 		break;
 	}
 
+	// the kill switch disarms immediately, so does a forced disarm the
+	// pilot has to acknowledge with the arming sequence, otherwise step the
+	// arming sequence with this frame
+	if(user_input.requested_arm_mode==ARMED){
+		if(kill_switch==DISARMED){
+			user_input.requested_arm_mode = DISARMED;
+			arm_seq = ARM_SEQ_WAIT_LEVEL;
+			__post_event(EVENT_KILLED);
+		}
+		else if(setpoint_manager_arming_locked()){
+			user_input.requested_arm_mode = DISARMED;
+			arm_seq = ARM_SEQ_WAIT_LEVEL;
+			__post_event(EVENT_LOCKED);
+		}
+	}
+	else if(__step_arming_sequence(new_thr) && rc_get_state()==RUNNING){
+		user_input.requested_arm_mode = ARMED;
+		__post_event(EVENT_ARMED);
+	}
+
 	// fill in sticks
 	if(user_input.requested_arm_mode==ARMED){
 		user_input.thr_stick   = new_thr;
@@ -162,8 +216,11 @@ void new_dsm_data_callback()
 	}
 	if(user_input.input_active==0){
 		user_input.input_active=1; // flag that connection has come back online
-		printf("DSM CONNECTION ESTABLISHED\n");
+		__post_event(EVENT_CONNECTED);
 	}
+	// user_input is only this thread's working copy, the feedback ISR gets
+	// the finished frame in one piece
+	setpoint_manager_input(&user_input, frame_ns);
 	return;
 
 }
@@ -175,34 +232,32 @@ void dsm_disconnect_callback(void)
 	user_input.pitch_stick = 0.0;
 	user_input.yaw_stick = 0.0;
 	user_input.input_active = 0;
-	fprintf(stderr, "LOST DSM CONNECTION\n");
+	setpoint_manager_input(&user_input, rc_nanos_since_boot());
+	__post_event(EVENT_LOST);
 }
 
-void* input_manager(void* ptr)
+void* input_manager(__attribute__ ((unused)) void* ptr)
 {
-	initialized_flag = 1;
-	// wait for first packet
-	while(rc_get_state()!=EXITING){
-		if(user_input.input_active) break;
-		rc_usleep(1000000/INPUT_MANAGER_HZ);
-	}
+	int ev;
 
-	// not much to do since the DSM callbacks to most of it. Later some
-	// logic to handle other inputs such as mavlink/bluetooth/wifi
-	while(rc_get_state()!=EXITING){
-		// if the core got disarmed, wait for arming sequence
-		if(user_input.requested_arm_mode == DISARMED){
-			__wait_for_arming_sequence();
-			// user may have pressed the pause button or shut down while waiting
-			// check before continuing
-			if(rc_get_state()!=RUNNING) continue;
-			else{
-				user_input.requested_arm_mode=ARMED;
-				printf("DSM ARM REQUEST\n");
-			}
-		}
-		// wait
-		rc_usleep(1000000/INPUT_MANAGER_HZ);
+	rt_setup_thread(RT_THREAD_INPUT);
+	user_input.initialized = 1;
+	// arming and disarming happens in the DSM callbacks, this thread only
+	// sleeps until they report something. Later some logic to handle other
+	// inputs such as mavlink/bluetooth/wifi
+	while(1){
+		pthread_mutex_lock(&event_mutex);
+		while(events==0) pthread_cond_wait(&event_cond, &event_mutex);
+		ev = events;
+		events = 0;
+		pthread_mutex_unlock(&event_mutex);
+
+		if(ev & EVENT_EXIT) break;
+		if(ev & EVENT_CONNECTED) printf("DSM CONNECTION ESTABLISHED\n");
+		if(ev & EVENT_LOST) fprintf(stderr, "LOST DSM CONNECTION\n");
+		if(ev & EVENT_KILLED) printf("DSM KILL SWITCH DISARMED\n");
+		if(ev & EVENT_LOCKED) printf("FORCED DISARM, REPEAT ARMING SEQUENCE\n");
+		if(ev & EVENT_ARMED) printf("DSM ARM REQUEST\n");
 	}
 	return NULL;
 }
@@ -217,11 +272,12 @@ int input_manager_init()
 		fprintf(stderr, "ERROR in input_manager_init, failed to initialize dsm\n");
 		return -1;
 	}
+	rc_dsm_set_callback(new_dsm_data_callback);
 	rc_dsm_set_disconnect_callback(dsm_disconnect_callback);
 
 	// start thread
 	if(rc_pthread_create(&input_manager_thread, &input_manager, NULL,
-				SCHED_FIFO, INPUT_MANAGER_PRI)==-1){
+				rt_thread_policy(RT_THREAD_INPUT), rt_thread_priority(RT_THREAD_INPUT))==-1){
 		fprintf(stderr, "ERROR in input_manager_init, failed to start thread\n");
 		return -1;
 	}
@@ -241,7 +297,8 @@ int input_manager_cleanup()
 		fprintf(stderr, "WARNING in input_manager_cleanup, was never initialized\n");
 		return -1;
 	}
-	// wait for the thread to exit
+	// wake the thread so it sees the exit request, then wait for it
+	__post_event(EVENT_EXIT);
 	if(rc_pthread_timed_join(input_manager_thread, NULL, INPUT_MANAGER_TOUT)==1){
 		fprintf(stderr,"WARNING: in input_manager_cleanup, thread join timeout\n");
 		return -1;
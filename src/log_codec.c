@@ -0,0 +1,358 @@
+/**
+ * @file log_codec.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <log_codec.h>
+
+#define VARINT64_MAX	10	// bytes of the longest 64 bit varint
+#define VARINT32_MAX	5
+
+
+static inline size_t __put_varint(unsigned char* out, uint64_t v)
+{
+	size_t n = 0;
+	while(v>=0x80){
+		out[n++] = (unsigned char)(v|0x80);
+		v >>= 7;
+	}
+	out[n++] = (unsigned char)v;
+	return n;
+}
+
+
+/**
+ * @return     bytes consumed, 0 if the varint runs past the end or is too long
+ */
+static inline size_t __get_varint(const unsigned char* in, size_t len, uint64_t* v)
+{
+	size_t n = 0;
+	int shift = 0;
+	uint64_t x = 0;
+	while(n<len && n<VARINT64_MAX){
+		x |= (uint64_t)(in[n]&0x7f) << shift;
+		if(!(in[n++]&0x80)){
+			*v = x;
+			return n;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+
+static inline uint64_t __zigzag64(uint64_t d)
+{
+	return (d<<1) ^ (uint64_t)((int64_t)d>>63);
+}
+
+
+static inline uint64_t __unzigzag64(uint64_t z)
+{
+	return (z>>1) ^ (uint64_t)(-(int64_t)(z&1));
+}
+
+
+static inline uint32_t __zigzag32(uint32_t d)
+{
+	return (d<<1) ^ (uint32_t)((int32_t)d>>31);
+}
+
+
+static inline uint32_t __unzigzag32(uint32_t z)
+{
+	return (z>>1) ^ (uint32_t)(-(int32_t)(z&1));
+}
+
+
+static log_codec_kind_t __kind(const log_field_t* f)
+{
+	if(f->size==8 && strcmp(f->type, "double")==0) return LOG_CODEC_XOR64;
+	if(f->size==4 && strcmp(f->type, "float")==0) return LOG_CODEC_XOR32;
+	if(f->size==8 && (strcmp(f->type, "uint64_t")==0 || strcmp(f->type, "int64_t")==0)){
+		return LOG_CODEC_DELTA64;
+	}
+	if(f->size==4 && (strcmp(f->type, "int")==0 || strcmp(f->type, "uint32_t")==0 ||
+				strcmp(f->type, "int32_t")==0)){
+		return LOG_CODEC_DELTA32;
+	}
+	return LOG_CODEC_RAW;
+}
+
+
+int log_codec_init(log_codec_t* c, const log_field_t* fields, uint32_t num_fields, uint32_t record_size)
+{
+	uint32_t i;
+
+	memset(c, 0, sizeof(*c));
+	c->kind = malloc(num_fields*sizeof(*c->kind));
+	c->offset = malloc(num_fields*sizeof(*c->offset));
+	c->size = malloc(num_fields*sizeof(*c->size));
+	c->prev = calloc(1, record_size);
+	if(c->kind==NULL || c->offset==NULL || c->size==NULL || c->prev==NULL){
+		fprintf(stderr,"ERROR in log_codec_init, out of memory\n");
+		log_codec_free(c);
+		return -1;
+	}
+	c->num_fields = num_fields;
+	c->record_size = record_size;
+	for(i=0;i<num_fields;i++){
+		if(fields[i].offset+fields[i].size > record_size){
+			fprintf(stderr,"ERROR in log_codec_init, field %.*s lies outside the record\n",
+						LOG_FIELD_NAME_LEN, fields[i].name);
+			log_codec_free(c);
+			return -1;
+		}
+		c->kind[i] = __kind(&fields[i]);
+		c->offset[i] = fields[i].offset;
+		c->size[i] = fields[i].size;
+		switch(c->kind[i]){
+		case LOG_CODEC_DELTA64:
+		case LOG_CODEC_XOR64:
+			c->max_encoded += VARINT64_MAX;
+			break;
+		case LOG_CODEC_DELTA32:
+		case LOG_CODEC_XOR32:
+			c->max_encoded += VARINT32_MAX;
+			break;
+		default:
+			c->max_encoded += c->size[i];
+		}
+	}
+	return 0;
+}
+
+
+void log_codec_reset(log_codec_t* c)
+{
+	memset(c->prev, 0, c->record_size);
+}
+
+
+size_t log_codec_encode(log_codec_t* c, const void* rec, unsigned char* out)
+{
+	const unsigned char* r = rec;
+	size_t n = 0;
+	uint64_t a64, b64;
+	uint32_t a32, b32, i;
+
+	for(i=0;i<c->num_fields;i++){
+		switch(c->kind[i]){
+		case LOG_CODEC_DELTA64:
+			memcpy(&a64, r+c->offset[i], 8);
+			memcpy(&b64, c->prev+c->offset[i], 8);
+			n += __put_varint(out+n, __zigzag64(a64-b64));
+			break;
+		case LOG_CODEC_XOR64:
+			memcpy(&a64, r+c->offset[i], 8);
+			memcpy(&b64, c->prev+c->offset[i], 8);
+			n += __put_varint(out+n, a64^b64);
+			break;
+		case LOG_CODEC_DELTA32:
+			memcpy(&a32, r+c->offset[i], 4);
+			memcpy(&b32, c->prev+c->offset[i], 4);
+			n += __put_varint(out+n, __zigzag32(a32-b32));
+			break;
+		case LOG_CODEC_XOR32:
+			memcpy(&a32, r+c->offset[i], 4);
+			memcpy(&b32, c->prev+c->offset[i], 4);
+			n += __put_varint(out+n, a32^b32);
+			break;
+		default:
+			memcpy(out+n, r+c->offset[i], c->size[i]);
+			n += c->size[i];
+		}
+	}
+	memcpy(c->prev, rec, c->record_size);
+	return n;
+}
+
+
+int log_codec_decode(log_codec_t* c, const unsigned char* in, size_t len, void* rec)
+{
+	size_t n = 0, k;
+	uint64_t v, b64;
+	uint32_t b32, i;
+	unsigned char* p = c->prev;
+
+	for(i=0;i<c->num_fields;i++){
+		if(c->kind[i]==LOG_CODEC_RAW){
+			if(len-n < c->size[i]) return -1;
+			memcpy(p+c->offset[i], in+n, c->size[i]);
+			n += c->size[i];
+			continue;
+		}
+		k = __get_varint(in+n, len-n, &v);
+		if(k==0) return -1;
+		n += k;
+		switch(c->kind[i]){
+		case LOG_CODEC_DELTA64:
+			memcpy(&b64, p+c->offset[i], 8);
+			b64 += __unzigzag64(v);
+			memcpy(p+c->offset[i], &b64, 8);
+			break;
+		case LOG_CODEC_XOR64:
+			memcpy(&b64, p+c->offset[i], 8);
+			b64 ^= v;
+			memcpy(p+c->offset[i], &b64, 8);
+			break;
+		case LOG_CODEC_DELTA32:
+			if(v>UINT32_MAX) return -1;
+			memcpy(&b32, p+c->offset[i], 4);
+			b32 += __unzigzag32((uint32_t)v);
+			memcpy(p+c->offset[i], &b32, 4);
+			break;
+		case LOG_CODEC_XOR32:
+			if(v>UINT32_MAX) return -1;
+			memcpy(&b32, p+c->offset[i], 4);
+			b32 ^= (uint32_t)v;
+			memcpy(p+c->offset[i], &b32, 4);
+			break;
+		default:
+			break;
+		}
+	}
+	// padding between fields comes back as whatever was logged first,
+	// zeros in practice
+	memcpy(rec, p, c->record_size);
+	return n;
+}
+
+
+void log_codec_free(log_codec_t* c)
+{
+	free(c->kind);
+	free(c->offset);
+	free(c->size);
+	free(c->prev);
+	memset(c, 0, sizeof(*c));
+}
+
+
+int log_reader_open(log_reader_t* r, FILE* f)
+{
+	uint32_t i;
+
+	memset(r, 0, sizeof(*r));
+	r->f = f;
+	if(fread(&r->header, sizeof(r->header), 1, f)!=1){
+		fprintf(stderr,"ERROR: log file too short for header\n");
+		return -1;
+	}
+	if(strncmp(r->header.magic, LOG_FILE_MAGIC_BLOCKS, sizeof(r->header.magic))==0){
+		r->blocks = 1;
+	}
+	else if(strncmp(r->header.magic, LOG_FILE_MAGIC, sizeof(r->header.magic))!=0){
+		fprintf(stderr,"ERROR: not an rc_pilot binary log\n");
+		return -1;
+	}
+	if(r->header.record_size==0 || r->header.num_fields==0){
+		fprintf(stderr,"ERROR: log header describes an empty record\n");
+		return -1;
+	}
+	r->fields = malloc(r->header.num_fields*sizeof(log_field_t));
+	if(r->fields==NULL){
+		fprintf(stderr,"ERROR: failed to allocate log field table\n");
+		return -1;
+	}
+	if(fread(r->fields, sizeof(log_field_t), r->header.num_fields, f)!=r->header.num_fields){
+		fprintf(stderr,"ERROR: log file too short for field table\n");
+		log_reader_close(r);
+		return -1;
+	}
+	for(i=0;i<r->header.num_fields;i++){
+		r->fields[i].name[LOG_FIELD_NAME_LEN-1] = 0;
+		r->fields[i].type[LOG_FIELD_TYPE_LEN-1] = 0;
+		if(r->fields[i].offset+r->fields[i].size > r->header.record_size){
+			fprintf(stderr,"ERROR: field %s lies outside the record\n", r->fields[i].name);
+			log_reader_close(r);
+			return -1;
+		}
+	}
+	if(r->blocks){
+		r->block = malloc(LOG_BLOCK_SIZE);
+		if(r->block==NULL){
+			fprintf(stderr,"ERROR: failed to allocate log block buffer\n");
+			log_reader_close(r);
+			return -1;
+		}
+		if(log_codec_init(&r->codec, r->fields, r->header.num_fields, r->header.record_size)){
+			log_reader_close(r);
+			return -1;
+		}
+	}
+	if(fseek(f, r->header.header_size, SEEK_SET)){
+		perror("ERROR seeking to first record");
+		log_reader_close(r);
+		return -1;
+	}
+	r->block_start = r->header.header_size;
+	return 0;
+}
+
+
+/**
+ * @brief      reads the block at block_start into the buffer
+ *
+ * @return     1 if a block was read, 0 at the end of the log, -1 on a
+ *             corrupt block
+ */
+static int __read_block(log_reader_t* r)
+{
+	log_block_header_t bh;
+
+	if(fseek(r->f, r->block_start, SEEK_SET)) return 0;
+	if(fread(&bh, sizeof(bh), 1, r->f)!=1) return 0;
+	// zeros past the last block of a preallocated file
+	if(bh.magic==0) return 0;
+	if(bh.magic!=LOG_BLOCK_MAGIC || bh.payload_size > LOG_BLOCK_SIZE-sizeof(bh)){
+		fprintf(stderr,"ERROR: corrupt log block at offset %llu\n",
+					(unsigned long long)r->block_start);
+		return -1;
+	}
+	if(fread(r->block, 1, bh.payload_size, r->f)!=bh.payload_size){
+		fprintf(stderr,"WARNING: log ends in the middle of a block\n");
+		return 0;
+	}
+	r->block_len = bh.payload_size;
+	r->block_pos = 0;
+	r->block_left = bh.num_records;
+	r->block_start += (sizeof(bh)+bh.payload_size+LOG_BLOCK_ALIGN-1) & ~(uint64_t)(LOG_BLOCK_ALIGN-1);
+	log_codec_reset(&r->codec);
+	return 1;
+}
+
+
+int log_reader_next(log_reader_t* r, void* rec)
+{
+	int ret;
+
+	if(!r->blocks) return fread(rec, r->header.record_size, 1, r->f)==1;
+
+	while(r->block_left==0){
+		ret = __read_block(r);
+		if(ret<=0) return ret;
+	}
+	ret = log_codec_decode(&r->codec, r->block+r->block_pos, r->block_len-r->block_pos, rec);
+	if(ret<0){
+		fprintf(stderr,"ERROR: corrupt record in log block\n");
+		return -1;
+	}
+	r->block_pos += ret;
+	r->block_left--;
+	return 1;
+}
+
+
+void log_reader_close(log_reader_t* r)
+{
+	free(r->fields);
+	free(r->block);
+	if(r->blocks) log_codec_free(&r->codec);
+	r->fields = NULL;
+	r->block = NULL;
+}
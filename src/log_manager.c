@@ -0,0 +1,456 @@
+/**
+ * @file log_manager.c
+ */
+
+#define _GNU_SOURCE // for O_DIRECT and fallocate
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h> // for offsetof
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+
+#include <rc_pilot_defs.h>
+#include <thread_defs.h>
+#include <rt_setup.h>
+#include <settings.h>
+#include <log_manager.h>
+#include <log_codec.h>
+
+
+#define MAX_LOG_FILES	500
+#define RING_LEN	4096	// must be a power of 2, 4 seconds at 1kHz
+#define RING_MASK	(RING_LEN-1)
+
+// single-producer/single-consumer ring. head is only ever written by the
+// feedback controller, tail is only ever written by the writer thread.
+static log_entry_t ring[RING_LEN];
+static atomic_uint_fast32_t head;
+static atomic_uint_fast32_t tail;
+static atomic_uint_fast64_t dropped;
+
+/**
+ * where the writer thread is with the log file, only start_log_manager() and
+ * stop_log_manager() move it out of LOG_READY and LOG_ACTIVE
+ */
+typedef enum log_state_t{
+	LOG_NO_FILE,	///< writer is opening the next file
+	LOG_READY,	///< file open with its header, waiting for an arm
+	LOG_ACTIVE,	///< the feedback ISR is filling the ring
+	LOG_CLOSING	///< disarmed, writer flushes and closes the file
+} log_state_t;
+static atomic_int log_state = LOG_NO_FILE;
+static atomic_int writer_exit;	// set by join_log_manager_thread()
+
+static int fd = -1;		// file descriptor for the log file
+static char path[100];		// of the log file, removed again if never armed
+static uint64_t written;	// bytes written to the log file
+static uint64_t allocated;	// bytes preallocated
+static int prealloc_failed;	// 1 once fallocate turned out not to be supported
+
+#define X(type, fmt, name) {#name, #type, offsetof(log_entry_t, name), sizeof(type)},
+static const log_field_t log_fields[] = { LOG_TABLE };
+#undef X
+#define NUM_LOG_FIELDS	(sizeof(log_fields)/sizeof(log_fields[0]))
+
+// compact logs are encoded into one aligned block at a time, which only goes
+// to disk once it is full or the log closes
+static int compact;
+static log_codec_t codec;
+static unsigned char block[LOG_BLOCK_SIZE] __attribute__((aligned(LOG_BLOCK_ALIGN)));
+static uint32_t block_len;	// header and payload bytes in block
+static uint32_t block_records;
+static int thread_running;	// 1 while the writer thread needs joining
+
+// background thread
+static pthread_t pthread;
+
+
+
+int print_entry(log_entry_t entry){
+	#define X(type, fmt, name) printf("%s " fmt "\n", #name, entry.name);
+	LOG_TABLE
+	#undef X
+	printf("\n");
+	return 0;
+}
+
+
+int add_log_entry(const log_entry_t* new_entry){
+	uint_fast32_t h, t;
+
+	if(atomic_load_explicit(&log_state, memory_order_relaxed)!=LOG_ACTIVE){
+		return -1;
+	}
+	h = atomic_load_explicit(&head, memory_order_relaxed);
+	t = atomic_load_explicit(&tail, memory_order_acquire);
+	if(h-t >= RING_LEN){
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+	ring[h & RING_MASK] = *new_entry;
+	// publish the entry only after it has been completely written
+	atomic_store_explicit(&head, h+1, memory_order_release);
+	return 0;
+}
+
+
+uint64_t log_manager_dropped_entries(){
+	return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+
+/**
+ * @brief      write all bytes to the log file, retrying on partial writes
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __write_all(const void* buf, size_t len)
+{
+	const char* p = buf;
+	ssize_t ret;
+	while(len>0){
+		ret = write(fd, p, len);
+		if(ret<0){
+			if(errno==EINTR) continue;
+			perror("ERROR in log_manager write");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+		written += ret;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      preallocates the next log_prealloc_mb of the file once the
+ *             writes get close to the end of what is already allocated, so the
+ *             filesystem doesn't have to find room on every write
+ *
+ *             The file size is left alone, so after a crash or power cut the
+ *             file ends at the last record written instead of in zeros the
+ *             readers would take for records. Only ever called on the
+ *             writer thread, the first step when the file is opened.
+ */
+static void __prealloc(uint64_t need)
+{
+	uint64_t step = (uint64_t)settings.log_prealloc_mb<<20;
+
+	if(step==0 || prealloc_failed) return;
+	if(allocated>0 && written+need<=allocated) return;
+	// not posix_fallocate, that falls back to writing zeros
+	if(fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, step)){
+		// keep logging on filesystems without support, just don't retry
+		fprintf(stderr,"WARNING: log preallocation failed: %s\n", strerror(errno));
+		prealloc_failed = 1;
+		return;
+	}
+	allocated += step;
+}
+
+
+/**
+ * @brief      pads the current block to LOG_BLOCK_ALIGN, writes it and starts
+ *             a new one
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __flush_block()
+{
+	log_block_header_t bh;
+	uint32_t len;
+
+	if(block_records==0) return 0;
+	bh.magic = LOG_BLOCK_MAGIC;
+	bh.num_records = block_records;
+	bh.payload_size = block_len-sizeof(bh);
+	bh.reserved = 0;
+	memcpy(block, &bh, sizeof(bh));
+	len = (block_len+LOG_BLOCK_ALIGN-1) & ~(LOG_BLOCK_ALIGN-1);
+	memset(block+block_len, 0, len-block_len);
+	__prealloc(len);
+	block_len = sizeof(bh);
+	block_records = 0;
+	log_codec_reset(&codec);
+	return __write_all(block, len);
+}
+
+
+/**
+ * @brief      writes every entry currently in the ring to disk as at most two
+ *             contiguous chunks, then hands the space back to the producer.
+ *             For a compact log the entries are encoded into the block buffer
+ *             instead and only full blocks are written.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __drain_ring()
+{
+	uint_fast32_t h, t, n, idx, first;
+
+	t = atomic_load_explicit(&tail, memory_order_relaxed);
+	h = atomic_load_explicit(&head, memory_order_acquire);
+	n = h-t;
+	if(n==0) return 0;
+
+	if(compact){
+		for(; t!=h; t++){
+			if(block_len+codec.max_encoded > LOG_BLOCK_SIZE && __flush_block()){
+				atomic_store_explicit(&tail, t, memory_order_release);
+				return -1;
+			}
+			block_len += log_codec_encode(&codec, &ring[t & RING_MASK], block+block_len);
+			block_records++;
+		}
+		atomic_store_explicit(&tail, h, memory_order_release);
+		return 0;
+	}
+
+	__prealloc(n*sizeof(log_entry_t));
+	idx = t & RING_MASK;
+	first = RING_LEN-idx;
+	if(first>n) first = n;
+	if(__write_all(&ring[idx], first*sizeof(log_entry_t))) return -1;
+	if(n>first){
+		if(__write_all(&ring[0], (n-first)*sizeof(log_entry_t))) return -1;
+	}
+	atomic_store_explicit(&tail, h, memory_order_release);
+	return 0;
+}
+
+
+/**
+ * @brief      writes the file header and field table. For a compact log they
+ *             are padded to LOG_BLOCK_ALIGN in the block buffer so the blocks
+ *             after them stay aligned.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __write_header()
+{
+	log_file_header_t header;
+	uint32_t len = sizeof(header) + sizeof(log_fields);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, compact ? LOG_FILE_MAGIC_BLOCKS : LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC));
+	header.version = LOG_FILE_VERSION;
+	header.num_fields = NUM_LOG_FIELDS;
+	header.header_size = len;
+	header.record_size = sizeof(log_entry_t);
+
+	if(!compact){
+		if(__write_all(&header, sizeof(header))) return -1;
+		if(__write_all(log_fields, sizeof(log_fields))) return -1;
+		return 0;
+	}
+	len = (len+LOG_BLOCK_ALIGN-1) & ~(LOG_BLOCK_ALIGN-1);
+	header.header_size = len;
+	memset(block, 0, len);
+	memcpy(block, &header, sizeof(header));
+	memcpy(block+sizeof(header), log_fields, sizeof(log_fields));
+	if(__write_all(block, len)) return -1;
+	block_len = sizeof(log_block_header_t);
+	block_records = 0;
+	return 0;
+}
+
+
+/**
+ * @brief      Opens the next log file in the series and writes its header,
+ *             so arming only has to flip log_state. Runs on the writer
+ *             thread, never in the feedback ISR.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __open_next_file()
+{
+	int i;
+	struct stat st = {0};
+
+	// first make sure the directory exists, make it if not
+	if (stat(LOG_DIR, &st) == -1) {
+		mkdir(LOG_DIR, 0755);
+	}
+
+	// search for existing log files to determine the next number in the series
+	for(i=1;i<=MAX_LOG_FILES+1;i++){
+		memset(&path, 0, sizeof(path));
+		sprintf(path, LOG_DIR "%d.bin", i);
+		// if file exists, move onto the next index
+		if(stat(path, &st)==0) continue;
+		else break;
+	}
+	// limit number of log files
+	if(i==MAX_LOG_FILES+1){
+		printf("ERROR: log file limit exceeded\n");
+		printf("delete old log files before continuing\n");
+		return -1;
+	}
+	// create and open new file for writing. Compact logs only ever write
+	// whole aligned blocks so they can bypass the page cache, not every
+	// filesystem supports that though.
+	fd = -1;
+	if(compact && settings.log_direct_io){
+		fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0644);
+		if(fd == -1) fprintf(stderr,"WARNING: O_DIRECT not supported for logs, using buffered writes\n");
+	}
+	if(fd == -1) fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd == -1) {
+		printf("ERROR: can't open log file for writing\n");
+		return -1;
+	}
+	written = 0;
+	allocated = 0;
+	prealloc_failed = 0;
+	if(compact) log_codec_reset(&codec);
+	__prealloc(0);
+	if(__write_header()){
+		close(fd);
+		fd = -1;
+		unlink(path);
+		return -1;
+	}
+	// an entry the ISR pushed just as the last log was stopped belongs to
+	// neither file, we own the tail so drop it
+	atomic_store_explicit(&tail, atomic_load_explicit(&head, memory_order_acquire),
+							memory_order_release);
+	return 0;
+}
+
+
+/**
+ * @brief      writes out what is left in the ring, trims the preallocation
+ *             and closes the file. A file that was never armed is removed so
+ *             every log on disk has a flight in it.
+ */
+static void __close_file(int armed)
+{
+	if(fd == -1) return;
+	if(armed){
+		__drain_ring();
+		if(compact) __flush_block();
+		if(log_manager_dropped_entries()){
+			fprintf(stderr,"WARNING: log_manager dropped %" PRIu64 " entries\n",
+							log_manager_dropped_entries());
+		}
+	}
+	// give back what was preallocated but never written
+	if(allocated>written && ftruncate(fd, written)){
+		perror("WARNING: failed to truncate log file");
+	}
+	fsync(fd);
+	close(fd);
+	fd = -1;
+	if(!armed) unlink(path);
+}
+
+
+static void* __log_manager_func(__attribute__ ((unused)) void* ptr){
+	rt_setup_thread(RT_THREAD_LOG);
+
+	// keep a file open and waiting between flights, stream the ring to disk
+	// while armed
+	while(rc_get_state()!=EXITING && !atomic_load(&writer_exit)){
+		switch(atomic_load(&log_state)){
+		case LOG_NO_FILE:
+			if(__open_next_file()){
+				fprintf(stderr,"ERROR: log_manager has no log file, not logging\n");
+				return NULL;
+			}
+			atomic_store(&log_state, LOG_READY);
+			break;
+		case LOG_ACTIVE:
+			__drain_ring();
+			break;
+		case LOG_CLOSING:
+			__close_file(1);
+			atomic_store(&log_state, LOG_NO_FILE);
+			continue;
+		default:
+			break;
+		}
+		rc_usleep(1000000/LOG_MANAGER_HZ);
+	}
+
+	// if program is exiting write out the rest of a log in use. The exchange
+	// stops a racing start_log_manager() from arming a file being closed.
+	switch(atomic_exchange(&log_state, LOG_NO_FILE)){
+	case LOG_ACTIVE:
+	case LOG_CLOSING:
+		__close_file(1);
+		break;
+	default:
+		__close_file(0);
+		break;
+	}
+	return NULL;
+}
+
+
+int log_manager_init(){
+	if(thread_running){
+		fprintf(stderr,"ERROR: in log_manager_init, log manager already running.\n");
+		return -1;
+	}
+	// the codec allocates, so once here and only reset for every file
+	compact = settings.log_compact;
+	if(compact && log_codec_init(&codec, log_fields, NUM_LOG_FIELDS, sizeof(log_entry_t))){
+		return -1;
+	}
+	atomic_store(&writer_exit, 0);
+	atomic_store(&log_state, LOG_NO_FILE);
+
+	// start logging thread, it opens the first file right away
+	if(rc_pthread_create(&pthread, __log_manager_func, NULL, rt_thread_policy(RT_THREAD_LOG), rt_thread_priority(RT_THREAD_LOG))<0){
+		fprintf(stderr,"ERROR in log_manager_init, failed to start thread\n");
+		if(compact) log_codec_free(&codec);
+		return -1;
+	}
+	thread_running = 1;
+	return 0;
+}
+
+
+int start_log_manager(){
+	int expected = LOG_READY;
+
+	atomic_store(&dropped, 0);
+	if(!atomic_compare_exchange_strong(&log_state, &expected, LOG_ACTIVE)) return -1;
+	return 0;
+}
+
+
+int stop_log_manager(){
+	int expected = LOG_ACTIVE;
+
+	if(!atomic_compare_exchange_strong(&log_state, &expected, LOG_CLOSING)) return -1;
+	return 0;
+}
+
+
+int join_log_manager_thread(){
+	int ret;
+
+	if(!thread_running) return 0;
+	// thread also exits on rc_get_state()==EXITING
+	atomic_store(&writer_exit, 1);
+
+	ret = rc_pthread_timed_join(pthread,NULL,LOG_MANAGER_TOUT);
+	if(ret==1) fprintf(stderr,"WARNING: log_manager_thread exit timeout\n");
+	else if(ret==-1) fprintf(stderr,"ERROR: failed to joing log_manager thread\n");
+	// the writer may still use the codec if it didn't exit
+	else if(compact) log_codec_free(&codec);
+	thread_running = 0;
+	return ret;
+}
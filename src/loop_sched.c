@@ -0,0 +1,52 @@
+/**
+ * @file loop_sched.c
+ */
+
+#include <stdio.h>
+
+#include <loop_sched.h>
+
+
+static int __gcd(int a, int b)
+{
+	int t;
+	while(b!=0){
+		t = a%b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+
+int loop_sched_init(loop_task_t* tasks, int n)
+{
+	int i, j, p, shared, best, best_shared;
+
+	for(i=0;i<n;i++){
+		if(tasks[i].divisor<1){
+			fprintf(stderr,"ERROR in loop_sched_init, divisor of %s must be at least 1\n", tasks[i].name);
+			return -1;
+		}
+		// candidate phases are 0 to divisor-1, pick the one that collides
+		// with the fewest tasks already placed, earliest wins a tie
+		best = 0;
+		best_shared = n+1;
+		for(p=0;p<tasks[i].divisor;p++){
+			shared = 0;
+			for(j=0;j<i;j++){
+				if((p-tasks[j].phase)%__gcd(tasks[i].divisor, tasks[j].divisor)==0){
+					shared++;
+				}
+			}
+			if(shared<best_shared){
+				best = p;
+				best_shared = shared;
+			}
+		}
+		tasks[i].phase = best;
+		tasks[i].countdown = best;
+		tasks[i].due = 0;
+	}
+	return 0;
+}
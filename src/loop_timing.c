@@ -0,0 +1,148 @@
+/**
+ * @file loop_timing.c
+ */
+
+#include <stdio.h>
+#include <string.h> // for memset
+#include <float.h> // for DBL_MAX
+
+#include <loop_timing.h>
+
+/**
+ * running accumulator for one tracked quantity within the current window
+ */
+typedef struct stat_acc_t{
+	double min_us;
+	double max_us;
+	double sum_us;
+	int n;		// samples so far in the window
+	loop_hist_t hist;
+} stat_acc_t;
+
+static stat_acc_t acc[LOOP_NUM_STATS];
+static int window_len;		// loops per window
+static int window_count;	// loops so far in current window
+static uint64_t last_entry_ns;	// ISR entry of the previous loop
+
+
+static void __acc_reset(stat_acc_t* a)
+{
+	a->min_us = DBL_MAX;
+	a->max_us = 0.0;
+	a->sum_us = 0.0;
+	a->n = 0;
+	memset(a->hist.bins, 0, sizeof(a->hist.bins));
+}
+
+
+static void __acc_add(stat_acc_t* a, double us)
+{
+	int bin;
+	if(us<a->min_us) a->min_us = us;
+	if(us>a->max_us) a->max_us = us;
+	a->sum_us += us;
+	a->n++;
+	bin = (int)((us - a->hist.origin_us)/a->hist.bin_us);
+	if(bin<0) bin = 0;
+	else if(bin>=LOOP_TIMING_HIST_BINS) bin = LOOP_TIMING_HIST_BINS-1;
+	a->hist.bins[bin]++;
+}
+
+
+static void __acc_publish(stat_acc_t* a, loop_stat_summary_t* s)
+{
+	int i;
+	int n = a->n;
+	uint32_t sum = 0;
+	uint32_t target = n - n/100; // 99th percentile sample
+
+	if(n==0){
+		memset(s, 0, sizeof(loop_stat_summary_t));
+		return;
+	}
+	s->min_us = a->min_us;
+	s->max_us = a->max_us;
+	s->mean_us = a->sum_us/n;
+	// report the upper edge of the bin containing the p99 sample
+	for(i=0;i<LOOP_TIMING_HIST_BINS;i++){
+		sum += a->hist.bins[i];
+		if(sum>=target) break;
+	}
+	if(i==LOOP_TIMING_HIST_BINS) i--;
+	s->p99_us = a->hist.origin_us + (i+1)*a->hist.bin_us;
+	if(s->p99_us>s->max_us) s->p99_us = s->max_us;
+}
+
+
+int loop_timing_init(loop_timing_t* t, int feedback_hz)
+{
+	int i;
+
+	if(feedback_hz<=0){
+		fprintf(stderr,"ERROR in loop_timing_init, feedback_hz must be positive\n");
+		return -1;
+	}
+	memset(t, 0, sizeof(loop_timing_t));
+	t->period_us = 1000000.0/feedback_hz;
+	window_len = feedback_hz;
+	window_count = 0;
+	last_entry_ns = 0;
+
+	for(i=0;i<LOOP_NUM_STATS;i++){
+		acc[i].hist.origin_us = 0.0;
+		acc[i].hist.bin_us = LOOP_TIMING_STAGE_BIN_US;
+		__acc_reset(&acc[i]);
+	}
+	// center the interval histogram on the nominal period
+	acc[LOOP_STAT_INTERVAL].hist.bin_us = LOOP_TIMING_JITTER_BIN_US;
+	acc[LOOP_STAT_INTERVAL].hist.origin_us = t->period_us -
+			(LOOP_TIMING_HIST_BINS/2)*LOOP_TIMING_JITTER_BIN_US;
+	t->jitter = acc[LOOP_STAT_INTERVAL].hist;
+	// frames wait for the next loop so the latency spans a whole period
+	acc[LOOP_STAT_INPUT].hist.bin_us = LOOP_TIMING_INPUT_BIN_US;
+	return 0;
+}
+
+
+void loop_timing_update(loop_timing_t* t)
+{
+	int i;
+	double total, interval;
+
+	__acc_add(&acc[LOOP_STAT_SETPOINT], (t->setpoint_done_ns - t->isr_entry_ns)/1000.0);
+	__acc_add(&acc[LOOP_STAT_ESTIMATE], (t->estimate_done_ns - t->setpoint_done_ns)/1000.0);
+	__acc_add(&acc[LOOP_STAT_CONTROL], (t->esc_done_ns - t->estimate_done_ns)/1000.0);
+	total = (t->esc_done_ns - t->isr_entry_ns)/1000.0;
+	__acc_add(&acc[LOOP_STAT_TOTAL], total);
+	if(total>t->period_us) t->overruns++;
+
+	// interval needs a previous loop so the first loop only records its entry
+	if(last_entry_ns!=0){
+		interval = (t->isr_entry_ns - last_entry_ns)/1000.0;
+		__acc_add(&acc[LOOP_STAT_INTERVAL], interval);
+		if(interval>1.5*t->period_us) t->late_callbacks++;
+	}
+	else{
+		// keep the interval count in step with the other stats
+		__acc_add(&acc[LOOP_STAT_INTERVAL], t->period_us);
+	}
+	last_entry_ns = t->isr_entry_ns;
+
+	if(t->input_ns!=0){
+		__acc_add(&acc[LOOP_STAT_INPUT], (t->esc_done_ns - t->input_ns)/1000.0);
+		t->input_ns = 0;
+	}
+
+	window_count++;
+	if(window_count<window_len) return;
+
+	// window complete, publish and start over
+	for(i=0;i<LOOP_NUM_STATS;i++){
+		__acc_publish(&acc[i], &t->stats[i]);
+	}
+	t->jitter = acc[LOOP_STAT_INTERVAL].hist;
+	t->windows++;
+	for(i=0;i<LOOP_NUM_STATS;i++) __acc_reset(&acc[i]);
+	window_count = 0;
+	return;
+}
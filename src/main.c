@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
 
 #include <rc/start_stop.h>
 #include <rc/adc.h>
@@ -22,6 +23,16 @@
 #include <mix.h>
 #include <input_manager.h>
 #include <setpoint_manager.h>
+#include <log_manager.h>
+#include <printf_manager.h>
+#include <battery_manager.h>
+#include <esc_output.h>
+#include <pru_esc.h>
+#include <mavlink_manager.h>
+#include <altitude_manager.h>
+#include <rt_setup.h>
+#include <shm_export.h>
+#include <watchdog.h>
 
 
 #define FAIL(str) \
@@ -30,6 +41,14 @@ rc_led_set(RC_LED_GREEN,0); \
 rc_led_blink(RC_LED_RED,4.0,2.0); \
 return -1;
 
+// set by SIGUSR1, main loop reloads the controllers from the settings file
+static volatile sig_atomic_t reload_requested = 0;
+
+
+static void __reload_signal_handler(__attribute__ ((unused)) int signo)
+{
+	reload_requested = 1;
+}
 
 
 /**
@@ -98,9 +117,14 @@ int main()
 	}
 	printf("Loaded settings\n");
 
+	// lock memory and prefault before anything real-time starts, failure
+	// is reported below but isn't fatal so the program still runs as a
+	// normal user on the bench
+	rt_setup_process();
+
 	// do initialization not involving threads
 	printf("initializing thrust map\n");
-	if(thrust_map_init()<0){
+	if(thrust_map_init(settings.thrust_map)<0){
 		fprintf(stderr,"ERROR: failed to initialize thrust map\n");
 		return -1;
 	}
@@ -118,8 +142,28 @@ int main()
 	// initialize cape hardware, this prints an error itself if unsuccessful
 	printf("initializing servos\n");
 	if(rc_servo_init()==-1) return -1;
+	if(esc_output_init(settings.esc_protocol)<0){
+		fprintf(stderr,"ERROR: failed to initialize esc output\n");
+		return -1;
+	}
+	// after the mixer and thrust map, it takes a copy of their tables
+	if(settings.enable_pru_esc){
+		printf("initializing pru_esc\n");
+		// commands come once per FIFO read
+		if(pru_esc_init(mix_default_mixer(), thrust_map_default_curve(),
+				settings.esc_protocol, settings.feedback_hz/settings.imu_fifo_batch,
+				settings.watchdog_stall_ms)<0){
+			fprintf(stderr,"ERROR: failed to initialize pru_esc\n");
+			return -1;
+		}
+	}
 	printf("initializing adc\n");
 	if(rc_adc_init()==-1) return -1;
+	printf("initializing battery_manager\n");
+	if(battery_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to initialize battery_manager\n");
+		return -1;
+	}
 
 	// start signal handler so threads can exit cleanly
 	printf("initializing signal handler\n");
@@ -127,8 +171,23 @@ int main()
 		fprintf(stderr,"ERROR: failed to complete rc_enable_signal_handler\n");
 		return -1;
 	}
+	// kill -USR1 reloads the controller gains without disarming. No
+	// SA_RESTART so the sleep in the main loop wakes up right away
+	struct sigaction reload_action;
+	reload_action.sa_handler = __reload_signal_handler;
+	reload_action.sa_flags = 0;
+	sigemptyset(&reload_action.sa_mask);
+	if(sigaction(SIGUSR1, &reload_action, NULL)){
+		fprintf(stderr,"ERROR: failed to install SIGUSR1 handler\n");
+		return -1;
+	}
 
 	// start threads
+	printf("starting battery_manager\n");
+	if(battery_manager_start()<0){
+		fprintf(stderr,"ERROR: failed to start battery_manager\n");
+		return -1;
+	}
 	printf("initializing DSM and input_manager\n");
 	if(input_manager_init()<0){
 		printf("ERROR: failed to initialize input_manager\n");
@@ -145,20 +204,79 @@ int main()
 	// Assign functions to be called when button events occur
 	rc_button_set_callbacks(RC_BTN_PIN_PAUSE,on_pause_press,NULL);
 
+	// barometer needs the bus to itself for calibration, start it before
+	// the IMU interrupt
+	if(settings.enable_baro){
+		printf("initializing altitude_manager\n");
+		if(altitude_manager_init()<0){
+			FAIL("ERROR: failed to initialize altitude_manager\n")
+		}
+	}
+
+	// other processes can map the state once the ISR starts publishing
+	if(settings.enable_shm_export){
+		printf("initializing shm_export\n");
+		if(shm_export_init()<0){
+			fprintf(stderr,"ERROR: failed to initialize shm_export\n");
+		}
+	}
+
+	// the deadline check runs from the first loop of the ISR
+	if(settings.enable_watchdog){
+		printf("initializing watchdog\n");
+		if(watchdog_init()<0){
+			fprintf(stderr,"ERROR: failed to initialize watchdog\n");
+			return -1;
+		}
+	}
+
+	// the writer opens the first log file now so arming in the ISR only has
+	// to flip a flag
+	if(settings.enable_logging){
+		printf("initializing log_manager\n");
+		if(log_manager_init()<0){
+			fprintf(stderr,"ERROR: failed to initialize log_manager\n");
+			return -1;
+		}
+	}
+
 	// set up feedback controller
 	printf("initializing feedback controller\n");
 	feedback_init();
 
+	if(settings.enable_watchdog){
+		printf("starting watchdog\n");
+		if(watchdog_start()<0){
+			fprintf(stderr,"ERROR: failed to start watchdog\n");
+			return -1;
+		}
+	}
+
+	// telemetry reads the state snapshots the feedback ISR publishes
+	if(settings.enable_telemetry || settings.enable_mocap){
+		printf("starting mavlink_manager\n");
+		if(start_mavlink_manager()<0){
+			fprintf(stderr,"ERROR: failed to start mavlink_manager\n");
+		}
+	}
+
+	// report the real-time setup once the IMU interrupt thread has had a
+	// chance to run, including the log writer
+	rc_usleep(100000);
+	rt_setup_report();
 
 	// print header before starting printf thread
 	printf("\nTurn your transmitter kill switch to arm.\n");
 	printf("Then move throttle UP then DOWN to arm controller\n");
 
-	// // start printf_thread if running from a terminal
-	// // if it was started as a background process then don't bother
-	// if(isatty(fileno(stdout))){
-	// 	start_printf_manager(&cstate, &setpoint, &user_input, &settings);
-	// }
+	// start printf_thread if running from a terminal
+	// if it was started as a background process then don't bother
+	if(isatty(fileno(stdout))){
+		printf("initializing printf manager\n");
+		if(printf_init()<0){
+			fprintf(stderr,"ERROR: failed to initialize printf_manager\n");
+		}
+	}
 
 	// final setup
 	rc_make_pid_file();
@@ -166,12 +284,25 @@ int main()
 	rc_set_state(RUNNING);
 	while(rc_get_state()!=EXITING){
 		usleep(500000);
+		if(reload_requested){
+			reload_requested = 0;
+			feedback_reload_controllers();
+		}
 	}
 
+	printf_cleanup();
 	printf("cleaning up\n");
+	// join the watchdog first so it doesn't take the ISR stopping for a stall
+	watchdog_cleanup();
 	feedback_cleanup();
+	pru_esc_cleanup();
+	join_log_manager_thread();
 	setpoint_manager_cleanup();
 	input_manager_cleanup();
+	battery_manager_cleanup();
+	cleanup_mavlink_manager();
+	altitude_manager_cleanup();
+	shm_export_cleanup();
 	return 0;
 }
 
@@ -0,0 +1,346 @@
+/**
+ * @file mavlink_manager.c
+ *
+ * Streams telemetry to a ground station over UDP. Each message is packed from
+ * the latest state snapshot into a preallocated buffer, and everything due in
+ * one tick goes out in a single datagram. The thread runs SCHED_OTHER so
+ * ground station traffic never competes with the feedback ISR.
+ *
+ * A second thread listens on mocap_port for ATT_POS_MOCAP messages and hands
+ * them to the feedback ISR through the mocap mailbox. It runs SCHED_FIFO and
+ * stamps each datagram as soon as it arrives to keep the latency estimate
+ * tight.
+ *
+ * @author Jae
+ * @date 2/5/2018
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> // for memset
+#include <unistd.h> // for close
+#include <sys/socket.h>
+#include <sys/time.h> // for struct timeval
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <rc/mavlink_udp.h>
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+
+#include <mavlink_manager.h>
+#include <mocap.h>
+#include <state_snapshot.h>
+#include <settings.h>
+#include <thread_defs.h>
+#include <watchdog.h>
+
+#define MAV_COMP_ID		MAV_COMP_ID_AUTOPILOT1
+#define MAV_MAX_MOTORS		8
+#define MAV_BUF_LEN		(MAVLINK_MAX_PACKET_LEN*MAV_NUM_MSGS)
+#define MAV_RX_BUF_LEN		2048
+#define MAV_RX_TIMEOUT_US	100000	// how often the rx thread checks for exit
+
+/**
+ * messages the manager streams, each with its own rate from the settings
+ */
+typedef enum mav_stream_t{
+	MAV_HEARTBEAT,
+	MAV_ATTITUDE,
+	MAV_MOTORS,
+	MAV_BATTERY,
+	MAV_NUM_MSGS
+} mav_stream_t;
+
+typedef struct mav_schedule_t{
+	uint64_t period_ns;	///< 0 if the message is disabled
+	uint64_t next_ns;	///< time since boot the message is due next
+} mav_schedule_t;
+
+static pthread_t pthread;
+static int initialized = 0;
+static int sock = -1;
+static struct sockaddr_in dest;
+static mav_schedule_t schedule[MAV_NUM_MSGS];
+static mavlink_message_t msg;
+static uint8_t buf[MAV_BUF_LEN];
+static size_t buf_len;
+static unsigned long send_errors;
+
+static pthread_t rx_pthread;
+static int rx_running = 0;
+static int rx_sock = -1;
+static uint8_t rx_buf[MAV_RX_BUF_LEN];
+static mavlink_message_t rx_msg;
+static mavlink_status_t rx_status;
+
+
+static uint8_t __mav_type()
+{
+	switch(settings.num_rotors){
+	case 4:
+		return MAV_TYPE_QUADROTOR;
+	case 6:
+		return MAV_TYPE_HEXAROTOR;
+	case 8:
+		return MAV_TYPE_OCTOROTOR;
+	default:
+		return MAV_TYPE_GENERIC;
+	}
+}
+
+
+/**
+ * @brief      packs one message from the snapshot and appends it to the
+ *             datagram buffer
+ */
+static void __pack(mav_stream_t id, const state_snapshot_t* snap)
+{
+	mavlink_heartbeat_t hb;
+	mavlink_attitude_t att;
+	mavlink_servo_output_raw_t servo;
+	mavlink_sys_status_t sys;
+	uint16_t us[MAV_MAX_MOTORS];
+	uint8_t sys_id = settings.telemetry_sys_id;
+	int i;
+
+	switch(id){
+	case MAV_HEARTBEAT:
+		memset(&hb, 0, sizeof(hb));
+		hb.type = __mav_type();
+		hb.autopilot = MAV_AUTOPILOT_GENERIC;
+		hb.base_mode = MAV_MODE_FLAG_CUSTOM_MODE_ENABLED;
+		if(snap->fstate.arm_state==ARMED) hb.base_mode |= MAV_MODE_FLAG_SAFETY_ARMED;
+		hb.custom_mode = snap->user_input.flight_mode;
+		hb.system_status = snap->fstate.arm_state==ARMED ? MAV_STATE_ACTIVE : MAV_STATE_STANDBY;
+		mavlink_msg_heartbeat_encode(sys_id, MAV_COMP_ID, &msg, &hb);
+		break;
+	case MAV_ATTITUDE:
+		memset(&att, 0, sizeof(att));
+		att.time_boot_ms = snap->time_ns/1000000;
+		att.roll = snap->fstate.roll;
+		att.pitch = snap->fstate.pitch;
+		att.yaw = snap->fstate.yaw;
+		mavlink_msg_attitude_encode(sys_id, MAV_COMP_ID, &msg, &att);
+		break;
+	case MAV_MOTORS:
+		// motor signals as the equivalent 1000-2000us PWM pulse
+		for(i=0;i<MAV_MAX_MOTORS;i++){
+			us[i] = (i<settings.num_rotors) ? 1000 + 1000*snap->fstate.m[i] : 0;
+		}
+		memset(&servo, 0, sizeof(servo));
+		servo.time_usec = snap->time_ns/1000;
+		servo.servo1_raw = us[0];
+		servo.servo2_raw = us[1];
+		servo.servo3_raw = us[2];
+		servo.servo4_raw = us[3];
+		servo.servo5_raw = us[4];
+		servo.servo6_raw = us[5];
+		servo.servo7_raw = us[6];
+		servo.servo8_raw = us[7];
+		mavlink_msg_servo_output_raw_encode(sys_id, MAV_COMP_ID, &msg, &servo);
+		break;
+	case MAV_BATTERY:
+		memset(&sys, 0, sizeof(sys));
+		sys.voltage_battery = snap->fstate.v_batt*1000.0;
+		sys.current_battery = -1;	// not measured
+		sys.battery_remaining = -1;
+		mavlink_msg_sys_status_encode(sys_id, MAV_COMP_ID, &msg, &sys);
+		break;
+	default:
+		return;
+	}
+	buf_len += mavlink_msg_to_send_buffer(buf+buf_len, &msg);
+}
+
+
+static void __set_rate(mav_stream_t id, int hz, uint64_t now)
+{
+	schedule[id].period_ns = hz>0 ? 1000000000ULL/hz : 0;
+	schedule[id].next_ns = now;
+}
+
+
+static void* __mavlink_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	state_snapshot_t snap;
+	uint64_t now;
+	int i;
+
+	rt_setup_thread(RT_THREAD_TELEMETRY);
+	while(rc_get_state()!=EXITING){
+		now = rc_nanos_since_boot();
+		buf_len = 0;
+		// nothing to report until the ISR has published once
+		if(state_snapshot_get(&snap)==0){
+			for(i=0;i<MAV_NUM_MSGS;i++){
+				if(schedule[i].period_ns==0 || now<schedule[i].next_ns) continue;
+				// under load only the heartbeat keeps the link alive
+				if(i!=MAV_HEARTBEAT && watchdog_shed(WATCHDOG_SHED_TELEMETRY)){
+					schedule[i].next_ns = now + schedule[i].period_ns;
+					continue;
+				}
+				__pack(i, &snap);
+				schedule[i].next_ns += schedule[i].period_ns;
+				// don't try to catch up after a stall, just resume the rate
+				if(schedule[i].next_ns<now) schedule[i].next_ns = now + schedule[i].period_ns;
+			}
+		}
+		if(buf_len>0){
+			if(sendto(sock, buf, buf_len, MSG_DONTWAIT, (struct sockaddr*)&dest, sizeof(dest))<0){
+				send_errors++;
+			}
+		}
+		rc_usleep(1000000/MAVLINK_MANAGER_HZ);
+	}
+	return NULL;
+}
+
+
+static void __handle_mocap(const mavlink_message_t* m, uint64_t rx_ns)
+{
+	mavlink_att_pos_mocap_t mc;
+	double pos[3], q[4];
+	uint64_t latency_ns = (uint64_t)settings.mocap_latency_ms*1000000ULL;
+	int i;
+
+	mavlink_msg_att_pos_mocap_decode(m, &mc);
+	pos[0] = mc.x;
+	pos[1] = mc.y;
+	pos[2] = mc.z;
+	for(i=0;i<4;i++) q[i] = mc.q[i];
+	mocap_publish(rx_ns>latency_ns ? rx_ns-latency_ns : 0, pos, q);
+}
+
+
+static void* __mavlink_rx_func(__attribute__ ((unused)) void* ptr)
+{
+	ssize_t n, i;
+	uint64_t rx_ns;
+
+	rt_setup_thread(RT_THREAD_MOCAP);
+	while(rc_get_state()!=EXITING){
+		// times out every MAV_RX_TIMEOUT_US so the exit check runs
+		n = recv(rx_sock, rx_buf, sizeof(rx_buf), 0);
+		if(n<=0) continue;
+		rx_ns = rc_nanos_since_boot();
+		for(i=0;i<n;i++){
+			if(mavlink_parse_char(MAVLINK_COMM_0, rx_buf[i], &rx_msg, &rx_status)==0) continue;
+			if(rx_msg.msgid==MAVLINK_MSG_ID_ATT_POS_MOCAP) __handle_mocap(&rx_msg, rx_ns);
+		}
+	}
+	return NULL;
+}
+
+
+static int __start_rx()
+{
+	struct sockaddr_in addr;
+	struct timeval tv;
+
+	rx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(rx_sock<0){
+		perror("ERROR in start_mavlink_manager, failed to open mocap socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(settings.mocap_port);
+	tv.tv_sec = 0;
+	tv.tv_usec = MAV_RX_TIMEOUT_US;
+	if(setsockopt(rx_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))<0 ||
+			bind(rx_sock, (struct sockaddr*)&addr, sizeof(addr))<0){
+		perror("ERROR in start_mavlink_manager, failed to bind mocap_port");
+		close(rx_sock);
+		rx_sock = -1;
+		return -1;
+	}
+	mocap_init();
+	if(rc_pthread_create(&rx_pthread, __mavlink_rx_func, NULL, rt_thread_policy(RT_THREAD_MOCAP), rt_thread_priority(RT_THREAD_MOCAP))<0){
+		fprintf(stderr,"ERROR in start_mavlink_manager, failed to start rx thread\n");
+		close(rx_sock);
+		rx_sock = -1;
+		return -1;
+	}
+	rx_running = 1;
+	return 0;
+}
+
+
+static int __start_tx()
+{
+	uint64_t now;
+
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(settings.telemetry_port);
+	if(inet_pton(AF_INET, settings.telemetry_ip, &dest.sin_addr)!=1){
+		fprintf(stderr,"ERROR in start_mavlink_manager, invalid telemetry_ip\n");
+		return -1;
+	}
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock<0){
+		perror("ERROR in start_mavlink_manager, failed to open socket");
+		return -1;
+	}
+
+	now = rc_nanos_since_boot();
+	__set_rate(MAV_HEARTBEAT, settings.telemetry_heartbeat_hz, now);
+	__set_rate(MAV_ATTITUDE, settings.telemetry_attitude_hz, now);
+	__set_rate(MAV_MOTORS, settings.telemetry_motors_hz, now);
+	__set_rate(MAV_BATTERY, settings.telemetry_battery_hz, now);
+	send_errors = 0;
+
+	if(rc_pthread_create(&pthread, __mavlink_manager_func, NULL, rt_thread_policy(RT_THREAD_TELEMETRY), rt_thread_priority(RT_THREAD_TELEMETRY))<0){
+		fprintf(stderr,"ERROR in start_mavlink_manager, failed to start thread\n");
+		close(sock);
+		sock = -1;
+		return -1;
+	}
+	initialized = 1;
+	return 0;
+}
+
+
+int start_mavlink_manager()
+{
+	if(settings.enable_telemetry && __start_tx()) return -1;
+	if(settings.enable_mocap && __start_rx()){
+		cleanup_mavlink_manager();
+		return -1;
+	}
+	return 0;
+}
+
+
+int cleanup_mavlink_manager()
+{
+	int ret = 0, rx_ret;
+	if(initialized){
+		// wait for the thread to exit
+		ret = rc_pthread_timed_join(pthread,NULL,MAVLINK_MANAGER_TOUT);
+		if(ret==1) fprintf(stderr,"WARNING: mavlink_manager_thread exit timeout\n");
+		else if(ret==-1) fprintf(stderr,"ERROR: failed to join mavlink_manager thread\n");
+		if(send_errors) fprintf(stderr,"WARNING: mavlink_manager failed to send %lu packets\n", send_errors);
+	}
+	if(ret==0 && sock>=0){
+		close(sock);
+		sock = -1;
+	}
+	initialized = 0;
+
+	if(rx_running){
+		rx_ret = rc_pthread_timed_join(rx_pthread,NULL,MAVLINK_MANAGER_TOUT);
+		if(rx_ret==1) fprintf(stderr,"WARNING: mavlink_manager rx thread exit timeout\n");
+		else if(rx_ret==-1) fprintf(stderr,"ERROR: failed to join mavlink_manager rx thread\n");
+		if(rx_ret==0){
+			close(rx_sock);
+			rx_sock = -1;
+		}
+		else ret = rx_ret;
+	}
+	rx_running = 0;
+	return ret;
+}
@@ -4,10 +4,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <float.h> // for DBL_MAX
+#include <math.h>
 #include <mix.h>
+#include <airframe.h>
+#include <rc_pilot_defs.h>
 
 
+#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_4X)
 /**
  * Most popular: 4-rotor X layout like DJI Phantom and 3DR Iris
  * top view:
@@ -18,12 +21,14 @@
  * columns: X Y Z Roll Pitch Yaw
  * rows: motors 1-4
  */
-static double mix_4x[][6] = { \
+static scalar_t mix_4x[][6] = { \
 {0.0,   0.0,  -1.0,  -0.5,   0.5,   0.5},\
 {0.0,   0.0,  -1.0,  -0.5,  -0.5,  -0.5},\
 {0.0,   0.0,  -1.0,   0.5,  -0.5,   0.5},\
 {0.0,   0.0,  -1.0,   0.5,   0.5,  -0.5}};
+#endif
 
+#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_4PLUS)
 /**
  * less popular: 4-rotor + layout
  *
@@ -34,12 +39,14 @@ static double mix_4x[][6] = { \
  * columns: X Y Z Roll Pitch Yaw
  * rows: motors 1-4
  */
-static double mix_4plus[][6] = { \
+static scalar_t mix_4plus[][6] = { \
 {0.0,   0.0,  -1.0,   0.0,   0.5,   0.5},\
 {0.0,   0.0,  -1.0,  -0.5,   0.0,  -0.5},\
 {0.0,   0.0,  -1.0,   0.0,  -0.5,   0.5},\
 {0.0,   0.0,  -1.0,   0.5,   0.0,  -0.5}};
+#endif
 
+#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_6X)
 /*
  * 6X like DJI S800
  *
@@ -50,14 +57,16 @@ static double mix_4plus[][6] = { \
  * columns: X Y Z Roll Pitch Yaw
  * rows: motors 1-6
  */
-static double mix_6x[][6] = { \
+static scalar_t mix_6x[][6] = { \
 {0.0,   0.0,  -1.0,  -0.25,   0.5,   0.5},\
 {0.0,   0.0,  -1.0,  -0.50,   0.0,  -0.5},\
 {0.0,   0.0,  -1.0,  -0.25,  -0.5,   0.5},\
 {0.0,   0.0,  -1.0,   0.25,  -0.5,  -0.5},\
 {0.0,   0.0,  -1.0,   0.50,   0.0,   0.5},\
 {0.0,   0.0,  -1.0,   0.25,   0.5,  -0.5}};
+#endif
 
+#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_8X)
 /**
  * 8X like DJI S1000
  *
@@ -69,7 +78,7 @@ static double mix_6x[][6] = { \
  * columns: X Y Z Roll Pitch Yaw
  * rows: motors 1-8
  */
-static double mix_8x[][6] = { \
+static scalar_t mix_8x[][6] = { \
 {0.0,   0.0,  -1.0,  -0.21,   0.50,   0.5},\
 {0.0,   0.0,  -1.0,  -0.50,   0.21,  -0.5},\
 {0.0,   0.0,  -1.0,  -0.50,  -0.21,   0.5},\
@@ -78,7 +87,9 @@ static double mix_8x[][6] = { \
 {0.0,   0.0,  -1.0,   0.50,  -0.21,  -0.5},\
 {0.0,   0.0,  -1.0,   0.50,   0.21,   0.5},\
 {0.0,   0.0,  -1.0,   0.21,   0.50,  -0.5}};
+#endif
 
+#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_6DOF_ROTORBITS)
 /**
  * 6D0F control for rotorbits platform
  *
@@ -89,15 +100,17 @@ static double mix_8x[][6] = { \
  * columns: X Y Z Roll Pitch Yaw
  * rows: motors 1-6
  */
-static double mix_6dof_rotorbits[][6] = { \
+static scalar_t mix_6dof_rotorbits[][6] = { \
 {-0.2736,    0.3638,   -1.0000,   -0.2293,    0.3921,    0.3443},\
 { 0.6362,    0.0186,   -1.0000,   -0.3638,   -0.0297,   -0.3638},\
 {-0.3382,   -0.3533,   -1.0000,   -0.3320,   -0.3638,    0.3546},\
 {-0.3382,    0.3533,   -1.0000,    0.3320,   -0.3638,   -0.3546},\
 { 0.6362,   -0.0186,   -1.0000,    0.3638,   -0.0297,    0.3638},\
 {-0.2736,   -0.3638,   -1.0000,    0.2293,    0.3921,   -0.3443}};
+#endif
 
 
+#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_6DOF_5INCH_MONOCOQUE)
 /**
  * 6D0F control for 5-inch nylon monocoque
  *
@@ -108,80 +121,338 @@ static double mix_6dof_rotorbits[][6] = { \
  * columns: X Y Z Roll Pitch Yaw
  * rows: motors 1-6
  */
-static double mix_6dof_5inch_monocoque[][6] = { \
+static scalar_t mix_6dof_5inch_monocoque[][6] = { \
 {-0.2736,    0.3638,   -1.0000,   -0.2293,    0.3921,    0.3443},\
 { 0.6362,    0.0186,   -1.0000,   -0.3638,   -0.0297,   -0.3638},\
 {-0.3382,   -0.3533,   -1.0000,   -0.3320,   -0.3638,    0.3546},\
 {-0.3382,    0.3533,   -1.0000,    0.3320,   -0.3638,   -0.3546},\
 { 0.6362,   -0.0186,   -1.0000,    0.3638,   -0.0297,    0.3638},\
 {-0.2736,   -0.3638,   -1.0000,    0.2293,    0.3921,   -0.3443}};
+#endif
 
-static double (*mix_matrix)[6];
-static int initialized;
-static int rotors;
-static int dof;
+// the mixer behind mix_init() and the mix_* functions
+static mixer_t mixer;
 
+// with a fixed airframe the rotor count and dof are constants so every loop
+// over the motors below has a known trip count
+#ifdef AIRFRAME_LAYOUT
+#define ROTORS(mx)	((void)(mx), AIRFRAME_ROTORS)
+#define DOF(mx)		((void)(mx), AIRFRAME_DOF)
+#else
+#define ROTORS(mx)	((mx)->rotors)
+#define DOF(mx)		((mx)->dof)
+#endif
 
-int mix_init(rotor_layout_t layout)
+#define SET_LAYOUT(mx, r, d, m) do{ (mx)->rotors = r; (mx)->dof = d; (mx)->matrix = m; }while(0)
+
+/**
+ * Step counts and tolerances for mixer_allocate()
+ */
+#define ALLOC_MAX_LEVELS	4
+#define ALLOC_NULL_PASSES	1	// sweeps over the null space basis
+#define ALLOC_LINE_STEPS	16	// bisection steps per null space direction
+#define ALLOC_LINE_RANGE	2.0	// furthest a null space direction is moved
+#define ALLOC_EPS		1e-9
+
+// channels in each priority level, -1 for an unused slot
+static const int alloc_level_ch[ALLOC_MAX_LEVELS][2] = {
+	{VEC_Z,		-1},
+	{VEC_ROLL,	VEC_PITCH},
+	{VEC_YAW,	-1},
+	{VEC_Y,		VEC_X}};
+
+
+/*
+ * Generic kernels, only ever called with a constant rotor count n from the
+ * wrappers below so the compiler can fully unroll and vectorize each one.
+ */
+static inline void __bounds_n(const int n, const mixer_t* mx, int ch, const scalar_t* mot, scalar_t* min, scalar_t* max)
+{
+	int i;
+	scalar_t hi, lo, up, dn;
+	scalar_t new_max = SCALAR_MAX;
+	scalar_t new_min = -SCALAR_MAX;
+
+	for(i=0;i<n;i++){
+		hi = SCALAR_C(1.0)-mot[i];	// room for this motor to move up
+		lo = -mot[i];		// room for this motor to move down
+		up = hi*mx->pinv[ch][i] + lo*mx->ninv[ch][i] + mx->pad[ch][i];
+		dn = lo*mx->pinv[ch][i] + hi*mx->ninv[ch][i] - mx->pad[ch][i];
+		if(up<new_max) new_max = up;
+		if(dn>new_min) new_min = dn;
+	}
+	*min = new_min;
+	*max = new_max;
+}
+
+static inline void __add_n(const int n, const mixer_t* mx, scalar_t u, int ch, scalar_t* mot)
+{
+	int i;
+	for(i=0;i<n;i++){
+		mot[i] += u*mx->col[ch][i];
+		if(mot[i]>SCALAR_C(1.0)) mot[i]=SCALAR_C(1.0);
+		else if(mot[i]<SCALAR_C(0.0)) mot[i]=SCALAR_C(0.0);
+	}
+}
+
+static inline scalar_t __sat_add_n(const int n, const mixer_t* mx, scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot)
 {
+	scalar_t min, max;
+	__bounds_n(n, mx, ch, mot, &min, &max);
+	if(max>lim_max) max = lim_max;
+	if(min<lim_min) min = lim_min;
+	if(u>max) u = max;
+	else if(u<min) u = min;
+	__add_n(n, mx, u, ch, mot);
+	return u;
+}
+
+#define MIX_FAST_KERNELS(n) \
+static void __bounds_##n(const mixer_t* mx, int ch, const scalar_t* mot, scalar_t* min, scalar_t* max)\
+{ __bounds_n(n, mx, ch, mot, min, max); }\
+static void __add_##n(const mixer_t* mx, scalar_t u, int ch, scalar_t* mot)\
+{ __add_n(n, mx, u, ch, mot); }\
+static scalar_t __sat_add_##n(const mixer_t* mx, scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot)\
+{ return __sat_add_n(n, mx, u, ch, lim_min, lim_max, mot); }
+
+#ifndef AIRFRAME_LAYOUT
+MIX_FAST_KERNELS(4)
+MIX_FAST_KERNELS(6)
+MIX_FAST_KERNELS(8)
+#endif
+
+
+/**
+ * @brief      builds the fast path tables for the matrix just selected
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __build_fast_tables(mixer_t* mx)
+{
+	int i, ch;
+	scalar_t a;
+
+	for(ch=0;ch<MAX_INPUTS;ch++){
+		for(i=0;i<MAX_ROTORS;i++){
+			a = (i<ROTORS(mx)) ? mx->matrix[i][ch] : 0.0;
+			mx->col[ch][i]  = a;
+			mx->pinv[ch][i] = (a>0.0) ? 1.0/a : 0.0;
+			mx->ninv[ch][i] = (a<0.0) ? 1.0/a : 0.0;
+			mx->pad[ch][i]  = (a==0.0) ? SCALAR_MAX : 0.0;
+		}
+	}
+
+	// a fixed airframe calls the kernel for its rotor count directly
+	#ifndef AIRFRAME_LAYOUT
+	switch(ROTORS(mx)){
+	case 4:
+		mx->bounds = __bounds_4;
+		mx->add = __add_4;
+		mx->sat_add = __sat_add_4;
+		break;
+	case 6:
+		mx->bounds = __bounds_6;
+		mx->add = __add_6;
+		mx->sat_add = __sat_add_6;
+		break;
+	case 8:
+		mx->bounds = __bounds_8;
+		mx->add = __add_8;
+		mx->sat_add = __sat_add_8;
+		break;
+	default:
+		fprintf(stderr,"ERROR in mix_init() no fast kernel for %d rotors\n", ROTORS(mx));
+		return -1;
+	}
+	#endif
+	return 0;
+}
+
+
+/**
+ * @brief      builds the pseudo-inverse and null space of the matrix just
+ *             selected for mixer_allocate()
+ *
+ *             The layout tables are already the minimum-norm allocation for
+ *             their airframe, so the pseudo-inverse of the columns in use,
+ *             (M'M)^-1 M', is the effectiveness matrix and I - M(M'M)^-1 M'
+ *             projects onto the motor patterns that have no effect.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __build_alloc_tables(mixer_t* mx)
+{
+	int i, j, k, r, piv;
+	int nc = DOF(mx);
+	int c0 = MAX_INPUTS-DOF(mx);	// 4DOF layouts only use Z through yaw
+	double g[MAX_INPUTS][2*MAX_INPUTS];
+	double proj[MAX_ROTORS][MAX_ROTORS];
+	double v[MAX_ROTORS];
+	double a, norm;
+
+	// augmented [M'M | I] for Gauss-Jordan inversion
+	for(i=0;i<nc;i++){
+		for(j=0;j<nc;j++){
+			a = 0.0;
+			for(k=0;k<ROTORS(mx);k++) a += mx->matrix[k][c0+i]*mx->matrix[k][c0+j];
+			g[i][j] = a;
+			g[i][nc+j] = (i==j) ? 1.0 : 0.0;
+		}
+	}
+	for(i=0;i<nc;i++){
+		piv = i;
+		for(r=i+1;r<nc;r++) if(fabs(g[r][i])>fabs(g[piv][i])) piv = r;
+		if(fabs(g[piv][i])<ALLOC_EPS){
+			fprintf(stderr,"ERROR in mix_init() mixing matrix is rank deficient\n");
+			return -1;
+		}
+		if(piv!=i){
+			for(j=0;j<2*nc;j++){
+				a = g[i][j];
+				g[i][j] = g[piv][j];
+				g[piv][j] = a;
+			}
+		}
+		a = 1.0/g[i][i];
+		for(j=0;j<2*nc;j++) g[i][j] *= a;
+		for(r=0;r<nc;r++){
+			if(r==i || g[r][i]==0.0) continue;
+			a = g[r][i];
+			for(j=0;j<2*nc;j++) g[r][j] -= a*g[i][j];
+		}
+	}
+
+	// effectiveness (M'M)^-1 M', zero for channels the layout doesn't use
+	for(i=0;i<MAX_INPUTS;i++){
+		for(k=0;k<MAX_ROTORS;k++) mx->eff[i][k] = 0.0;
+	}
+	for(i=0;i<nc;i++){
+		for(k=0;k<ROTORS(mx);k++){
+			a = 0.0;
+			for(j=0;j<nc;j++) a += g[i][nc+j]*mx->matrix[k][c0+j];
+			mx->eff[c0+i][k] = a;
+		}
+	}
+
+	// null space from the columns of I - M*eff by Gram-Schmidt
+	for(i=0;i<ROTORS(mx);i++){
+		for(k=0;k<ROTORS(mx);k++){
+			a = (i==k) ? 1.0 : 0.0;
+			for(j=0;j<nc;j++) a -= mx->matrix[i][c0+j]*mx->eff[c0+j][k];
+			proj[i][k] = a;
+		}
+	}
+	mx->null_dim = 0;
+	for(k=0;k<ROTORS(mx) && mx->null_dim<ROTORS(mx)-nc;k++){
+		for(i=0;i<ROTORS(mx);i++) v[i] = proj[i][k];
+		for(r=0;r<mx->null_dim;r++){
+			a = 0.0;
+			for(i=0;i<ROTORS(mx);i++) a += mx->null[r][i]*v[i];
+			for(i=0;i<ROTORS(mx);i++) v[i] -= a*mx->null[r][i];
+		}
+		norm = 0.0;
+		for(i=0;i<ROTORS(mx);i++) norm += v[i]*v[i];
+		norm = sqrt(norm);
+		if(norm<1e-6) continue;
+		for(i=0;i<MAX_ROTORS;i++) mx->null[mx->null_dim][i] = (i<ROTORS(mx)) ? v[i]/norm : 0.0;
+		mx->null_dim++;
+	}
+	if(mx->null_dim!=ROTORS(mx)-nc){
+		fprintf(stderr,"ERROR in mix_init() found %d null space directions, expected %d\n",
+							mx->null_dim, ROTORS(mx)-nc);
+		return -1;
+	}
+
+	// X and Y only have a level of their own on 6DOF layouts
+	mx->levels = (DOF(mx)==6) ? ALLOC_MAX_LEVELS : ALLOC_MAX_LEVELS-1;
+	return 0;
+}
+
+
+int mixer_init(mixer_t* mx, rotor_layout_t layout)
+{
+	mx->initialized = 0;
+	#ifdef AIRFRAME_LAYOUT
+	if(layout!=AIRFRAME_LAYOUT){
+		fprintf(stderr,"ERROR in mix_init() this build only supports layout %d\n",
+							AIRFRAME_LAYOUT);
+		return -1;
+	}
+	#endif
+
 	switch(layout){
+	#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_4X)
 	case LAYOUT_4X:
-		rotors = 4;
-		dof = 4;
-		mix_matrix = mix_4x;
+		SET_LAYOUT(mx, 4, 4, mix_4x);
 		break;
+	#endif
+	#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_4PLUS)
 	case LAYOUT_4PLUS:
-		rotors = 4;
-		dof = 4;
-		mix_matrix = mix_4plus;
+		SET_LAYOUT(mx, 4, 4, mix_4plus);
 		break;
+	#endif
+	#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_6X)
 	case LAYOUT_6X:
-		rotors = 6;
-		dof = 4;
-		mix_matrix = mix_6x;
+		SET_LAYOUT(mx, 6, 4, mix_6x);
 		break;
+	#endif
+	#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_8X)
 	case LAYOUT_8X:
-		rotors = 8;
-		dof = 4;
-		mix_matrix = mix_8x;
+		SET_LAYOUT(mx, 8, 4, mix_8x);
 		break;
+	#endif
+	#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_6DOF_ROTORBITS)
 	case LAYOUT_6DOF_ROTORBITS:
-		rotors = 6;
-		dof = 6;
-		mix_matrix = mix_6dof_rotorbits;
+		SET_LAYOUT(mx, 6, 6, mix_6dof_rotorbits);
 		break;
+	#endif
+	#if !defined(AIRFRAME_LAYOUT) || defined(AIRFRAME_LAYOUT_6DOF_5INCH_MONOCOQUE)
 	case LAYOUT_6DOF_5INCH_MONOCOQUE:
-		rotors = 6;
-		dof = 6;
-		mix_matrix = mix_6dof_5inch_monocoque;
+		SET_LAYOUT(mx, 6, 6, mix_6dof_5inch_monocoque);
 		break;
+	#endif
 	default:
 		fprintf(stderr,"ERROR in mix_init() unknown rotor layout\n");
 		return -1;
 	}
 
-	initialized = 1;
+	if(__build_fast_tables(mx)) return -1;
+	if(__build_alloc_tables(mx)) return -1;
+	mx->layout = layout;
+	mx->initialized = 1;
 	return 0;
 }
 
 
-int mix_all_controls(double u[6], double* mot)
+int mix_init(rotor_layout_t layout)
+{
+	return mixer_init(&mixer, layout);
+}
+
+
+const mixer_t* mix_default_mixer()
+{
+	return &mixer;
+}
+
+
+int mixer_all_controls(const mixer_t* mx, scalar_t u[6], scalar_t* mot)
 {
 	int i,j;
-	if(initialized!=1){
+	if(mx->initialized!=1){
 		fprintf(stderr,"ERROR in mix_all_controls, mixing matrix not set yet\n");
 		return -1;
 	}
 	// sum control inputs
-	for(i=0;i<rotors;i++){
+	for(i=0;i<ROTORS(mx);i++){
 		mot[i]=0.0;
 		for(j=0;j<6;j++){
-			mot[i]+=mix_matrix[i][j]*u[j];
+			mot[i]+=mx->matrix[i][j]*u[j];
 		}
 	}
 	// ensure saturation, should not need to do this if mix_check_saturation
 	// was used properly, but here for safety anyway.
-	for(i=0;i<rotors;i++){
+	for(i=0;i<ROTORS(mx);i++){
 		if(mot[i]>1.0) mot[i]=1.0;
 		else if(mot[i]<0.0) mot[i]=0.0;
 	}
@@ -189,19 +460,25 @@ int mix_all_controls(double u[6], double* mot)
 }
 
 
-int mix_check_saturation(int ch, double* mot, double* min, double* max)
+int mix_all_controls(scalar_t u[6], scalar_t* mot)
+{
+	return mixer_all_controls(&mixer, u, mot);
+}
+
+
+int mixer_check_saturation(const mixer_t* mx, int ch, scalar_t* mot, scalar_t* min, scalar_t* max)
 {
 	int i, min_ch;
-	double tmp;
-	double new_max = DBL_MAX;
-	double new_min = -DBL_MAX;
+	scalar_t tmp;
+	scalar_t new_max = SCALAR_MAX;
+	scalar_t new_min = -SCALAR_MAX;
 
-	if(initialized!=1){
+	if(mx->initialized!=1){
 		fprintf(stderr,"ERROR: in check_channel_saturation, mix matrix not set yet\n");
 		return -1;
 	}
 
-	switch(dof){
+	switch(DOF(mx)){
 	case 4:
 		min_ch = 2;
 		break;
@@ -209,7 +486,7 @@ int mix_check_saturation(int ch, double* mot, double* min, double* max)
 		min_ch = 0;
 		break;
 	default:
-		fprintf(stderr,"ERROR: in check_channel_saturation, dof should be 4 or 6, currently %d\n", dof);
+		fprintf(stderr,"ERROR: in check_channel_saturation, dof should be 4 or 6, currently %d\n", DOF(mx));
 		return -1;
 	}
 
@@ -219,7 +496,7 @@ int mix_check_saturation(int ch, double* mot, double* min, double* max)
 	}
 
 	// make sure motors are not already saturated
-	for(i=0;i<rotors;i++){
+	for(i=0;i<ROTORS(mx);i++){
 		if(mot[i]>1.0 || mot[i]<0.0){
 			fprintf(stderr,"ERROR: motor channel already out of bounds\n");
 			return -1;
@@ -227,25 +504,25 @@ int mix_check_saturation(int ch, double* mot, double* min, double* max)
 	}
 
 	// find max positive input
-	for(i=0;i<rotors;i++){
+	for(i=0;i<ROTORS(mx);i++){
 		// if mix channel is 0, impossible to saturate
-		if(mix_matrix[i][ch]==0.0) continue;
+		if(mx->matrix[i][ch]==0.0) continue;
 		// for positive entry in mix matrix
-		if(mix_matrix[i][ch]>0.0)	tmp = (1.0-mot[i])/mix_matrix[i][ch];
+		if(mx->matrix[i][ch]>0.0)	tmp = (1.0-mot[i])/mx->matrix[i][ch];
 		// for negative entry in mix matrix
-		else tmp = -mot[i]/mix_matrix[i][ch];
+		else tmp = -mot[i]/mx->matrix[i][ch];
 		// set new upper limit if lower than current
 		if(tmp<new_max) new_max = tmp;
 	}
 
 	// find min (most negative) input
-	for(i=0;i<rotors;i++){
+	for(i=0;i<ROTORS(mx);i++){
 		// if mix channel is 0, impossible to saturate
-		if(mix_matrix[i][ch]==0.0) continue;
+		if(mx->matrix[i][ch]==0.0) continue;
 		// for positive entry in mix matrix
-		if(mix_matrix[i][ch]>0.0)	tmp = -mot[i]/mix_matrix[i][ch];
+		if(mx->matrix[i][ch]>0.0)	tmp = -mot[i]/mx->matrix[i][ch];
 		// for negative entry in mix matrix
-		else tmp = (1.0-mot[i])/mix_matrix[i][ch];
+		else tmp = (1.0-mot[i])/mx->matrix[i][ch];
 		// set new upper limit if lower than current
 		if(tmp>new_min) new_min = tmp;
 	}
@@ -256,16 +533,22 @@ int mix_check_saturation(int ch, double* mot, double* min, double* max)
 }
 
 
-int mix_add_input(double u, int ch, double* mot)
+int mix_check_saturation(int ch, scalar_t* mot, scalar_t* min, scalar_t* max)
+{
+	return mixer_check_saturation(&mixer, ch, mot, min, max);
+}
+
+
+int mixer_add_input(const mixer_t* mx, scalar_t u, int ch, scalar_t* mot)
 {
 	int i;
 	int min_ch;
 
-	if(initialized!=1 || dof==0){
+	if(mx->initialized!=1 || DOF(mx)==0){
 		fprintf(stderr,"ERROR: in mix_add_input, mix matrix not set yet\n");
 		return -1;
 	}
-	switch(dof){
+	switch(DOF(mx)){
 	case 4:
 		min_ch = 2;
 		break;
@@ -273,7 +556,7 @@ int mix_add_input(double u, int ch, double* mot)
 		min_ch = 0;
 		break;
 	default:
-		fprintf(stderr,"ERROR: in mix_add_input, dof should be 4 or 6, currently %d\n", dof);
+		fprintf(stderr,"ERROR: in mix_add_input, dof should be 4 or 6, currently %d\n", DOF(mx));
 		return -1;
 	}
 
@@ -283,8 +566,8 @@ int mix_add_input(double u, int ch, double* mot)
 	}
 
 	// add inputs
-	for(i=0;i<rotors;i++){
-		mot[i] += u*mix_matrix[i][ch];
+	for(i=0;i<ROTORS(mx);i++){
+		mot[i] += u*mx->matrix[i][ch];
 		// ensure saturation, should not need to do this if mix_check_saturation
 		// was used properly, but here for safety anyway.
 		if(mot[i]>1.0) mot[i]=1.0;
@@ -294,3 +577,216 @@ int mix_add_input(double u, int ch, double* mot)
 }
 
 
+int mix_add_input(scalar_t u, int ch, scalar_t* mot)
+{
+	return mixer_add_input(&mixer, u, ch, mot);
+}
+
+
+#ifdef AIRFRAME_LAYOUT
+void mixer_check_saturation_fast(const mixer_t* mx, int ch, const scalar_t* mot, scalar_t* min, scalar_t* max)
+{
+	__bounds_n(AIRFRAME_ROTORS, mx, ch, mot, min, max);
+}
+
+
+void mixer_add_input_fast(const mixer_t* mx, scalar_t u, int ch, scalar_t* mot)
+{
+	__add_n(AIRFRAME_ROTORS, mx, u, ch, mot);
+}
+
+
+scalar_t mixer_add_input_saturated(const mixer_t* mx, scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot)
+{
+	return __sat_add_n(AIRFRAME_ROTORS, mx, u, ch, lim_min, lim_max, mot);
+}
+#else
+void mixer_check_saturation_fast(const mixer_t* mx, int ch, const scalar_t* mot, scalar_t* min, scalar_t* max)
+{
+	mx->bounds(mx, ch, mot, min, max);
+}
+
+
+void mixer_add_input_fast(const mixer_t* mx, scalar_t u, int ch, scalar_t* mot)
+{
+	mx->add(mx, u, ch, mot);
+}
+
+
+scalar_t mixer_add_input_saturated(const mixer_t* mx, scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot)
+{
+	return mx->sat_add(mx, u, ch, lim_min, lim_max, mot);
+}
+#endif
+
+
+void mix_check_saturation_fast(int ch, const scalar_t* mot, scalar_t* min, scalar_t* max)
+{
+	mixer_check_saturation_fast(&mixer, ch, mot, min, max);
+}
+
+
+void mix_add_input_fast(scalar_t u, int ch, scalar_t* mot)
+{
+	mixer_add_input_fast(&mixer, u, ch, mot);
+}
+
+
+scalar_t mix_add_input_saturated(scalar_t u, int ch, scalar_t lim_min, scalar_t lim_max, scalar_t* mot)
+{
+	return mixer_add_input_saturated(&mixer, u, ch, lim_min, lim_max, mot);
+}
+
+
+/**
+ * @brief      how far the worst motor is outside of 0 to 1, 0 if none are
+ */
+static inline scalar_t __violation(const mixer_t* mx, const scalar_t* m)
+{
+	int i;
+	scalar_t v = SCALAR_C(0.0);
+	for(i=0;i<ROTORS(mx);i++){
+		if(m[i]-SCALAR_C(1.0)>v) v = m[i]-SCALAR_C(1.0);
+		if(-m[i]>v) v = -m[i];
+	}
+	return v;
+}
+
+
+/**
+ * @brief      largest fraction s within 0 to 1 of d that can be added to the
+ *             in-range motors m without saturating any of them
+ */
+static inline scalar_t __max_scale(const mixer_t* mx, const scalar_t* m, const scalar_t* d)
+{
+	int i;
+	scalar_t s = SCALAR_C(1.0);
+	scalar_t lim;
+	for(i=0;i<ROTORS(mx);i++){
+		if(d[i]>SCALAR_C(0.0))		lim = (SCALAR_C(1.0)-m[i])/d[i];
+		else if(d[i]<SCALAR_C(0.0))	lim = -m[i]/d[i];
+		else continue;
+		if(lim<s) s = lim;
+	}
+	return (s>SCALAR_C(0.0)) ? s : SCALAR_C(0.0);
+}
+
+
+/**
+ * @brief      moves the motors c along the null space to minimise the worst
+ *             saturation
+ *
+ *             The worst saturation is convex and piecewise linear along each
+ *             basis direction, so each one is minimised exactly to within
+ *             the bisection resolution by following the sign of the slope of
+ *             the motor that is worst off. The step counts are fixed, so this
+ *             always takes the same time for a layout.
+ */
+static void __null_desaturate(const mixer_t* mx, scalar_t* c)
+{
+	int p, k, n, i;
+	scalar_t lo, hi, t, w, e, slope;
+	const scalar_t* v;
+
+	for(p=0;p<ALLOC_NULL_PASSES;p++){
+		for(k=0;k<mx->null_dim;k++){
+			v = mx->null[k];
+			lo = -SCALAR_C(ALLOC_LINE_RANGE);
+			hi = SCALAR_C(ALLOC_LINE_RANGE);
+			for(n=0;n<ALLOC_LINE_STEPS;n++){
+				t = SCALAR_C(0.5)*(lo+hi);
+				// a motor is out of range by |c-0.5|-0.5, follow the slope
+				// of whichever is furthest out at t
+				w = SCALAR_C(-1.0);
+				slope = SCALAR_C(0.0);
+				for(i=0;i<ROTORS(mx);i++){
+					e = c[i] - SCALAR_C(0.5) + t*v[i];
+					if(scalar_fabs(e)>w){
+						w = scalar_fabs(e);
+						slope = (e>SCALAR_C(0.0)) ? v[i] : -v[i];
+					}
+				}
+				if(slope>SCALAR_C(0.0)) hi = t;
+				else lo = t;
+			}
+			t = SCALAR_C(0.5)*(lo+hi);
+			for(i=0;i<ROTORS(mx);i++) c[i] += t*v[i];
+		}
+	}
+}
+
+
+void mixer_allocate(const mixer_t* mx, scalar_t* u, scalar_t* mot)
+{
+	int l, j, i, ch;
+	scalar_t m[MAX_ROTORS], c[MAX_ROTORS], d[MAX_ROTORS], dn[MAX_ROTORS];
+	scalar_t s, sn;
+
+	for(i=0;i<MAX_ROTORS;i++) m[i] = SCALAR_C(0.0);
+	// a 4DOF layout has no X or Y level
+	if(DOF(mx)!=6){
+		u[VEC_X] = SCALAR_C(0.0);
+		u[VEC_Y] = SCALAR_C(0.0);
+	}
+
+	for(l=0;l<mx->levels;l++){
+		// motor change this whole level asks for
+		for(i=0;i<ROTORS(mx);i++) d[i] = SCALAR_C(0.0);
+		for(j=0;j<2;j++){
+			ch = alloc_level_ch[l][j];
+			if(ch<0) continue;
+			for(i=0;i<ROTORS(mx);i++) d[i] += u[ch]*mx->col[ch][i];
+		}
+		for(i=0;i<ROTORS(mx);i++) c[i] = m[i]+d[i];
+
+		s = SCALAR_C(1.0);
+		if(__violation(mx, c)>SCALAR_C(0.0)){
+			s = __max_scale(mx, m, d);
+			// null space motion doesn't change any input so it's only used
+			// when it lets more of this level through than plain scaling
+			if(mx->null_dim){
+				__null_desaturate(mx, c);
+				for(i=0;i<ROTORS(mx);i++) dn[i] = c[i]-m[i];
+				sn = __max_scale(mx, m, dn);
+				if(sn>s){
+					s = sn;
+					for(i=0;i<ROTORS(mx);i++) d[i] = dn[i];
+				}
+			}
+		}
+		for(i=0;i<ROTORS(mx);i++) m[i] += s*d[i];
+		for(j=0;j<2;j++){
+			ch = alloc_level_ch[l][j];
+			if(ch>=0) u[ch] *= s;
+		}
+	}
+
+	// rounding can leave a motor a hair outside the range
+	for(i=0;i<ROTORS(mx);i++){
+		if(m[i]>SCALAR_C(1.0)) m[i] = SCALAR_C(1.0);
+		else if(m[i]<SCALAR_C(0.0)) m[i] = SCALAR_C(0.0);
+		mot[i] = m[i];
+	}
+}
+
+
+void mix_allocate(scalar_t* u, scalar_t* mot)
+{
+	mixer_allocate(&mixer, u, mot);
+}
+
+
+void mixer_motor_effect(const mixer_t* mx, const scalar_t* mot, scalar_t* u)
+{
+	int i, ch;
+	for(ch=0;ch<MAX_INPUTS;ch++){
+		u[ch] = 0.0;
+		for(i=0;i<ROTORS(mx);i++) u[ch] += mx->eff[ch][i]*mot[i];
+	}
+}
+
+
+void mix_motor_effect(const scalar_t* mot, scalar_t* u)
+{
+	mixer_motor_effect(&mixer, mot, u);
+}
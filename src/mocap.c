@@ -0,0 +1,91 @@
+/**
+ * @file mocap.c
+ */
+
+#include <string.h> // for memset
+
+#include <seqlock.h>
+#include <mocap.h>
+
+#define MAX_READ_TRIES	4
+#define VEL_FILTER	0.5	// weight of the newest finite difference
+
+static seqlock_t lock = SEQLOCK_INITIALIZER;
+static mocap_sample_t mailbox;
+
+// writer side, only touched by the publishing thread
+static mocap_sample_t last_pub;
+static int have_last_pub;
+
+// reader side, only touched by the ISR
+static mocap_sample_t last_read;
+static int have_last_read;
+
+
+void mocap_init()
+{
+	seqlock_write_begin(&lock);
+	memset(&mailbox, 0, sizeof(mailbox));
+	seqlock_write_end(&lock);
+	have_last_pub = 0;
+	have_last_read = 0;
+}
+
+
+void mocap_publish(uint64_t capture_ns, const double pos[3], const double q[4])
+{
+	mocap_sample_t s;
+	double dt;
+	int i;
+
+	memset(&s, 0, sizeof(s));
+	s.time_ns = capture_ns;
+	memcpy(s.pos, pos, sizeof(s.pos));
+	memcpy(s.q, q, sizeof(s.q));
+
+	// velocity from consecutive samples, restarts after a gap or a sample
+	// that arrived out of order
+	if(have_last_pub && capture_ns>last_pub.time_ns &&
+			capture_ns-last_pub.time_ns<MOCAP_TIMEOUT_NS){
+		dt = (capture_ns-last_pub.time_ns)/1e9;
+		for(i=0;i<3;i++){
+			s.vel[i] = VEL_FILTER*(pos[i]-last_pub.pos[i])/dt
+					+ (1.0-VEL_FILTER)*last_pub.vel[i];
+		}
+	}
+	last_pub = s;
+	have_last_pub = 1;
+
+	seqlock_write_begin(&lock);
+	mailbox = s;
+	seqlock_write_end(&lock);
+}
+
+
+int mocap_get(uint64_t now_ns, mocap_sample_t* out)
+{
+	int i;
+	uint_fast32_t seq;
+	mocap_sample_t tmp;
+	double age;
+
+	for(i=0;i<MAX_READ_TRIES;i++){
+		seq = seqlock_read_begin(&lock);
+		tmp = mailbox;
+		if(!seqlock_read_retry(&lock, seq)){
+			if(tmp.time_ns!=0){
+				last_read = tmp;
+				have_last_read = 1;
+			}
+			break;
+		}
+	}
+	if(!have_last_read) return -1;
+
+	*out = last_read;
+	out->age_ns = now_ns>last_read.time_ns ? now_ns-last_read.time_ns : 0;
+	if(out->age_ns>MOCAP_TIMEOUT_NS) return -1;
+	age = out->age_ns/1e9;
+	for(i=0;i<3;i++) out->pos[i] += out->vel[i]*age;
+	return 0;
+}
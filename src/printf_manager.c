@@ -1,10 +1,20 @@
 /**
  * @file printf_manager.c
+ *
+ * Each refresh is formatted into one preallocated buffer from a single state
+ * snapshot and handed to the terminal with one non-blocking write. When the
+ * console (often a slow ssh or serial link) can't keep up the frame is dropped
+ * rather than stalling this thread, which runs at real-time priority next to
+ * the flight threads.
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
+#include <string.h> // for memset
 
 #include <rc/start_stop.h>
 #include <rc/time.h>
@@ -17,141 +27,234 @@
 #include <thread_defs.h>
 #include <settings.h>
 #include <flight_mode.h>
+#include <state_snapshot.h>
+#include <watchdog.h>
 
-
+#define PRINTF_BUF_LEN	1024
 
 static pthread_t pthread;
 static int initialized = 0;
+static int out_fd = -1;
+static int out_fd_nonblock;	// 1 if out_fd has its own O_NONBLOCK description
+static char buf[PRINTF_BUF_LEN];
+static size_t buf_len;
+static unsigned long frames_dropped;
+
 
 /**
- * @brief      Only used by printf_manager right now, but could be useful elsewhere.
+ * @brief      name of a flight mode for the MODE column
  *
  * @param[in]  mode  The mode
  *
- * @return     0 on success or -1 on error
+ * @return     string naming the mode, "UNKNOWN" if not recognized
  */
-int print_flight_mode(flight_mode_t mode){
+static const char* __flight_mode_name(flight_mode_t mode)
+{
 	switch(mode){
 	case TEST_BENCH_4DOF:
-		printf("TEST_BENCH_4DOF");
-		return 0;
+		return "TEST_BENCH_4DOF";
 	case TEST_BENCH_6DOF:
-		printf("TEST_BENCH_6DOF");
-		return 0;
+		return "TEST_BENCH_6DOF";
 	case DIRECT_THROTTLE_4DOF:
-		printf("DIRECT_THROTTLE_4DOF");
-		return 0;
+		return "DIRECT_THROTTLE_4DOF";
 	case DIRECT_THROTTLE_6DOF:
-		printf("DIRECT_THROTTLE_6DOF");
-		return 0;
+		return "DIRECT_THROTTLE_6DOF";
 	case ALT_HOLD_4DOF:
-		printf("ALT_HOLD_4DOF");
-		return 0;
+		return "ALT_HOLD_4DOF";
 	case ALT_HOLD_6DOF:
-		printf("ALT_HOLD_6DOF");
-		return 0;
+		return "ALT_HOLD_6DOF";
+	case ACRO_4DOF:
+		return "ACRO_4DOF";
 	default:
-		fprintf(stderr,"ERROR in print_flight_mode, unknown flight mode\n");
-		return -1;
+		return "UNKNOWN";
+	}
+}
+
+
+/**
+ * @brief      appends formatted text to the frame buffer, anything that
+ *             doesn't fit is cut off
+ */
+static void __attribute__ ((format (printf, 1, 2))) __append(const char* fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if(buf_len>=sizeof(buf)-1) return;
+	va_start(args, fmt);
+	n = vsnprintf(buf+buf_len, sizeof(buf)-buf_len, fmt, args);
+	va_end(args);
+	if(n<0) return;
+	buf_len += n;
+	if(buf_len>sizeof(buf)-1) buf_len = sizeof(buf)-1;
+}
+
+
+/**
+ * @brief      writes the frame buffer out without ever blocking and empties it
+ *
+ *             If the terminal has no room the whole frame is dropped. A frame
+ *             cut short by a partial write is also left as is, every line
+ *             starts with a carriage return so the next one overwrites it.
+ */
+static void __flush()
+{
+	struct pollfd pfd;
+	ssize_t ret;
+
+	if(buf_len==0) return;
+	// without a private non-blocking description, check for room first.
+	// This can still block if only part of the frame fits, but never waits
+	// on a terminal that isn't draining at all.
+	if(!out_fd_nonblock){
+		pfd.fd = out_fd;
+		pfd.events = POLLOUT;
+		if(poll(&pfd, 1, 0)!=1 || !(pfd.revents & POLLOUT)){
+			frames_dropped++;
+			buf_len = 0;
+			return;
+		}
 	}
+	ret = write(out_fd, buf, buf_len);
+	if(ret<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR){
+		// stdout went away, nothing more to do here
+		frames_dropped++;
+	}
+	else if(ret<(ssize_t)buf_len) frames_dropped++;
+	buf_len = 0;
 }
 
 
-static int __print_header(){
-	printf("\n");
+/**
+ * @brief      opens stdout a second time with O_NONBLOCK so the flag doesn't
+ *             affect the shared stdout description the shell and the rest of
+ *             the program use. Falls back to stdout itself if that fails.
+ */
+static void __open_output()
+{
+	out_fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if(out_fd>=0){
+		out_fd_nonblock = 1;
+		return;
+	}
+	out_fd = STDOUT_FILENO;
+	out_fd_nonblock = 0;
+}
+
+
+static void __append_header()
+{
+	__append("\n");
 	if(settings.printf_arm){
-		printf("  arm   |");
+		__append("  arm   |");
 	}
 	if(settings.printf_altitude){
-		printf(" alt(m) |");
+		__append(" alt(m) |");
 	}
 	if(settings.printf_rpy){
-		printf("roll |pitch| yaw |");
+		__append("roll |pitch| yaw |");
 	}
 	if(settings.printf_sticks){
-		printf(" thr |roll |pitch| yaw |");
+		__append(" thr |roll |pitch| yaw |");
 	}
 	if(settings.printf_setpoint){
-		printf("sp_alt |sp_roll|sp_ptch|sp_yaw |");
+		__append("sp_alt |sp_roll|sp_ptch|sp_yaw |");
 	}
 	if(settings.printf_u){
-		printf(" U0X | U1Y | U2Z | U3r | U4p | U5y |");
+		__append(" U0X | U1Y | U2Z | U3r | U4p | U5y |");
 	}
 	if(settings.printf_motors){
-		printf(" M1 | M2 | M3 | M4 | M5 | M6 |");
+		__append(" M1 | M2 | M3 | M4 | M5 | M6 |");
+	}
+	if(settings.printf_timing){
+		__append(" t_mean| t_p99 | t_max | ovrn |shed| stk_us|");
 	}
 	if(settings.printf_mode){
-		printf("   MODE ");
+		__append("   MODE ");
 	}
+	__append("\n");
+}
 
-	printf("\n");
-	fflush(stdout);
-	return 0;
+
+static void __append_line(const state_snapshot_t* snap)
+{
+	const loop_stat_summary_t* total = &snap->fstate.timing.stats[LOOP_STAT_TOTAL];
+	const loop_stat_summary_t* input = &snap->fstate.timing.stats[LOOP_STAT_INPUT];
+	watchdog_stats_t wd;
+
+	__append("\r");
+	if(settings.printf_arm){
+		__append(snap->fstate.arm_state==ARMED ? " ARMED  |" : "DISARMED|");
+	}
+	if(settings.printf_altitude){
+		__append("%7.2f |", snap->fstate.altitude);
+	}
+	if(settings.printf_rpy){
+		__append("%6.2f |%6.2f |%6.2f |", snap->fstate.roll,
+				snap->fstate.pitch, snap->fstate.yaw);
+	}
+	if(settings.printf_sticks){
+		__append("%6.2f |%6.2f |%6.2f |%6.2f |",
+				snap->user_input.thr_stick, snap->user_input.roll_stick,
+				snap->user_input.pitch_stick, snap->user_input.yaw_stick);
+	}
+	if(settings.printf_setpoint){
+		__append("%6.2f |%6.2f |%6.2f |%6.2f |",
+				snap->setpoint.altitude, snap->setpoint.roll,
+				snap->setpoint.pitch, snap->setpoint.yaw);
+	}
+	if(settings.printf_u){
+		__append("%6.2f |%6.2f |%6.2f |%6.2f |%6.2f |%6.2f |",
+				snap->fstate.u[0], snap->fstate.u[1], snap->fstate.u[2],
+				snap->fstate.u[3], snap->fstate.u[4], snap->fstate.u[5]);
+	}
+	if(settings.printf_motors){
+		__append("%5.2f |%5.2f |%5.2f |%5.2f |%5.2f |%5.2f |",
+				snap->fstate.m[0], snap->fstate.m[1], snap->fstate.m[2],
+				snap->fstate.m[3], snap->fstate.m[4], snap->fstate.m[5]);
+	}
+	if(settings.printf_timing){
+		watchdog_get_stats(&wd);
+		__append("%6.0f |%6.0f |%6.0f |%5llu | %d  |%6.0f |", total->mean_us,
+				total->p99_us, total->max_us,
+				(unsigned long long)snap->fstate.timing.overruns, wd.level,
+				input->mean_us);
+	}
+	if(settings.printf_mode){
+		__append("%s", __flight_mode_name(snap->user_input.flight_mode));
+	}
 }
 
 
 static void* __printf_manager_func(__attribute__ ((unused)) void* ptr)
 {
 	arm_state_t prev_arm_state;
+	state_snapshot_t snap;
 
+	rt_setup_thread(RT_THREAD_PRINTF);
 	initialized = 1;
-	__print_header();
-	prev_arm_state = fstate.arm_state;
+	// anything still sitting in the stdio buffer goes out before our frames
+	fflush(stdout);
+	memset(&snap, 0, sizeof(snap));
+	state_snapshot_get(&snap);
+	prev_arm_state = snap.fstate.arm_state;
+	__append_header();
+	__flush();
 
-	while(rc_get_state()==EXITING){
+	while(rc_get_state()!=EXITING){
+		// one coherent copy of the state per frame, keeps the old one if
+		// the ISR happened to be publishing
+		state_snapshot_get(&snap);
 
 		// re-print header on disarming
-		if(fstate.arm_state==DISARMED && prev_arm_state==ARMED){
-			__print_header();
-		}
-
-		printf("\r");
-		if(settings.printf_arm){
-			if(fstate.arm_state == ARMED) printf(" ARMED  |");
-			else                       printf("DISARMED|");
-		}
-		if(settings.printf_altitude){
-			printf("%7.2f |", fstate.altitude);
-		}
-		if(settings.printf_rpy){
-			printf("%6.2f |", fstate.roll);
-			printf("%6.2f |", fstate.roll);
-			printf("%6.2f |", fstate.roll);
-		}
-		if(settings.printf_sticks){
-			printf("%6.2f |", user_input.thr_stick);
-			printf("%6.2f |", user_input.roll_stick);
-			printf("%6.2f |", user_input.pitch_stick);
-			printf("%6.2f |", user_input.yaw_stick);
-		}
-		if(settings.printf_setpoint){
-			printf("%6.2f |", setpoint.altitude);
-			printf("%6.2f |", setpoint.roll);
-			printf("%6.2f |", setpoint.pitch);
-			printf("%6.2f |", setpoint.yaw);
-		}
-		if(settings.printf_u){
-			printf("%6.2f |", fstate.u[0]);
-			printf("%6.2f |", fstate.u[1]);
-			printf("%6.2f |", fstate.u[2]);
-			printf("%6.2f |", fstate.u[3]);
-			printf("%6.2f |", fstate.u[4]);
-			printf("%6.2f |", fstate.u[5]);
-		}
-		if(settings.printf_motors){
-			printf("%5.2f |", fstate.m[0]);
-			printf("%5.2f |", fstate.m[1]);
-			printf("%5.2f |", fstate.m[2]);
-			printf("%5.2f |", fstate.m[3]);
-			printf("%5.2f |", fstate.m[4]);
-			printf("%5.2f |", fstate.m[5]);
-		}
-		if(settings.printf_mode){
-			print_flight_mode(user_input.flight_mode);
+		if(snap.fstate.arm_state==DISARMED && prev_arm_state==ARMED){
+			__append_header();
 		}
+		// console updates are telemetry too, the header still goes out
+		if(!watchdog_shed(WATCHDOG_SHED_TELEMETRY)) __append_line(&snap);
+		__flush();
 
-		fflush(stdout);
-		prev_arm_state = fstate.arm_state;
+		prev_arm_state = snap.fstate.arm_state;
 		rc_usleep(1000000/PRINTF_MANAGER_HZ);
 	}
 	return NULL;
@@ -161,8 +264,13 @@ static void* __printf_manager_func(__attribute__ ((unused)) void* ptr)
 
 int printf_init()
 {
-	if(rc_pthread_create(&pthread, __printf_manager_func, NULL, SCHED_FIFO, PRINTF_MANAGER_PRI)<0){
-		fprintf(stderr,"ERROR in start_printf_manager, failed to start thread\n");
+	__open_output();
+	buf_len = 0;
+	frames_dropped = 0;
+	if(rc_pthread_create(&pthread, __printf_manager_func, NULL, rt_thread_policy(RT_THREAD_PRINTF), rt_thread_priority(RT_THREAD_PRINTF))<0){
+		fprintf(stderr,"ERROR in printf_init, failed to start thread\n");
+		if(out_fd_nonblock) close(out_fd);
+		out_fd = -1;
 		return -1;
 	}
 	rc_usleep(50000);
@@ -170,7 +278,8 @@ int printf_init()
 }
 
 
-int join_printf_manager_thread(){
+int printf_cleanup()
+{
 	int ret = 0;
 	if(initialized){
 		// wait for the thread to exit
@@ -178,6 +287,12 @@ int join_printf_manager_thread(){
 		if(ret==1) fprintf(stderr,"WARNING: printf_manager_thread exit timeout\n");
 		else if(ret==-1) fprintf(stderr,"ERROR: failed to join printf_manager thread\n");
 	}
+	if(initialized && ret==0){
+		if(out_fd_nonblock) close(out_fd);
+		out_fd = -1;
+		printf("\n");
+		if(frames_dropped) printf("printf_manager dropped %lu frames\n", frames_dropped);
+	}
 	initialized = 0;
 	return ret;
 }
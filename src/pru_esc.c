@@ -0,0 +1,206 @@
+/**
+ * @file pru_esc.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+
+#include <rc/pru.h>
+#include <rc/time.h>
+
+#include <pru_esc.h>
+#include <pru_esc_shared.h>
+
+#define PRU_ESC_BOOT_TIMEOUT_MS	100	// firmware picks up the configuration well within this
+#define PRU_ESC_READ_TRIES	4
+#define PRU_ESC_IDLE		-0.1	// same idle pulse as esc_output_idle()
+
+// pulse ranges rc_servo_send_esc_pulse_normalized() and
+// rc_servo_send_oneshot_pulse_normalized() use
+#define PWM_MIN_US		1000.0
+#define PWM_SPAN_US		1000.0
+#define ONESHOT_MIN_US		125.0
+#define ONESHOT_SPAN_US		125.0
+
+_Static_assert(PRU_ESC_LUT_LEN==THRUST_LUT_LEN, "PRU table must match thrust_curve_t");
+_Static_assert(PRU_ESC_MAX_ROTORS==MAX_ROTORS && PRU_ESC_INPUTS==MAX_INPUTS,
+						"PRU mixer must match mixer_t");
+
+static volatile pru_esc_shared_t* sh = NULL;
+static int running = 0;
+
+
+/**
+ * @brief      servo slot count for a pulse, the way rc_servo_send_pulse_us()
+ *             computes it
+ */
+static double __loops(double us)
+{
+	return us*(PRU_CLOCK_HZ/1000000)/PRU_SERVO_LOOP_CYCLES;
+}
+
+
+static int32_t __q16(double x)
+{
+	return (int32_t)lrint(x*PRU_ESC_ONE);
+}
+
+
+/**
+ * @brief      writes one command, cmd_seq is odd while it is incomplete
+ */
+static void __write_command(uint32_t mode, const scalar_t* u)
+{
+	int i;
+	uint32_t seq = sh->cmd_seq;
+
+	sh->cmd_seq = seq+1;
+	atomic_thread_fence(memory_order_release);
+	sh->cmd_mode = mode;
+	for(i=0;i<PRU_ESC_INPUTS;i++) sh->u[i] = u!=NULL ? __q16(u[i]) : 0;
+	atomic_thread_fence(memory_order_release);
+	sh->cmd_seq = seq+2;
+}
+
+
+int pru_esc_init(const mixer_t* mx, const thrust_curve_t* map,
+			esc_protocol_t protocol, int feedback_hz, int stall_ms)
+{
+	int i, j;
+	double min_us, span_us;
+	uint64_t start;
+	volatile uint32_t* mem;
+
+	running = 0;
+	if(mx==NULL || !mx->initialized || map==NULL || !map->initialized){
+		fprintf(stderr,"ERROR in pru_esc_init, mixer and thrust curve must be initialized\n");
+		return -1;
+	}
+	if(feedback_hz<1 || stall_ms<1){
+		fprintf(stderr,"ERROR in pru_esc_init, invalid loop rate or stall time\n");
+		return -1;
+	}
+	switch(protocol){
+	case ESC_PWM:
+		min_us = PWM_MIN_US;
+		span_us = PWM_SPAN_US;
+		break;
+	case ESC_ONESHOT125:
+		min_us = ONESHOT_MIN_US;
+		span_us = ONESHOT_SPAN_US;
+		break;
+	default:
+		fprintf(stderr,"ERROR in pru_esc_init, unknown protocol\n");
+		return -1;
+	}
+
+	mem = rc_pru_shared_mem_ptr();
+	if(mem==NULL){
+		fprintf(stderr,"ERROR in pru_esc_init, failed to map PRU shared memory\n");
+		return -1;
+	}
+	sh = (volatile pru_esc_shared_t*)((volatile char*)mem + PRU_ESC_SHARED_OFFSET);
+	// clear anything a previous run left so the firmware waits for us
+	sh->magic = 0;
+	sh->fw_state = 0;
+	sh->cmd_seq = 0;
+	sh->cmd_mode = PRU_ESC_CMD_IDLE;
+	if(rc_pru_start(PRU_ESC_CH, PRU_ESC_FW_NAME)){
+		fprintf(stderr,"ERROR in pru_esc_init, failed to start %s on PRU%d\n",
+						PRU_ESC_FW_NAME, PRU_ESC_CH);
+		return -1;
+	}
+
+	sh->version = PRU_ESC_VERSION;
+	sh->rotors = mx->rotors;
+	sh->period_cycles = PRU_CLOCK_HZ/feedback_hz;
+	sh->stall_cycles = (uint32_t)((uint64_t)PRU_CLOCK_HZ*stall_ms/1000);
+	sh->loops_min_q16 = (uint32_t)llrint(__loops(min_us)*PRU_ESC_ONE);
+	sh->loops_span_q16 = (uint32_t)llrint(__loops(span_us)*PRU_ESC_ONE);
+	sh->loops_idle = (uint32_t)__loops(min_us + PRU_ESC_IDLE*span_us);
+	for(i=0;i<PRU_ESC_MAX_ROTORS;i++){
+		for(j=0;j<PRU_ESC_INPUTS;j++){
+			sh->mix[i][j] = i<mx->rotors ? __q16(mx->matrix[i][j]) : 0;
+		}
+	}
+	for(i=0;i<PRU_ESC_LUT_LEN+2;i++) sh->lut[i] = __q16(map->lut[i]);
+	atomic_thread_fence(memory_order_release);
+	sh->magic = PRU_ESC_MAGIC;
+
+	start = rc_nanos_since_boot();
+	while(sh->fw_state!=PRU_ESC_FW_RUNNING){
+		if(sh->fw_state==PRU_ESC_FW_BAD_CONFIG){
+			fprintf(stderr,"ERROR in pru_esc_init, firmware rejected the configuration\n");
+			rc_pru_stop(PRU_ESC_CH);
+			return -1;
+		}
+		if(rc_nanos_since_boot()-start > PRU_ESC_BOOT_TIMEOUT_MS*1000000ULL){
+			fprintf(stderr,"ERROR in pru_esc_init, no answer from %s\n", PRU_ESC_FW_NAME);
+			rc_pru_stop(PRU_ESC_CH);
+			return -1;
+		}
+		rc_usleep(1000);
+	}
+	running = 1;
+	return 0;
+}
+
+
+int pru_esc_running()
+{
+	return running;
+}
+
+
+int pru_esc_send(const scalar_t* u)
+{
+	if(!running) return -1;
+	__write_command(PRU_ESC_CMD_RUN, u);
+	return 0;
+}
+
+
+int pru_esc_idle()
+{
+	if(!running) return -1;
+	__write_command(PRU_ESC_CMD_IDLE, NULL);
+	return 0;
+}
+
+
+int pru_esc_signals(scalar_t* m, int n)
+{
+	int i, tries;
+	uint32_t seq;
+	int32_t tmp[PRU_ESC_MAX_ROTORS];
+
+	if(!running || n<1 || n>PRU_ESC_MAX_ROTORS) return -1;
+	for(tries=0;tries<PRU_ESC_READ_TRIES;tries++){
+		seq = sh->status_seq;
+		if(seq&1) continue;
+		atomic_thread_fence(memory_order_acquire);
+		for(i=0;i<n;i++) tmp[i] = sh->m[i];
+		atomic_thread_fence(memory_order_acquire);
+		if(sh->status_seq!=seq) continue;
+		for(i=0;i<n;i++) m[i] = (scalar_t)tmp[i]/PRU_ESC_ONE;
+		return 0;
+	}
+	return -1;
+}
+
+
+int pru_esc_cleanup()
+{
+	if(!running) return 0;
+	__write_command(PRU_ESC_CMD_IDLE, NULL);
+	// give the firmware a moment to send the idle pulses before it stops
+	rc_usleep(1000);
+	running = 0;
+	if(rc_pru_stop(PRU_ESC_CH)){
+		fprintf(stderr,"ERROR in pru_esc_cleanup, failed to stop PRU%d\n", PRU_ESC_CH);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,214 @@
+/**
+ * @file rt_setup.c
+ */
+
+#define _GNU_SOURCE // for CPU_SET and pthread affinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include <rt_setup.h>
+#include <settings.h>
+#include <thread_defs.h>
+
+#define RT_STACK_PREFAULT	(64*1024)	// bytes touched on each stack
+
+/**
+ * what a thread actually got, filled in by rt_setup_thread()
+ */
+typedef struct rt_thread_status_t{
+	int running;
+	int policy;
+	int priority;
+	int pinned;		///< 1 if the affinity request succeeded
+	int ncpus;		///< number of cpus the thread may run on
+} rt_thread_status_t;
+
+static const char* names[RT_NUM_THREADS] = {
+	"feedback", "input", "printf", "log", "telemetry", "mocap", "battery", "altitude",
+	"watchdog"
+};
+
+static int memory_locked;
+static int lock_errno;
+static int heap_prefaulted_kb;
+static rt_thread_status_t status[RT_NUM_THREADS];
+
+
+const char* rt_thread_name(rt_thread_t thread)
+{
+	if(thread<0 || thread>=RT_NUM_THREADS) return NULL;
+	return names[thread];
+}
+
+
+void rt_setup_default_config(rt_thread_config_t* cfg)
+{
+	int i;
+	for(i=0;i<RT_NUM_THREADS;i++){
+		cfg[i].policy = SCHED_FIFO;
+		cfg[i].cpu = -1;
+	}
+	cfg[RT_THREAD_FEEDBACK].priority	= FEEDBACK_PRI;
+	cfg[RT_THREAD_INPUT].priority		= INPUT_MANAGER_PRI;
+	cfg[RT_THREAD_PRINTF].priority		= PRINTF_MANAGER_PRI;
+	cfg[RT_THREAD_LOG].priority		= LOG_MANAGER_PRI;
+	cfg[RT_THREAD_MOCAP].priority		= MAVLINK_RX_PRI;
+	cfg[RT_THREAD_ALTITUDE].priority	= ALTITUDE_MANAGER_PRI;
+	cfg[RT_THREAD_WATCHDOG].priority	= WATCHDOG_PRI;
+	cfg[RT_THREAD_TELEMETRY].policy		= SCHED_OTHER;
+	cfg[RT_THREAD_TELEMETRY].priority	= MAVLINK_MANAGER_PRI;
+	cfg[RT_THREAD_BATTERY].policy		= SCHED_OTHER;
+	cfg[RT_THREAD_BATTERY].priority		= BATTERY_MANAGER_PRI;
+}
+
+
+int rt_thread_policy(rt_thread_t thread)
+{
+	return settings.rt_threads[thread].policy;
+}
+
+
+int rt_thread_priority(rt_thread_t thread)
+{
+	return settings.rt_threads[thread].priority;
+}
+
+
+/**
+ * @brief      touches every page of a block of stack so it is mapped before
+ *             the thread does anything time critical
+ */
+static void __prefault_stack()
+{
+	volatile char buf[RT_STACK_PREFAULT];
+	long page = sysconf(_SC_PAGESIZE);
+	int i;
+
+	if(page<=0) page = 4096;
+	for(i=0;i<RT_STACK_PREFAULT;i+=page) buf[i] = 0;
+	(void)buf;
+}
+
+
+int rt_setup_process()
+{
+	int ret = 0;
+	size_t len;
+	long page;
+	char* heap;
+
+	if(settings.rt_lock_memory){
+		if(mlockall(MCL_CURRENT | MCL_FUTURE)){
+			lock_errno = errno;
+			ret = -1;
+		}
+		else memory_locked = 1;
+	}
+
+	if(settings.rt_prefault_heap_kb>0){
+		// keep freed memory in the process instead of returning it to the
+		// kernel, and never satisfy malloc with a fresh mmap
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+		len = (size_t)settings.rt_prefault_heap_kb*1024;
+		heap = malloc(len);
+		if(heap==NULL) ret = -1;
+		else{
+			page = sysconf(_SC_PAGESIZE);
+			if(page<=0) page = 4096;
+			for(size_t i=0;i<len;i+=page) ((volatile char*)heap)[i] = 0;
+			free(heap);
+			heap_prefaulted_kb = settings.rt_prefault_heap_kb;
+		}
+	}
+
+	__prefault_stack();
+	return ret;
+}
+
+
+int rt_setup_thread(rt_thread_t thread)
+{
+	rt_thread_status_t* s;
+	struct sched_param param;
+	cpu_set_t set;
+	int ret = 0, cpu;
+
+	if(thread<0 || thread>=RT_NUM_THREADS){
+		fprintf(stderr,"ERROR in rt_setup_thread, invalid thread\n");
+		return -1;
+	}
+	s = &status[thread];
+	__prefault_stack();
+
+	cpu = settings.rt_threads[thread].cpu;
+	s->pinned = 0;
+	if(cpu>=CPU_SETSIZE) ret = -1;
+	else if(cpu>=0){
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) ret = -1;
+		else s->pinned = 1;
+	}
+	s->ncpus = 0;
+	if(pthread_getaffinity_np(pthread_self(), sizeof(set), &set)==0){
+		s->ncpus = CPU_COUNT(&set);
+	}
+	// record what the thread was really created with
+	if(pthread_getschedparam(pthread_self(), &s->policy, &param)==0){
+		s->priority = param.sched_priority;
+	}
+	s->running = 1;
+	return ret;
+}
+
+
+static const char* __policy_name(int policy)
+{
+	switch(policy){
+	case SCHED_FIFO:
+		return "SCHED_FIFO";
+	case SCHED_RR:
+		return "SCHED_RR";
+	case SCHED_OTHER:
+		return "SCHED_OTHER";
+	default:
+		return "unknown";
+	}
+}
+
+
+void rt_setup_report()
+{
+	rt_thread_config_t* c;
+	rt_thread_status_t* s;
+	int i;
+
+	printf("real-time setup:\n");
+	if(memory_locked) printf("  memory locked:   yes\n");
+	else if(settings.rt_lock_memory) printf("  memory locked:   NO, mlockall failed: %s\n", strerror(lock_errno));
+	else printf("  memory locked:   no, disabled in settings\n");
+	printf("  heap prefaulted: %d kB\n", heap_prefaulted_kb);
+	printf("  %-10s %-12s %-5s %-6s %s\n", "thread", "policy", "prio", "cpus", "requested");
+	for(i=0;i<RT_NUM_THREADS;i++){
+		c = &settings.rt_threads[i];
+		s = &status[i];
+		if(!s->running){
+			printf("  %-10s not running\n", names[i]);
+			continue;
+		}
+		printf("  %-10s %-12s %-5d %-6d %s %d", names[i], __policy_name(s->policy),
+				s->priority, s->ncpus, __policy_name(c->policy), c->priority);
+		if(c->cpu>=0) printf(" cpu %d%s", c->cpu, s->pinned ? "" : " FAILED");
+		if(s->policy!=c->policy || s->priority!=c->priority) printf(" NOT OBTAINED");
+		printf("\n");
+	}
+	fflush(stdout);
+}
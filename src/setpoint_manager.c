@@ -6,8 +6,11 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h> // for memset
+#include <stdatomic.h>
 
 #include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/math/other.h>
 
 #include <setpoint_manager.h>
 #include <settings.h>
@@ -15,155 +18,376 @@
 #include <feedback.h>
 #include <rc_pilot_defs.h>
 #include <flight_mode.h>
+#include <seqlock.h>
 
 
 setpoint_t setpoint; // extern variable in setpoint_manager.h
 
-void __direct_throttle()
+#define MAX_READ_TRIES		8	// a publish takes well under 1us
+#define INTERP_MAX_PERIOD_NS	50000000 // longer gaps between frames are a lost link
+
+// latest frame from setpoint_manager_input(), written by the DSM thread
+static seqlock_t input_lock = SEQLOCK_INITIALIZER;
+static user_input_t input_pub;
+static uint64_t input_pub_ns;
+// newest frame fetched by setpoint_manager_update() and the one before it,
+// only touched by the feedback ISR
+static user_input_t input_cur, input_prev;
+static uint64_t cur_ns, prev_ns;
+static uint64_t cur_seq;	// completed publishes when input_cur was copied
+static uint64_t apply_ns;	// last __apply_input() by the ISR, 0 before the first
+
+// set by setpoint_manager_lock_arming(), cleared by the ISR on a DISARMED frame
+static atomic_int arming_locked;
+
+static void __direct_throttle(setpoint_t* sp, const user_input_t* in)
 {
 	double tmp;
 	// translate throttle stick (-1,1) to throttle (0,1)
 	// then scale and shift to be between thrust min/max
 	// Z-throttle should be negative since Z points down
-	tmp = (user_input.thr_stick + 1.0)/2.0;
+	tmp = (in->thr_stick + 1.0)/2.0;
 	tmp = tmp * (MAX_Z_COMPONENT - MIN_Z_COMPONENT);
-	setpoint.Z_throttle = -(tmp + MIN_Z_COMPONENT);
+	sp->Z_throttle = -(tmp + MIN_Z_COMPONENT);
 	return;
 }
 
-void __direct_yaw()
+static void __direct_yaw(setpoint_t* sp, const user_input_t* in, double dt)
 {
-	// if throttle stick is down all the way, probably landed, so
-	// keep the yaw setpoint at current yaw so it takes off straight
-	if(user_input.thr_stick < -0.95){
-		setpoint.yaw = fstate.yaw;
-		setpoint.yaw_rate = 0.0;
-	}
-	// otherwise, scale yaw_rate by max yaw rate in rad/s
-	// and move yaw setpoint
-	else{
-		setpoint.yaw_rate = user_input.yaw_stick * MAX_YAW_RATE;
-		setpoint.yaw_rate += setpoint.yaw_rate/settings.feedback_hz;
-	}
+	// with the throttle stick all the way down __track_attitude() holds the
+	// yaw setpoint instead. Otherwise scale yaw_rate by max yaw rate in rad/s
+	// and move the yaw setpoint by it over the time since the last update
+	if(in->thr_stick < -0.95) return;
+	sp->yaw_rate = in->yaw_stick * MAX_YAW_RATE;
+	sp->yaw += sp->yaw_rate*dt;
 	return;
 }
 
-int setpoint_manager_init()
+static void __altitude_hold(setpoint_t* sp, const user_input_t* in)
 {
-	if(setpoint.initialized){
-		fprintf(stderr, "ERROR in setpoint_manager_init, already initialized\n");
-		return -1;
-	}
-	memset(&setpoint,0,sizeof(setpoint_t));
-	setpoint.initialized = 1;
-	return 0;
+	// throttle stick sets the climb rate, feedback integrates it into the
+	// altitude setpoint. Z_throttle is still filled in since feedback falls
+	// back to it without a fresh altitude estimate.
+	sp->en_alt_ctrl = 1;
+	if(fabs(in->thr_stick) < THROTTLE_DEADZONE) sp->altitude_rate = 0.0;
+	else sp->altitude_rate = in->thr_stick * MAX_CLIMB_RATE;
+	__direct_throttle(sp, in);
+	return;
 }
 
+/**
+ * @brief      the setpoints that follow the vehicle instead of the sticks, run
+ *             on every update whether a new frame arrived or not
+ */
+static void __track_attitude(setpoint_t* sp, const feedback_state_t* fs, const user_input_t* in)
+{
+	switch(in->flight_mode){
+	case DIRECT_THROTTLE_4DOF:
+	case DIRECT_THROTTLE_6DOF:
+	case ALT_HOLD_4DOF:
+	case ALT_HOLD_6DOF:
+		// if throttle stick is down all the way, probably landed, so
+		// keep the yaw setpoint at current yaw so it takes off straight
+		if(in->thr_stick < -0.95){
+			sp->yaw = fs->yaw;
+			sp->yaw_rate = 0.0;
+		}
+		break;
 
+	case ACRO_4DOF:
+		// keep the angle setpoints on the vehicle so switching to an angle
+		// mode picks up from the current attitude
+		sp->roll = fs->roll;
+		sp->pitch = fs->pitch;
+		sp->yaw = fs->yaw;
+		break;
 
-int setpoint_manager_update()
-{
-	if(setpoint.initialized==0){
-		fprintf(stderr, "ERROR in setpoint_manager_update, not initialized yet\n");
-		return -1;
+	default:
+		break;
 	}
+}
 
-	if(user_input.initialized==0){
-		fprintf(stderr, "ERROR in setpoint_manager_update, input_manager not initialized yet\n");
-		return -1;
-	}
 
-	// if PAUSED or UNINITIALIZED, do nothing
-	if(rc_get_state()!=RUNNING) return 0;
+/**
+ * @brief      copies a frame published since the last call into input_cur
+ *
+ *             Checking for a new frame is a single atomic load, only a new
+ *             frame is copied. If the DSM thread keeps publishing during the
+ *             copy the frame is picked up on the next call instead.
+ *
+ * @return     1 if a new frame was fetched, 0 otherwise
+ */
+static int __fetch_input()
+{
+	int i;
+	uint_fast32_t seq;
+	user_input_t in;
+	uint64_t t;
 
-	// shutdown feedback on kill switch
-	if(user_input.requested_arm_mode == DISARMED){
-		if(fstate.arm_state==ARMED) feedback_disarm();
-		return 0;
+	if(seqlock_writes(&input_lock)==cur_seq) return 0;
+	for(i=0;i<MAX_READ_TRIES;i++){
+		seq = seqlock_read_begin(&input_lock);
+		in = input_pub;
+		t = input_pub_ns;
+		if(!seqlock_read_retry(&input_lock, seq)) break;
 	}
+	if(i==MAX_READ_TRIES) return 0;
+	input_prev = input_cur;
+	prev_ns = cur_ns;
+	input_cur = in;
+	cur_ns = t;
+	cur_seq = seq/2;
+	return 1;
+}
+
+
+/**
+ * @brief      fills in the sticks smoothed or predicted between input_prev and
+ *             input_cur at time now, leaves them as in input_cur when the two
+ *             frames can't be blended
+ */
+static void __interp_sticks(user_input_t* in, uint64_t now)
+{
+	double k, period;
+
+	if(settings.setpoint_interp==SETPOINT_INTERP_HOLD || prev_ns==0) return;
+	if(input_prev.flight_mode!=input_cur.flight_mode) return;
+	if(input_prev.requested_arm_mode!=ARMED || input_cur.requested_arm_mode!=ARMED) return;
+	if(cur_ns<=prev_ns || cur_ns-prev_ns>INTERP_MAX_PERIOD_NS) return;
+
+	period = cur_ns - prev_ns;
+	k = now>cur_ns ? (now-cur_ns)/period : 0.0;
+	if(k>1.0) k = 1.0;
+	// smoothing lags one period behind the newest frame: blend from the
+	// previous frame at arrival to the newest one period later. Prediction
+	// continues the slope past the newest frame.
+	if(settings.setpoint_interp==SETPOINT_INTERP_SMOOTH) k -= 1.0;
+	in->thr_stick	= input_cur.thr_stick + k*(input_cur.thr_stick-input_prev.thr_stick);
+	in->roll_stick	= input_cur.roll_stick + k*(input_cur.roll_stick-input_prev.roll_stick);
+	in->pitch_stick	= input_cur.pitch_stick + k*(input_cur.pitch_stick-input_prev.pitch_stick);
+	in->yaw_stick	= input_cur.yaw_stick + k*(input_cur.yaw_stick-input_prev.yaw_stick);
+	rc_saturate_double(&in->thr_stick,   -1.0, 1.0);
+	rc_saturate_double(&in->roll_stick,  -1.0, 1.0);
+	rc_saturate_double(&in->pitch_stick, -1.0, 1.0);
+	rc_saturate_double(&in->yaw_stick,   -1.0, 1.0);
+}
 
+
+/**
+ * @brief      translates the sticks to the setpoint for the flight mode
+ *
+ * @param      sp    setpoint to update
+ * @param[in]  in    the sticks
+ * @param[in]  dt    time the yaw rate is integrated over (s)
+ */
+static void __apply_input(setpoint_t* sp, const user_input_t* in, double dt)
+{
 	// finally, switch between flight modes and adjust setpoint properly
-	switch(user_input.flight_mode){
+	switch(in->flight_mode){
 
 
 	case TEST_BENCH_4DOF:
-		setpoint.en_alt_ctrl = 0;
-		setpoint.en_rpy_ctrl = 0;
-		setpoint.en_6dof = 0;
-		setpoint.roll_throttle = user_input.roll_stick;
-		setpoint.pitch_throttle = user_input.pitch_stick;
-		setpoint.yaw_throttle = user_input.yaw_stick;
-		setpoint.Z_throttle = -user_input.thr_stick;
+		sp->en_alt_ctrl = 0;
+		sp->en_rpy_ctrl = 0;
+		sp->en_rate_ctrl = 0;
+		sp->en_6dof = 0;
+		sp->roll_throttle = in->roll_stick;
+		sp->pitch_throttle = in->pitch_stick;
+		sp->yaw_throttle = in->yaw_stick;
+		sp->Z_throttle = -in->thr_stick;
 		break;
 
 	case TEST_BENCH_6DOF:
-		setpoint.en_alt_ctrl = 0;
-		setpoint.en_rpy_ctrl = 0;
-		setpoint.en_6dof = 1;
-		setpoint.X_throttle = -user_input.pitch_stick;
-		setpoint.Y_throttle = user_input.roll_stick;
-		setpoint.roll_throttle = 0.0;
-		setpoint.pitch_throttle = 0.0;
-		setpoint.yaw_throttle = user_input.yaw_stick;
-		setpoint.Z_throttle = -user_input.thr_stick;
+		sp->en_alt_ctrl = 0;
+		sp->en_rpy_ctrl = 0;
+		sp->en_rate_ctrl = 0;
+		sp->en_6dof = 1;
+		sp->X_throttle = -in->pitch_stick;
+		sp->Y_throttle = in->roll_stick;
+		sp->roll_throttle = 0.0;
+		sp->pitch_throttle = 0.0;
+		sp->yaw_throttle = in->yaw_stick;
+		sp->Z_throttle = -in->thr_stick;
 		break;
 
 	case DIRECT_THROTTLE_4DOF:
-		setpoint.en_alt_ctrl = 0;
-		setpoint.en_rpy_ctrl = 1;
-		setpoint.en_6dof = 0;
-		setpoint.roll = user_input.roll_stick;
-		setpoint.pitch = user_input.pitch_stick;
-		__direct_throttle();
-		__direct_yaw();
+		sp->en_alt_ctrl = 0;
+		sp->en_rpy_ctrl = 1;
+		sp->en_rate_ctrl = 0;
+		sp->en_6dof = 0;
+		sp->roll = in->roll_stick;
+		sp->pitch = in->pitch_stick;
+		__direct_throttle(sp, in);
+		__direct_yaw(sp, in, dt);
 		break;
 
 	case DIRECT_THROTTLE_6DOF:
-		setpoint.en_alt_ctrl = 0;
-		setpoint.en_rpy_ctrl = 1;
-		setpoint.en_6dof = 0;
-		setpoint.roll = 0.0;
-		setpoint.pitch = 0.0;
-		setpoint.X_throttle = -user_input.pitch_stick;
-		setpoint.Y_throttle = user_input.roll_stick;
-		__direct_throttle();
-		__direct_yaw();
+		sp->en_alt_ctrl = 0;
+		sp->en_rpy_ctrl = 1;
+		sp->en_rate_ctrl = 0;
+		sp->en_6dof = 0;
+		sp->roll = 0.0;
+		sp->pitch = 0.0;
+		sp->X_throttle = -in->pitch_stick;
+		sp->Y_throttle = in->roll_stick;
+		__direct_throttle(sp, in);
+		__direct_yaw(sp, in, dt);
 		break;
 
 	case ALT_HOLD_4DOF:
-		setpoint.en_alt_ctrl = 0;
-		setpoint.en_rpy_ctrl = 1;
-		setpoint.en_6dof = 0;
-		setpoint.roll = user_input.roll_stick;
-		setpoint.pitch = user_input.pitch_stick;
-		__direct_throttle();
-		__direct_yaw();
+		sp->en_rpy_ctrl = 1;
+		sp->en_rate_ctrl = 0;
+		sp->en_6dof = 0;
+		sp->roll = in->roll_stick;
+		sp->pitch = in->pitch_stick;
+		__altitude_hold(sp, in);
+		__direct_yaw(sp, in, dt);
 		break;
 
 	case ALT_HOLD_6DOF:
-		setpoint.en_alt_ctrl = 0;
-		setpoint.en_rpy_ctrl = 1;
-		setpoint.en_6dof = 0;
-		setpoint.roll = 0.0;
-		setpoint.pitch = 0.0;
-		setpoint.X_throttle = -user_input.pitch_stick;
-		setpoint.Y_throttle = user_input.roll_stick;
-		__direct_throttle();
-		__direct_yaw();
+		sp->en_rpy_ctrl = 1;
+		sp->en_rate_ctrl = 0;
+		sp->en_6dof = 0;
+		sp->roll = 0.0;
+		sp->pitch = 0.0;
+		sp->X_throttle = -in->pitch_stick;
+		sp->Y_throttle = in->roll_stick;
+		__altitude_hold(sp, in);
+		__direct_yaw(sp, in, dt);
+		break;
+
+	case ACRO_4DOF:
+		sp->en_alt_ctrl = 0;
+		sp->en_rpy_ctrl = 0;
+		sp->en_rate_ctrl = 1;
+		sp->en_6dof = 0;
+		sp->roll_rate = in->roll_stick * MAX_ROLL_RATE;
+		sp->pitch_rate = in->pitch_stick * MAX_PITCH_RATE;
+		sp->yaw_rate = in->yaw_stick * MAX_YAW_RATE;
+		__direct_throttle(sp, in);
 		break;
 
 	default: // should never get here
 		fprintf(stderr,"ERROR in setpoint_manager thread, unknown flight mode\n");
 		break;
 
-	} // end switch(user_input.flight_mode)
+	} // end switch(in->flight_mode)
+}
+
+
+int setpoint_manager_init()
+{
+	if(setpoint.initialized){
+		fprintf(stderr, "ERROR in setpoint_manager_init, already initialized\n");
+		return -1;
+	}
+	memset(&setpoint,0,sizeof(setpoint_t));
+	setpoint.initialized = 1;
+	return 0;
+}
+
+
+void setpoint_manager_input(const user_input_t* in, uint64_t time_ns)
+{
+	seqlock_write_begin(&input_lock);
+	input_pub = *in;
+	input_pub_ns = time_ns;
+	seqlock_write_end(&input_lock);
+}
+
+
+const user_input_t* setpoint_manager_last_input()
+{
+	return &input_cur;
+}
+
+
+
+int setpoint_manager_update()
+{
+	user_input_t in;
+	uint64_t now;
+	double dt;
+	int ret = 0;
+
+	if(setpoint.initialized==0){
+		fprintf(stderr, "ERROR in setpoint_manager_update, not initialized yet\n");
+		return -1;
+	}
+
+	if(user_input.initialized==0){
+		fprintf(stderr, "ERROR in setpoint_manager_update, input_manager not initialized yet\n");
+		return -1;
+	}
+
+	// always take the newest frame so readers of setpoint_manager_last_input()
+	// see it even while paused
+	__fetch_input();
+
+	// if PAUSED or UNINITIALIZED, do nothing
+	if(rc_get_state()!=RUNNING){
+		apply_ns = 0;
+		return 0;
+	}
+
+	// shutdown feedback on kill switch, this also ends a lock on arming
+	if(input_cur.requested_arm_mode == DISARMED){
+		apply_ns = 0;
+		if(fstate.arm_state==ARMED) feedback_disarm();
+		atomic_store(&arming_locked, 0);
+		return 0;
+	}
+
+	// the sticks only change with a new frame, unless they are smoothed or
+	// predicted in between
+	in = input_cur;
+	if(cur_seq!=setpoint.input_seq){
+		setpoint.input_time_ns = cur_ns;
+		setpoint.input_seq = cur_seq;
+		ret = 1;
+	}
+	if(ret || settings.setpoint_interp!=SETPOINT_INTERP_HOLD){
+		now = rc_nanos_since_boot();
+		// the yaw rate holds from one apply to the next: every setpoint tick
+		// when interpolating, otherwise the measured time between frames. A
+		// gap longer than a lost link or the first apply counts as one tick.
+		dt = (double)settings.setpoint_divisor/settings.feedback_hz;
+		if(settings.setpoint_interp==SETPOINT_INTERP_HOLD && apply_ns!=0 &&
+				now>apply_ns && now-apply_ns<=INTERP_MAX_PERIOD_NS){
+			dt = (now-apply_ns)/1e9;
+		}
+		apply_ns = now;
+		__interp_sticks(&in, now);
+		__apply_input(&setpoint, &in, dt);
+	}
+	__track_attitude(&setpoint, &fstate, &in);
 
-	// arm feedback when requested
-	if(user_input.requested_arm_mode == ARMED){
+	// arm feedback when requested, unless the request predates a forced
+	// disarm
+	if(input_cur.requested_arm_mode == ARMED && !atomic_load(&arming_locked)){
 		if(fstate.arm_state==DISARMED) feedback_arm();
 	}
 
-	return 0;
+	return ret;
+}
+
+
+void setpoint_manager_apply(setpoint_t* sp, const feedback_state_t* fs, const user_input_t* in, double dt)
+{
+	__apply_input(sp, in, dt);
+	__track_attitude(sp, fs, in);
+}
+
+
+void setpoint_manager_lock_arming()
+{
+	atomic_store(&arming_locked, 1);
+}
+
+
+int setpoint_manager_arming_locked()
+{
+	return atomic_load(&arming_locked);
 }
 
 
@@ -7,14 +7,28 @@
 
 #include <stdio.h>
 #include <string.h>	// FOR str_cmp()
+#include <sched.h>	// for SCHED_FIFO
 #include <fcntl.h>	// for F_OK
 #include <unistd.h>	// for access()
+#include <stdint.h>
+#include <stddef.h>	// for offsetof()
+#include <limits.h>	// for PATH_MAX
+#include <sys/stat.h>
 
 #include <json-c/json.h>
 #include <rc/math/filter.h>
 
 #include <settings.h>
 #include <rc_pilot_defs.h>
+#include <thread_defs.h> // for MAVLINK_MANAGER_HZ
+
+#define TELEMETRY_DEFAULT_IP	"127.0.0.1"
+
+// binary image of the validated settings written next to the json file
+#define SETTINGS_CACHE_SUFFIX	".cache"
+#define SETTINGS_CACHE_MAGIC	0x53505243	// "CRPS"
+#define SETTINGS_CACHE_VERSION	2		// bump when a field changes meaning
+#define SETTINGS_CACHE_MAX_TF	16		// max coefficients per controller
 
 
 // json object respresentation of the whole settings file
@@ -28,10 +42,60 @@ static rc_filter_t roll_controller;
 static rc_filter_t pitch_controller;
 static rc_filter_t yaw_controller;
 static rc_filter_t altitude_controller;
+static rc_filter_t roll_rate_controller;
+static rc_filter_t pitch_rate_controller;
+static rc_filter_t yaw_rate_controller;
+
+static int __load_json(const char* path);
+static int __parse_controllers(json_object* obj, rc_filter_t* const* out);
+
+static rc_filter_t* const controllers[SETTINGS_NUM_CONTROLLERS] = {
+	&roll_controller, &pitch_controller, &yaw_controller, &altitude_controller,
+	&roll_rate_controller, &pitch_rate_controller, &yaw_rate_controller
+};
+
+// names in the json file, same order as settings_controller_t
+static const char* const controller_names[SETTINGS_NUM_CONTROLLERS] = {
+	"roll_controller", "pitch_controller", "yaw_controller", "altitude_controller",
+	"roll_rate_controller", "pitch_rate_controller", "yaw_rate_controller"
+};
 
 // if anything goes wrong set this flag back to 0
 static int was_load_successful = 0;
 
+// json file the settings were last loaded from, reread by
+// settings_load_controllers()
+static char loaded_path[PATH_MAX];
+
+/**
+ * discrete controller as stored in the cache, after c2d so loading it doesn't
+ * redo the tustin approximation
+ */
+typedef struct cached_filter_t{
+	int num_len;
+	int den_len;
+	double dt;
+	double gain;
+	double num[SETTINGS_CACHE_MAX_TF];
+	double den[SETTINGS_CACHE_MAX_TF];
+} cached_filter_t;
+
+/**
+ * Layout of the cache file. It is only valid for the json file with the same
+ * modification time and size, and for a binary with the same settings_t, so
+ * the whole thing is read and written in one go with no conversion.
+ */
+typedef struct settings_cache_t{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			///< sizeof(settings_cache_t) of the writer
+	uint32_t crc;			///< crc32 of everything from src_mtime_ns on
+	int64_t src_mtime_ns;		///< modification time of the json file
+	int64_t src_size;		///< size of the json file in bytes
+	settings_t settings;
+	cached_filter_t ctl[SETTINGS_NUM_CONTROLLERS];
+} settings_cache_t;
+
 
 // macro for reading a boolean
 #define PARSE_BOOL(name) \
@@ -45,6 +109,18 @@ if(json_object_is_type(tmp, json_type_boolean)==0){\
 }\
 settings.name = json_object_get_boolean(tmp);\
 
+// macro for reading an optional boolean, missing entries take the default so
+// settings files written by older versions still load
+#define PARSE_BOOL_OPTIONAL(name,default) \
+if(json_object_object_get_ex(jobj, #name, &tmp)==0){\
+	settings.name = default;\
+}\
+else if(json_object_is_type(tmp, json_type_boolean)==0){\
+	fprintf(stderr,"ERROR parsing settings file, " #name " should be a boolean\n");\
+	return -1;\
+}\
+else settings.name = json_object_get_boolean(tmp);\
+
 // macro for reading a integer
 #define PARSE_INT(name) \
 if(json_object_object_get_ex(jobj, #name, &tmp)==0){ \
@@ -73,6 +149,23 @@ if(settings.name<min || settings.name>max){\
 	return -1;\
 }\
 
+// macro for reading an optional bound integer, missing entries take the default
+#define PARSE_INT_MIN_MAX_OPTIONAL(name,min,max,default) \
+if(json_object_object_get_ex(jobj, #name, &tmp)==0){ \
+	settings.name = default;\
+}\
+else if(json_object_is_type(tmp, json_type_int)==0){\
+	fprintf(stderr,"ERROR parsing settings file, " #name " should be an int\n");\
+	return -1;\
+}\
+else{\
+	settings.name = json_object_get_int(tmp);\
+	if(settings.name<min || settings.name>max){\
+		fprintf(stderr,"ERROR parsing settings file, " #name " should be between min and max\n");\
+		return -1;\
+	}\
+}\
+
 // macro for reading a polarity which should be +-1
 #define PARSE_POLARITY(name) \
 if(json_object_object_get_ex(jobj, #name, &tmp)==0){ \
@@ -181,6 +274,284 @@ int __parse_thrust_map()
 }
 
 
+/**
+ * @brief      parses the optional esc_protocol string, PWM if not given
+ *
+ * @return     0 on success, -1 on failure
+ */
+int __parse_esc_protocol()
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	if(json_object_object_get_ex(jobj, "esc_protocol", &tmp)==0){
+		settings.esc_protocol = ESC_PWM;
+		return 0;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: esc_protocol should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	if(strcmp(tmp_str, "ESC_PWM")==0){
+		settings.esc_protocol = ESC_PWM;
+	}
+	else if(strcmp(tmp_str, "ESC_ONESHOT125")==0){
+		settings.esc_protocol = ESC_ONESHOT125;
+	}
+	else if(strcmp(tmp_str, "ESC_MULTISHOT")==0 || strcmp(tmp_str, "ESC_DSHOT")==0){
+		// the servo PRU firmware only times pulses in whole microseconds
+		// and has no DShot framing
+		fprintf(stderr,"ERROR: %s is not supported by the servo PRU firmware\n", tmp_str);
+		return -1;
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid esc_protocol string\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      parses the optional mix_allocation string, greedy if not given
+ *
+ * @return     0 on success, -1 on failure
+ */
+int __parse_mix_allocation()
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	if(json_object_object_get_ex(jobj, "mix_allocation", &tmp)==0){
+		settings.mix_allocation = MIX_ALLOC_GREEDY;
+		return 0;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: mix_allocation should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	if(strcmp(tmp_str, "MIX_ALLOC_GREEDY")==0){
+		settings.mix_allocation = MIX_ALLOC_GREEDY;
+	}
+	else if(strcmp(tmp_str, "MIX_ALLOC_PRIORITY")==0){
+		settings.mix_allocation = MIX_ALLOC_PRIORITY;
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid mix_allocation string\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      parses the optional imu_source string, the DMP if not given
+ *
+ * @return     0 on success, -1 on failure
+ */
+int __parse_imu_source()
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	if(json_object_object_get_ex(jobj, "imu_source", &tmp)==0){
+		settings.imu_source = IMU_SOURCE_DMP;
+		return 0;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: imu_source should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	if(strcmp(tmp_str, "IMU_SOURCE_DMP")==0){
+		settings.imu_source = IMU_SOURCE_DMP;
+	}
+	else if(strcmp(tmp_str, "IMU_SOURCE_FIFO")==0){
+		settings.imu_source = IMU_SOURCE_FIFO;
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid imu_source string\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      parses the optional setpoint_interp string, hold if not given
+ *
+ * @return     0 on success, -1 on failure
+ */
+int __parse_setpoint_interp()
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	if(json_object_object_get_ex(jobj, "setpoint_interp", &tmp)==0){
+		settings.setpoint_interp = SETPOINT_INTERP_HOLD;
+		return 0;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: setpoint_interp should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	if(strcmp(tmp_str, "SETPOINT_INTERP_HOLD")==0){
+		settings.setpoint_interp = SETPOINT_INTERP_HOLD;
+	}
+	else if(strcmp(tmp_str, "SETPOINT_INTERP_SMOOTH")==0){
+		settings.setpoint_interp = SETPOINT_INTERP_SMOOTH;
+	}
+	else if(strcmp(tmp_str, "SETPOINT_INTERP_PREDICT")==0){
+		settings.setpoint_interp = SETPOINT_INTERP_PREDICT;
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid setpoint_interp string\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      parses the optional telemetry_ip string
+ *
+ * @return     0 on success, -1 on failure
+ */
+int __parse_telemetry_ip()
+{
+	struct json_object *tmp = NULL;
+	const char* tmp_str = TELEMETRY_DEFAULT_IP;
+	if(json_object_object_get_ex(jobj, "telemetry_ip", &tmp)){
+		if(json_object_is_type(tmp, json_type_string)==0){
+			fprintf(stderr,"ERROR: telemetry_ip should be a string\n");
+			return -1;
+		}
+		tmp_str = json_object_get_string(tmp);
+	}
+	if(strlen(tmp_str)>=sizeof(settings.telemetry_ip)){
+		fprintf(stderr,"ERROR: telemetry_ip should be a dotted IPv4 address\n");
+		return -1;
+	}
+	strcpy(settings.telemetry_ip, tmp_str);
+	return 0;
+}
+
+
+/**
+ * @brief      parses one thread entry of the realtime object, fields that are
+ *             missing keep their defaults
+ *
+ * @return     0 on success, -1 on failure
+ */
+int __parse_rt_thread(json_object* jobj_thread, const char* name, rt_thread_config_t* cfg)
+{
+	struct json_object *tmp = NULL;
+	const char* tmp_str;
+
+	if(json_object_is_type(jobj_thread, json_type_object)==0){
+		fprintf(stderr,"ERROR: realtime thread %s should be an object\n", name);
+		return -1;
+	}
+	if(json_object_object_get_ex(jobj_thread, "policy", &tmp)){
+		if(json_object_is_type(tmp, json_type_string)==0){
+			fprintf(stderr,"ERROR: policy of realtime thread %s should be a string\n", name);
+			return -1;
+		}
+		tmp_str = json_object_get_string(tmp);
+		if(strcmp(tmp_str, "SCHED_FIFO")==0) cfg->policy = SCHED_FIFO;
+		else if(strcmp(tmp_str, "SCHED_RR")==0) cfg->policy = SCHED_RR;
+		else if(strcmp(tmp_str, "SCHED_OTHER")==0){
+			cfg->policy = SCHED_OTHER;
+			cfg->priority = 0;
+		}
+		else{
+			fprintf(stderr,"ERROR: invalid policy for realtime thread %s\n", name);
+			return -1;
+		}
+	}
+	if(json_object_object_get_ex(jobj_thread, "priority", &tmp)){
+		if(json_object_is_type(tmp, json_type_int)==0){
+			fprintf(stderr,"ERROR: priority of realtime thread %s should be an int\n", name);
+			return -1;
+		}
+		cfg->priority = json_object_get_int(tmp);
+	}
+	if(json_object_object_get_ex(jobj_thread, "cpu", &tmp)){
+		if(json_object_is_type(tmp, json_type_int)==0){
+			fprintf(stderr,"ERROR: cpu of realtime thread %s should be an int\n", name);
+			return -1;
+		}
+		cfg->cpu = json_object_get_int(tmp);
+		if(cfg->cpu<-1){
+			fprintf(stderr,"ERROR: cpu of realtime thread %s should be -1 or a cpu number\n", name);
+			return -1;
+		}
+	}
+	if(cfg->policy==SCHED_OTHER && cfg->priority!=0){
+		fprintf(stderr,"ERROR: realtime thread %s uses SCHED_OTHER so priority must be 0\n", name);
+		return -1;
+	}
+	if(cfg->policy!=SCHED_OTHER && (cfg->priority<1 || cfg->priority>99)){
+		fprintf(stderr,"ERROR: priority of realtime thread %s should be between 1 and 99\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      parses the optional realtime object, anything missing takes the
+ *             defaults from thread_defs.h
+ *
+ * @return     0 on success, -1 on failure
+ */
+int __parse_realtime()
+{
+	struct json_object *jobj_rt = NULL;
+	struct json_object *threads = NULL;
+	struct json_object *tmp = NULL;
+	const char* name;
+	int i;
+
+	settings.rt_lock_memory = 1;
+	settings.rt_prefault_heap_kb = 1024;
+	rt_setup_default_config(settings.rt_threads);
+	if(json_object_object_get_ex(jobj, "realtime", &jobj_rt)==0) return 0;
+	if(json_object_is_type(jobj_rt, json_type_object)==0){
+		fprintf(stderr,"ERROR: realtime should be an object\n");
+		return -1;
+	}
+	if(json_object_object_get_ex(jobj_rt, "lock_memory", &tmp)){
+		if(json_object_is_type(tmp, json_type_boolean)==0){
+			fprintf(stderr,"ERROR: realtime lock_memory should be a boolean\n");
+			return -1;
+		}
+		settings.rt_lock_memory = json_object_get_boolean(tmp);
+	}
+	if(json_object_object_get_ex(jobj_rt, "prefault_heap_kb", &tmp)){
+		if(json_object_is_type(tmp, json_type_int)==0){
+			fprintf(stderr,"ERROR: realtime prefault_heap_kb should be an int\n");
+			return -1;
+		}
+		settings.rt_prefault_heap_kb = json_object_get_int(tmp);
+		if(settings.rt_prefault_heap_kb<0 || settings.rt_prefault_heap_kb>65536){
+			fprintf(stderr,"ERROR: realtime prefault_heap_kb should be between 0 and 65536\n");
+			return -1;
+		}
+	}
+	if(json_object_object_get_ex(jobj_rt, "threads", &threads)==0) return 0;
+	if(json_object_is_type(threads, json_type_object)==0){
+		fprintf(stderr,"ERROR: realtime threads should be an object\n");
+		return -1;
+	}
+	for(i=0;i<RT_NUM_THREADS;i++){
+		name = rt_thread_name(i);
+		if(json_object_object_get_ex(threads, name, &tmp)==0) continue;
+		if(__parse_rt_thread(tmp, name, &settings.rt_threads[i])) return -1;
+	}
+	return 0;
+}
+
+
 /**
  * @brief      parses a json_object and fills in the flight mode.
  *
@@ -216,6 +587,9 @@ int __parse_flight_mode(json_object* jobj_str, flight_mode_t* mode)
 	else if(strcmp(tmp_str, "ALT_HOLD_6DOF")==0){
 		*mode = ALT_HOLD_6DOF;
 	}
+	else if(strcmp(tmp_str, "ACRO_4DOF")==0){
+		*mode = ACRO_4DOF;
+	}
 	else{
 		fprintf(stderr,"ERROR: invalid flight mode\n");
 		return -1;
@@ -390,6 +764,9 @@ int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter, int feedback_
 		return -1;
 	}
 
+	// the filter keeps copies, tools/sweep parses this for every candidate
+	rc_vector_free(&num_vec);
+	rc_vector_free(&den_vec);
 	return 0;
 }
 
@@ -398,9 +775,83 @@ int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter, int feedback_
  *
  * @return     0 on success, -1 on failure
  */
-int __write_settings_to_disk(){
+/**
+ * @brief      rate the controller runs at, which it is discretized for
+ */
+static int __controller_hz(settings_controller_t id)
+{
+	switch(id){
+	case CTRL_ALTITUDE:
+		return settings.feedback_hz/settings.altitude_divisor;
+	case CTRL_ROLL:
+	case CTRL_PITCH:
+	case CTRL_YAW:
+		return settings.feedback_hz/settings.attitude_divisor;
+	default:
+		return settings.feedback_hz;
+	}
+}
+
+
+/**
+ * @brief      Parses all controllers out of a settings json object. The rate
+ *             controllers are only needed with the rate loop enabled and are
+ *             left empty otherwise. On failure every filter in out is freed.
+ *
+ * @param      obj   whole settings file
+ * @param      out   SETTINGS_NUM_CONTROLLERS filters to fill in
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __parse_controllers(json_object* obj, rc_filter_t* const* out)
+{
+	struct json_object *tmp = NULL;
+	int i;
+
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		if(i>=CTRL_ROLL_RATE && !settings.enable_rate_loop){
+			rc_filter_free(out[i]);
+			*out[i] = rc_filter_empty();
+			continue;
+		}
+		if(json_object_object_get_ex(obj, controller_names[i], &tmp)==0){
+			fprintf(stderr,"ERROR: can't find %s in settings file\n", controller_names[i]);
+			break;
+		}
+		if(__parse_controller(tmp, out[i], __controller_hz(i))){
+			fprintf(stderr,"ERROR: could not parse %s\n", controller_names[i]);
+			break;
+		}
+	}
+	if(i==SETTINGS_NUM_CONTROLLERS) return 0;
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++) rc_filter_free(out[i]);
+	return -1;
+}
+
+
+/**
+ * @brief      default rate controller, a plain proportional gain
+ */
+static json_object* __default_rate_controller(double kp)
+{
+	struct json_object *obj = json_object_new_object();
+	struct json_object *array;
+
+	json_object_object_add(obj, "gain", json_object_new_double(1.0));
+	json_object_object_add(obj, "CT_or_DT", json_object_new_string("DT"));
+	array = json_object_new_array();
+	json_object_array_add(array, json_object_new_double(kp));
+	json_object_object_add(obj, "numerator", array);
+	array = json_object_new_array();
+	json_object_array_add(array, json_object_new_double(1.0));
+	json_object_object_add(obj, "denominator", array);
+	return obj;
+}
+
+
+int __write_settings_to_disk(const char* path){
 	int out;
-	out = json_object_to_file_ext(SETTINGS_FILE, jobj, \
+	out = json_object_to_file_ext(path, jobj, \
 		JSON_C_TO_STRING_SPACED | JSON_C_TO_STRING_PRETTY);
 	if(out!=0){
 		fprintf(stderr,"failed to write settings to disk\n");
@@ -423,6 +874,10 @@ int __load_default_settings()
 	struct json_object *array = NULL;	// temp object for new arrays
 	struct json_object *tmp = NULL;		// temp object
 	struct json_object *tmp2 = NULL;	// temp object
+	struct json_object *tmp3 = NULL;	// temp object
+	struct json_object *tmp4 = NULL;	// temp object
+	rt_thread_config_t rt_threads[RT_NUM_THREADS];
+	int i;
 
 	// make new object to return
 	jobj = json_object_new_object();
@@ -436,13 +891,42 @@ int __load_default_settings()
 	json_object_object_add(jobj, "orientation", tmp);
 	tmp = json_object_new_double(7.4);
 	json_object_object_add(jobj, "v_nominal", tmp);
+	tmp = json_object_new_string("ESC_PWM");
+	json_object_object_add(jobj, "esc_protocol", tmp);
 	// feedback loop frequency
 	tmp = json_object_new_int(100);
 	json_object_object_add(jobj, "feedback_hz", tmp);
+	// battery voltage sample rate
+	tmp = json_object_new_int(50);
+	json_object_object_add(jobj, "battery_hz", tmp);
+	// outer loops run every n feedback loops
+	tmp = json_object_new_int(1);
+	json_object_object_add(jobj, "setpoint_divisor", tmp);
+	tmp = json_object_new_int(1);
+	json_object_object_add(jobj, "altitude_divisor", tmp);
+	tmp = json_object_new_int(1);
+	json_object_object_add(jobj, "attitude_divisor", tmp);
+	// gyro rate inner loop
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "enable_rate_loop", tmp);
+	tmp = json_object_new_string("IMU_SOURCE_DMP");
+	json_object_object_add(jobj, "imu_source", tmp);
+	tmp = json_object_new_int(1);
+	json_object_object_add(jobj, "imu_fifo_batch", tmp);
+	tmp = json_object_new_string("MIX_ALLOC_GREEDY");
+	json_object_object_add(jobj, "mix_allocation", tmp);
+	tmp = json_object_new_string("SETPOINT_INTERP_HOLD");
+	json_object_object_add(jobj, "setpoint_interp", tmp);
 
 	// features
 	tmp = json_object_new_boolean(FALSE);
 	json_object_object_add(jobj, "enable_logging", tmp);
+	tmp = json_object_new_boolean(TRUE);
+	json_object_object_add(jobj, "log_compact", tmp);
+	tmp = json_object_new_int(16);
+	json_object_object_add(jobj, "log_prealloc_mb", tmp);
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "log_direct_io", tmp);
 
 	// flight modes
 	tmp = json_object_new_int(3);
@@ -499,6 +983,75 @@ int __load_default_settings()
 	json_object_object_add(jobj, "printf_motors", tmp);
 	tmp = json_object_new_boolean(TRUE);
 	json_object_object_add(jobj, "printf_mode", tmp);
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "printf_timing", tmp);
+
+	// mavlink telemetry
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "enable_telemetry", tmp);
+	tmp = json_object_new_string(TELEMETRY_DEFAULT_IP);
+	json_object_object_add(jobj, "telemetry_ip", tmp);
+	tmp = json_object_new_int(14551);
+	json_object_object_add(jobj, "telemetry_port", tmp);
+	tmp = json_object_new_int(1);
+	json_object_object_add(jobj, "telemetry_sys_id", tmp);
+	tmp = json_object_new_int(1);
+	json_object_object_add(jobj, "telemetry_heartbeat_hz", tmp);
+	tmp = json_object_new_int(20);
+	json_object_object_add(jobj, "telemetry_attitude_hz", tmp);
+	tmp = json_object_new_int(10);
+	json_object_object_add(jobj, "telemetry_motors_hz", tmp);
+	tmp = json_object_new_int(2);
+	json_object_object_add(jobj, "telemetry_battery_hz", tmp);
+
+	// barometer altitude estimate
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "enable_baro", tmp);
+
+	// motion capture input
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "enable_mocap", tmp);
+	tmp = json_object_new_int(14552);
+	json_object_object_add(jobj, "mocap_port", tmp);
+	tmp = json_object_new_int(5);
+	json_object_object_add(jobj, "mocap_latency_ms", tmp);
+
+	// shared memory state export
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "enable_shm_export", tmp);
+
+	// output stage on the PRU
+	tmp = json_object_new_boolean(FALSE);
+	json_object_object_add(jobj, "enable_pru_esc", tmp);
+
+	// watchdog
+	tmp = json_object_new_boolean(TRUE);
+	json_object_object_add(jobj, "enable_watchdog", tmp);
+	tmp = json_object_new_int(50);
+	json_object_object_add(jobj, "watchdog_stall_ms", tmp);
+
+	// real-time setup, every thread listed with its defaults
+	rt_setup_default_config(rt_threads);
+	tmp2 = json_object_new_object();
+	tmp = json_object_new_boolean(TRUE);
+	json_object_object_add(tmp2, "lock_memory", tmp);
+	tmp = json_object_new_int(1024);
+	json_object_object_add(tmp2, "prefault_heap_kb", tmp);
+	tmp3 = json_object_new_object();
+	for(i=0;i<RT_NUM_THREADS;i++){
+		tmp4 = json_object_new_object();
+		if(rt_threads[i].policy==SCHED_OTHER) tmp = json_object_new_string("SCHED_OTHER");
+		else if(rt_threads[i].policy==SCHED_RR) tmp = json_object_new_string("SCHED_RR");
+		else tmp = json_object_new_string("SCHED_FIFO");
+		json_object_object_add(tmp4, "policy", tmp);
+		tmp = json_object_new_int(rt_threads[i].priority);
+		json_object_object_add(tmp4, "priority", tmp);
+		tmp = json_object_new_int(rt_threads[i].cpu);
+		json_object_object_add(tmp4, "cpu", tmp);
+		json_object_object_add(tmp3, rt_thread_name(i), tmp4);
+	}
+	json_object_object_add(tmp2, "threads", tmp3);
+	json_object_object_add(jobj, "realtime", tmp2);
 
 	// roll controller
 	tmp2 = json_object_new_object();
@@ -616,37 +1169,274 @@ int __load_default_settings()
 
 	json_object_object_add(jobj, "altitude_controller", tmp2);
 
+	// rate controllers, only used with enable_rate_loop
+	json_object_object_add(jobj, "roll_rate_controller", __default_rate_controller(0.05));
+	json_object_object_add(jobj, "pitch_rate_controller", __default_rate_controller(0.05));
+	json_object_object_add(jobj, "yaw_rate_controller", __default_rate_controller(0.1));
+
 	return 0;
 }
 
 
 
+
+/**
+ * @brief      standard reflected crc32, only runs over a ~1.5k image at boot so
+ *             the bitwise version is plenty
+ */
+static uint32_t __crc32(const void* data, size_t len)
+{
+	const uint8_t* p = data;
+	uint32_t crc = 0xFFFFFFFF;
+	size_t i;
+	int j;
+
+	for(i=0;i<len;i++){
+		crc ^= p[i];
+		for(j=0;j<8;j++) crc = (crc>>1) ^ (0xEDB88320 & -(crc&1));
+	}
+	return ~crc;
+}
+
+
+static uint32_t __cache_crc(const settings_cache_t* c)
+{
+	size_t start = offsetof(settings_cache_t, src_mtime_ns);
+	return __crc32((const uint8_t*)c+start, sizeof(settings_cache_t)-start);
+}
+
+
+static int __cache_path(const char* path, char* out, size_t len)
+{
+	if((size_t)snprintf(out, len, "%s%s", path, SETTINGS_CACHE_SUFFIX)>=len){
+		return -1;
+	}
+	return 0;
+}
+
+
+static int64_t __mtime_ns(const struct stat* st)
+{
+	return (int64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+/**
+ * @brief      a fixed airframe build can only fly the airframe it was built for
+ *
+ * @return     0 if set matches the build, -1 otherwise
+ */
+static int __check_airframe(const settings_t* set)
+{
+	#ifdef AIRFRAME_LAYOUT
+	if(set->layout!=AIRFRAME_LAYOUT){
+		fprintf(stderr,"ERROR: settings layout doesn't match the AIRFRAME this was built for\n");
+		return -1;
+	}
+	#endif
+	#ifdef AIRFRAME_THRUST_MAP
+	if(set->thrust_map!=AIRFRAME_THRUST_MAP){
+		fprintf(stderr,"ERROR: settings thrust_map doesn't match the THRUST_MAP this was built for\n");
+		return -1;
+	}
+	#endif
+	(void)set;
+	return 0;
+}
+
+
+/**
+ * @brief      loads the settings and controllers from the cache next to the
+ *             json file at path.
+ *
+ *             Nothing is changed unless the whole image checks out, so a stale
+ *             or damaged cache just means the json gets parsed instead.
+ *
+ * @return     0 on success, -1 if the cache is missing, stale or invalid
+ */
+static int __load_cache(const char* path)
+{
+	static settings_cache_t c;
+	char cache_path[PATH_MAX];
+	rc_filter_t f[SETTINGS_NUM_CONTROLLERS];
+	cached_filter_t* cf;
+	struct stat st;
+	ssize_t n;
+	int fd, i, ok = 1;
+
+	if(stat(path, &st)) return -1;
+	if(__cache_path(path, cache_path, sizeof(cache_path))) return -1;
+	fd = open(cache_path, O_RDONLY);
+	if(fd<0) return -1;
+	n = read(fd, &c, sizeof(c));
+	close(fd);
+
+	if(n!=sizeof(c) || c.magic!=SETTINGS_CACHE_MAGIC ||
+			c.version!=SETTINGS_CACHE_VERSION || c.size!=sizeof(c)){
+		return -1;
+	}
+	if(c.src_mtime_ns!=__mtime_ns(&st) || c.src_size!=(int64_t)st.st_size){
+		return -1;
+	}
+	if(c.crc!=__cache_crc(&c)){
+		fprintf(stderr,"WARNING: settings cache %s is corrupt, parsing json\n", cache_path);
+		return -1;
+	}
+	if(__check_airframe(&c.settings)) return -1;
+
+	// build the controllers on the side so a failure leaves the old ones
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		f[i] = rc_filter_empty();
+		cf = &c.ctl[i];
+		if(!ok) continue;
+		// rate controllers are left empty without the rate loop
+		if(cf->num_len==0 && cf->den_len==0) continue;
+		if(cf->num_len<1 || cf->den_len<cf->num_len || cf->den_len>SETTINGS_CACHE_MAX_TF ||
+			rc_filter_alloc_from_arrays(&f[i], cf->dt, cf->num, cf->num_len, cf->den, cf->den_len)){
+			ok = 0;
+			continue;
+		}
+		f[i].gain = cf->gain;
+	}
+	if(!ok){
+		for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++) rc_filter_free(&f[i]);
+		return -1;
+	}
+
+	memcpy(&settings, &c.settings, sizeof(settings));
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		rc_filter_free(controllers[i]);
+		*controllers[i] = f[i];
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      writes the settings and controllers just parsed from the json at
+ *             path to its cache. Goes through a temporary file and rename so a
+ *             power cut never leaves a half written cache behind.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __write_cache(const char* path)
+{
+	static settings_cache_t c;
+	char cache_path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	rc_filter_t* f;
+	struct stat st;
+	ssize_t n;
+	int fd, i;
+
+	if(stat(path, &st)) return -1;
+	if(__cache_path(path, cache_path, sizeof(cache_path))) return -1;
+	if((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path)>=sizeof(tmp_path)){
+		return -1;
+	}
+
+	// zero everything so padding bytes don't change the crc
+	memset(&c, 0, sizeof(c));
+	c.magic = SETTINGS_CACHE_MAGIC;
+	c.version = SETTINGS_CACHE_VERSION;
+	c.size = sizeof(c);
+	c.src_mtime_ns = __mtime_ns(&st);
+	c.src_size = st.st_size;
+	memcpy(&c.settings, &settings, sizeof(settings));
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		f = controllers[i];
+		if(f->num.len>SETTINGS_CACHE_MAX_TF || f->den.len>SETTINGS_CACHE_MAX_TF){
+			fprintf(stderr,"WARNING: controller too long to cache, settings cache not written\n");
+			return -1;
+		}
+		c.ctl[i].num_len = f->num.len;
+		c.ctl[i].den_len = f->den.len;
+		c.ctl[i].dt = f->dt;
+		c.ctl[i].gain = f->gain;
+		memcpy(c.ctl[i].num, f->num.d, f->num.len*sizeof(double));
+		memcpy(c.ctl[i].den, f->den.d, f->den.len*sizeof(double));
+	}
+	c.crc = __cache_crc(&c);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd<0){
+		fprintf(stderr,"WARNING: can't write settings cache %s\n", tmp_path);
+		return -1;
+	}
+	n = write(fd, &c, sizeof(c));
+	if(n!=sizeof(c) || fsync(fd)){
+		close(fd);
+		unlink(tmp_path);
+		fprintf(stderr,"WARNING: failed to write settings cache %s\n", tmp_path);
+		return -1;
+	}
+	close(fd);
+	if(rename(tmp_path, cache_path)){
+		unlink(tmp_path);
+		fprintf(stderr,"WARNING: failed to rename settings cache to %s\n", cache_path);
+		return -1;
+	}
+	return 0;
+}
+
+
 int settings_load_from_file()
+{
+	return settings_load_from_path(SETTINGS_FILE);
+}
+
+
+int settings_load_from_path(const char* path)
+{
+	was_load_successful = 0;
+	// boot normally takes this path, the json is only parsed when it changed
+	if(strlen(path)>=sizeof(loaded_path)){
+		fprintf(stderr,"ERROR: settings path too long\n");
+		return -1;
+	}
+	if(__load_cache(path)==0){
+		strcpy(loaded_path, path);
+		was_load_successful = 1;
+		return 0;
+	}
+	if(__load_json(path)) return -1;
+	__write_cache(path);
+	strcpy(loaded_path, path);
+	was_load_successful = 1;
+	return 0;
+}
+
+
+/**
+ * @brief      parses and validates the json settings file at path, writing a
+ *             default one there first if it doesn't exist
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __load_json(const char* path)
 {
 	struct json_object *tmp = NULL; // temp object
 	char* tmp_str = NULL; // temp string poitner
 	double tmp_flt;
 	int tmp_int;
 
-	was_load_successful = 0;
-
 	#ifdef DEBUG
 	fprintf(stderr,"beginning of load_settings_from_file\n");
 	fprintf(stderr,"about to check access of fly settings file\n");
 	#endif
 
 	// read in file contents
-	if(access(SETTINGS_FILE, F_OK)!=0){
+	if(access(path, F_OK)!=0){
 		printf("Fly settings file missing, making default\n");
 		__load_default_settings();
 		printf("Writing default settings to file\n");
-		if(__write_settings_to_disk()!=0) -1;
+		if(__write_settings_to_disk(path)!=0) return -1;
 	}
 	else{
 		#ifdef DEBUG
 		printf("about to read json from file\n");
 		#endif
-		jobj = json_object_from_file(SETTINGS_FILE);
+		jobj = json_object_from_file(path);
 		if(jobj==NULL){
 			fprintf(stderr,"ERROR, failed to read settings from disk\n");
 			return -1;
@@ -660,7 +1450,9 @@ int settings_load_from_file()
 	// start parsing data
 	if(__parse_layout()==-1) return -1; // parse_layout also fill in num_rotors and dof
 	if(__parse_thrust_map()==-1) return -1;
+	if(__check_airframe(&settings)) return -1;
 	PARSE_DOUBLE_MIN_MAX(v_nominal,7.0,18.0)
+	if(__parse_esc_protocol()==-1) return -1;
 
 
 	// parse enable_logging
@@ -673,6 +1465,9 @@ int settings_load_from_file()
 		return -1;
 	}
 	settings.enable_logging = json_object_get_boolean(tmp);
+	PARSE_BOOL_OPTIONAL(log_compact,1)
+	PARSE_INT_MIN_MAX_OPTIONAL(log_prealloc_mb,0,1024,16)
+	PARSE_BOOL_OPTIONAL(log_direct_io,0)
 
 
 
@@ -715,12 +1510,57 @@ int settings_load_from_file()
 	PARSE_POLARITY(dsm_kill_pol)
 
 
-	// parse feedback_hz
+	// parse feedback_hz, the DMP caps it at 200Hz while the raw FIFO samples
+	// at any whole fraction of 1kHz
+	if(__parse_imu_source()==-1) return -1;
 	PARSE_INT(feedback_hz)
-	if(settings.feedback_hz!=50 && settings.feedback_hz!=100 && settings.feedback_hz!=200){
+	if(settings.imu_source==IMU_SOURCE_DMP && settings.feedback_hz!=50 &&
+			settings.feedback_hz!=100 && settings.feedback_hz!=200){
 		fprintf(stderr,"ERROR: feedback_hz must be 50,100,or 200\n");
 		return -1;
 	}
+	if(settings.imu_source==IMU_SOURCE_FIFO && (settings.feedback_hz<100 ||
+			settings.feedback_hz>IMU_FIFO_MAX_HZ || IMU_FIFO_MAX_HZ%settings.feedback_hz)){
+		fprintf(stderr,"ERROR: with IMU_SOURCE_FIFO feedback_hz must be at least 100 and divide %d\n", IMU_FIFO_MAX_HZ);
+		return -1;
+	}
+	PARSE_INT_MIN_MAX_OPTIONAL(imu_fifo_batch,1,IMU_FIFO_MAX_BATCH,1)
+	if(settings.imu_source==IMU_SOURCE_DMP && settings.imu_fifo_batch!=1){
+		fprintf(stderr,"ERROR: imu_fifo_batch needs IMU_SOURCE_FIFO, the DMP interrupts once per sample\n");
+		return -1;
+	}
+	if(settings.feedback_hz%settings.imu_fifo_batch){
+		fprintf(stderr,"ERROR: imu_fifo_batch must divide feedback_hz\n");
+		return -1;
+	}
+	PARSE_INT_MIN_MAX_OPTIONAL(battery_hz,1,200,50)
+	// outer loops run at whole fractions of the feedback rate
+	PARSE_INT_MIN_MAX_OPTIONAL(setpoint_divisor,1,20,1)
+	PARSE_INT_MIN_MAX_OPTIONAL(altitude_divisor,1,20,1)
+	PARSE_INT_MIN_MAX_OPTIONAL(attitude_divisor,1,20,1)
+	if(settings.feedback_hz%settings.setpoint_divisor || settings.feedback_hz%settings.altitude_divisor ||
+				settings.feedback_hz%settings.attitude_divisor){
+		fprintf(stderr,"ERROR: setpoint, altitude and attitude divisors must divide feedback_hz\n");
+		return -1;
+	}
+	// gyro rate stage on every sample with the angle controllers cascaded on
+	// top, the raw FIFO is only worth its rate with it
+	PARSE_BOOL_OPTIONAL(enable_rate_loop,0)
+	if(settings.imu_source==IMU_SOURCE_FIFO && !settings.enable_rate_loop){
+		fprintf(stderr,"ERROR: IMU_SOURCE_FIFO needs enable_rate_loop\n");
+		return -1;
+	}
+	if(!settings.enable_rate_loop && settings.attitude_divisor!=1){
+		fprintf(stderr,"ERROR: attitude_divisor needs enable_rate_loop, the angle loop is the inner loop without it\n");
+		return -1;
+	}
+	if(!settings.enable_rate_loop && (settings.flight_mode_1==ACRO_4DOF ||
+			settings.flight_mode_2==ACRO_4DOF || settings.flight_mode_3==ACRO_4DOF)){
+		fprintf(stderr,"ERROR: ACRO_4DOF flight mode needs enable_rate_loop\n");
+		return -1;
+	}
+	if(__parse_mix_allocation()==-1) return -1;
+	if(__parse_setpoint_interp()==-1) return -1;
 
 	// parse printf options
 	PARSE_BOOL(printf_arm)
@@ -731,54 +1571,135 @@ int settings_load_from_file()
 	PARSE_BOOL(printf_u)
 	PARSE_BOOL(printf_motors)
 	PARSE_BOOL(printf_mode)
+	PARSE_BOOL_OPTIONAL(printf_timing,0)
+
+	// parse telemetry options
+	PARSE_BOOL_OPTIONAL(enable_telemetry,0)
+	if(__parse_telemetry_ip()==-1) return -1;
+	PARSE_INT_MIN_MAX_OPTIONAL(telemetry_port,1,65535,14551)
+	PARSE_INT_MIN_MAX_OPTIONAL(telemetry_sys_id,1,255,1)
+	PARSE_INT_MIN_MAX_OPTIONAL(telemetry_heartbeat_hz,0,MAVLINK_MANAGER_HZ,1)
+	PARSE_INT_MIN_MAX_OPTIONAL(telemetry_attitude_hz,0,MAVLINK_MANAGER_HZ,20)
+	PARSE_INT_MIN_MAX_OPTIONAL(telemetry_motors_hz,0,MAVLINK_MANAGER_HZ,10)
+	PARSE_INT_MIN_MAX_OPTIONAL(telemetry_battery_hz,0,MAVLINK_MANAGER_HZ,2)
+
+	PARSE_BOOL_OPTIONAL(enable_baro,0)
+
+	// parse mocap options
+	PARSE_BOOL_OPTIONAL(enable_mocap,0)
+	PARSE_INT_MIN_MAX_OPTIONAL(mocap_port,1,65535,14552)
+	PARSE_INT_MIN_MAX_OPTIONAL(mocap_latency_ms,0,200,5)
+
+	PARSE_BOOL_OPTIONAL(enable_shm_export,0)
+
+	// the PRU only mixes the inputs it is handed, the null space moves of the
+	// priority allocator don't survive that
+	PARSE_BOOL_OPTIONAL(enable_pru_esc,0)
+	if(settings.enable_pru_esc && settings.mix_allocation!=MIX_ALLOC_GREEDY){
+		fprintf(stderr,"ERROR: enable_pru_esc needs mix_allocation MIX_ALLOC_GREEDY\n");
+		return -1;
+	}
+
+	// parse watchdog options
+	PARSE_BOOL_OPTIONAL(enable_watchdog,1)
+	PARSE_INT_MIN_MAX_OPTIONAL(watchdog_stall_ms,5,1000,50)
+
+	if(__parse_realtime()==-1) return -1;
+
 
 
+	// parse controllers
+	if(__parse_controllers(jobj, controllers)) return -1;
 
-	// parse roll controller
-	if(json_object_object_get_ex(jobj, "roll_controller", &tmp)==0){
-		fprintf(stderr,"ERROR: can't find roll_controller in settings file\n");
+	json_object_put(jobj);	// free memory
+	jobj = NULL;
+	return 0;
+}
+
+int settings_load_controllers(rc_filter_t* ctl)
+{
+	json_object* file;
+	int ret;
+
+	if(was_load_successful==0){
+		fprintf(stderr,"ERROR in settings_load_controllers, settings not loaded from file yet\n");
 		return -1;
 	}
-	if(__parse_controller(tmp, &roll_controller, settings.feedback_hz)){
-		fprintf(stderr,"ERROR: could not parse roll_controller\n");
+	file = json_object_from_file(loaded_path);
+	if(file==NULL){
+		fprintf(stderr,"ERROR in settings_load_controllers, failed to read %s\n", loaded_path);
 		return -1;
 	}
+	ret = settings_parse_controllers(file, ctl);
+	json_object_put(file);
+	return ret;
+}
+
 
-	// parse pitch controller
-	if(json_object_object_get_ex(jobj, "pitch_controller", &tmp)==0){
-		fprintf(stderr,"ERROR: can't find pitch_controller in settings file\n");
+int settings_parse_controllers(json_object* obj, rc_filter_t* ctl)
+{
+	rc_filter_t* out[SETTINGS_NUM_CONTROLLERS];
+	int i;
+
+	if(was_load_successful==0){
+		fprintf(stderr,"ERROR in settings_parse_controllers, settings not loaded from file yet\n");
 		return -1;
 	}
-	if(__parse_controller(tmp, &pitch_controller, settings.feedback_hz)){
-		fprintf(stderr,"ERROR: could not parse pitch_controller\n");
-		return -1;
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		ctl[i] = rc_filter_empty();
+		out[i] = &ctl[i];
 	}
+	return __parse_controllers(obj, out);
+}
+
+
+const char* settings_controller_name(settings_controller_t id)
+{
+	if(id<0 || id>=SETTINGS_NUM_CONTROLLERS) return NULL;
+	return controller_names[id];
+}
 
-	// parse yaw controller
-	if(json_object_object_get_ex(jobj, "yaw_controller", &tmp)==0){
-		fprintf(stderr,"ERROR: can't find yaw_controller in settings file\n");
+
+int settings_get_controller(settings_controller_t id, rc_filter_t* ctrl)
+{
+	if(was_load_successful == 0){
+		fprintf(stderr,"ERROR: can't get json controller, last read failed\n");
 		return -1;
 	}
-	if(__parse_controller(tmp, &yaw_controller, settings.feedback_hz)){
-		fprintf(stderr,"ERROR: could not parse yaw_controller\n");
+	if(id<0 || id>=SETTINGS_NUM_CONTROLLERS){
+		fprintf(stderr,"ERROR in settings_get_controller, invalid controller\n");
 		return -1;
 	}
+	*ctrl = *controllers[id];
+	return 0;
+}
 
-	// parse altitude controller
-	if(json_object_object_get_ex(jobj, "altitude_controller", &tmp)==0){
-		fprintf(stderr,"ERROR: can't find altitude_controller in settings file\n");
+
+int settings_get_controller_bank(const settings_controller_t* ids, int n,
+					rc_filter_t* ctl, filter_bank_t* fb)
+{
+	rc_filter_t* f[FILTER_BANK_LANES];
+	int i;
+
+	if(ctl==NULL && was_load_successful==0){
+		fprintf(stderr,"ERROR: can't get json controller, last read failed\n");
 		return -1;
 	}
-	if(__parse_controller(tmp, &altitude_controller, settings.feedback_hz)){
-		fprintf(stderr,"ERROR: could not parse altitude_controller\n");
+	if(n<1 || n>FILTER_BANK_LANES){
+		fprintf(stderr,"ERROR in settings_get_controller_bank, invalid number of controllers\n");
 		return -1;
 	}
-
-	json_object_put(jobj);	// free memory
-	was_load_successful = 1;
-	return 0;
+	for(i=0;i<n;i++){
+		if(ids[i]<0 || ids[i]>=SETTINGS_NUM_CONTROLLERS){
+			fprintf(stderr,"ERROR in settings_get_controller_bank, invalid controller\n");
+			return -1;
+		}
+		f[i] = (ctl==NULL) ? controllers[ids[i]] : &ctl[ids[i]];
+	}
+	return filter_bank_alloc(fb, f, n);
 }
 
+
 int settings_get(settings_t* set)
 {
 	if(was_load_successful==0){
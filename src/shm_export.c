@@ -0,0 +1,73 @@
+/**
+ * @file shm_export.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>	// for O_* constants
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <rc/time.h>
+
+#include <shm_export.h>
+
+static shm_export_t* shm;	// writer side mapping, NULL until initialized
+
+
+int shm_export_init()
+{
+	int fd;
+	shm_export_t* p;
+
+	fd = shm_open(SHM_EXPORT_NAME, O_CREAT|O_RDWR, 0644);
+	if(fd<0){
+		perror("ERROR in shm_export_init, shm_open");
+		return -1;
+	}
+	if(ftruncate(fd, sizeof(shm_export_t))){
+		perror("ERROR in shm_export_init, ftruncate");
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, sizeof(shm_export_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p==MAP_FAILED){
+		perror("ERROR in shm_export_init, mmap");
+		return -1;
+	}
+
+	// a segment left behind by an earlier run is overwritten, readers see
+	// the magic disappear until the new header is complete
+	memset(p, 0, sizeof(shm_export_t));
+	p->version = SHM_EXPORT_VERSION;
+	p->size = sizeof(shm_export_t);
+	p->scalar_size = sizeof(scalar_t);
+	p->writer_pid = getpid();
+	atomic_thread_fence(memory_order_release);
+	memcpy(p->magic, SHM_EXPORT_MAGIC, sizeof(p->magic));
+	shm = p;
+	return 0;
+}
+
+
+void shm_export_publish()
+{
+	if(shm==NULL) return;
+	seqlock_write_begin(&shm->lock);
+	if(shm->state.time_ns!=0) shm->state.seq++;
+	shm->state.time_ns = rc_nanos_since_boot();
+	shm->state.fstate = fstate;
+	shm->state.setpoint = setpoint;
+	shm->state.user_input = *setpoint_manager_last_input();
+	seqlock_write_end(&shm->lock);
+}
+
+
+void shm_export_cleanup()
+{
+	if(shm==NULL) return;
+	munmap(shm, sizeof(shm_export_t));
+	shm = NULL;
+	shm_unlink(SHM_EXPORT_NAME);
+}
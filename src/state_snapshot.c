@@ -0,0 +1,46 @@
+/**
+ * @file state_snapshot.c
+ */
+
+#include <stdio.h>
+
+#include <rc/time.h>
+
+#include <seqlock.h>
+#include <state_snapshot.h>
+
+#define MAX_READ_TRIES	8 // a publish takes ~1us so this is plenty
+
+static seqlock_t lock = SEQLOCK_INITIALIZER;
+static state_snapshot_t snapshot;
+
+
+void state_snapshot_publish()
+{
+	seqlock_write_begin(&lock);
+	if(snapshot.time_ns!=0) snapshot.seq++;
+	snapshot.time_ns = rc_nanos_since_boot();
+	snapshot.fstate = fstate;
+	snapshot.setpoint = setpoint;
+	snapshot.user_input = *setpoint_manager_last_input();
+	seqlock_write_end(&lock);
+}
+
+
+int state_snapshot_get(state_snapshot_t* snap)
+{
+	int i;
+	uint_fast32_t seq;
+	state_snapshot_t tmp;
+
+	for(i=0;i<MAX_READ_TRIES;i++){
+		seq = seqlock_read_begin(&lock);
+		if(seq==0) return -1; // nothing published yet
+		tmp = snapshot;
+		if(!seqlock_read_retry(&lock, seq)){
+			*snap = tmp;
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -11,12 +11,19 @@
 #include <stdlib.h>
 
 #include <thrust_map.h>
+#include <airframe.h>
 
-static double* signal;
-static double* thrust;
-static int points;
+#ifdef THRUST_MAP_NEON
+#include <arm_neon.h>
+#endif
 
+#define MAX_THRUST_POINTS 32
 
+// the curve behind thrust_map_init() and map_motor_signals()
+static thrust_curve_t curve;
+
+
+#if !defined(AIRFRAME_THRUST_MAP) || defined(AIRFRAME_MAP_MN1806_1400KV_4S)
 // Tiger Motor MN1806, 1400KV 6x4.5" 3-blade prop, 14.8V,
 // BLheli ESC Low Timing
 // this one is in Newtons but it doesn't really matter
@@ -33,9 +40,11 @@ static double mn1806_1400kv_4s_map[][2] = \
  {0.8,	3.7282}, \
  {0.9,	4.3147}, \
  {1.0,	4.7258}};
+#endif
 
 
 
+#if !defined(AIRFRAME_THRUST_MAP) || defined(AIRFRAME_MAP_F20_2300KV_2S)
 // tiger motor F20 2300kv motor, 2S lipo, 4x4.0" 3-blade props
 // blheli esc med-low timing
 // thrust units in gram-force but doesn't really matter
@@ -62,15 +71,17 @@ static double f20_2300kv_2s_map[][2] = \
  {0.90,	162.0185}, \
  {0.95,	168.4321}, \
  {1.00,	177.1643}};
+#endif
 
 
 
+#if !defined(AIRFRAME_THRUST_MAP) || defined(AIRFRAME_MAP_RX2206_4S)
 /*
  * Lumenier RX2206-13 2000kv motor, 4S lipo, 5x45" lumenier prop
  * blheli esc high timing
  * for 5" monocoque hex
  */
-static const int rx2206_4s_points = 11;
+static const int rx2206_4s_points = 12;
 static double rx2206_4s_map[][2] = \
 {{0.0	,	0.00000000000000}, \
  {0.05	,	17.8844719758775}, \
@@ -84,27 +95,85 @@ static double rx2206_4s_map[][2] = \
  {0.81	,	418.819295994349}, \
  {0.905	,	505.430124336786}, \
  {1.0	,	566.758535098236}};
+#endif
 
 
-int thrust_map_init(thrust_map_t map)
+/**
+ * @brief      maps m through the original piecewise linear curve by scanning
+ *             for the interval that contains it. Only used to build the
+ *             lookup table.
+ */
+static double __map_exact(const double* signal, const double* thrust, int points, double m)
 {
 	int i;
+	double pos;
+
+	// return quickly for boundary conditions
+	if(m<=0.0) return 0.0;
+	if(m>=1.0) return 1.0;
+
+	// scan through the data to pick the upper and lower points to interpolate
+	for(i=1; i<points; i++){
+		if(m <= thrust[i]){
+			pos = (m-thrust[i-1])/(thrust[i]-thrust[i-1]);
+			return signal[i-1]+(pos*(signal[i]-signal[i-1]));
+		}
+	}
+	return 1.0;
+}
+
+/**
+ * @brief      single precision table for the NEON path, the table itself in a
+ *             float build
+ */
+#ifdef THRUST_MAP_NEON
+static inline const float* __lut_f(const thrust_curve_t* c)
+{
+	#ifdef CONTROL_FLOAT
+	return c->lut;
+	#else
+	return c->lut_f;
+	#endif
+}
+#endif
+
+
+int thrust_curve_init(thrust_curve_t* c, thrust_map_t map)
+{
+	int i, points;
 	double max;
 	double (*data)[2]; // pointer to constant data
+	double signal[MAX_THRUST_POINTS];
+	double thrust[MAX_THRUST_POINTS];
+
+	c->initialized = 0;
+	#ifdef AIRFRAME_THRUST_MAP
+	if(map!=AIRFRAME_THRUST_MAP){
+		fprintf(stderr,"ERROR: this build only supports thrust map %d\n",
+							AIRFRAME_THRUST_MAP);
+		return -1;
+	}
+	#endif
 
 	switch(map){
+	#if !defined(AIRFRAME_THRUST_MAP) || defined(AIRFRAME_MAP_MN1806_1400KV_4S)
 	case MN1806_1400KV_4S:
 		points = mn1806_1400kv_4s_points;
 		data = mn1806_1400kv_4s_map;
 		break;
+	#endif
+	#if !defined(AIRFRAME_THRUST_MAP) || defined(AIRFRAME_MAP_F20_2300KV_2S)
 	case F20_2300KV_2S:
 		points = f20_2300kv_2s_points;
 		data = f20_2300kv_2s_map;
 		break;
+	#endif
+	#if !defined(AIRFRAME_THRUST_MAP) || defined(AIRFRAME_MAP_RX2206_4S)
 	case RX2206_4S:
 		points = rx2206_4s_points;
 		data = rx2206_4s_map;
 		break;
+	#endif
 	default:
 		fprintf(stderr,"ERROR: unknown thrust map\n");
 		return -1;
@@ -138,41 +207,134 @@ int thrust_map_init(thrust_map_t map)
 		}
 	}
 
-	// create new global array of normalized thrust and inputs
-	if(signal!=NULL) free(signal);
-	if(thrust!=NULL) free(thrust);
-	signal = (double*) malloc(points * sizeof(double));
-	thrust = (double*) malloc(points * sizeof(double));
+	if(points>MAX_THRUST_POINTS){
+		fprintf(stderr,"ERROR: thrust_map has more than %d points\n", MAX_THRUST_POINTS);
+		return -1;
+	}
+
+	// fill in local arrays of normalized thrust and inputs
 	max = data[points-1][1];
 	for(i=0; i<points; i++){
 		signal[i] = data[i][0];
 		thrust[i] = data[i][1]/max;
 	}
+
+	// resample the curve at uniform thrust steps for the lookup table
+	for(i=0; i<=THRUST_LUT_LEN; i++){
+		c->lut[i] = __map_exact(signal, thrust, points, (double)i/THRUST_LUT_LEN);
+	}
+	c->lut[THRUST_LUT_LEN+1] = c->lut[THRUST_LUT_LEN];
+	#if defined(THRUST_MAP_NEON) && !defined(CONTROL_FLOAT)
+	for(i=0; i<THRUST_LUT_LEN+2; i++) c->lut_f[i] = c->lut[i];
+	#endif
+	c->map = map;
+	c->initialized = 1;
 	return 0;
 }
 
 
-double map_motor_signal(double m){
+int thrust_map_init(thrust_map_t map)
+{
+	return thrust_curve_init(&curve, map);
+}
+
+
+const thrust_curve_t* thrust_map_default_curve()
+{
+	return &curve;
+}
+
+
+scalar_t thrust_curve_signal(const thrust_curve_t* c, scalar_t m){
 	int i;
-	double pos;
+	scalar_t x;
 
-	// sanity check
-	if(m>1.0 || m<0.0){
+	// sanity check, written so NaN fails it too
+	if(!(m>=0.0 && m<=1.0)){
 		printf("ERROR: desired thrust t must be between 0.0 & 1.0\n");
 		return -1;
 	}
 
-	// return quickly for boundary conditions
-	if(m==0.0 || m==1.0) return m;
+	// index and fraction of the lookup table interval containing m
+	x = m*THRUST_LUT_LEN;
+	i = (int)x;
+	return c->lut[i] + (x-i)*(c->lut[i+1]-c->lut[i]);
+}
 
-	// scan through the data to pick the upper and lower points to interpolate
-	for(i=1; i<points; i++){
-		if(m <= thrust[i]){
-			pos = (m-thrust[i-1])/(thrust[i]-thrust[i-1]);
-			return signal[i-1]+(pos*(signal[i]-signal[i-1]));
-		}
+
+scalar_t map_motor_signal(scalar_t m){
+	return thrust_curve_signal(&curve, m);
+}
+
+
+int thrust_curve_signals(const thrust_curve_t* c, const scalar_t* in, scalar_t* out, int n){
+	int j = 0;
+	int i;
+	scalar_t x;
+	const scalar_t* lut = c->lut;
+	#ifdef THRUST_MAP_NEON
+	const float* lut_f = __lut_f(c);
+	#endif
+
+	if(n<0){
+		fprintf(stderr,"ERROR: in map_motor_signals, n must be >= 0\n");
+		return -1;
 	}
 
-	fprintf(stderr,"ERROR: something in map_motor_signal went wrong\n");
-	return -1;
+	#ifdef THRUST_MAP_NEON
+	// four motors per iteration, NEON has no gather so the table lookups go
+	// lane by lane while the clamp and interpolation are vectorized
+	const float32x4_t zero = vdupq_n_f32(0.0f);
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	const float32x4_t len = vdupq_n_f32((float)THRUST_LUT_LEN);
+	for(; j+4<=n; j+=4){
+		#ifdef CONTROL_FLOAT
+		float32x4_t v = vld1q_f32(&in[j]);
+		#else
+		float tmp[4] = {in[j], in[j+1], in[j+2], in[j+3]};
+		float32x4_t v = vld1q_f32(tmp);
+		#endif
+		// NaN lanes go to 0 like in the scalar loop, vmaxq_f32 would keep them
+		v = vbslq_f32(vceqq_f32(v, v), v, zero);
+		v = vminq_f32(vmaxq_f32(v, zero), one);
+		float32x4_t xv = vmulq_f32(v, len);
+		uint32x4_t iv = vcvtq_u32_f32(xv);
+		float32x4_t frac = vsubq_f32(xv, vcvtq_f32_u32(iv));
+		uint32_t idx[4];
+		vst1q_u32(idx, iv);
+		float32x4_t lo = vld1q_dup_f32(&lut_f[idx[0]]);
+		float32x4_t hi = vld1q_dup_f32(&lut_f[idx[0]+1]);
+		lo = vld1q_lane_f32(&lut_f[idx[1]], lo, 1);
+		hi = vld1q_lane_f32(&lut_f[idx[1]+1], hi, 1);
+		lo = vld1q_lane_f32(&lut_f[idx[2]], lo, 2);
+		hi = vld1q_lane_f32(&lut_f[idx[2]+1], hi, 2);
+		lo = vld1q_lane_f32(&lut_f[idx[3]], lo, 3);
+		hi = vld1q_lane_f32(&lut_f[idx[3]+1], hi, 3);
+		#ifdef CONTROL_FLOAT
+		vst1q_f32(&out[j], vmlaq_f32(lo, frac, vsubq_f32(hi, lo)));
+		#else
+		vst1q_f32(tmp, vmlaq_f32(lo, frac, vsubq_f32(hi, lo)));
+		out[j]   = tmp[0];
+		out[j+1] = tmp[1];
+		out[j+2] = tmp[2];
+		out[j+3] = tmp[3];
+		#endif
+	}
+	#endif
+
+	for(; j<n; j++){
+		x = in[j];
+		// NaN maps to 0 instead of an undefined conversion to int below
+		if(!(x>=SCALAR_C(0.0))) x = SCALAR_C(0.0);
+		else if(x>SCALAR_C(1.0)) x = SCALAR_C(1.0);
+		x *= SCALAR_C(THRUST_LUT_LEN);
+		i = (int)x;
+		out[j] = lut[i] + (x-i)*(lut[i+1]-lut[i]);
+	}
+	return 0;
+}
+
+
+int map_motor_signals(const scalar_t* in, scalar_t* out, int n){
+	return thrust_curve_signals(&curve, in, out, n);
 }
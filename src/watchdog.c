@@ -0,0 +1,228 @@
+/**
+ * @file watchdog.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+
+#include <watchdog.h>
+#include <feedback.h>
+#include <setpoint_manager.h>
+#include <esc_output.h>
+#include <pru_esc.h>
+#include <settings.h>
+#include <rt_setup.h>
+#include <thread_defs.h>
+
+static const char* level_names[WATCHDOG_NUM_LEVELS] = {
+	"nominal", "logging shed", "telemetry shed", "altitude loop at half rate"
+};
+
+static pthread_t pthread;
+static int thread_running = 0;
+
+// written by the ISR
+static uint64_t period_ns;	// 0 until watchdog_init()
+static int debt;
+static int clean_loops;
+static int recover_loops;
+static _Atomic int level;
+static _Atomic uint64_t heartbeat_ns;	// time the ISR last finished
+static _Atomic uint64_t overruns;
+static _Atomic uint64_t escalations;
+static _Atomic uint64_t recoveries;
+static _Atomic uint64_t loops_at_level[WATCHDOG_NUM_LEVELS];
+
+// written by the heartbeat thread
+static uint64_t stall_ns;
+static _Atomic uint64_t imu_stalls;
+static _Atomic uint64_t stall_disarms;
+static _Atomic uint64_t longest_stall_ns;
+
+
+int watchdog_init()
+{
+	int i;
+	// the ISR loops once per FIFO read, batch samples at a time
+	int loop_hz = settings.feedback_hz/settings.imu_fifo_batch;
+
+	stall_ns = (uint64_t)settings.watchdog_stall_ms*1000000ULL;
+	if(stall_ns < 2*1000000000ULL/loop_hz){
+		fprintf(stderr,"ERROR in watchdog_init, watchdog_stall_ms must be at least two feedback periods\n");
+		return -1;
+	}
+	debt = 0;
+	clean_loops = 0;
+	recover_loops = WATCHDOG_RECOVER_S*loop_hz;
+	atomic_store(&level, WATCHDOG_NOMINAL);
+	atomic_store(&heartbeat_ns, 0);
+	atomic_store(&overruns, 0);
+	atomic_store(&escalations, 0);
+	atomic_store(&recoveries, 0);
+	for(i=0;i<WATCHDOG_NUM_LEVELS;i++) atomic_store(&loops_at_level[i], 0);
+	atomic_store(&imu_stalls, 0);
+	atomic_store(&stall_disarms, 0);
+	atomic_store(&longest_stall_ns, 0);
+	period_ns = 1000000000ULL/loop_hz;
+	return 0;
+}
+
+
+void watchdog_loop_done(uint64_t isr_entry_ns)
+{
+	uint64_t now;
+	int l;
+
+	if(period_ns==0) return;
+	now = rc_nanos_since_boot();
+	l = atomic_load_explicit(&level, memory_order_relaxed);
+
+	if(now-isr_entry_ns > period_ns){
+		atomic_fetch_add_explicit(&overruns, 1, memory_order_relaxed);
+		debt += WATCHDOG_OVERRUN_WEIGHT;
+		clean_loops = 0;
+	}
+	else if(debt>0) debt--;
+	else clean_loops++;
+
+	// the debt starts over after each step so every level takes its own
+	// stretch of sustained overruns
+	if(debt>=WATCHDOG_SHED_DEBT && l<WATCHDOG_NUM_LEVELS-1){
+		l++;
+		debt = 0;
+		atomic_fetch_add_explicit(&escalations, 1, memory_order_relaxed);
+		atomic_store_explicit(&level, l, memory_order_relaxed);
+	}
+	else if(clean_loops>=recover_loops && l>WATCHDOG_NOMINAL){
+		l--;
+		clean_loops = 0;
+		atomic_fetch_add_explicit(&recoveries, 1, memory_order_relaxed);
+		atomic_store_explicit(&level, l, memory_order_relaxed);
+	}
+	if(debt>WATCHDOG_SHED_DEBT) debt = WATCHDOG_SHED_DEBT;
+	atomic_fetch_add_explicit(&loops_at_level[l], 1, memory_order_relaxed);
+	atomic_store_explicit(&heartbeat_ns, now, memory_order_release);
+}
+
+
+int watchdog_shed(watchdog_level_t l)
+{
+	return atomic_load_explicit(&level, memory_order_relaxed)>=(int)l;
+}
+
+
+void watchdog_get_stats(watchdog_stats_t* s)
+{
+	int i;
+
+	s->level = atomic_load(&level);
+	s->overruns = atomic_load(&overruns);
+	s->escalations = atomic_load(&escalations);
+	s->recoveries = atomic_load(&recoveries);
+	for(i=0;i<WATCHDOG_NUM_LEVELS;i++) s->loops_at_level[i] = atomic_load(&loops_at_level[i]);
+	s->imu_stalls = atomic_load(&imu_stalls);
+	s->stall_disarms = atomic_load(&stall_disarms);
+	s->longest_stall_ns = atomic_load(&longest_stall_ns);
+}
+
+
+void watchdog_stall_disarm()
+{
+	setpoint_manager_lock_arming();
+	if(fstate.arm_state==ARMED){
+		feedback_disarm();
+		atomic_fetch_add(&stall_disarms, 1);
+	}
+}
+
+
+static void* __watchdog_func(__attribute__ ((unused)) void* ptr)
+{
+	uint64_t now, beat, gap;
+	int stalled = 0;
+	int l, reported = WATCHDOG_NOMINAL;
+
+	rt_setup_thread(RT_THREAD_WATCHDOG);
+	while(rc_get_state()!=EXITING){
+		now = rc_nanos_since_boot();
+		beat = atomic_load_explicit(&heartbeat_ns, memory_order_acquire);
+		// nothing to watch until the ISR has finished once
+		gap = (beat!=0 && now>beat) ? now-beat : 0;
+		if(gap>atomic_load(&longest_stall_ns)) atomic_store(&longest_stall_ns, gap);
+
+		if(gap>stall_ns){
+			if(!stalled){
+				stalled = 1;
+				atomic_fetch_add(&imu_stalls, 1);
+				fprintf(stderr,"WATCHDOG: no feedback loop for %.0fms, idling motors\n", gap/1e6);
+			}
+			// also catches arming while the IMU is still stalled
+			watchdog_stall_disarm();
+			// the PRU idles on its own after the same stall time
+			if(!pru_esc_running()) esc_output_idle(SETTINGS_NUM_ROTORS);
+		}
+		else if(stalled){
+			stalled = 0;
+			fprintf(stderr,"WATCHDOG: feedback loop resumed\n");
+		}
+
+		l = atomic_load(&level);
+		if(l!=reported){
+			fprintf(stderr,"WATCHDOG: %s, %s\n",
+				l>reported ? "sustained loop overruns" : "loop back on time",
+				level_names[l]);
+			reported = l;
+		}
+		rc_usleep(1000000/WATCHDOG_HZ);
+	}
+	return NULL;
+}
+
+
+int watchdog_start()
+{
+	if(period_ns==0){
+		fprintf(stderr,"ERROR in watchdog_start, call watchdog_init first\n");
+		return -1;
+	}
+	if(rc_pthread_create(&pthread, __watchdog_func, NULL, rt_thread_policy(RT_THREAD_WATCHDOG), rt_thread_priority(RT_THREAD_WATCHDOG))<0){
+		fprintf(stderr,"ERROR in watchdog_start, failed to start thread\n");
+		return -1;
+	}
+	thread_running = 1;
+	return 0;
+}
+
+
+int watchdog_cleanup()
+{
+	int ret = 0;
+	watchdog_stats_t s;
+
+	if(thread_running){
+		// wait for the thread to exit
+		ret = rc_pthread_timed_join(pthread,NULL,WATCHDOG_TOUT);
+		if(ret==1) fprintf(stderr,"WARNING: watchdog thread exit timeout\n");
+		else if(ret==-1) fprintf(stderr,"ERROR: failed to join watchdog thread\n");
+	}
+	thread_running = 0;
+
+	watchdog_get_stats(&s);
+	if(s.overruns || s.imu_stalls){
+		printf("watchdog: %llu overruns, %llu escalations, %llu recoveries, %llu loops shed\n",
+			(unsigned long long)s.overruns, (unsigned long long)s.escalations,
+			(unsigned long long)s.recoveries,
+			(unsigned long long)(s.loops_at_level[WATCHDOG_SHED_LOGGING]
+				+ s.loops_at_level[WATCHDOG_SHED_TELEMETRY]
+				+ s.loops_at_level[WATCHDOG_SHED_OUTER]));
+		printf("watchdog: %llu imu stalls, %llu disarms, longest gap %.1fms\n",
+			(unsigned long long)s.imu_stalls, (unsigned long long)s.stall_disarms,
+			s.longest_stall_ns/1e6);
+	}
+	return ret;
+}
@@ -0,0 +1,354 @@
+/**
+ * @file bench.c
+ *
+ * Benchmark suite for the control loop hot paths, run with 'make bench'.
+ *
+ * Times the mixer functions and one full feedback step for every
+ * rotor_layout_t, plus the thrust map and the roll/pitch/yaw controllers from
+ * the settings file, both one by one and together as a filter bank. Each
+ * result is reported in ns/op and cycles/op as CSV, or JSON with -j, tagged
+ * with the git revision, machine and control path precision (see scalar.h) so
+ * results from different commits, boards and builds can be collected side by
+ * side.
+ *
+ * The feedback step goes through the dmp callback with the hardware replaced
+ * by tools/replay_backend.c, so it covers setpoint_manager_update(), the
+ * state estimate and __feedback_control() exactly as in flight minus the
+ * cost of the real ESC writes.
+ *
+ * Before timing anything the thrust map is checked on out of range and NaN
+ * inputs, a failure there ends the run with an error.
+ *
+ * Cycles come from the perf cycle counter when the kernel allows it and from
+ * the x86 time stamp counter otherwise, the cycle_source column says which.
+ *
+ * Usage: bench [-s settings.json] [-n iterations] [-j]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include <rc/math/filter.h>
+#include <rc/start_stop.h>
+#include <rc/time.h>
+
+#include <rc_pilot_defs.h>
+#include <settings.h>
+#include <feedback.h>
+#include <setpoint_manager.h>
+#include <input_manager.h>
+#include <mix.h>
+#include <filter_bank.h>
+#include <thrust_map.h>
+#include <battery_manager.h>
+#include <esc_output.h>
+#include "replay_backend.h"
+#include "cycle_counter.h"
+
+#ifndef BENCH_GIT_REV
+#define BENCH_GIT_REV "unknown"
+#endif
+
+#define DEFAULT_ITERATIONS	200000
+#define SAMPLES			256	// random input vectors cycled through
+
+static const struct{
+	rotor_layout_t layout;
+	const char* name;
+	int rotors;
+} layouts[] = {
+	{LAYOUT_4X,			"LAYOUT_4X",			4},
+	{LAYOUT_4PLUS,			"LAYOUT_4PLUS",			4},
+	{LAYOUT_6X,			"LAYOUT_6X",			6},
+	{LAYOUT_8X,			"LAYOUT_8X",			8},
+	{LAYOUT_6DOF_ROTORBITS,		"LAYOUT_6DOF_ROTORBITS",	6},
+	{LAYOUT_6DOF_5INCH_MONOCOQUE,	"LAYOUT_6DOF_5INCH_MONOCOQUE",	6}
+};
+#define NUM_LAYOUTS ((int)(sizeof(layouts)/sizeof(layouts[0])))
+
+static scalar_t inputs[SAMPLES][6];	// control inputs, also used as angles
+static scalar_t thrusts[SAMPLES];	// 0 to 1
+static replay_inputs_t imu[SAMPLES];
+static volatile double sink;		// keeps the compiler from removing loops
+
+static int json;
+static int first_result = 1;
+static struct utsname machine;
+
+static uint64_t t0_ns, t0_cycles;
+
+
+static uint64_t __nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+static void __start()
+{
+	t0_cycles = cycle_counter_read();
+	t0_ns = __nanos();
+}
+
+
+static void __stop(const char* bench, const char* layout, int iterations)
+{
+	uint64_t ns = __nanos()-t0_ns;
+	uint64_t cycles = cycle_counter_read()-t0_cycles;
+	double ns_op = (double)ns/iterations;
+	double cyc_op = (double)cycles/iterations;
+	int have_cycles = cycle_counter_available();
+
+	if(json){
+		printf("%s\n  {\"rev\": \"%s\", \"machine\": \"%s\", \"scalar\": \"%s\", "
+			"\"bench\": \"%s\", \"layout\": \"%s\", \"iterations\": %d, "
+			"\"ns_per_op\": %.2f, ", first_result ? "[" : ",", BENCH_GIT_REV,
+			machine.machine, SCALAR_NAME, bench, layout, iterations, ns_op);
+		if(have_cycles) printf("\"cycles_per_op\": %.1f, ", cyc_op);
+		else printf("\"cycles_per_op\": null, ");
+		printf("\"cycle_source\": \"%s\"}", cycle_counter_source);
+	}
+	else{
+		if(first_result){
+			printf("rev,machine,scalar,bench,layout,iterations,ns_per_op,cycles_per_op,cycle_source\n");
+		}
+		printf("%s,%s,%s,%s,%s,%d,%.2f,", BENCH_GIT_REV, machine.machine,
+					SCALAR_NAME, bench, layout, iterations, ns_op);
+		if(have_cycles) printf("%.1f", cyc_op);
+		printf(",%s\n", cycle_counter_source);
+	}
+	first_result = 0;
+	fflush(stdout);
+}
+
+
+// times body over n iterations, i is the iteration index inside body
+#define BENCH(name, layout, n, body) do{	\
+	__start();				\
+	for(i=0;i<(n);i++){ body; }		\
+	__stop(name, layout, n);		\
+}while(0)
+
+
+/**
+ * @brief      checks the thrust map rejects or clamps inputs outside 0-1,
+ *             NaN included, instead of reading outside the lookup table
+ *
+ * @return     0 if all checks pass, -1 otherwise
+ */
+static int __check_thrust_map()
+{
+	const scalar_t bad[] = {NAN, -NAN, -0.5, 1.5};
+	const scalar_t clamped[] = {0.0, 0.0, 0.0, 1.0};
+	scalar_t in[MAX_ROTORS], out[MAX_ROTORS];
+	int i, j, ret = 0;
+
+	for(i=0;i<4;i++){
+		if(map_motor_signal(bad[i])!=-1){
+			fprintf(stderr,"ERROR: map_motor_signal(%f) didn't fail\n", (double)bad[i]);
+			ret = -1;
+		}
+		// every position so both the vector and the scalar tail see it
+		for(j=0;j<MAX_ROTORS;j++) in[j] = (j==i || j==MAX_ROTORS-1-i) ? bad[i] : 0.5;
+		if(map_motor_signals(in, out, MAX_ROTORS)) return -1;
+		for(j=0;j<MAX_ROTORS;j++){
+			if(in[j]==0.5) continue;
+			if(out[j]!=map_motor_signal(clamped[i])){
+				fprintf(stderr,"ERROR: map_motor_signals(%f) gave %f\n",
+							(double)bad[i], (double)out[j]);
+				ret = -1;
+			}
+		}
+	}
+	return ret;
+}
+
+
+static void __print_usage()
+{
+	printf("\n");
+	printf("Usage: bench [options]\n");
+	printf("-s {file}   settings file for the controllers and thrust map\n");
+	printf("            defaults to %s\n", SETTINGS_FILE);
+	printf("-n {num}    iterations per benchmark, default %d\n", DEFAULT_ITERATIONS);
+	printf("-j          print results as JSON instead of CSV\n");
+	printf("-h          print this help message\n");
+	printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, i, j, l, s;
+	int n = DEFAULT_ITERATIONS;
+	int n_step;
+	const char* settings_path = SETTINGS_FILE;
+	const char* name;
+	scalar_t mot[MAX_ROTORS], out[MAX_ROTORS];
+	scalar_t min, max;
+	rc_filter_t D_roll, D_pitch, D_yaw;
+	filter_bank_t D_rpy;
+	static const settings_controller_t rpy_ids[3] = {CTRL_ROLL, CTRL_PITCH, CTRL_YAW};
+	scalar_t rpy_out[3];
+
+	opterr = 0;
+	while((c = getopt(argc, argv, "s:n:jh"))!=-1){
+		switch(c){
+		case 's':
+			settings_path = optarg;
+			break;
+		case 'n':
+			n = atoi(optarg);
+			if(n<=0){
+				fprintf(stderr,"ERROR: iterations must be positive\n");
+				return -1;
+			}
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'h':
+			__print_usage();
+			return 0;
+		default:
+			__print_usage();
+			return -1;
+		}
+	}
+	// a full feedback step is ~50x the cost of one mixer call
+	n_step = n/20 > 0 ? n/20 : 1;
+
+	// controller output shouldn't end up between the results
+	fflush(stdout);
+	s = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+	if(settings_load_from_path(settings_path)){
+		fprintf(stderr,"ERROR: failed to load settings from %s\n", settings_path);
+		return -1;
+	}
+	settings.enable_logging = 0;
+	settings.enable_mocap = 0;
+	settings.enable_baro = 0;
+	if(thrust_map_init(settings.thrust_map)<0) return -1;
+	if(__check_thrust_map()<0) return -1;
+	if(esc_output_init(settings.esc_protocol)<0) return -1;
+	if(mix_init(settings.layout)<0) return -1;
+	if(setpoint_manager_init()<0) return -1;
+
+	srand(1);
+	for(i=0;i<SAMPLES;i++){
+		for(j=0;j<6;j++) inputs[i][j] = 0.2*rand()/(double)RAND_MAX - 0.1;
+		thrusts[i] = rand()/(double)RAND_MAX;
+		imu[i].tait_bryan[TB_ROLL_Y]  = inputs[i][0];
+		imu[i].tait_bryan[TB_PITCH_X] = inputs[i][1];
+		imu[i].tait_bryan[TB_YAW_Z]   = inputs[i][2];
+		for(j=0;j<3;j++) imu[i].gyro[j] = 10.0*inputs[i][j+3];
+		imu[i].v_batt = settings.v_nominal;
+	}
+
+	replay_backend_set_inputs(&imu[0]);
+	if(battery_manager_init()<0) return -1;
+	if(feedback_init()<0) return -1;
+	replay_backend_set_inputs(&imu[0]);
+	user_input.initialized = 1;
+	user_input.input_active = 1;
+	user_input.flight_mode = settings.flight_mode_1;
+	user_input.thr_stick = 0.2;
+	user_input.requested_arm_mode = ARMED;
+	// a single frame, the feedback step then times the loops between frames
+	setpoint_manager_input(&user_input, rc_nanos_since_boot());
+	rc_set_state(RUNNING);
+	replay_backend_step();
+	if(fstate.arm_state!=ARMED){
+		fprintf(stderr,"ERROR: controller failed to arm\n");
+		return -1;
+	}
+	// the roll/pitch/yaw controllers exactly as configured
+	if(settings_get_roll_controller(&D_roll)) return -1;
+	if(settings_get_pitch_controller(&D_pitch)) return -1;
+	if(settings_get_yaw_controller(&D_yaw)) return -1;
+	if(settings_get_controller_bank(rpy_ids, 3, NULL, &D_rpy)) return -1;
+
+	fflush(stdout);
+	dup2(s, STDOUT_FILENO);
+	close(s);
+	uname(&machine);
+	cycle_counter_init();
+
+	/***************************************************************************
+	* layout independent
+	***************************************************************************/
+	BENCH("map_motor_signal", "-", n,
+		sink += map_motor_signal(thrusts[i%SAMPLES]));
+	BENCH("battery_manager_get", "-", n,
+		sink += battery_manager_get().gain);
+	BENCH("battery_manager_update", "-", n,
+		battery_manager_update());
+	BENCH("rc_filter_march_roll", "-", n,
+		sink += rc_filter_march(&D_roll, inputs[i%SAMPLES][VEC_ROLL]));
+	BENCH("rc_filter_march_pitch", "-", n,
+		sink += rc_filter_march(&D_pitch, inputs[i%SAMPLES][VEC_PITCH]));
+	BENCH("rc_filter_march_yaw", "-", n,
+		sink += rc_filter_march(&D_yaw, inputs[i%SAMPLES][VEC_YAW]));
+	BENCH("filter_bank_march_rpy", "-", n,
+		filter_bank_march(&D_rpy, &inputs[i%SAMPLES][VEC_ROLL], rpy_out);
+		sink += rpy_out[0]);
+
+	/***************************************************************************
+	* per layout
+	***************************************************************************/
+	for(l=0;l<NUM_LAYOUTS;l++){
+		name = layouts[l].name;
+		// a fixed airframe build only has its own layout compiled in
+		#ifdef AIRFRAME_LAYOUT
+		if(layouts[l].layout!=AIRFRAME_LAYOUT) continue;
+		#endif
+		if(mix_init(layouts[l].layout)<0) return -1;
+		settings.layout = layouts[l].layout;
+		settings.num_rotors = layouts[l].rotors;
+		for(j=0;j<MAX_ROTORS;j++) mot[j] = 0.5;
+
+		BENCH("mix_check_saturation", name, n,
+			mix_check_saturation(VEC_ROLL+(i&1), mot, &min, &max);
+			sink += max);
+		BENCH("mix_check_saturation_fast", name, n,
+			mix_check_saturation_fast(VEC_ROLL+(i&1), mot, &min, &max);
+			sink += max);
+		BENCH("mix_add_input", name, n,
+			mix_add_input(inputs[i%SAMPLES][VEC_ROLL]*0.01, VEC_ROLL, mot));
+		for(j=0;j<MAX_ROTORS;j++) mot[j] = 0.5;
+		BENCH("mix_add_input_fast", name, n,
+			mix_add_input_fast(inputs[i%SAMPLES][VEC_ROLL]*0.01, VEC_ROLL, mot));
+		for(j=0;j<MAX_ROTORS;j++) mot[j] = 0.5;
+		BENCH("mix_add_input_saturated", name, n,
+			sink += mix_add_input_saturated(inputs[i%SAMPLES][VEC_ROLL]*0.01,
+					VEC_ROLL, -MAX_ROLL_COMPONENT, MAX_ROLL_COMPONENT, mot));
+		BENCH("mix_all_controls", name, n,
+			mix_all_controls(inputs[i%SAMPLES], mot);
+			sink += mot[0]);
+		BENCH("map_motor_signals", name, n,
+			map_motor_signals(&thrusts[i%(SAMPLES-MAX_ROTORS)], out,
+							layouts[l].rotors);
+			sink += out[0]);
+		BENCH("feedback_step", name, n_step,
+			replay_backend_set_inputs(&imu[i%SAMPLES]);
+			replay_backend_step());
+		if(fstate.arm_state!=ARMED){
+			fprintf(stderr,"ERROR: controller disarmed during %s\n", name);
+			return -1;
+		}
+	}
+	if(json) printf("\n]\n");
+
+	feedback_cleanup();
+	return 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * @headerfile cycle_counter.h
+ *
+ * @brief      CPU cycle counter for the benchmarks.
+ *
+ *             Uses the perf hardware cycle counter when the kernel allows it
+ *             and the x86 time stamp counter otherwise. cycle_counter_source
+ *             says which, "none" when neither is there and cycle_counter_read()
+ *             always returns 0. Reading the perf counter is a syscall, time
+ *             an empty region to know what it adds. Header only so the tools
+ *             that don't link the controller can use it too, each gets its own
+ *             counter.
+ */
+
+#ifndef CYCLE_COUNTER_H
+#define CYCLE_COUNTER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+static int cycle_counter_fd = -1;
+static const char* cycle_counter_source = "none";
+
+
+/**
+ * @brief      opens the perf hardware cycle counter for this thread, falls
+ *             back to the time stamp counter on x86 if perf isn't available
+ */
+static inline void cycle_counter_init()
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	cycle_counter_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if(cycle_counter_fd>=0){
+		ioctl(cycle_counter_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(cycle_counter_fd, PERF_EVENT_IOC_ENABLE, 0);
+		cycle_counter_source = "perf";
+		return;
+	}
+	#if defined(__x86_64__) || defined(__i386__)
+	cycle_counter_source = "tsc";
+	#endif
+}
+
+
+/**
+ * @brief      whether cycle_counter_read() counts anything
+ */
+static inline int cycle_counter_available()
+{
+	return strcmp(cycle_counter_source, "none")!=0;
+}
+
+
+static inline uint64_t cycle_counter_read()
+{
+	uint64_t c = 0;
+	if(cycle_counter_fd>=0){
+		if(read(cycle_counter_fd, &c, sizeof(c))!=sizeof(c)) c = 0;
+		return c;
+	}
+	#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	c = ((uint64_t)hi<<32) | lo;
+	#endif
+	return c;
+}
+
+#endif // CYCLE_COUNTER_H
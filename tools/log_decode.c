@@ -0,0 +1,183 @@
+/**
+ * @file log_decode.c
+ *
+ * Converts a binary flight log, plain or compact, to CSV with one column per
+ * field in the log header, or back to a plain binary log for tools that only
+ * read that. Floating point columns are printed with enough digits to read
+ * back the exact values that were logged.
+ *
+ * Only needs src/log_codec.c, so it builds and runs on a workstation.
+ *
+ * Usage: log_decode [-o out.csv] [-b out.bin] log.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include <log_manager.h>
+#include <log_codec.h>
+
+
+static void __print_usage()
+{
+	printf("\n");
+	printf("Usage: log_decode [options] log.bin\n");
+	printf("-o {file}   write CSV to file instead of stdout\n");
+	printf("-b {file}   write a plain binary log instead of CSV\n");
+	printf("-h          print this help message\n");
+	printf("\n");
+}
+
+
+static void __print_field(FILE* out, const log_field_t* f, const unsigned char* rec)
+{
+	const unsigned char* p = rec + f->offset;
+	uint64_t u64;
+	int64_t i64;
+	uint32_t u32;
+	int32_t i32;
+	double d;
+	float fl;
+
+	if(strcmp(f->type, "double")==0 && f->size==8){
+		memcpy(&d, p, 8);
+		fprintf(out, "%.17g", d);
+	}
+	else if(strcmp(f->type, "float")==0 && f->size==4){
+		memcpy(&fl, p, 4);
+		fprintf(out, "%.9g", (double)fl);
+	}
+	else if(strcmp(f->type, "uint64_t")==0 && f->size==8){
+		memcpy(&u64, p, 8);
+		fprintf(out, "%" PRIu64, u64);
+	}
+	else if(strcmp(f->type, "int64_t")==0 && f->size==8){
+		memcpy(&i64, p, 8);
+		fprintf(out, "%" PRId64, i64);
+	}
+	else if(strcmp(f->type, "uint32_t")==0 && f->size==4){
+		memcpy(&u32, p, 4);
+		fprintf(out, "%" PRIu32, u32);
+	}
+	else if(f->size==4 && (strcmp(f->type, "int")==0 || strcmp(f->type, "int32_t")==0)){
+		memcpy(&i32, p, 4);
+		fprintf(out, "%" PRId32, i32);
+	}
+	// anything else has no CSV representation, leave the column empty
+}
+
+
+static int __write_plain_header(FILE* out, const log_reader_t* r)
+{
+	log_file_header_t header = r->header;
+
+	memset(header.magic, 0, sizeof(header.magic));
+	memcpy(header.magic, LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC));
+	header.header_size = sizeof(header) + header.num_fields*sizeof(log_field_t);
+	if(fwrite(&header, sizeof(header), 1, out)!=1) return -1;
+	if(fwrite(r->fields, sizeof(log_field_t), header.num_fields, out)!=header.num_fields) return -1;
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, ret;
+	uint32_t i;
+	const char* out_path = NULL;
+	const char* bin_path = NULL;
+	FILE* log_file;
+	FILE* out = stdout;
+	log_reader_t reader;
+	unsigned char* rec;
+	uint64_t records = 0;
+
+	opterr = 0;
+	while((c = getopt(argc, argv, "o:b:h"))!=-1){
+		switch(c){
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'b':
+			bin_path = optarg;
+			break;
+		case 'h':
+			__print_usage();
+			return 0;
+		default:
+			__print_usage();
+			return -1;
+		}
+	}
+	if(optind!=argc-1 || (out_path!=NULL && bin_path!=NULL)){
+		__print_usage();
+		return -1;
+	}
+
+	log_file = fopen(argv[optind], "rb");
+	if(log_file==NULL){
+		perror("ERROR opening log file");
+		return -1;
+	}
+	if(log_reader_open(&reader, log_file)) return -1;
+	rec = malloc(reader.header.record_size);
+	if(rec==NULL){
+		fprintf(stderr,"ERROR: failed to allocate record buffer\n");
+		return -1;
+	}
+
+	if(bin_path!=NULL || out_path!=NULL){
+		out = fopen(bin_path!=NULL ? bin_path : out_path, bin_path!=NULL ? "wb" : "w");
+		if(out==NULL){
+			perror("ERROR opening output file");
+			return -1;
+		}
+	}
+	// stdio buffering is the bottleneck on big logs
+	setvbuf(out, NULL, _IOFBF, 1<<16);
+
+	if(bin_path!=NULL){
+		if(__write_plain_header(out, &reader)){
+			perror("ERROR writing output");
+			return -1;
+		}
+	}
+	else{
+		for(i=0;i<reader.header.num_fields;i++){
+			fprintf(out, i ? ",%s" : "%s", reader.fields[i].name);
+		}
+		fprintf(out, "\n");
+	}
+
+	while((ret = log_reader_next(&reader, rec))==1){
+		if(bin_path!=NULL){
+			if(fwrite(rec, reader.header.record_size, 1, out)!=1){
+				perror("ERROR writing output");
+				return -1;
+			}
+		}
+		else{
+			for(i=0;i<reader.header.num_fields;i++){
+				if(i) fputc(',', out);
+				__print_field(out, &reader.fields[i], rec);
+			}
+			fputc('\n', out);
+		}
+		records++;
+	}
+
+	if(fclose(out)){
+		perror("ERROR writing output");
+		return -1;
+	}
+	fprintf(stderr, "decoded %" PRIu64 " records from %s log\n", records,
+					reader.blocks ? "compact" : "plain");
+	log_reader_close(&reader);
+	fclose(log_file);
+	free(rec);
+	return ret<0 ? -1 : 0;
+}
@@ -0,0 +1,329 @@
+/**
+ * @file mix_bench.c
+ *
+ * Microbenchmark comparing the original mix_check_saturation() and
+ * mix_add_input() path against the precomputed fast path for every rotor
+ * layout. Each iteration mixes Z, roll, pitch and yaw (plus X and Y on 6DOF
+ * layouts) from a fresh random starting point the same way
+ * __feedback_control() does. Also checks both paths produce the same motor
+ * outputs.
+ *
+ * The priority allocator mix_allocate() is also timed one call at a time,
+ * cold. WORST_PASSES times every sample is run once in a shuffled order, and
+ * before each call EVICT_BYTES of memory are walked so the mixer tables and
+ * the inputs come from RAM and the branch predictor has seen other inputs in
+ * between. The largest of those times is the worst case, the 99th percentile
+ * is given next to it since a preemption can land on any single call. Both
+ * are in ns and, when there is a cycle counter (see cycle_counter.h), in
+ * cycles, with the cost of timing an empty call taken off. The number of steps
+ * only depends on which levels saturate, so the worst case is set by the
+ * layout. Its motors are checked against the inputs it reports as applied,
+ * and the mean error between the requested and produced inputs is given for
+ * both allocators.
+ *
+ * Runs on the host or on the BeagleBone, only depends on mix.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <mix.h>
+#include <airframe.h>
+#include <rc_pilot_defs.h>
+#include "cycle_counter.h"
+
+#define ITERATIONS	200000
+#define SAMPLES		256	// random input vectors cycled through
+#define WORST_PASSES	16	// cold runs of each sample for the worst case
+#define WORST_RUNS	(WORST_PASSES*SAMPLES)
+#define EVICT_BYTES	(1<<20)	// walked before each cold run, 4x the Cortex-A8's L2
+#define CACHE_LINE	64
+
+static const char* layout_names[] = {
+	"LAYOUT_4X",
+	"LAYOUT_4PLUS",
+	"LAYOUT_6X",
+	"LAYOUT_8X",
+	"LAYOUT_6DOF_ROTORBITS",
+	"LAYOUT_6DOF_5INCH_MONOCOQUE"
+};
+
+static scalar_t inputs[SAMPLES][6];
+static double sink; // keep the compiler from optimizing the loops away
+static volatile unsigned char evict[EVICT_BYTES];
+static uint64_t cold_ns[WORST_RUNS], cold_cycles[WORST_RUNS];
+
+
+static uint64_t __nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+static void __mix_legacy(const scalar_t* in, int dof6, scalar_t* mot)
+{
+	int i, ch;
+	scalar_t min, max, u;
+	static const int order[] = {VEC_ROLL, VEC_PITCH, VEC_YAW, VEC_Y, VEC_X};
+
+	for(i=0;i<MAX_ROTORS;i++) mot[i] = 0.0;
+	mix_check_saturation(VEC_Z, mot, &min, &max);
+	u = in[VEC_Z];
+	if(u>max) u = max;
+	if(u<min) u = min;
+	mix_add_input(u, VEC_Z, mot);
+	for(i=0;i<(dof6?5:3);i++){
+		ch = order[i];
+		mix_check_saturation(ch, mot, &min, &max);
+		if(max>0.8) max = 0.8;
+		if(min<-0.8) min = -0.8;
+		u = in[ch];
+		if(u>max) u = max;
+		if(u<min) u = min;
+		mix_add_input(u, ch, mot);
+	}
+}
+
+
+static void __mix_fast(const scalar_t* in, int dof6, scalar_t* mot)
+{
+	int i;
+	static const int order[] = {VEC_ROLL, VEC_PITCH, VEC_YAW, VEC_Y, VEC_X};
+
+	for(i=0;i<MAX_ROTORS;i++) mot[i] = 0.0;
+	mix_add_input_saturated(in[VEC_Z], VEC_Z, -SCALAR_MAX, SCALAR_MAX, mot);
+	for(i=0;i<(dof6?5:3);i++){
+		mix_add_input_saturated(in[order[i]], order[i], -0.8, 0.8, mot);
+	}
+}
+
+
+static void __mix_priority(const scalar_t* in, int dof6, scalar_t* u, scalar_t* mot)
+{
+	int ch;
+	for(ch=0;ch<6;ch++){
+		u[ch] = in[ch];
+		if(ch==VEC_Z) continue;
+		if(!dof6 && (ch==VEC_X || ch==VEC_Y)) u[ch] = 0.0;
+		if(u[ch]>0.8) u[ch] = 0.8;
+		if(u[ch]<-0.8) u[ch] = -0.8;
+	}
+	mix_allocate(u, mot);
+}
+
+
+/**
+ * @brief      pushes everything else out of the data caches by writing one
+ *             byte per cache line of a buffer larger than them
+ */
+static void __evict()
+{
+	int i;
+	for(i=0;i<EVICT_BYTES;i+=CACHE_LINE) evict[i]++;
+}
+
+
+static int __cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x<y ? -1 : x>y;
+}
+
+
+/**
+ * @brief      sorts t and returns the largest value and the 99th percentile
+ *             after taking off the timing overhead
+ */
+static void __worst(uint64_t* t, int n, uint64_t overhead, double* max, double* p99)
+{
+	uint64_t a, b;
+
+	qsort(t, n, sizeof(t[0]), __cmp_u64);
+	a = t[n-1];
+	b = t[(n*99)/100];
+	*max = a>overhead ? (double)(a-overhead) : 0.0;
+	*p99 = b>overhead ? (double)(b-overhead) : 0.0;
+}
+
+
+/**
+ * @brief      times every sample of the priority allocator once per pass,
+ *             cold, into cold_ns and cold_cycles
+ *
+ * @param[out] ns_overhead      smallest time of an empty timed region
+ * @param[out] cycles_overhead  the same in cycles
+ */
+static void __time_cold(int dof6, uint64_t* ns_overhead, uint64_t* cycles_overhead)
+{
+	int p, i, j, k, tmp;
+	int order[SAMPLES];
+	uint64_t t0, t1, c0, c1;
+	scalar_t u[6], mot[MAX_ROTORS];
+
+	*ns_overhead = UINT64_MAX;
+	*cycles_overhead = UINT64_MAX;
+	for(i=0;i<1000;i++){
+		c0 = cycle_counter_read();
+		t0 = __nanos();
+		t1 = __nanos();
+		c1 = cycle_counter_read();
+		if(t1-t0<*ns_overhead) *ns_overhead = t1-t0;
+		if(c1-c0<*cycles_overhead) *cycles_overhead = c1-c0;
+	}
+
+	for(i=0;i<SAMPLES;i++) order[i] = i;
+	k = 0;
+	for(p=0;p<WORST_PASSES;p++){
+		// a new order every pass so no sample always follows the same one
+		for(i=SAMPLES-1;i>0;i--){
+			j = rand()%(i+1);
+			tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+		for(i=0;i<SAMPLES;i++){
+			__evict();
+			c0 = cycle_counter_read();
+			t0 = __nanos();
+			__mix_priority(inputs[order[i]], dof6, u, mot);
+			t1 = __nanos();
+			c1 = cycle_counter_read();
+			sink += mot[0];
+			cold_ns[k] = t1-t0;
+			cold_cycles[k] = c1-c0;
+			k++;
+		}
+	}
+}
+
+
+// sum over channels of how far the motors miss the requested inputs
+static double __effect_err(const scalar_t* in, int dof6, const scalar_t* mot)
+{
+	int ch;
+	scalar_t u[6];
+	double want, err = 0.0;
+	mix_motor_effect(mot, u);
+	for(ch=0;ch<6;ch++){
+		if(!dof6 && (ch==VEC_X || ch==VEC_Y)) continue;
+		want = in[ch];
+		if(ch!=VEC_Z){
+			if(want>0.8) want = 0.8;
+			if(want<-0.8) want = -0.8;
+		}
+		err += fabs(want-u[ch]);
+	}
+	return err;
+}
+
+
+int main()
+{
+	int l, i, j;
+	int dof6;
+	uint64_t t0, t1;
+	double legacy_ns, fast_ns, err, max_err;
+	double prio_ns, prio_err, fast_miss, prio_miss;
+	double worst_ns, p99_ns, worst_cyc, p99_cyc;
+	uint64_t ns_overhead, cycles_overhead;
+	scalar_t mot_a[MAX_ROTORS], mot_b[MAX_ROTORS], mot_c[MAX_ROTORS];
+	scalar_t u[6], eff[6];
+
+	cycle_counter_init();
+	srand(1);
+	for(i=0;i<SAMPLES;i++){
+		// throttle in the flyable range, other channels anywhere +-1
+		inputs[i][VEC_Z] = -0.1 - 0.75*rand()/(double)RAND_MAX;
+		for(j=0;j<6;j++){
+			if(j==VEC_Z) continue;
+			inputs[i][j] = 2.0*rand()/(double)RAND_MAX - 1.0;
+		}
+	}
+
+	printf("layout,legacy_ns_per_loop,fast_ns_per_loop,speedup,max_abs_diff,"
+		"priority_ns_per_loop,priority_worst_ns,priority_p99_ns,"
+		"priority_worst_cycles,priority_p99_cycles,priority_max_effect_err,"
+		"fast_mean_miss,priority_mean_miss,cycle_source\n");
+	for(l=LAYOUT_4X;l<=LAYOUT_6DOF_5INCH_MONOCOQUE;l++){
+		// a fixed airframe build only has its own layout compiled in
+		#ifdef AIRFRAME_LAYOUT
+		if(l!=AIRFRAME_LAYOUT) continue;
+		#endif
+		if(mix_init(l)){
+			fprintf(stderr,"ERROR: mix_init failed for %s\n", layout_names[l]);
+			return -1;
+		}
+		dof6 = (l==LAYOUT_6DOF_ROTORBITS || l==LAYOUT_6DOF_5INCH_MONOCOQUE);
+
+		// both paths must agree before their timing means anything
+		max_err = 0.0;
+		for(i=0;i<SAMPLES;i++){
+			__mix_legacy(inputs[i], dof6, mot_a);
+			__mix_fast(inputs[i], dof6, mot_b);
+			for(j=0;j<MAX_ROTORS;j++){
+				err = fabs(mot_a[j]-mot_b[j]);
+				if(err>max_err) max_err = err;
+			}
+		}
+
+		// the priority allocator's motors must produce what it reports
+		prio_err = 0.0;
+		fast_miss = 0.0;
+		prio_miss = 0.0;
+		for(i=0;i<SAMPLES;i++){
+			__mix_priority(inputs[i], dof6, u, mot_c);
+			mix_motor_effect(mot_c, eff);
+			for(j=0;j<6;j++){
+				err = fabs(eff[j]-u[j]);
+				if(err>prio_err) prio_err = err;
+			}
+			__mix_fast(inputs[i], dof6, mot_b);
+			fast_miss += __effect_err(inputs[i], dof6, mot_b)/SAMPLES;
+			prio_miss += __effect_err(inputs[i], dof6, mot_c)/SAMPLES;
+		}
+
+		t0 = __nanos();
+		for(i=0;i<ITERATIONS;i++){
+			__mix_legacy(inputs[i%SAMPLES], dof6, mot_a);
+			sink += mot_a[0];
+		}
+		t1 = __nanos();
+		legacy_ns = (double)(t1-t0)/ITERATIONS;
+
+		t0 = __nanos();
+		for(i=0;i<ITERATIONS;i++){
+			__mix_fast(inputs[i%SAMPLES], dof6, mot_b);
+			sink += mot_b[0];
+		}
+		t1 = __nanos();
+		fast_ns = (double)(t1-t0)/ITERATIONS;
+
+		t0 = __nanos();
+		for(i=0;i<ITERATIONS;i++){
+			__mix_priority(inputs[i%SAMPLES], dof6, u, mot_c);
+			sink += mot_c[0];
+		}
+		t1 = __nanos();
+		prio_ns = (double)(t1-t0)/ITERATIONS;
+
+		__time_cold(dof6, &ns_overhead, &cycles_overhead);
+		__worst(cold_ns, WORST_RUNS, ns_overhead, &worst_ns, &p99_ns);
+		__worst(cold_cycles, WORST_RUNS, cycles_overhead, &worst_cyc, &p99_cyc);
+
+		printf("%s,%.1f,%.1f,%.2f,%.3g,%.1f,%.0f,%.0f,", layout_names[l],
+					legacy_ns, fast_ns, legacy_ns/fast_ns, max_err,
+					prio_ns, worst_ns, p99_ns);
+		if(cycle_counter_available()) printf("%.0f,%.0f,", worst_cyc, p99_cyc);
+		else printf(",,");
+		printf("%.3g,%.4f,%.4f,%s\n", prio_err, fast_miss, prio_miss,
+					cycle_counter_source);
+	}
+	fprintf(stderr, "(sink %g)\n", sink);
+	return 0;
+}
@@ -0,0 +1,379 @@
+/**
+ * @file replay.c
+ *
+ * Offline replay of a binary flight log, plain or compact, through the
+ * feedback controller.
+ *
+ * The IMU angles, battery voltage, sticks and flight mode recorded in each log
+ * entry are pushed through the same dmp callback, setpoint manager, state
+ * estimator, mixer and thrust map as on the cape, one record after the other
+ * as fast as the machine allows. The ESC pulses the controller sends are
+ * written out as CSV, and the difference to the motor signals recorded in the
+ * log is reported so a change to the control loop can be regression tested
+ * against real flights. Loop timing statistics from fstate.timing are printed
+ * at the end for profiling.
+ *
+ * With -F the same log is also replayed by a second build of the harness,
+ * typically bin/replay_float from make replay_float, running in lockstep on a
+ * pipe. The largest difference between the motor signals of the two builds is
+ * reported, which shows what the float control path (see scalar.h) costs in
+ * accuracy on a real flight.
+ *
+ * With -W the watchdog's IMU stall response is run at the given record, and
+ * the replay checks the controller stays disarmed, even though the sticks
+ * still ask for ARMED, until the pilot gives a new arm request one second
+ * later. Fails if it arms before that or not after it.
+ *
+ * Usage: replay [-s settings.json] [-o out.csv] [-q] [-F other_replay]
+ *               [-W record] log.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h> // for dup
+#include <sys/wait.h>
+
+#include <rc/start_stop.h>
+
+#include <rc_pilot_defs.h>
+#include <settings.h>
+#include <feedback.h>
+#include <setpoint_manager.h>
+#include <input_manager.h>
+#include <mix.h>
+#include <thrust_map.h>
+#include <log_manager.h>
+#include <log_codec.h>
+#include <battery_manager.h>
+#include <esc_output.h>
+#include <watchdog.h>
+#include "replay_backend.h"
+#include "replay_log.h"
+
+// comparison against a second build started with -F
+static FILE* other;
+static pid_t other_pid;
+static double other_max_dev;
+static uint64_t other_max_record;
+static uint64_t other_arm_diffs;
+static uint64_t other_records;
+
+
+static void __print_usage()
+{
+	printf("\n");
+	printf("Usage: replay [options] log.bin\n");
+	printf("-s {file}   settings file the log was recorded with\n");
+	printf("            defaults to %s\n", SETTINGS_FILE);
+	printf("-o {file}   write ESC outputs as CSV to file instead of stdout\n");
+	printf("-q          don't write ESC outputs, only print the summary\n");
+	printf("-F {file}   also replay the log with another replay build, e.g.\n");
+	printf("            bin/replay_float, and report the largest difference\n");
+	printf("            between the motor signals of the two\n");
+	printf("-W {n}      stall the IMU at record n and check arming stays locked\n");
+	printf("            until a new arm request one second later\n");
+	printf("-x          write ESC outputs at full precision with no summary,\n");
+	printf("            this is what -F reads from the other build\n");
+	printf("-h          print this help message\n");
+	printf("\n");
+}
+
+
+static uint64_t __wall_nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * @brief      starts another replay build on the same settings and log with
+ *             its ESC outputs coming back on a pipe, and skips its CSV header
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __start_other(const char* exe, const char* settings_path, const char* log_path)
+{
+	int fd[2];
+	char line[512];
+
+	if(pipe(fd)){
+		perror("ERROR creating pipe for comparison replay");
+		return -1;
+	}
+	other_pid = fork();
+	if(other_pid<0){
+		perror("ERROR forking comparison replay");
+		return -1;
+	}
+	if(other_pid==0){
+		dup2(fd[1], STDOUT_FILENO);
+		close(fd[0]);
+		close(fd[1]);
+		execl(exe, exe, "-x", "-s", settings_path, log_path, (char*)NULL);
+		perror("ERROR starting comparison replay");
+		_exit(127);
+	}
+	close(fd[1]);
+	other = fdopen(fd[0], "r");
+	if(other==NULL){
+		perror("ERROR opening comparison replay pipe");
+		return -1;
+	}
+	if(fgets(line, sizeof(line), other)==NULL){
+		fprintf(stderr,"ERROR: comparison replay %s wrote no output\n", exe);
+		fclose(other);
+		other = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      reads the other build's outputs for the record just replayed
+ *             and compares them to this build's. Stops comparing if the other
+ *             build runs out of records.
+ */
+static void __compare_other(uint64_t record)
+{
+	char line[512];
+	char* p;
+	char* end;
+	int i, arm;
+	double m, dev;
+
+	if(fgets(line, sizeof(line), other)==NULL || strtoull(line, &p, 10)!=record){
+		fprintf(stderr,"ERROR: comparison replay out of step at record %" PRIu64 "\n", record);
+		fclose(other);
+		other = NULL;
+		return;
+	}
+	arm = strtol(p+1, &p, 10);
+	if(arm!=(int)fstate.arm_state) other_arm_diffs++;
+	for(i=1;i<=settings.num_rotors;i++){
+		m = strtod(p+1, &end);
+		if(end==p+1) break;
+		p = end;
+		dev = fabs(m-replay_backend_esc(i));
+		if(dev>other_max_dev){
+			other_max_dev = dev;
+			other_max_record = record;
+		}
+	}
+	other_records++;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, i, status;
+	int quiet = 0;
+	int exact = 0;
+	const char* settings_path = SETTINGS_FILE;
+	const char* out_path = NULL;
+	const char* other_path = NULL;
+	FILE* log_file;
+	log_reader_t reader;
+	FILE* out = stdout;
+	char* rec;
+	uint32_t record_size;
+	uint64_t records = 0;
+	uint64_t batt_div;
+	uint64_t t_start, t_end;
+	double m, logged, err, max_err = 0.0;
+	double wall_s, flight_s;
+	loop_stat_summary_t* total;
+	int64_t stall_record = -1;
+	int64_t rearm_record = -1;	// record the new arm request goes out with
+	uint64_t locked_armed = 0;	// armed loops between the stall and rearm_record
+	int64_t rearmed_at = -1;
+
+	opterr = 0;
+	while((c = getopt(argc, argv, "s:o:qF:W:xh"))!=-1){
+		switch(c){
+		case 's':
+			settings_path = optarg;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'F':
+			other_path = optarg;
+			break;
+		case 'W':
+			stall_record = strtoll(optarg, NULL, 10);
+			break;
+		case 'x':
+			exact = 1;
+			break;
+		case 'h':
+			__print_usage();
+			return 0;
+		default:
+			__print_usage();
+			return -1;
+		}
+	}
+	if(optind!=argc-1){
+		__print_usage();
+		return -1;
+	}
+
+	// start the other build before stdout is redirected below
+	if(other_path!=NULL && __start_other(other_path, settings_path, argv[optind])){
+		return -1;
+	}
+
+	if(out_path!=NULL && !quiet){
+		out = fopen(out_path, "w");
+		if(out==NULL){
+			perror("ERROR opening output file");
+			return -1;
+		}
+	}
+	else if(!quiet){
+		// keep the CSV on stdout clean by sending everything the
+		// controller prints to stderr instead
+		out = fdopen(dup(STDOUT_FILENO), "w");
+		if(out==NULL || dup2(STDERR_FILENO, STDOUT_FILENO)<0){
+			perror("ERROR redirecting stdout");
+			return -1;
+		}
+	}
+
+	// settings first since the controllers and mixer depend on them
+	if(settings_load_from_path(settings_path)){
+		fprintf(stderr,"ERROR: failed to load settings from %s\n", settings_path);
+		return -1;
+	}
+	// never write a new log while replaying an old one
+	settings.enable_logging = 0;
+	// mocap and barometer samples aren't in the log, so altitude hold
+	// replays as direct throttle
+	settings.enable_mocap = 0;
+	settings.enable_baro = 0;
+
+	log_file = fopen(argv[optind], "rb");
+	if(log_file==NULL){
+		perror("ERROR opening log file");
+		return -1;
+	}
+	record_size = replay_log_open(&reader, log_file);
+	if(record_size==0) return -1;
+	rec = malloc(record_size);
+	if(rec==NULL){
+		fprintf(stderr,"ERROR: failed to allocate record buffer\n");
+		return -1;
+	}
+	if(log_reader_next(&reader, rec)!=1){
+		fprintf(stderr,"ERROR: log file has no records\n");
+		return -1;
+	}
+	if(replay_log_start(rec)) return -1;
+
+	if(!quiet){
+		fprintf(out, "record,arm_state");
+		for(i=1;i<=settings.num_rotors;i++) fprintf(out, ",mot_%d", i);
+		fprintf(out, "\n");
+	}
+
+	// in flight the battery thread samples at battery_hz, not every loop
+	batt_div = settings.feedback_hz/settings.battery_hz;
+	if(batt_div<1) batt_div = 1;
+
+	if(stall_record>=0) rearm_record = stall_record + settings.feedback_hz;
+
+	t_start = __wall_nanos();
+	do{
+		// the watchdog's response to a stall, then the pilot's new arm
+		// request as the input manager would publish it, one frame
+		// DISARMED then ARMED again
+		if((int64_t)records==stall_record) watchdog_stall_disarm();
+		if((int64_t)records==rearm_record) user_input.requested_arm_mode = DISARMED;
+		if((int64_t)records==rearm_record+1) user_input.requested_arm_mode = ARMED;
+		replay_log_load(rec);
+		if(records%batt_div==0) battery_manager_update();
+		replay_backend_step();
+		if(stall_record>=0 && (int64_t)records>=stall_record && fstate.arm_state==ARMED){
+			if((int64_t)records<=rearm_record) locked_armed++;
+			else if(rearmed_at<0) rearmed_at = records;
+		}
+
+		for(i=0;i<settings.num_rotors;i++){
+			if(replay_log_motor(rec, i, &logged)) continue;
+			m = replay_backend_esc(i+1);
+			err = fabs(m-logged);
+			if(err>max_err) max_err = err;
+		}
+		if(!quiet){
+			fprintf(out, "%" PRIu64 ",%d", records, fstate.arm_state);
+			for(i=1;i<=settings.num_rotors;i++){
+				fprintf(out, exact ? ",%.17g" : ",%f", replay_backend_esc(i));
+			}
+			fprintf(out, "\n");
+		}
+		if(other!=NULL) __compare_other(records);
+		records++;
+	}while(log_reader_next(&reader, rec)==1);
+	t_end = __wall_nanos();
+
+	feedback_cleanup();
+	log_reader_close(&reader);
+	fclose(log_file);
+	if(!quiet) fclose(out);
+	free(rec);
+
+	if(other_pid>0){
+		if(other!=NULL) fclose(other);
+		if(waitpid(other_pid, &status, 0)<0 || !WIFEXITED(status) || WEXITSTATUS(status)!=0){
+			fprintf(stderr,"ERROR: comparison replay %s failed\n", other_path);
+			return -1;
+		}
+		fprintf(stderr, "compared %" PRIu64 " records of this %s build to %s\n",
+					other_records, SCALAR_NAME, other_path);
+		fprintf(stderr, "max abs motor signal deviation: %g at record %" PRIu64
+				", arm state differed on %" PRIu64 " records\n",
+				other_max_dev, other_max_record, other_arm_diffs);
+		if(other_records!=records) return -1;
+	}
+	if(stall_record>=0){
+		fprintf(stderr, "stall at record %" PRId64 ": armed on %" PRIu64 " records before the new "
+				"arm request at %" PRId64 ", re-armed at record %" PRId64 "\n",
+				stall_record, locked_armed, rearm_record, rearmed_at);
+		if(rearm_record+1>=(int64_t)records){
+			fprintf(stderr,"ERROR: log too short for -W %" PRId64 "\n", stall_record);
+			return -1;
+		}
+		if(locked_armed>0){
+			fprintf(stderr,"ERROR: arming was not locked after the stall\n");
+			return -1;
+		}
+		if(rearmed_at<0){
+			fprintf(stderr,"ERROR: no arming after the new arm request\n");
+			return -1;
+		}
+	}
+	if(exact) return 0;
+
+	wall_s = (t_end-t_start)/1e9;
+	flight_s = (double)records/settings.feedback_hz;
+	fprintf(stderr, "replayed %" PRIu64 " records (%.1fs of flight) in %.3fs, %.0fx real time\n",
+				records, flight_s, wall_s, flight_s/wall_s);
+	fprintf(stderr, "max abs difference to logged motor signals: %g\n", max_err);
+	if(fstate.timing.windows>0){
+		total = &fstate.timing.stats[LOOP_STAT_TOTAL];
+		fprintf(stderr, "loop time last window: min %.2fus mean %.2fus p99 %.2fus max %.2fus\n",
+				total->min_us, total->mean_us, total->p99_us, total->max_us);
+	}
+	return 0;
+}
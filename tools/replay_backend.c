@@ -0,0 +1,177 @@
+/**
+ * @file replay_backend.c
+ *
+ * Hardware shims for tools/replay, see replay_backend.h
+ */
+
+#include <stdio.h>
+#include <string.h> // for memcpy
+
+#include <rc/mpu.h>
+#include <rc/servo.h>
+#include <rc/adc.h>
+#include <rc/led.h>
+
+#include <input_manager.h>
+#include <imu_fifo.h>
+#include "replay_backend.h"
+
+// input_manager.c isn't linked into the replay, the replay fills this in from
+// the log instead of the DSM radio
+user_input_t user_input;
+
+static rc_mpu_data_t* mpu_data;
+static void (*dmp_callback)(void);
+static void (*fifo_callback)(int remaining);
+static int fifo_batch;
+static int fifo_steps;
+static double v_batt;
+static double esc[REPLAY_MAX_CHANNELS];
+static int esc_initialized;
+
+
+void replay_backend_set_inputs(const replay_inputs_t* in)
+{
+	v_batt = in->v_batt;
+	if(mpu_data==NULL) return;
+	memcpy(mpu_data->fused_TaitBryan, in->tait_bryan, sizeof(in->tait_bryan));
+	memcpy(mpu_data->gyro, in->gyro, sizeof(in->gyro));
+}
+
+
+int replay_backend_step()
+{
+	// one log record is one FIFO sample, grouped into reads of fifo_batch
+	if(fifo_callback!=NULL){
+		fifo_callback(fifo_batch-1 - fifo_steps%fifo_batch);
+		fifo_steps++;
+		return 0;
+	}
+	if(dmp_callback==NULL){
+		fprintf(stderr,"ERROR in replay_backend_step, no dmp callback set\n");
+		return -1;
+	}
+	dmp_callback();
+	return 0;
+}
+
+
+double replay_backend_esc(int ch)
+{
+	if(ch<1 || ch>REPLAY_MAX_CHANNELS || !esc_initialized) return -1.0;
+	return esc[ch-1];
+}
+
+
+/*******************************************************************************
+* librobotcontrol functions replaced by the backend
+*******************************************************************************/
+
+int rc_mpu_initialize_dmp(rc_mpu_data_t* data, __attribute__ ((unused)) rc_mpu_config_t conf)
+{
+	mpu_data = data;
+	memset(mpu_data, 0, sizeof(rc_mpu_data_t));
+	return 0;
+}
+
+
+int rc_mpu_set_dmp_callback(void (*func)(void))
+{
+	dmp_callback = func;
+	return 0;
+}
+
+
+int rc_mpu_power_off()
+{
+	dmp_callback = NULL;
+	fifo_callback = NULL;
+	return 0;
+}
+
+
+/*******************************************************************************
+* imu_fifo.c talks to the MPU registers directly and isn't linked into the
+* tools, these stand in for it
+*******************************************************************************/
+
+int imu_fifo_init(rc_mpu_data_t* data, __attribute__ ((unused)) rc_mpu_config_t conf,
+			__attribute__ ((unused)) int sample_hz, int batch)
+{
+	mpu_data = data;
+	memset(mpu_data, 0, sizeof(rc_mpu_data_t));
+	fifo_batch = batch;
+	fifo_steps = 0;
+	return 0;
+}
+
+
+int imu_fifo_set_callback(void (*func)(int remaining))
+{
+	fifo_callback = func;
+	return 0;
+}
+
+
+uint64_t imu_fifo_overflows()
+{
+	return 0;
+}
+
+
+int imu_fifo_cleanup()
+{
+	fifo_callback = NULL;
+	return 0;
+}
+
+
+static int __record_esc(int ch, double input)
+{
+	int i;
+	if(ch<0 || ch>REPLAY_MAX_CHANNELS){
+		fprintf(stderr,"ERROR in replay backend, esc channel out of range\n");
+		return -1;
+	}
+	if(!esc_initialized){
+		for(i=0;i<REPLAY_MAX_CHANNELS;i++) esc[i] = -1.0;
+		esc_initialized = 1;
+	}
+	// channel 0 means all channels, same as the real library
+	if(ch==0){
+		for(i=0;i<REPLAY_MAX_CHANNELS;i++) esc[i] = input;
+	}
+	else esc[ch-1] = input;
+	return 0;
+}
+
+
+int rc_servo_send_esc_pulse_normalized(int ch, double input)
+{
+	return __record_esc(ch, input);
+}
+
+
+// same normalized signal, only the pulse width on the wire differs
+int rc_servo_send_oneshot_pulse_normalized(int ch, double input)
+{
+	return __record_esc(ch, input);
+}
+
+
+double rc_adc_batt()
+{
+	return v_batt;
+}
+
+
+double rc_adc_dc_jack()
+{
+	return v_batt;
+}
+
+
+int rc_led_set(__attribute__ ((unused)) rc_led_t led, __attribute__ ((unused)) int value)
+{
+	return 0;
+}
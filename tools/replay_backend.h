@@ -0,0 +1,61 @@
+/**
+ * @headerfile replay_backend.h
+ *
+ * @brief      Stand-in for the cape hardware used by tools/replay.
+ *
+ *             replay_backend.c defines the handful of librobotcontrol IMU,
+ *             servo, ADC and LED functions the controller calls. Since they
+ *             are defined in the executable they take precedence over the
+ *             versions in the shared library, everything else (filters, math)
+ *             still comes from the library. That includes rc_get_state() and
+ *             rc_set_state(), which only keep a variable and need no stand-in,
+ *             the replay sets RUNNING itself. It also stands in for
+ *             src/imu_fifo.c, which the tools don't link. Instead of touching
+ *             hardware they hand the controller whatever the replay loaded
+ *             with replay_backend_set_inputs() and record the ESC pulses it
+ *             sends.
+ */
+
+#ifndef REPLAY_BACKEND_H
+#define REPLAY_BACKEND_H
+
+#define REPLAY_MAX_CHANNELS 8
+
+/**
+ * One loop worth of inputs for the controller, as pulled out of a log record.
+ */
+typedef struct replay_inputs_t{
+	double tait_bryan[3];	///< fused TaitBryan angles, indexed like rc_mpu_data_t
+	double gyro[3];		///< gyro in deg/s
+	double v_batt;		///< unfiltered battery voltage
+} replay_inputs_t;
+
+/**
+ * @brief      loads the IMU data and battery voltage the controller will read
+ *             on the next call to replay_backend_step()
+ *
+ * @param[in]  in    inputs for the next loop
+ */
+void replay_backend_set_inputs(const replay_inputs_t* in);
+
+/**
+ * @brief      runs the dmp callback registered by feedback_init() once, the
+ *             same way the IMU interrupt thread would.
+ *
+ *             With IMU_SOURCE_FIFO it runs the FIFO callback for one sample
+ *             instead, every imu_fifo_batch steps make up one read.
+ *
+ * @return     0 on success, -1 if no callback has been registered
+ */
+int replay_backend_step();
+
+/**
+ * @brief      last normalized pulse sent to an ESC channel
+ *
+ * @param[in]  ch    channel 1-8, same numbering as rc_servo
+ *
+ * @return     the last pulse, or -1.0 if nothing was sent yet
+ */
+double replay_backend_esc(int ch);
+
+#endif // REPLAY_BACKEND_H
@@ -0,0 +1,159 @@
+/**
+ * @file replay_log.c
+ *
+ * Log columns for the offline tools, see replay_log.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <rc/mpu.h>
+#include <rc/start_stop.h>
+#include <rc/time.h>
+
+#include <settings.h>
+#include <feedback.h>
+#include <setpoint_manager.h>
+#include <input_manager.h>
+#include <mix.h>
+#include <thrust_map.h>
+#include <battery_manager.h>
+#include <esc_output.h>
+#include "replay_log.h"
+
+#define X(name, type) {#name, type},
+static const struct{
+	const char* name;
+	const char* type;
+} fields[] = { REPLAY_FIELDS };
+#undef X
+
+static uint32_t offsets[NUM_REPLAY_FIELDS];
+static int mot_offsets[8];	// logged motor signals, -1 if missing
+
+
+uint32_t replay_log_open(log_reader_t* r, FILE* f)
+{
+	const log_field_t* field;
+	uint32_t i;
+	int j, found[NUM_REPLAY_FIELDS] = {0};
+	char name[LOG_FIELD_NAME_LEN];
+
+	if(log_reader_open(r, f)) return 0;
+	for(j=0;j<8;j++) mot_offsets[j] = -1;
+	for(i=0;i<r->header.num_fields;i++){
+		field = &r->fields[i];
+		for(j=0;j<NUM_REPLAY_FIELDS;j++){
+			if(strcmp(field->name, fields[j].name)) continue;
+			if(strcmp(field->type, fields[j].type)){
+				fprintf(stderr,"ERROR: field %s should be %s, log has %s\n",
+						field->name, fields[j].type, field->type);
+				return 0;
+			}
+			offsets[j] = field->offset;
+			found[j] = 1;
+		}
+		for(j=0;j<8;j++){
+			snprintf(name, sizeof(name), "mot_%d", j+1);
+			if(strcmp(field->name, name)==0 && strcmp(field->type, "double")==0){
+				mot_offsets[j] = field->offset;
+			}
+		}
+	}
+	for(j=0;j<NUM_REPLAY_FIELDS;j++){
+		if(!found[j]){
+			fprintf(stderr,"ERROR: log is missing %s, it was probably written before log version 2\n",
+							fields[j].name);
+			return 0;
+		}
+	}
+	return r->header.record_size;
+}
+
+
+double replay_log_double(const char* rec, replay_field_t field)
+{
+	double d;
+	memcpy(&d, rec + offsets[field], sizeof(d));
+	return d;
+}
+
+
+int replay_log_int(const char* rec, replay_field_t field)
+{
+	int i;
+	memcpy(&i, rec + offsets[field], sizeof(i));
+	return i;
+}
+
+
+void replay_log_inputs(const char* rec, replay_inputs_t* in)
+{
+	in->tait_bryan[TB_ROLL_Y]  = replay_log_double(rec, F_imu_roll);
+	in->tait_bryan[TB_PITCH_X] = replay_log_double(rec, F_imu_pitch);
+	in->tait_bryan[TB_YAW_Z]   = replay_log_double(rec, F_imu_yaw);
+	in->gyro[0] = replay_log_double(rec, F_gyro_x);
+	in->gyro[1] = replay_log_double(rec, F_gyro_y);
+	in->gyro[2] = replay_log_double(rec, F_gyro_z);
+	in->v_batt  = replay_log_double(rec, F_v_batt_raw);
+}
+
+
+void replay_log_sticks(const char* rec, user_input_t* ui)
+{
+	ui->thr_stick	= replay_log_double(rec, F_thr_stick);
+	ui->roll_stick	= replay_log_double(rec, F_roll_stick);
+	ui->pitch_stick	= replay_log_double(rec, F_pitch_stick);
+	ui->yaw_stick	= replay_log_double(rec, F_yaw_stick);
+	ui->flight_mode	= replay_log_int(rec, F_flight_mode);
+}
+
+
+void replay_log_load(const char* rec)
+{
+	replay_inputs_t in;
+
+	replay_log_inputs(rec, &in);
+	replay_backend_set_inputs(&in);
+	replay_log_sticks(rec, &user_input);
+	// every record was a loop with a fresh frame as far as the setpoint
+	// manager can tell
+	setpoint_manager_input(&user_input, rc_nanos_since_boot());
+}
+
+
+int replay_log_motor(const char* rec, int i, double* m)
+{
+	if(i<0 || i>=8 || mot_offsets[i]<0) return -1;
+	memcpy(m, rec + mot_offsets[i], sizeof(*m));
+	return 0;
+}
+
+
+int replay_log_start(const char* first)
+{
+	// same initialization order as main()
+	if(thrust_map_init(settings.thrust_map)<0) return -1;
+	if(esc_output_init(settings.esc_protocol)<0) return -1;
+	if(mix_init(settings.layout)<0) return -1;
+	if(setpoint_manager_init()<0) return -1;
+
+	// the battery filter is prefilled from the first reading so give it the
+	// first record before starting the controller
+	replay_log_load(first);
+	if(battery_manager_init()<0) return -1;
+	if(feedback_init()<0) return -1;
+	replay_log_load(first);
+	user_input.initialized = 1;
+	user_input.input_active = 1;
+	rc_set_state(RUNNING);
+
+	// one disarmed loop so the state estimate is current when the setpoint
+	// manager arms on the first record
+	user_input.requested_arm_mode = DISARMED;
+	setpoint_manager_input(&user_input, rc_nanos_since_boot());
+	replay_backend_step();
+	user_input.requested_arm_mode = ARMED;
+	setpoint_manager_input(&user_input, rc_nanos_since_boot());
+	return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * @headerfile replay_log.h
+ *
+ * @brief      Reads the controller inputs out of binary flight logs for the
+ *             offline tools built on replay_backend.h.
+ *
+ *             The columns are found by name in the log header, so logs
+ *             written by a different build still replay as long as they have
+ *             them.
+ */
+
+#ifndef REPLAY_LOG_H
+#define REPLAY_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <log_codec.h>
+#include "replay_backend.h"
+
+struct user_input_t;
+
+/**
+ * columns the replay needs out of each record
+ */
+#define REPLAY_FIELDS \
+	X(imu_roll,	"double") \
+	X(imu_pitch,	"double") \
+	X(imu_yaw,	"double") \
+	X(gyro_x,	"double") \
+	X(gyro_y,	"double") \
+	X(gyro_z,	"double") \
+	X(v_batt_raw,	"double") \
+	X(thr_stick,	"double") \
+	X(roll_stick,	"double") \
+	X(pitch_stick,	"double") \
+	X(yaw_stick,	"double") \
+	X(flight_mode,	"int") \
+	X(u_roll,	"double") \
+	X(u_pitch,	"double") \
+	X(u_yaw,	"double")
+
+#define X(name, type) F_##name,
+typedef enum replay_field_t{ REPLAY_FIELDS NUM_REPLAY_FIELDS } replay_field_t;
+#undef X
+
+/**
+ * @brief      opens the log, plain or compact, and looks up the offset of
+ *             every column the replay needs. Leaves the reader at the first
+ *             record.
+ *
+ * @param      r     reader to open, close with log_reader_close()
+ * @param      f     log file opened for reading in binary mode
+ *
+ * @return     record size on success, 0 on failure
+ */
+uint32_t replay_log_open(log_reader_t* r, FILE* f);
+
+/**
+ * @brief      value of a double column in a record
+ */
+double replay_log_double(const char* rec, replay_field_t field);
+
+/**
+ * @brief      value of an int column in a record
+ */
+int replay_log_int(const char* rec, replay_field_t field);
+
+/**
+ * @brief      IMU and battery inputs recorded in a record
+ *
+ * @param[in]  rec   The record
+ * @param[out] in    the inputs for replay_backend_set_inputs()
+ */
+void replay_log_inputs(const char* rec, replay_inputs_t* in);
+
+/**
+ * @brief      sticks and flight mode recorded in a record, the rest of the
+ *             frame is left alone
+ *
+ * @param[in]  rec   The record
+ * @param      ui    frame to fill in
+ */
+void replay_log_sticks(const char* rec, struct user_input_t* ui);
+
+/**
+ * @brief      loads the IMU, battery and stick inputs from a record into the
+ *             backend and user_input for the next replay_backend_step()
+ */
+void replay_log_load(const char* rec);
+
+/**
+ * @brief      motor signal the controller logged in a record
+ *
+ * @param[in]  rec   The record
+ * @param[in]  i     motor 0-7
+ * @param[out] m     the logged signal
+ *
+ * @return     0 on success, -1 if the log has no column for that motor
+ */
+int replay_log_motor(const char* rec, int i, double* m);
+
+/**
+ * @brief      Initializes the controller in the same order as main() and
+ *             arms it on the first record of the log.
+ *
+ *             The settings must be loaded already. Runs one disarmed loop on
+ *             the record so the state estimate is current when the setpoint
+ *             manager arms, like it would be in flight, the next
+ *             replay_backend_step() is the first armed loop.
+ *
+ * @param[in]  first  The first record
+ *
+ * @return     0 on success, -1 on failure
+ */
+int replay_log_start(const char* first);
+
+#endif // REPLAY_LOG_H
@@ -0,0 +1,103 @@
+/**
+ * @file shm_dump.c
+ *
+ * Prints the controller state a running rc_pilot exports through shared
+ * memory as CSV, and doubles as an example reader for companion processes.
+ * rc_pilot has to run with enable_shm_export in its settings file.
+ *
+ * Every read is a plain copy out of the mapped segment, no syscalls, so the
+ * same loop could poll at the feedback rate. Loops published between two
+ * reads are counted as skipped from the gap in the snapshot sequence.
+ *
+ * Only needs the headers and -lrt, but the headers include the
+ * librobotcontrol ones, see the shm_dump target in the Makefile for building
+ * it off the board.
+ *
+ * Usage: shm_dump [-r rate_hz] [-n samples]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <shm_export.h>
+
+#define DEFAULT_RATE_HZ	10
+
+
+static void __print_usage()
+{
+	printf("\n");
+	printf("Usage: shm_dump [options]\n");
+	printf("-r {hz}     samples per second, default %d\n", DEFAULT_RATE_HZ);
+	printf("-n {num}    stop after num samples, default runs until killed\n");
+	printf("-h          print this help message\n");
+	printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, i;
+	int rate = DEFAULT_RATE_HZ;
+	long samples = -1;
+	long n = 0;
+	uint64_t last_seq = 0;
+	uint64_t skipped;
+	const shm_export_t* shm;
+	state_snapshot_t snap;
+
+	opterr = 0;
+	while((c = getopt(argc, argv, "r:n:h"))!=-1){
+		switch(c){
+		case 'r':
+			rate = atoi(optarg);
+			if(rate<=0){
+				fprintf(stderr,"ERROR: rate must be positive\n");
+				return -1;
+			}
+			break;
+		case 'n':
+			samples = atol(optarg);
+			break;
+		case 'h':
+			__print_usage();
+			return 0;
+		default:
+			__print_usage();
+			return -1;
+		}
+	}
+
+	shm = shm_export_open();
+	if(shm==NULL) return -1;
+	fprintf(stderr, "reading state of rc_pilot pid %d\n", shm->writer_pid);
+
+	printf("seq,time_ns,skipped,arm_state,altitude,roll,pitch,yaw,v_batt");
+	for(i=1;i<=8;i++) printf(",mot_%d", i);
+	printf(",loop_mean_us,loop_max_us\n");
+
+	while(samples<0 || n<samples){
+		usleep(1000000/rate);
+		if(shm_export_read(shm, &snap)) continue;
+		skipped = (n>0 && snap.seq>last_seq) ? snap.seq-last_seq-1 : 0;
+		last_seq = snap.seq;
+		printf("%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%d,%f,%f,%f,%f,%f",
+			snap.seq, snap.time_ns, skipped, snap.fstate.arm_state,
+			(double)snap.fstate.altitude, (double)snap.fstate.roll,
+			(double)snap.fstate.pitch, (double)snap.fstate.yaw,
+			(double)snap.fstate.v_batt);
+		for(i=0;i<8;i++) printf(",%f", (double)snap.fstate.m[i]);
+		printf(",%.2f,%.2f\n",
+			snap.fstate.timing.stats[LOOP_STAT_TOTAL].mean_us,
+			snap.fstate.timing.stats[LOOP_STAT_TOTAL].max_us);
+		fflush(stdout);
+		n++;
+	}
+
+	shm_export_close(shm);
+	return 0;
+}
@@ -0,0 +1,972 @@
+/**
+ * @file sweep.c
+ *
+ * Gain sweep and Monte Carlo tuning of the controllers against a recorded
+ * flight.
+ *
+ * Replaying a log as tools/replay does is open loop, the IMU angles come from
+ * the log no matter what the controller does, so a different gain can't show
+ * up as better or worse tracking. The sweep first fits a rigid body model to
+ * the flight, one axis at a time from the logged commands and gyro rates:
+ *
+ *     d(rate)/dt = a*u + b*rate + c
+ *
+ * and then flies every candidate settings file in closed loop against that
+ * model, with the sticks, flight mode and battery voltage from the log and
+ * the attitude and rates from the model. Candidates are ranked by the RMS
+ * tracking error of the loops under feedback, angles or rates in acro, plus
+ * a weight times the fraction of armed loops with a motor at its limit.
+ *
+ * The parameter file has one line per parameter, a path into one of the
+ * controllers in the settings json followed by the values to try:
+ *
+ *     # every combination of the listed values is a candidate
+ *     roll_controller.numerator[0]  0.08 0.1 0.12
+ *     roll_controller.crossover_freq_rad_per_sec  range 4 12 5
+ *     # each grid point is tried with -n random draws of these
+ *     pitch_controller.numerator[1]  uniform 0.1 0.3
+ *
+ * Change the loop gain through the numerator, __parse_controller() reads the
+ * gain entry but doesn't apply it. With -t each candidate is flown that many
+ * times against models with a and b drawn within -p of the fit, the same
+ * draws for every candidate so they are compared on equal terms, and the
+ * mean cost is ranked.
+ *
+ * Every run flies its own controller_t without hardware, with its own mixer,
+ * thrust curve, state, setpoint and IMU data, and with controllers parsed
+ * straight from the patched settings json in memory. The rest of the
+ * settings are the same for every candidate. The battery gain only depends
+ * on the log so it is computed once up front.
+ *
+ * The runs are flown by a pool of threads in one process, each with its
+ * own copy of the settings json to patch. Every thread starts with an equal
+ * block of runs in a deque of its own and works it from the bottom. One that
+ * runs dry steals from the top of the others', so the pool stays balanced
+ * however long each run takes, and the owners only contend with a thief on
+ * their last run.
+ *
+ * Usage: sweep [-s settings.json] -g params.txt [options] log.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <json-c/json.h>
+
+#include <rc/mpu.h>
+#include <rc/start_stop.h>
+
+#include <rc_pilot_defs.h>
+#include <settings.h>
+#include <feedback.h>
+#include <setpoint_manager.h>
+#include <input_manager.h>
+#include <mix.h>
+#include <thrust_map.h>
+#include <log_codec.h>
+#include <battery_manager.h>
+#include "replay_backend.h"
+#include "replay_log.h"
+
+#define MAX_PARAMS		16
+#define MAX_VALUES		64
+#define PATH_LEN		128
+#define DEFAULT_SAMPLES		32
+#define DEFAULT_TOP		10
+#define DEFAULT_SAT_WEIGHT	1.0
+#define MAX_TILT		1.5	// rad, a candidate past this has lost the vehicle
+#define DEG_TO_RAD		(M_PI/180.0)
+
+enum{AX_ROLL, AX_PITCH, AX_YAW, NUM_AXES};
+static const char* axis_names[NUM_AXES] = {"roll", "pitch", "yaw"};
+static const int axis_tb[NUM_AXES] = {TB_ROLL_Y, TB_PITCH_X, TB_YAW_Z};
+static const replay_field_t axis_u[NUM_AXES] = {F_u_roll, F_u_pitch, F_u_yaw};
+
+typedef struct param_t{
+	char path[PATH_LEN];	///< into the settings json, e.g. roll_controller.numerator[0]
+	int uniform;		///< 1 to draw from [lo,hi], 0 for the listed values
+	int n;
+	double v[MAX_VALUES];
+	double lo, hi;
+} param_t;
+
+typedef struct plant_t{
+	double a[NUM_AXES];	///< rate derivative per unit command
+	double b[NUM_AXES];	///< rate derivative per rad/s of rate
+	double c[NUM_AXES];	///< constant rate derivative
+} plant_t;
+
+typedef enum run_status_t{
+	RUN_PENDING,
+	RUN_DONE,
+	RUN_DIVERGED,
+	RUN_FAILED
+} run_status_t;
+
+/**
+ * result of one run, written by the worker that flew it
+ */
+typedef struct run_result_t{
+	run_status_t status;
+	double rms[NUM_AXES];	///< tracking error of each axis
+	double sat;		///< fraction of armed loops with a motor at 0 or 1
+	double cost;
+} run_result_t;
+
+/**
+ * one run's controller instance and everything it points at
+ */
+typedef struct flight_t{
+	controller_t ctl;
+	mixer_t mixer;
+	thrust_curve_t thrust;
+	feedback_state_t state;
+	setpoint_t setpoint;
+	rc_mpu_data_t imu;
+	user_input_t input;
+} flight_t;
+
+/**
+ * A worker's runs, from top up to bottom. All runs are handed out before the
+ * workers start, so this is a Chase-Lev deque without the push and the run
+ * numbers themselves are the slots. The owner pops at the bottom, thieves
+ * take from the top.
+ */
+typedef struct run_deque_t{
+	_Atomic int64_t top;
+	_Atomic int64_t bottom;
+} run_deque_t;
+
+#define STEAL_EMPTY	-1
+#define STEAL_RETRY	-2	// lost the race for the top run to another thread
+
+typedef struct worker_t{
+	run_deque_t runs;
+	json_object* root;	///< this worker's copy of the settings json
+	pthread_t thread;
+	int started;
+	int id;
+	uint64_t stolen;	///< runs taken from other workers
+} __attribute__((aligned(64))) worker_t;
+
+static param_t params[MAX_PARAMS];
+static int num_params;
+static int grid_points = 1;
+static int samples = 1;		// random draws per grid point, 1 without uniform parameters
+static int trials = 1;
+static double spread = 0.2;
+static double sat_weight = DEFAULT_SAT_WEIGHT;
+static uint64_t seed = 1;
+static const char* settings_path = SETTINGS_FILE;
+
+static char* records;		// the whole log, decoded
+static uint64_t num_records;
+static uint32_t record_size;
+static plant_t plant;
+static double* batt_gain;	// gain of the disarmed first loop, then after each record
+
+static run_result_t* results;
+static worker_t* workers;
+static int num_workers;
+
+
+static void __print_usage()
+{
+	printf("\n");
+	printf("Usage: sweep [options] -g params.txt log.bin\n");
+	printf("-s {file}   settings file the log was recorded with, the base for\n");
+	printf("            every candidate, defaults to %s\n", SETTINGS_FILE);
+	printf("-g {file}   parameters to sweep, see tools/sweep.c\n");
+	printf("-j {num}    worker threads, defaults to the number of cpus\n");
+	printf("-n {num}    random draws per grid point for uniform parameters,\n");
+	printf("            default %d\n", DEFAULT_SAMPLES);
+	printf("-t {num}    runs per candidate against perturbed models, default 1\n");
+	printf("-p {frac}   model perturbation for -t, default 0.2\n");
+	printf("-S {num}    random seed, default 1\n");
+	printf("-w {num}    cost of saturation relative to 1 rad RMS error,\n");
+	printf("            default %.1f\n", DEFAULT_SAT_WEIGHT);
+	printf("-k {num}    candidates to print, default %d\n", DEFAULT_TOP);
+	printf("-o {file}   write every candidate as CSV\n");
+	printf("-h          print this help message\n");
+	printf("\n");
+}
+
+
+static double __wall_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+/**
+ * @brief      uniform double in [0,1) from a splitmix64 stream
+ */
+static double __random(uint64_t* state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+	z = (z^(z>>27))*0x94d049bb133111ebULL;
+	z ^= z>>31;
+	return (z>>11)*(1.0/9007199254740992.0);
+}
+
+
+/**
+ * @brief      reads the parameter file
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __read_params(const char* path)
+{
+	FILE* f;
+	char line[1024];
+	char* tok;
+	char* end;
+	param_t* p;
+	int lineno = 0, i, has_uniform = 0;
+	double lo, hi;
+
+	f = fopen(path, "r");
+	if(f==NULL){
+		perror("ERROR opening parameter file");
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)!=NULL){
+		lineno++;
+		tok = strtok(line, " \t\r\n");
+		if(tok==NULL || tok[0]=='#') continue;
+		if(num_params==MAX_PARAMS){
+			fprintf(stderr,"ERROR: more than %d parameters\n", MAX_PARAMS);
+			goto fail;
+		}
+		p = &params[num_params];
+		if(strlen(tok)>=PATH_LEN){
+			fprintf(stderr,"ERROR: parameter path too long on line %d\n", lineno);
+			goto fail;
+		}
+		strcpy(p->path, tok);
+		tok = strtok(NULL, " \t\r\n");
+		if(tok!=NULL && (strcmp(tok, "uniform")==0 || strcmp(tok, "range")==0)){
+			p->uniform = (tok[0]=='u');
+			tok = strtok(NULL, " \t\r\n");
+			lo = tok ? strtod(tok, &end) : 0.0;
+			if(tok==NULL || *end) goto bad_value;
+			tok = strtok(NULL, " \t\r\n");
+			hi = tok ? strtod(tok, &end) : 0.0;
+			if(tok==NULL || *end) goto bad_value;
+			p->lo = lo;
+			p->hi = hi;
+			if(p->uniform){
+				has_uniform = 1;
+				p->n = 1;
+			}
+			else{
+				tok = strtok(NULL, " \t\r\n");
+				p->n = tok ? atoi(tok) : 0;
+				if(p->n<2 || p->n>MAX_VALUES) goto bad_value;
+				for(i=0;i<p->n;i++) p->v[i] = lo + (hi-lo)*i/(p->n-1);
+			}
+		}
+		else{
+			while(tok!=NULL){
+				if(p->n==MAX_VALUES){
+					fprintf(stderr,"ERROR: more than %d values on line %d\n", MAX_VALUES, lineno);
+					goto fail;
+				}
+				p->v[p->n++] = strtod(tok, &end);
+				if(*end) goto bad_value;
+				tok = strtok(NULL, " \t\r\n");
+			}
+			if(p->n==0) goto bad_value;
+		}
+		if(!p->uniform) grid_points *= p->n;
+		num_params++;
+	}
+	fclose(f);
+	if(num_params==0){
+		fprintf(stderr,"ERROR: no parameters in %s\n", path);
+		return -1;
+	}
+	if(!has_uniform) samples = 1;
+	return 0;
+
+bad_value:
+	fprintf(stderr,"ERROR: bad values on line %d of %s\n", lineno, path);
+fail:
+	fclose(f);
+	return -1;
+}
+
+
+/**
+ * @brief      value of every parameter for a candidate. Grid points are
+ *             numbered with the first parameter changing slowest.
+ */
+static void __candidate_values(uint64_t cand, double* v)
+{
+	uint64_t g = cand/samples;
+	uint64_t rng = seed ^ (cand*0xd1b54a32d192ed03ULL);
+	int i;
+
+	for(i=num_params-1;i>=0;i--){
+		if(params[i].uniform) continue;
+		v[i] = params[i].v[g%params[i].n];
+		g /= params[i].n;
+	}
+	for(i=0;i<num_params;i++){
+		if(!params[i].uniform) continue;
+		v[i] = params[i].lo + (params[i].hi-params[i].lo)*__random(&rng);
+	}
+}
+
+
+/**
+ * @brief      Replaces the number at a path like
+ *             roll_controller.numerator[0] in a settings json object. Ints
+ *             stay ints so the settings parser still accepts them.
+ *
+ * @return     0 on success, -1 if the path doesn't lead to a number
+ */
+static int __set_param(json_object* root, const char* path, double v)
+{
+	char buf[PATH_LEN];
+	char* seg;
+	char* save;
+	char* br;
+	json_object* parent = NULL;
+	json_object* cur = root;
+	json_object* val;
+	const char* key = NULL;
+	int idx = -1;
+
+	strcpy(buf, path);
+	for(seg=strtok_r(buf, ".", &save); seg!=NULL; seg=strtok_r(NULL, ".", &save)){
+		br = strchr(seg, '[');
+		if(br!=NULL) *br = 0;
+		if(!json_object_is_type(cur, json_type_object) ||
+				!json_object_object_get_ex(cur, seg, &val)) return -1;
+		parent = cur;
+		key = seg;
+		idx = -1;
+		cur = val;
+		if(br!=NULL){
+			idx = atoi(br+1);
+			if(!json_object_is_type(cur, json_type_array) ||
+				idx<0 || idx>=(int)json_object_array_length(cur)) return -1;
+			parent = cur;
+			cur = json_object_array_get_idx(cur, idx);
+		}
+	}
+	if(parent==NULL) return -1;
+	if(json_object_is_type(cur, json_type_int)) val = json_object_new_int((int)lround(v));
+	else if(json_object_is_type(cur, json_type_double)) val = json_object_new_double(v);
+	else return -1;
+	if(idx>=0) json_object_array_put_idx(parent, idx, val);
+	else json_object_object_add(parent, key, val);
+	return 0;
+}
+
+
+/**
+ * @brief      whether a parameter path is inside one of the controllers, the
+ *             only part of the settings each candidate gets its own copy of
+ */
+static int __is_controller_path(const char* path)
+{
+	const char* name;
+	size_t n;
+	int i;
+
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		name = settings_controller_name(i);
+		n = strlen(name);
+		if(strncmp(path, name, n)==0 && path[n]=='.') return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      Fits the rate model of each axis to the log by least squares.
+ *
+ * @return     0 on success, -1 if the flight doesn't pin the model down
+ */
+static int __fit_plant(double dt)
+{
+	replay_inputs_t in0, in1;
+	double m[3][4], x[3], y, f, r, ss_res, ss_tot, mean;
+	uint64_t k;
+	int ax, i, j, p;
+
+	if(num_records<100){
+		fprintf(stderr,"ERROR: log too short to fit a model\n");
+		return -1;
+	}
+	printf("model fitted to %" PRIu64 " records, d(rate)/dt = a*u + b*rate + c\n", num_records);
+	for(ax=0;ax<NUM_AXES;ax++){
+		memset(m, 0, sizeof(m));
+		mean = 0.0;
+		for(k=0;k+1<num_records;k++){
+			replay_log_inputs(records+k*record_size, &in0);
+			replay_log_inputs(records+(k+1)*record_size, &in1);
+			x[0] = replay_log_double(records+k*record_size, axis_u[ax]);
+			x[1] = in0.gyro[axis_tb[ax]]*DEG_TO_RAD;
+			x[2] = 1.0;
+			y = (in1.gyro[axis_tb[ax]]-in0.gyro[axis_tb[ax]])*DEG_TO_RAD/dt;
+			mean += y;
+			for(i=0;i<3;i++){
+				for(j=0;j<3;j++) m[i][j] += x[i]*x[j];
+				m[i][3] += x[i]*y;
+			}
+		}
+		mean /= num_records-1;
+		// gaussian elimination with partial pivoting on the normal equations
+		for(i=0;i<3;i++){
+			p = i;
+			for(j=i+1;j<3;j++) if(fabs(m[j][i])>fabs(m[p][i])) p = j;
+			if(fabs(m[p][i])<1e-12*(num_records)){
+				fprintf(stderr,"ERROR: %s command or rate doesn't vary enough in the log to fit a model\n",
+							axis_names[ax]);
+				return -1;
+			}
+			for(j=0;j<4;j++){ f = m[i][j]; m[i][j] = m[p][j]; m[p][j] = f; }
+			for(j=i+1;j<3;j++){
+				f = m[j][i]/m[i][i];
+				for(p=i;p<4;p++) m[j][p] -= f*m[i][p];
+			}
+		}
+		for(i=2;i>=0;i--){
+			x[i] = m[i][3];
+			for(j=i+1;j<3;j++) x[i] -= m[i][j]*x[j];
+			x[i] /= m[i][i];
+		}
+		plant.a[ax] = x[0];
+		plant.b[ax] = x[1];
+		plant.c[ax] = x[2];
+
+		// report how much of the rate change the model explains
+		ss_res = ss_tot = 0.0;
+		for(k=0;k+1<num_records;k++){
+			replay_log_inputs(records+k*record_size, &in0);
+			replay_log_inputs(records+(k+1)*record_size, &in1);
+			y = (in1.gyro[axis_tb[ax]]-in0.gyro[axis_tb[ax]])*DEG_TO_RAD/dt;
+			r = y - plant.a[ax]*replay_log_double(records+k*record_size, axis_u[ax])
+				- plant.b[ax]*in0.gyro[axis_tb[ax]]*DEG_TO_RAD - plant.c[ax];
+			ss_res += r*r;
+			ss_tot += (y-mean)*(y-mean);
+		}
+		printf("  %-6s a=% .4g b=% .4g c=% .4g r2=%.3f\n", axis_names[ax],
+			plant.a[ax], plant.b[ax], plant.c[ax],
+			ss_tot>0.0 ? 1.0-ss_res/ss_tot : 0.0);
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      controller sees the model's attitude and rates the way
+ *             replay_backend_set_inputs() hands the logged ones to the IMU
+ */
+static void __set_imu(rc_mpu_data_t* imu, const replay_inputs_t* in)
+{
+	memcpy(imu->fused_TaitBryan, in->tait_bryan, sizeof(in->tait_bryan));
+	memcpy(imu->gyro, in->gyro, sizeof(in->gyro));
+}
+
+
+/**
+ * @brief      Sets up a disarmed controller instance for a candidate, with
+ *             the candidate's values patched into root
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __flight_init(flight_t* f, uint64_t cand, json_object* root)
+{
+	rc_filter_t loaded[SETTINGS_NUM_CONTROLLERS];
+	double v[MAX_PARAMS];
+	int i;
+
+	__candidate_values(cand, v);
+	for(i=0;i<num_params;i++){
+		if(__set_param(root, params[i].path, v[i])) return -1;
+	}
+	if(settings_parse_controllers(root, loaded)) return -1;
+	memset(f, 0, sizeof(*f));
+	f->setpoint.initialized = 1;
+	if(mixer_init(&f->mixer, settings.layout) ||
+			thrust_curve_init(&f->thrust, settings.thrust_map)<0 ||
+			controller_init(&f->ctl, &settings, loaded, &f->mixer, &f->thrust,
+					&f->imu, &f->state, &f->setpoint, 0)){
+		for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++) rc_filter_free(&loaded[i]);
+		return -1;
+	}
+	// the instance keeps the altitude controller, the banks hold copies
+	for(i=0;i<SETTINGS_NUM_CONTROLLERS;i++){
+		if(i!=CTRL_ALTITUDE) rc_filter_free(&loaded[i]);
+	}
+	f->ctl.input = &f->input;
+	return 0;
+}
+
+
+/**
+ * @brief      Flies one candidate against the model on its own controller
+ *             instance. root is the caller's copy of the settings json.
+ *
+ * @return     run status
+ */
+static run_status_t __run(uint64_t run, json_object* root, run_result_t* res)
+{
+	flight_t f;
+	double sq[NUM_AXES] = {0.0};
+	double rate[NUM_AXES], angle[NUM_AXES], err[NUM_AXES];
+	double dt, u;
+	uint64_t rng = seed ^ ((run%trials+1)*0x9e3779b97f4a7c15ULL);
+	uint64_t k, armed = 0, tracked = 0, sat = 0;
+	replay_inputs_t in;
+	plant_t pl = plant;
+	run_status_t status = RUN_DONE;
+	int i, ax;
+
+	// same draws for every candidate, none for the first trial
+	if(run%trials){
+		for(ax=0;ax<NUM_AXES;ax++){
+			pl.a[ax] *= 1.0 + spread*(2.0*__random(&rng)-1.0);
+			pl.b[ax] *= 1.0 + spread*(2.0*__random(&rng)-1.0);
+		}
+	}
+	if(__flight_init(&f, run/trials, root)) return RUN_FAILED;
+
+	// one disarmed loop on the first record so the state estimate is current
+	// when the instance arms, as replay_log_start() does
+	replay_log_inputs(records, &in);
+	__set_imu(&f.imu, &in);
+	replay_log_sticks(records, &f.input);
+	f.input.requested_arm_mode = DISARMED;
+	f.ctl.batt_gain = batt_gain[0];
+	controller_march(&f.ctl);
+	f.input.requested_arm_mode = ARMED;
+
+	for(ax=0;ax<NUM_AXES;ax++){
+		angle[ax] = in.tait_bryan[axis_tb[ax]];
+		rate[ax] = in.gyro[axis_tb[ax]]*DEG_TO_RAD;
+	}
+	dt = 1.0/settings.feedback_hz;
+
+	for(k=0;k<num_records;k++){
+		// sticks and battery from the log, attitude from the model
+		replay_log_inputs(records+k*record_size, &in);
+		for(ax=0;ax<NUM_AXES;ax++){
+			in.tait_bryan[axis_tb[ax]] = angle[ax];
+			in.gyro[axis_tb[ax]] = rate[ax]/DEG_TO_RAD;
+		}
+		in.tait_bryan[TB_YAW_Z] = remainder(angle[AX_YAW], 2.0*M_PI);
+		__set_imu(&f.imu, &in);
+		replay_log_sticks(records+k*record_size, &f.input);
+		f.ctl.batt_gain = batt_gain[k+1];
+		controller_march(&f.ctl);
+
+		if(f.state.arm_state==ARMED){
+			armed++;
+			for(i=0;i<settings.num_rotors;i++){
+				if(f.state.m[i]<=0.0 || f.state.m[i]>=1.0){
+					sat++;
+					break;
+				}
+			}
+			if(f.setpoint.en_rate_ctrl){
+				err[AX_ROLL]	= f.setpoint.roll_rate - f.state.roll_rate;
+				err[AX_PITCH]	= f.setpoint.pitch_rate - f.state.pitch_rate;
+				err[AX_YAW]	= f.setpoint.yaw_rate - f.state.yaw_rate;
+			}
+			else{
+				err[AX_ROLL]	= f.setpoint.roll - f.state.roll;
+				err[AX_PITCH]	= f.setpoint.pitch - f.state.pitch;
+				err[AX_YAW]	= f.setpoint.yaw - f.state.yaw;
+			}
+			if(f.setpoint.en_rpy_ctrl){
+				tracked++;
+				for(ax=0;ax<NUM_AXES;ax++) sq[ax] += err[ax]*err[ax];
+			}
+		}
+
+		for(ax=0;ax<NUM_AXES;ax++){
+			u = f.state.arm_state==ARMED ? f.state.u[VEC_ROLL+ax] : 0.0;
+			rate[ax] += dt*(pl.a[ax]*u + pl.b[ax]*rate[ax] + pl.c[ax]);
+			angle[ax] += dt*rate[ax];
+		}
+		if(!isfinite(angle[AX_ROLL]) || !isfinite(angle[AX_PITCH]) ||
+				fabs(angle[AX_ROLL])>MAX_TILT || fabs(angle[AX_PITCH])>MAX_TILT){
+			status = RUN_DIVERGED;
+			break;
+		}
+	}
+	controller_free(&f.ctl);
+	if(status!=RUN_DONE) return status;
+
+	res->cost = 0.0;
+	for(ax=0;ax<NUM_AXES;ax++){
+		res->rms[ax] = tracked ? sqrt(sq[ax]/tracked) : 0.0;
+		res->cost += res->rms[ax];
+	}
+	res->sat = armed ? (double)sat/armed : 0.0;
+	res->cost += sat_weight*res->sat;
+	return RUN_DONE;
+}
+
+
+/**
+ * @brief      takes the run at the bottom of the worker's own deque
+ *
+ * @return     the run, or STEAL_EMPTY if there is none left
+ */
+static int64_t __pop(run_deque_t* d)
+{
+	int64_t t, b, run;
+
+	b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if(t>b){
+		atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+		return STEAL_EMPTY;
+	}
+	run = b;
+	// the last run, a thief may be after it too
+	if(t==b){
+		if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t+1,
+				memory_order_seq_cst, memory_order_relaxed)) run = STEAL_EMPTY;
+		atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+	}
+	return run;
+}
+
+
+/**
+ * @brief      takes the run at the top of another worker's deque
+ *
+ * @return     the run, STEAL_EMPTY if there is none or STEAL_RETRY if another
+ *             thread got it first
+ */
+static int64_t __steal(run_deque_t* d)
+{
+	int64_t t, b;
+
+	t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if(t>=b) return STEAL_EMPTY;
+	if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t+1,
+			memory_order_seq_cst, memory_order_relaxed)) return STEAL_RETRY;
+	return t;
+}
+
+
+/**
+ * @brief      worker thread, flies its own runs and then steals until every
+ *             deque is empty. Nothing is added once the workers start, so one
+ *             pass finding them all empty means the sweep is done.
+ */
+static void* __worker(void* arg)
+{
+	worker_t* w = arg;
+	int64_t run;
+	int i;
+
+	for(;;){
+		run = __pop(&w->runs);
+		for(i=1; run<0 && i<num_workers; i++){
+			while((run = __steal(&workers[(w->id+i)%num_workers].runs))==STEAL_RETRY);
+			if(run>=0) w->stolen++;
+		}
+		if(run<0) break;
+		results[run].status = __run(run, w->root, &results[run]);
+	}
+	return NULL;
+}
+
+
+/**
+ * @brief      battery gain the controller would get on every record, the
+ *             battery manager fed the logged voltage at battery_hz
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __battery_gains()
+{
+	replay_inputs_t in;
+	uint64_t k, div;
+
+	div = settings.feedback_hz/settings.battery_hz;
+	if(div<1) div = 1;
+	batt_gain = malloc((num_records+1)*sizeof(*batt_gain));
+	if(batt_gain==NULL){
+		fprintf(stderr,"ERROR: out of memory\n");
+		return -1;
+	}
+	// the filter is prefilled from the first reading
+	replay_log_inputs(records, &in);
+	replay_backend_set_inputs(&in);
+	if(battery_manager_init()) return -1;
+	batt_gain[0] = battery_manager_get().gain;
+	for(k=0;k<num_records;k++){
+		replay_log_inputs(records+k*record_size, &in);
+		replay_backend_set_inputs(&in);
+		if(k%div==0) battery_manager_update();
+		batt_gain[k+1] = battery_manager_get().gain;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      folds the trials of every candidate into the first one, the mean
+ *             cost if all of them finished
+ */
+static void __merge_trials(uint64_t candidates)
+{
+	uint64_t c;
+	int t, ax;
+	run_result_t* r;
+
+	if(trials==1) return;
+	for(c=0;c<candidates;c++){
+		r = &results[c*trials];
+		for(t=1;t<trials;t++){
+			if(results[c*trials+t].status!=RUN_DONE && r->status==RUN_DONE){
+				r->status = results[c*trials+t].status;
+			}
+			if(r->status!=RUN_DONE) continue;
+			for(ax=0;ax<NUM_AXES;ax++) r->rms[ax] += results[c*trials+t].rms[ax];
+			r->sat += results[c*trials+t].sat;
+			r->cost += results[c*trials+t].cost;
+		}
+		if(r->status!=RUN_DONE) continue;
+		for(ax=0;ax<NUM_AXES;ax++) r->rms[ax] /= trials;
+		r->sat /= trials;
+		r->cost /= trials;
+	}
+}
+
+
+static uint64_t* order;
+static int __by_cost(const void* pa, const void* pb)
+{
+	const run_result_t* a = &results[*(const uint64_t*)pa*trials];
+	const run_result_t* b = &results[*(const uint64_t*)pb*trials];
+	if(a->status!=b->status) return a->status==RUN_DONE ? -1 : (b->status==RUN_DONE ? 1 : 0);
+	if(a->cost<b->cost) return -1;
+	return a->cost>b->cost;
+}
+
+
+static const char* __status_name(run_status_t s)
+{
+	switch(s){
+	case RUN_DONE:		return "ok";
+	case RUN_DIVERGED:	return "diverged";
+	default:		return "failed";
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, i, j, top = DEFAULT_TOP;
+	const char* grid_path = NULL;
+	const char* out_path = NULL;
+	FILE* log_file;
+	FILE* out;
+	log_reader_t reader;
+	uint64_t k, candidates, runs, cap = 0;
+	json_object* base;
+	double v[MAX_PARAMS];
+	double t_start;
+	char* p;
+	int ret, failed = 0;
+	uint64_t stolen = 0;
+	run_result_t* r;
+
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_workers<1) num_workers = 1;
+	samples = DEFAULT_SAMPLES;
+
+	opterr = 0;
+	while((c = getopt(argc, argv, "s:g:j:n:t:p:S:w:k:o:h"))!=-1){
+		switch(c){
+		case 's': settings_path = optarg; break;
+		case 'g': grid_path = optarg; break;
+		case 'j': num_workers = atoi(optarg); break;
+		case 'n': samples = atoi(optarg); break;
+		case 't': trials = atoi(optarg); break;
+		case 'p': spread = atof(optarg); break;
+		case 'S': seed = strtoull(optarg, NULL, 0); break;
+		case 'w': sat_weight = atof(optarg); break;
+		case 'k': top = atoi(optarg); break;
+		case 'o': out_path = optarg; break;
+		case 'h':
+			__print_usage();
+			return 0;
+		default:
+			__print_usage();
+			return -1;
+		}
+	}
+	if(optind!=argc-1 || grid_path==NULL || num_workers<1 || samples<1 || trials<1 || spread<0.0){
+		__print_usage();
+		return -1;
+	}
+	if(__read_params(grid_path)) return -1;
+
+	// the base settings, also checks every path leads to a controller number
+	// before any worker gets a copy
+	if(settings_load_from_path(settings_path)){
+		fprintf(stderr,"ERROR: failed to load settings from %s\n", settings_path);
+		return -1;
+	}
+	settings.enable_logging = 0;
+	settings.enable_mocap = 0;
+	settings.enable_baro = 0;
+	base = json_object_from_file(settings_path);
+	if(base==NULL) return -1;
+	__candidate_values(0, v);
+	for(i=0;i<num_params;i++){
+		if(!__is_controller_path(params[i].path)){
+			fprintf(stderr,"ERROR: %s isn't in a controller, only controllers can be swept\n",
+							params[i].path);
+			return -1;
+		}
+		if(__set_param(base, params[i].path, v[i])){
+			fprintf(stderr,"ERROR: %s isn't a number in %s\n", params[i].path, settings_path);
+			return -1;
+		}
+	}
+	json_object_put(base);
+
+	// the whole log in memory, read by every worker
+	log_file = fopen(argv[optind], "rb");
+	if(log_file==NULL){
+		perror("ERROR opening log file");
+		return -1;
+	}
+	record_size = replay_log_open(&reader, log_file);
+	if(record_size==0) return -1;
+	for(;;){
+		if(num_records==cap){
+			cap = cap ? cap*2 : 4096;
+			p = realloc(records, cap*record_size);
+			if(p==NULL){
+				fprintf(stderr,"ERROR: out of memory reading log\n");
+				return -1;
+			}
+			records = p;
+		}
+		ret = log_reader_next(&reader, records+num_records*record_size);
+		if(ret!=1) break;
+		num_records++;
+	}
+	log_reader_close(&reader);
+	fclose(log_file);
+	if(__fit_plant(1.0/settings.feedback_hz)) return -1;
+	if(__battery_gains()) return -1;
+
+	candidates = (uint64_t)grid_points*samples;
+	runs = candidates*trials;
+	results = calloc(runs, sizeof(run_result_t));
+	if((uint64_t)num_workers>runs) num_workers = runs;
+	workers = aligned_alloc(64, num_workers*sizeof(worker_t));
+	if(results==NULL || workers==NULL){
+		fprintf(stderr,"ERROR: out of memory\n");
+		return -1;
+	}
+	// an equal block of runs each, json-c objects aren't thread safe so every
+	// worker patches a tree of its own
+	for(i=0;i<num_workers;i++){
+		memset(&workers[i], 0, sizeof(worker_t));
+		workers[i].id = i;
+		atomic_init(&workers[i].runs.top, (int64_t)(runs*i/num_workers));
+		atomic_init(&workers[i].runs.bottom, (int64_t)(runs*(i+1)/num_workers));
+		workers[i].root = json_object_from_file(settings_path);
+		if(workers[i].root==NULL){
+			fprintf(stderr,"ERROR: failed to read %s\n", settings_path);
+			return -1;
+		}
+	}
+
+	printf("flying %" PRIu64 " candidates x %d trials on %d threads\n", candidates, trials, num_workers);
+	fflush(stdout);
+	t_start = __wall_seconds();
+	// this thread is worker 0, the rest steal the runs of any that didn't start
+	for(i=1;i<num_workers;i++){
+		if(pthread_create(&workers[i].thread, NULL, __worker, &workers[i])){
+			fprintf(stderr,"ERROR: failed to start worker thread %d\n", i);
+			continue;
+		}
+		workers[i].started = 1;
+	}
+	__worker(&workers[0]);
+	for(i=0;i<num_workers;i++){
+		if(workers[i].started) pthread_join(workers[i].thread, NULL);
+		stolen += workers[i].stolen;
+		json_object_put(workers[i].root);
+	}
+	free(workers);
+	printf("done in %.1fs, %" PRIu64 " runs stolen\n\n", __wall_seconds()-t_start, stolen);
+
+	__merge_trials(candidates);
+	order = malloc(candidates*sizeof(*order));
+	for(k=0;k<candidates;k++) order[k] = k;
+	qsort(order, candidates, sizeof(*order), __by_cost);
+
+	printf("rank   cost       rms_roll   rms_pitch  rms_yaw    sat%%   ");
+	for(i=0;i<num_params;i++) printf(" %s", params[i].path);
+	printf("\n");
+	for(k=0;k<candidates && k<(uint64_t)top;k++){
+		r = &results[order[k]*trials];
+		__candidate_values(order[k], v);
+		if(r->status==RUN_DONE){
+			printf("%-6" PRIu64 " %-10.5g %-10.5g %-10.5g %-10.5g %-6.2f ", k+1, r->cost,
+				r->rms[AX_ROLL], r->rms[AX_PITCH], r->rms[AX_YAW], 100.0*r->sat);
+		}
+		else printf("%-6" PRIu64 " %-52s ", k+1, __status_name(r->status));
+		for(i=0;i<num_params;i++) printf(" %g", v[i]);
+		printf("\n");
+	}
+	for(k=0;k<candidates;k++) if(results[k*trials].status!=RUN_DONE) failed++;
+	if(failed) printf("\n%d candidates diverged or failed\n", failed);
+
+	if(out_path!=NULL){
+		out = fopen(out_path, "w");
+		if(out==NULL){
+			perror("ERROR opening output file");
+			return -1;
+		}
+		fprintf(out, "candidate");
+		for(i=0;i<num_params;i++) fprintf(out, ",%s", params[i].path);
+		fprintf(out, ",status,cost,rms_roll,rms_pitch,rms_yaw,sat\n");
+		for(k=0;k<candidates;k++){
+			r = &results[k*trials];
+			__candidate_values(k, v);
+			fprintf(out, "%" PRIu64, k);
+			for(j=0;j<num_params;j++) fprintf(out, ",%.17g", v[j]);
+			fprintf(out, ",%s,%.9g,%.9g,%.9g,%.9g,%.9g\n", __status_name(r->status),
+				r->cost, r->rms[AX_ROLL], r->rms[AX_PITCH], r->rms[AX_YAW], r->sat);
+		}
+		fclose(out);
+	}
+	free(order);
+	free(batt_gain);
+	free(records);
+	return 0;
+}